@@ -56,6 +56,114 @@ Routine can return non success error codes.
 	//  Pre2PostContextListṹʼ
 	ExInitializeNPagedLookasideList(&Pre2PostContextList, NULL, NULL, 0, sizeof(PRE_2_POST_CONTEXT), PRE_2_POST_TAG, 0);
 
+	//stream context name arena
+	Ctx_Init();
+
+	//select the AES kernel (AES-NI if the processor supports it)
+	Aes_Init(AesImplNi);
+
+	//select the trailer CRC32C kernel (SSE4.2 if the processor supports it)
+	FlagFmt_Init(FlagFmtImplSse42);
+
+	//XTS tweak key derivation
+	status = Crypt_Init();
+	if (!NT_SUCCESS(status))
+	{
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//expanded key schedule cache
+	status = KeyCache_Init();
+	if (!NT_SUCCESS(status))
+	{
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//history key list, empty until the engine sends IOCTL_SET_KEYLIST
+	status = KeyList_Init();
+	if (!NT_SUCCESS(status))
+	{
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//process monitor list, empty until the engine adds processes
+	status = ProcList_Init();
+	if (!NT_SUCCESS(status))
+	{
+		KeyList_Uninit();
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//monitor decisions of requesting processes
+	status = PidCache_Init();
+	if (!NT_SUCCESS(status))
+	{
+		ProcList_Uninit();
+		KeyList_Uninit();
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//path policy, every file is covered until the engine installs one
+	status = PolicyList_Init();
+	if (!NT_SUCCESS(status))
+	{
+		PidCache_Uninit();
+		ProcList_Uninit();
+		KeyList_Uninit();
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//swap buffers for non-cached reads and writes
+	status = BufPool_Init(BUFPOOL_DEFAULT_LIMIT);
+	if (!NT_SUCCESS(status))
+	{
+		PolicyList_Uninit();
+		PidCache_Uninit();
+		ProcList_Uninit();
+		KeyList_Uninit();
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
+
+	//workers encrypting large writes, one per processor
+	status = WorkPool_Init(0);
+	if (!NT_SUCCESS(status))
+	{
+		BufPool_Uninit();
+		PolicyList_Uninit();
+		PidCache_Uninit();
+		ProcList_Uninit();
+		KeyList_Uninit();
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
+		return status;
+	}
 
 	//עminifilter
 	status = FltRegisterFilter(DriverObject,
@@ -67,7 +175,7 @@ Routine can return non success error codes.
 	if (NT_SUCCESS(status)) 
 	{
 		//֮ǰR3ͨŶ˿
-//		status = Msg_CreateCommunicationPort(gFilterHandle);
+		status = Msg_CreateCommunicationPort(gFilterHandle);
 		if (NT_SUCCESS(status))
 		{
 			//
@@ -75,9 +183,28 @@ Routine can return non success error codes.
 
 			if (!NT_SUCCESS(status)) {
 
+				Msg_CloseCommunicationPort(g_pServerPort);
 				FltUnregisterFilter(gFilterHandle);
 			}
 		}
+		else
+		{
+			FltUnregisterFilter(gFilterHandle);
+		}
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		WorkPool_Uninit();
+		BufPool_Uninit();
+		PolicyList_Uninit();
+		PidCache_Uninit();
+		ProcList_Uninit();
+		KeyList_Uninit();
+		KeyCache_Uninit();
+		Crypt_Uninit();
+		ExDeleteNPagedLookasideList(&Pre2PostContextList);
+		Ctx_Uninit();
 	}
 
 	return status;
@@ -114,7 +241,7 @@ Returns STATUS_SUCCESS.
 		("[CryptMini]DriveExit: Entered\n"));
 
 	//Close server port, must before filter is unregistered, otherwise filter will be halted.
-//	Msg_CloseCommunicationPort(g_pServerPort);
+	Msg_CloseCommunicationPort(g_pServerPort);
 
 	LOG_PRINT(LOG_INFO,
 		("[CryptMini]DriveExit: FltUnregisterFilter\n"));
@@ -124,6 +251,17 @@ Returns STATUS_SUCCESS.
 	LOG_PRINT(LOG_INFO,
 		("[CryptMini]DriveExit: ExDeleteNPagedLookasideList\n"));
 	ExDeleteNPagedLookasideList(&Pre2PostContextList);
+	Ctx_Uninit();
+
+	//all contexts are gone now, so are their key references
+	WorkPool_Uninit();
+	BufPool_Uninit();
+	PolicyList_Uninit();
+	PidCache_Uninit();
+	ProcList_Uninit();
+	KeyList_Uninit();
+	KeyCache_Uninit();
+	Crypt_Uninit();
 
 	return STATUS_SUCCESS;
 }
@@ -179,7 +317,6 @@ Return Value:
 	UCHAR volPropBuffer[sizeof(FLT_VOLUME_PROPERTIES) + 512];
 	PFLT_VOLUME_PROPERTIES volProp = (PFLT_VOLUME_PROPERTIES)volPropBuffer;
 
-	UCHAR szIV[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1, 2, 3, 4, 5, 6 };
 	UCHAR szKey[MAX_KEY_LENGTH] = { 0 };
 	UCHAR szKeyDigest[HASH_SIZE] = { 0 };
 	UCHAR uKeyLen = 32;
@@ -191,6 +328,10 @@ Return Value:
 		if (!NT_SUCCESS(status))
 			leave;
 
+		ctx->KeyEntry = NULL;
+		ctx->FileCache = NULL;
+		ctx->Layout.Kind = LayoutTrailer;
+
 		//Always get the volume properties, so I can get a sector size
 		status = FltGetVolumeProperties(FltObjects->Volume, volProp, sizeof(volPropBuffer), &retLen);
 		if (!NT_SUCCESS(status))
@@ -200,7 +341,6 @@ Return Value:
 		ctx->SectorSize = max(volProp->SectorSize, MIN_SECTOR_SIZE);
 		ctx->Name.Buffer = NULL;
 		ctx->FsName.Buffer = NULL;
-		///ctx->aes_ctr_ctx = NULL ;
 
 		//Get the storage device object we want a name for.
 		status = FltGetDiskDeviceObject(FltObjects->Volume, &devObj);
@@ -249,17 +389,33 @@ Return Value:
 			RtlAppendUnicodeToString(&ctx->Name, L":");
 		}
 
-		//init aes ctr context
-		KeInitializeSpinLock(&ctx->FsCryptSpinLock);
-		///ctx->aes_ctr_ctx = counter_mode_ctx_init(szIV, g_szCurFileKey, uKeyLen) ;
-		///if (NULL == ctx->aes_ctr_ctx)
-		///{
-		///	leave  ;
-		///}
+		//init aes key schedule
+		RtlCopyMemory(ctx->szKey, szKey, uKeyLen);
+		RtlCopyMemory(ctx->szKeyHash, szKeyDigest, HASH_SIZE);
+		ctx->CipherId = CRYPT_DEFAULT_CIPHER;
+		if (!Layout_Init(&ctx->Layout, CRYPT_DEFAULT_LAYOUT, ctx->SectorSize, FLAGFMT_MAX_SIZE))
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]CryptMiniInstanceSetup: sector size %u not supported\n", ctx->SectorSize));
+			status = STATUS_FLT_DO_NOT_ATTACH;
+			leave;
+		}
 
+		//counted until the context is freed
+		if (ctx->Layout.Kind == LayoutHeader)
+			InterlockedIncrement(&gHeaderLayoutVolumes);
+
+		status = KeyCache_Reference(ctx->szKeyHash, ctx->szKey, &ctx->KeyEntry);
+		if (!NT_SUCCESS(status))
+			leave;
 
-		//init per-volume mutex
-		ExInitializeFastMutex(&ctx->FsCtxTableMutex);
+		//optional, without it every open reads the trailer
+		ctx->FileCache = FileCache_Create();
+		if (ctx->FileCache == NULL)
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]CryptMiniInstanceSetup: FileCache_Create failed\n"));
+		}
 
 		//Set the context
 		status = FltSetVolumeContext(FltObjects->Volume, FLT_SET_CONTEXT_KEEP_IF_EXISTS, ctx, NULL);
@@ -274,15 +430,6 @@ Return Value:
 		if (ctx)
 		{
 			FltReleaseContext(ctx); // system will hang if not call this routine
-#if DBG			
-			if ((ctx->Name.Buffer[0] == L'C') || (ctx->Name.Buffer[0] == L'c'))
-			{
-				FltDeleteContext(ctx);
-				status = STATUS_FLT_DO_NOT_ATTACH;
-				LOG_PRINT(LOG_ERROR,
-					("[CryptMini]CryptMiniInstanceSetup:  system volume detach\n"));
-			}
-#endif
 		}
 
 		if (devObj)
@@ -455,11 +602,23 @@ None
 			ctx->Name.Buffer = NULL;
 		}
 
-		///if (NULL != ctx->aes_ctr_ctx)
-		///{
-		///	counter_mode_ctx_destroy(ctx->aes_ctr_ctx) ;
-		///	ctx->aes_ctr_ctx = NULL ;
-		///}
+		//do not leave key material in freed pool
+		RtlSecureZeroMemory(ctx->szKey, sizeof(ctx->szKey));
+
+		if (ctx->KeyEntry != NULL)
+		{
+			KeyCache_Release(ctx->KeyEntry);
+			ctx->KeyEntry = NULL;
+		}
+
+		if (ctx->FileCache != NULL)
+		{
+			FileCache_Delete(ctx->FileCache);
+			ctx->FileCache = NULL;
+		}
+
+		if (ctx->Layout.Kind == LayoutHeader)
+			InterlockedDecrement(&gHeaderLayoutVolumes);
 	}
 	break;
 	case FLT_STREAM_CONTEXT:
@@ -474,12 +633,36 @@ None
 		if (streamCtx == NULL)
 			break;
 
-		if (streamCtx->FileName.Buffer != NULL)
+		Ctx_FreeNameInStreamContext(streamCtx);
+
+		if (NULL != streamCtx->KeyEntry)
+		{
+			KeyCache_Release(streamCtx->KeyEntry);
+			streamCtx->KeyEntry = NULL;
+		}
+
+		if (NULL != streamCtx->RetiredKeyEntry)
+		{
+			KeyCache_Release(streamCtx->RetiredKeyEntry);
+			streamCtx->RetiredKeyEntry = NULL;
+		}
+
+		Ctx_UnmarkStreamHandled(streamCtx);
+
+		Ctx_UnmarkStreamPending(streamCtx);
+
+		if (NULL != streamCtx->VolumeContext)
 		{
-			ExFreePoolWithTag(streamCtx->FileName.Buffer, STRING_TAG);
+			//the stamp may not show writes through this stream yet
+			if (SC_TEST_FLAG(streamCtx, SC_FLAG_WRITER) &&
+				SC_TEST_FLAG(streamCtx, SC_FLAG_FILE_ID) &&
+				NULL != streamCtx->VolumeContext->FileCache)
+			{
+				FileCache_Remove(streamCtx->VolumeContext->FileCache, &streamCtx->FileId);
+			}
 
-			streamCtx->FileName.Length = streamCtx->FileName.MaximumLength = 0;
-			streamCtx->FileName.Buffer = NULL;
+			FltReleaseContext(streamCtx->VolumeContext);
+			streamCtx->VolumeContext = NULL;
 		}
 
 		///if (NULL != streamCtx->aes_ctr_ctx)
@@ -488,11 +671,9 @@ None
 		///	streamCtx->aes_ctr_ctx = NULL ;
 		///}
 
-		if (NULL != streamCtx->Resource)
-		{
-			ExDeleteResourceLite(streamCtx->Resource);
-			ExFreePoolWithTag(streamCtx->Resource, RESOURCE_TAG);
-		}
+		ExDeleteResourceLite(&streamCtx->ProbeLock);
+
+		ExDeleteResourceLite(&streamCtx->Resource);
 	}
 	break;
 	}
@@ -503,109 +684,2833 @@ None
 *************************************************************************/
 
 FLT_PREOP_CALLBACK_STATUS
-PreCreate(
-_Inout_ PFLT_CALLBACK_DATA Data,
-_In_ PCFLT_RELATED_OBJECTS FltObjects,
-_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+FastPathCount(
+_In_ FAST_PATH_OPERATION Operation,
+_In_ FLT_PREOP_CALLBACK_STATUS Status
 )
+/*++
+
+Routine Description:
+
+    This routine counts a pre-operation callback in gFastPath.  The
+    counters of the current processor are only contended by threads
+    preempted and rescheduled elsewhere.
+
+Arguments:
+
+    Operation - Operation of the callback
+
+    Status - Status the callback returns
+
+Return Value:
+
+    Status
+
+--*/
 {
-	UNREFERENCED_PARAMETER(Data);
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(CompletionContext);
+	PFAST_PATH_SLOT slot = &gFastPath[KeGetCurrentProcessorNumberEx(NULL) % FAST_PATH_SLOTS];
 
-	LOG_PRINT(LOG_INFO,
-		("[CryptMini]PreCreate: Entered\n"));
+	InterlockedIncrement64(&slot->Calls[Operation]);
 
-	return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	if (Status == FLT_PREOP_SUCCESS_NO_CALLBACK)
+		InterlockedIncrement64(&slot->NoCallback[Operation]);
+
+	return Status;
 }
 
-FLT_POSTOP_CALLBACK_STATUS
-PostCreate(
-_Inout_ PFLT_CALLBACK_DATA Data,
-_In_ PCFLT_RELATED_OBJECTS FltObjects,
-_In_opt_ PVOID CompletionContext,
-_In_ FLT_POST_OPERATION_FLAGS Flags
+VOID
+QueryFastPathStats(
+_Out_ PFAST_PATH_STATS Stats
 )
+/*++
+
+Routine Description:
+
+    This routine sums the fast path counters of all processors.
+
+Arguments:
+
+    Stats - Receives the counters
+
+Return Value:
+
+    None
+
+--*/
 {
-	UNREFERENCED_PARAMETER(Data);
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(CompletionContext);
-	UNREFERENCED_PARAMETER(Flags);
+	ULONG i, op;
 
-	LOG_PRINT(LOG_INFO,
-		("[CryptMini]PostCreate: Entered\n"));
+	RtlZeroMemory(Stats, sizeof(FAST_PATH_STATS));
 
-	return FLT_POSTOP_FINISHED_PROCESSING;
+	for (i = 0; i < FAST_PATH_SLOTS; i++)
+	{
+		for (op = 0; op < FastPathMaximum; op++)
+		{
+			Stats->Calls[op] += gFastPath[i].Calls[op];
+			Stats->NoCallback[op] += gFastPath[i].NoCallback[op];
+		}
+	}
 }
 
-FLT_PREOP_CALLBACK_STATUS
-PreRead(
-_Inout_ PFLT_CALLBACK_DATA Data,
-_In_ PCFLT_RELATED_OBJECTS FltObjects,
-_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+VOID
+CountLatency(
+_Inout_ volatile LONG64 *Count,
+_Inout_ volatile LONG64 *Time,
+_Inout_ volatile LONG64 *MaxTime,
+_In_ LARGE_INTEGER Start
 )
+/*++
+
+Routine Description:
+
+    This routine adds the time elapsed since Start to a latency counter
+    of gCreateStats.
+
+Arguments:
+
+    Count - Number of timed calls
+
+    Time - Total time, in 100ns units
+
+    MaxTime - Longest call, in 100ns units
+
+    Start - KeQueryPerformanceCounter at the start of the call
+
+Return Value:
+
+    None
+
+--*/
 {
-	UNREFERENCED_PARAMETER(Data);
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(CompletionContext);
+	LARGE_INTEGER end;
+	LARGE_INTEGER frequency;
+	LONG64 elapsed;
+	LONG64 maxTime;
 
-	LOG_PRINT(LOG_INFO,
-		("[CryptMini]PreRead: Entered\n"));
+	end = KeQueryPerformanceCounter(&frequency);
+	elapsed = (end.QuadPart - Start.QuadPart) * 10000000 / frequency.QuadPart;
 
-	return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	InterlockedIncrement64(Count);
+	InterlockedExchangeAdd64(Time, elapsed);
+
+	for (maxTime = ReadNoFence64(MaxTime); elapsed > maxTime; )
+	{
+		LONG64 prev = InterlockedCompareExchange64(MaxTime, elapsed, maxTime);
+		if (prev == maxTime)
+			break;
+		maxTime = prev;
+	}
 }
 
-FLT_POSTOP_CALLBACK_STATUS
-PostRead(
-_Inout_ PFLT_CALLBACK_DATA Data,
-_In_ PCFLT_RELATED_OBJECTS FltObjects,
-_In_opt_ PVOID CompletionContext,
-_In_ FLT_POST_OPERATION_FLAGS Flags
+VOID
+QueryCreateStats(
+_Out_ PCREATE_STATS Stats
 )
 {
-	UNREFERENCED_PARAMETER(Data);
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(CompletionContext);
-	UNREFERENCED_PARAMETER(Flags);
+	Stats->Creates = ReadNoFence64(&gCreateStats.Creates);
+	Stats->CreateTime = ReadNoFence64(&gCreateStats.CreateTime);
+	Stats->CreateMaxTime = ReadNoFence64(&gCreateStats.CreateMaxTime);
+	Stats->Probes = ReadNoFence64(&gCreateStats.Probes);
+	Stats->ProbeTime = ReadNoFence64(&gCreateStats.ProbeTime);
+	Stats->ProbeMaxTime = ReadNoFence64(&gCreateStats.ProbeMaxTime);
+	Stats->Coalesced = ReadNoFence64(&gCreateStats.Coalesced);
+	Stats->ProbeFailures = ReadNoFence64(&gCreateStats.ProbeFailures);
+}
 
-	LOG_PRINT(LOG_INFO,
-		("[CryptMini]PostRead: Entered\n"));
+VOID
+QueryDriverStats(
+_Out_ PMSG_GET_STATS Stats
+)
+/*++
 
-	return FLT_POSTOP_FINISHED_PROCESSING;
+Routine Description:
+
+    This routine gathers the counters IOCTL_GET_STATS replies with.  The
+    file flag caches of the volumes we are attached to are summed.
+
+    Called at PASSIVE_LEVEL.
+
+Arguments:
+
+    Stats - Receives the counters
+
+Return Value:
+
+    None
+
+--*/
+{
+	NTSTATUS status;
+	FAST_PATH_STATS fastPath;
+	CREATE_STATS create;
+	BUFPOOL_STATS bufPool;
+	FILE_CACHE_STATS fileCache;
+	PIDCACHE_STATS pidCache;
+	PFLT_VOLUME *volumes = NULL;
+	PVOLUME_CONTEXT volCtx;
+	ULONG count = 0;
+	ULONG op, i;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Stats, sizeof(MSG_GET_STATS));
+
+	QueryFastPathStats(&fastPath);
+	for (op = 0; op < FastPathMaximum; op++)
+	{
+		Stats->llCalls[op] = fastPath.Calls[op];
+		Stats->llNoCallback[op] = fastPath.NoCallback[op];
+	}
+
+	QueryCreateStats(&create);
+	Stats->llCreates = create.Creates;
+	Stats->llCreateTime = create.CreateTime;
+	Stats->llCreateMaxTime = create.CreateMaxTime;
+	Stats->llProbes = create.Probes;
+	Stats->llProbeTime = create.ProbeTime;
+	Stats->llProbeMaxTime = create.ProbeMaxTime;
+	Stats->llProbeCoalesced = create.Coalesced;
+	Stats->llProbeFailures = create.ProbeFailures;
+
+	BufPool_QueryStats(&bufPool);
+	Stats->llBufMagazineHits = bufPool.MagazineHits;
+	Stats->llBufDepotHits = bufPool.DepotHits;
+	Stats->llBufMisses = bufPool.Misses;
+	Stats->llBufFailures = bufPool.Failures;
+	Stats->llBufBytes = bufPool.Bytes;
+
+	PidCache_QueryStats(&pidCache);
+	Stats->llPidCacheHits = pidCache.Hits;
+	Stats->llPidCacheMisses = pidCache.Misses;
+	Stats->llPidCacheExits = pidCache.Exits;
+
+	//volumes may come and go between the two calls
+	status = FltEnumerateVolumes(gFilterHandle, NULL, 0, &count);
+	while (status == STATUS_BUFFER_TOO_SMALL && count != 0)
+	{
+		volumes = ExAllocatePoolWithTag(PagedPool, count * sizeof(PFLT_VOLUME), STATS_TAG);
+		if (volumes == NULL)
+			return;
+
+		status = FltEnumerateVolumes(gFilterHandle, volumes, count, &count);
+		if (NT_SUCCESS(status))
+			break;
+
+		ExFreePoolWithTag(volumes, STATS_TAG);
+		volumes = NULL;
+	}
+
+	if (volumes == NULL)
+		return;
+
+	for (i = 0; i < count; i++)
+	{
+		if (NT_SUCCESS(FltGetVolumeContext(gFilterHandle, volumes[i], &volCtx)))
+		{
+			if (volCtx->FileCache != NULL)
+			{
+				FileCache_QueryStats(volCtx->FileCache, &fileCache);
+				Stats->llFileCacheHits += fileCache.Hits;
+				Stats->llFileCachePlaintextHits += fileCache.PlaintextHits;
+				Stats->llFileCacheMisses += fileCache.Misses;
+				Stats->llFileCacheEvictions += fileCache.Evictions;
+				Stats->llFileCacheInvalidations += fileCache.Invalidations;
+			}
+
+			FltReleaseContext(volCtx);
+		}
+
+		FltObjectDereference(volumes[i]);
+	}
+
+	ExFreePoolWithTag(volumes, STATS_TAG);
 }
 
 FLT_PREOP_CALLBACK_STATUS
-PreWrite(
+PreCreate(
 _Inout_ PFLT_CALLBACK_DATA Data,
 _In_ PCFLT_RELATED_OBJECTS FltObjects,
 _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
 )
 {
-	UNREFERENCED_PARAMETER(Data);
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(CompletionContext);
+	PFILE_OBJECT fileObject = FltObjects->FileObject;
+	ULONG options = Data->Iopb->Parameters.Create.Options;
+	ULONG disposition = options >> 24;
+	PROCESS_DECISION decision;
+	ULONG_PTR context;
 
 	LOG_PRINT(LOG_INFO,
-		("[CryptMini]PreWrite: Entered\n"));
+		("[CryptMini]PreCreate: Entered\n"));
 
-	return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	//volume opens, paging files and directories are never encrypted
+	if ((fileObject->FileName.Length == 0 && fileObject->RelatedFileObject == NULL) ||
+		FlagOn(Data->Iopb->OperationFlags, SL_OPEN_PAGING_FILE) ||
+		FlagOn(options, FILE_DIRECTORY_FILE))
+		return FastPathCount(FastPathCreate, FLT_PREOP_SUCCESS_NO_CALLBACK);
+
+	//resolved in the requestor's context and cached per process, so the
+	//image name is looked up once per process and policy change
+	decision = PidCache_Resolve(Data);
+	context = (ULONG_PTR)decision;
+
+	//the file flag of a file the create truncates is gone by PostCreate.
+	//What ignored processes truncate is left plain anyway
+	if (decision != ProcessDecisionIgnored &&
+		(disposition == FILE_SUPERSEDE || disposition == FILE_OVERWRITE || disposition == FILE_OVERWRITE_IF) &&
+		ProbeOverwrittenFile(Data, FltObjects))
+	{
+		context |= CREATE_CONTEXT_WAS_CRYPT;
+	}
+
+	*CompletionContext = (PVOID)context;
+
+	return FastPathCount(FastPathCreate, FLT_PREOP_SUCCESS_WITH_CALLBACK);
 }
 
-FLT_POSTOP_CALLBACK_STATUS
-PostWrite(
+BOOLEAN
+ProbeOverwrittenFile(
 _Inout_ PFLT_CALLBACK_DATA Data,
-_In_ PCFLT_RELATED_OBJECTS FltObjects,
-_In_opt_ PVOID CompletionContext,
-_In_ FLT_POST_OPERATION_FLAGS Flags
+_In_ PCFLT_RELATED_OBJECTS FltObjects
 )
+/*++
+
+Routine Description:
+
+    This routine tells whether the file a superseding or overwriting
+    create is about to truncate holds a file flag, while it still does.
+    The file is opened below us by the name of the create and its flag
+    is looked up in the file cache of the volume, or read.
+
+    A file that could not be looked at is taken as encrypted, so nothing
+    encrypted is rewritten in plain text; one that does not exist yet is
+    not.
+
+    Called at PASSIVE_LEVEL.
+
+Arguments:
+
+    Data - Callback data of the create
+
+    FltObjects - Objects of the create
+
+Return Value:
+
+    TRUE if the file is, or may be, encrypted
+
+--*/
 {
-	UNREFERENCED_PARAMETER(Data);
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(CompletionContext);
-	UNREFERENCED_PARAMETER(Flags);
+	NTSTATUS status;
+	PVOLUME_CONTEXT volCtx = NULL;
+	PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+	OBJECT_ATTRIBUTES objAttr;
+	IO_STATUS_BLOCK ioStatus;
+	HANDLE handle = NULL;
+	PFILE_OBJECT fileObject = NULL;
+	FILE_CACHE_ID fileId;
+	FILE_CACHE_STAMP stamp;
+	FILE_FLAG flag;
+	LARGE_INTEGER fileSize;
+	BOOLEAN encrypted = TRUE;
 
-	LOG_PRINT(LOG_INFO,
-		("[CryptMini]PostWrite: Entered\n"));
+	PAGED_CODE();
+
+	try {
+
+		status = FltGetVolumeContext(FltObjects->Filter, FltObjects->Volume, &volCtx);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		InitializeObjectAttributes(&objAttr, &nameInfo->Name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+		//sent below us, so it is not seen by PreCreate again
+		status = FltCreateFileEx(FltObjects->Filter, FltObjects->Instance, &handle, &fileObject,
+			FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE, &objAttr, &ioStatus, NULL, 0,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN,
+			FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_COMPLETE_IF_OPLOCKED,
+			NULL, 0, IO_IGNORE_SHARE_ACCESS_CHECK);
+		if (status == STATUS_OBJECT_NAME_NOT_FOUND || status == STATUS_OBJECT_PATH_NOT_FOUND)
+		{
+			encrypted = FALSE;
+			leave;
+		}
+
+		if (!NT_SUCCESS(status))
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]ProbeOverwrittenFile: FltCreateFileEx failed, status=%08x\n", status));
+			leave;
+		}
+
+		if (volCtx->FileCache != NULL &&
+			NT_SUCCESS(FileCache_QueryFile(FltObjects->Instance, fileObject, &fileId, &stamp)) &&
+			FileCache_Lookup(volCtx->FileCache, &fileId, &stamp, &encrypted, &flag))
+			leave;
+
+		status = Trailer_Read(FltObjects->Instance, fileObject, volCtx, &flag, &fileSize);
+		encrypted = (BOOLEAN)(status != STATUS_NOT_FOUND);
+	}
+	finally {
+
+		if (fileObject != NULL)
+			ObDereferenceObject(fileObject);
+
+		if (handle != NULL)
+			FltClose(handle);
+
+		if (nameInfo != NULL)
+			FltReleaseFileNameInformation(nameInfo);
+
+		if (volCtx != NULL)
+			FltReleaseContext(volCtx);
+	}
+
+	return encrypted;
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostCreate(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    This routine finds or creates the stream context of the opened file.
+    The file flag trailer is not read here: a stream whose trailer was
+    not looked for yet is counted in the pending stream filter, and its
+    first read, write or mapping reads it, see ResolveStream.  Opens
+    that never touch the data cost no read.
+
+    A stream the create made or truncated has no file flag to look for;
+    it is encrypted or not as the requestor's process and the flag
+    PreCreate found before the truncation decide, see
+    SetupTruncatedStream.  The path policy only narrows which of these
+    monitored processes encrypt, matched on the normalized name: the
+    name opened may be relative, by file id, a short name or another
+    link.  Files encrypted already are recognized wherever they are.
+
+    Called at PASSIVE_LEVEL.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - CREATE_CONTEXT_XXX bits, from PreCreate.
+
+    Flags - Unused.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING
+
+--*/
+{
+	NTSTATUS status;
+	PROCESS_DECISION decision = (PROCESS_DECISION)((ULONG_PTR)CompletionContext & CREATE_CONTEXT_DECISION);
+	BOOLEAN wasEncrypted = BooleanFlagOn((ULONG_PTR)CompletionContext, CREATE_CONTEXT_WAS_CRYPT);
+	PVOLUME_CONTEXT volCtx = NULL;
+	PSTREAM_CONTEXT streamCtx = NULL;
+	PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+	LARGE_INTEGER start;
+	UNICODE_STRING relativeName = { 0 };
+	BOOLEAN created = FALSE;
+	BOOLEAN truncated;
+	BOOLEAN isDir = FALSE;
+	KIRQL oldIrql;
+
+	UNREFERENCED_PARAMETER(Flags);
+
+	PAGED_CODE();
+
+	LOG_PRINT(LOG_CREATE,
+		("[CryptMini]PostCreate: Entered, process decision %u\n", (ULONG)decision));
+
+	if (!NT_SUCCESS(Data->IoStatus.Status) || (Data->IoStatus.Status == STATUS_REPARSE))
+		return FLT_POSTOP_FINISHED_PROCESSING;
+
+	if (FlagOn(FltObjects->FileObject->Flags, FO_VOLUME_OPEN))
+		return FLT_POSTOP_FINISHED_PROCESSING;
+
+	start = KeQueryPerformanceCounter(NULL);
+
+	status = FltIsDirectory(FltObjects->FileObject, FltObjects->Instance, &isDir);
+	if (!NT_SUCCESS(status) || isDir)
+		return FLT_POSTOP_FINISHED_PROCESSING;
+
+	try {
+
+		status = FltGetVolumeContext(FltObjects->Filter, FltObjects->Volume, &volCtx);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		status = Ctx_FindOrCreateStreamContext(Data, (PFLT_RELATED_OBJECTS)FltObjects, TRUE, &streamCtx, &created);
+		if (!NT_SUCCESS(status))
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]PostCreate: Ctx_FindOrCreateStreamContext failed, status=%08x\n", status));
+			leave;
+		}
+
+		if (created)
+		{
+			SC_LOCK(streamCtx, &oldIrql);
+			if (streamCtx->VolumeContext == NULL)
+			{
+				FltReferenceContext(volCtx);
+				streamCtx->VolumeContext = volCtx;
+			}
+			SC_UNLOCK(streamCtx, oldIrql);
+		}
+
+		truncated = (BOOLEAN)(Data->IoStatus.Information == FILE_CREATED ||
+			Data->IoStatus.Information == FILE_OVERWRITTEN ||
+			Data->IoStatus.Information == FILE_SUPERSEDED);
+
+		//the name is informational only, do not fail the create for it
+		if ((created || (truncated && decision == ProcessDecisionMonitored)) &&
+			NT_SUCCESS(FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo)))
+		{
+			if (created)
+			{
+				SC_LOCK(streamCtx, &oldIrql);
+				Ctx_UpdateNameInStreamContext(&nameInfo->Name, streamCtx);
+				SC_UNLOCK(streamCtx, oldIrql);
+			}
+
+			if (NT_SUCCESS(FltParseFileNameInformation(nameInfo)))
+			{
+				//named streams share the file id of their file
+				if (created && nameInfo->Stream.Length == 0)
+					SC_SET_FLAG(streamCtx, SC_FLAG_UNNAMED_STREAM);
+
+				relativeName.Buffer = nameInfo->Name.Buffer + nameInfo->Volume.Length / sizeof(WCHAR);
+				relativeName.Length = nameInfo->Name.Length - nameInfo->Volume.Length;
+				relativeName.MaximumLength = relativeName.Length;
+			}
+		}
+
+		//the create is not failed for it, the stream is left unencrypted
+		if (truncated)
+		{
+			//outside the policy monitored processes keep what is
+			//encrypted, as trusted ones do, and encrypt nothing new.  A
+			//name that could not be had is not decided against
+			if (decision == ProcessDecisionMonitored && !PolicyList_Match(&relativeName))
+				decision = ProcessDecisionTrusted;
+
+			status = SetupTruncatedStream(FltObjects, volCtx, streamCtx, decision, wasEncrypted);
+			if (!NT_SUCCESS(status))
+			{
+				LOG_PRINT(LOG_ERROR,
+					("[CryptMini]PostCreate: %wZ left unencrypted, status=%08x\n", &streamCtx->FileName, status));
+			}
+		}
+
+		SC_LOCK(streamCtx, &oldIrql);
+		streamCtx->RefCount++;
+		if (FltObjects->FileObject->WriteAccess)
+			SC_SET_FLAG(streamCtx, SC_FLAG_WRITER);
+		//counted before the stream can be touched through this handle; a
+		//probe that failed is retried from here
+		if (!SC_TEST_FLAG(streamCtx, SC_FLAG_TRAILER_CHECKED))
+			Ctx_MarkStreamPending(streamCtx, FltObjects->FileObject);
+		SC_UNLOCK(streamCtx, oldIrql);
+	}
+	finally {
+
+		if (nameInfo != NULL)
+			FltReleaseFileNameInformation(nameInfo);
+
+		if (streamCtx != NULL)
+			FltReleaseContext(streamCtx);
+
+		if (volCtx != NULL)
+			FltReleaseContext(volCtx);
+
+		CountLatency(&gCreateStats.Creates, &gCreateStats.CreateTime, &gCreateStats.CreateMaxTime, start);
+	}
+
+	return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+NTSTATUS
+SetupTruncatedStream(
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PVOLUME_CONTEXT volCtx,
+_Inout_ PSTREAM_CONTEXT streamCtx,
+_In_ PROCESS_DECISION Decision,
+_In_ BOOLEAN WasEncrypted
+)
+/*++
+
+Routine Description:
+
+    This routine sets up the context of a stream a create made or
+    truncated to zero, without reading it: the file flag is written here
+    if the stream is to be encrypted, and is known to be missing if not.
+
+    Monitored processes encrypt the streams they make.  A stream that was
+    encrypted stays so, with a new nonce, unless an ignored process
+    truncates it; trusted processes keep it encrypted but leave their new
+    streams alone.  Whether it was encrypted is known from the flag
+    PreCreate read before the truncation: the context of a stream opened
+    for the first time has not been probed.  The flag needs write access.
+
+    The new flag always names the volume key.  A key of the old contents
+    stays referenced: I/O still in flight on them may be using it.
+
+    The file cache entry of the old contents is dropped, and the file id
+    kept for the writer to drop what later writes leave: the stamp of the
+    new contents can match the old one within a tick of the system time.
+
+    Called at PASSIVE_LEVEL.
+
+Arguments:
+
+    FltObjects - Objects of the create
+
+    volCtx - Context of the volume
+
+    streamCtx - Context of the stream
+
+    Decision - PROCESS_DECISION of the requestor
+
+    WasEncrypted - The truncated file held a file flag, see
+        ProbeOverwrittenFile
+
+Return Value:
+
+    Status of writing the file flag, STATUS_SUCCESS if none is written
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	BOOLEAN encrypt = FALSE;
+	FILE_FLAG flag;
+	FILE_CACHE_ID fileId;
+	FILE_CACHE_STAMP stamp;
+	BOOLEAN hasId;
+	KIRQL sizeIrql;
+	KIRQL oldIrql;
+
+	PAGED_CODE();
+
+	SC_iLOCK(&streamCtx->ProbeLock);
+
+	//a context probed before, through another open, knows it too
+	if (SC_TEST_FLAG(streamCtx, SC_FLAG_FILE_CRYPT))
+		WasEncrypted = TRUE;
+
+	if (FltObjects->FileObject->WriteAccess && volCtx->KeyEntry != NULL)
+	{
+		if (WasEncrypted)
+			encrypt = (BOOLEAN)(Decision != ProcessDecisionIgnored);
+		else
+			encrypt = (BOOLEAN)(Decision == ProcessDecisionMonitored);
+	}
+
+	if (encrypt)
+	{
+		flag.uVersion = FLAGFMT_VERSION_2;
+		flag.CipherId = volCtx->CipherId;
+		flag.FileValidLength.QuadPart = 0;
+		RtlCopyMemory(flag.szKeyHash, volCtx->szKeyHash, HASH_SIZE);
+
+		status = Crypt_GenerateNonce(flag.szNonce);
+		if (NT_SUCCESS(status))
+			status = Trailer_Write(FltObjects->Instance, FltObjects->FileObject, volCtx, &flag);
+
+		encrypt = (BOOLEAN)NT_SUCCESS(status);
+	}
+
+	//under the probe lock: no probe of the old contents inserts after it
+	hasId = (BOOLEAN)(SC_TEST_FLAG(streamCtx, SC_FLAG_UNNAMED_STREAM) && volCtx->FileCache != NULL &&
+		NT_SUCCESS(FileCache_QueryFile(FltObjects->Instance, FltObjects->FileObject, &fileId, &stamp)));
+	if (hasId)
+		FileCache_Remove(volCtx->FileCache, &fileId);
+
+	SC_LOCK(streamCtx, &oldIrql);
+
+	SC_SIZE_LOCK(streamCtx, &sizeIrql);
+	streamCtx->FileSize.QuadPart = encrypt ? Layout_FileSize(&volCtx->Layout, 0) : 0;
+	streamCtx->FileValidLength.QuadPart = 0;
+	SC_SIZE_UNLOCK(streamCtx, sizeIrql);
+
+	if (encrypt)
+	{
+		streamCtx->uTrailLength = volCtx->Layout.TailLength;
+		RtlCopyMemory(streamCtx->szKeyHash, flag.szKeyHash, HASH_SIZE);
+		RtlCopyMemory(streamCtx->szNonce, flag.szNonce, IV_LENGTH);
+
+		if (streamCtx->KeyEntry != volCtx->KeyEntry)
+		{
+			ASSERT(streamCtx->RetiredKeyEntry == NULL);
+			KeyCache_AddRef(volCtx->KeyEntry);
+			streamCtx->RetiredKeyEntry = streamCtx->KeyEntry;
+			streamCtx->KeyEntry = volCtx->KeyEntry;
+		}
+
+		//counted before the flags are set, see Ctx_MayBeHandled
+		Ctx_MarkStreamHandled(streamCtx, FltObjects->FileObject);
+
+		SC_SET_FLAG(streamCtx, SC_FLAG_FILE_CRYPT | SC_FLAG_DECRYPT_ON_READ | SC_FLAG_ENCRYPT_ON_WRITE |
+			(volCtx->Layout.Kind == LayoutHeader ? SC_FLAG_HEADER : 0));
+	}
+	else
+	{
+		SC_CLEAR_FLAG(streamCtx, SC_FLAG_FILE_CRYPT | SC_FLAG_DECRYPT_ON_READ | SC_FLAG_ENCRYPT_ON_WRITE | SC_FLAG_HEADER);
+	}
+
+	if (hasId)
+	{
+		streamCtx->FileId = fileId;
+		SC_SET_FLAG(streamCtx, SC_FLAG_FILE_ID);
+	}
+
+	SC_SET_FLAG(streamCtx, SC_FLAG_TRAILER_CHECKED);
+	Ctx_UnmarkStreamPending(streamCtx);
+
+	SC_UNLOCK(streamCtx, oldIrql);
+
+	SC_iUNLOCK(&streamCtx->ProbeLock);
+
+	return status;
+}
+
+NTSTATUS
+ProbeStream(
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Inout_ PSTREAM_CONTEXT streamCtx
+)
+/*++
+
+Routine Description:
+
+    This routine looks for the file flag trailer of a stream, in the file
+    cache of its volume first.  An encrypted file whose key is known gets
+    SC_FLAG_DECRYPT_ON_READ/SC_FLAG_ENCRYPT_ON_WRITE set and a reference
+    to its key.  One under an unknown key or another cipher only gets
+    SC_FLAG_FILE_CRYPT, and is counted as handled all the same so its
+    writes and size changes are denied.  SC_FLAG_TRAILER_CHECKED is set
+    on success.
+
+    Called at PASSIVE_LEVEL with the probe lock of the stream held.
+
+Arguments:
+
+    FltObjects - Objects of the operation touching the stream first
+
+    streamCtx - Context of the stream
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status;
+	PVOLUME_CONTEXT volCtx = NULL;
+	PKEY_CACHE_ENTRY keyEntry = NULL;
+	FILE_FLAG flag;
+	LARGE_INTEGER fileSize;
+	FILE_CACHE_ID fileId;
+	FILE_CACHE_STAMP stamp;
+	BOOLEAN cacheable = FALSE;
+	BOOLEAN encrypted;
+	KIRQL sizeIrql;
+	BOOLEAN found = FALSE;
+	KIRQL oldIrql;
+
+	PAGED_CODE();
+
+	try {
+
+		status = FltGetVolumeContext(FltObjects->Filter, FltObjects->Volume, &volCtx);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		//the id is kept to drop the entry of a file opened for write
+		if (SC_TEST_FLAG(streamCtx, SC_FLAG_UNNAMED_STREAM) && volCtx->FileCache != NULL &&
+			NT_SUCCESS(FileCache_QueryFile(FltObjects->Instance, FltObjects->FileObject, &fileId, &stamp)))
+		{
+			SC_LOCK(streamCtx, &oldIrql);
+			streamCtx->FileId = fileId;
+			SC_SET_FLAG(streamCtx, SC_FLAG_FILE_ID);
+			SC_UNLOCK(streamCtx, oldIrql);
+
+			//the file may be changing while opened for write
+			cacheable = !SC_TEST_FLAG(streamCtx, SC_FLAG_WRITER);
+		}
+
+		//a file reopened unchanged, encrypted or not, is cached by file id
+		if (cacheable && FileCache_Lookup(volCtx->FileCache, &fileId, &stamp, &encrypted, &flag))
+		{
+			fileSize = stamp.EndOfFile;
+			status = encrypted ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+		}
+		else
+		{
+			status = Trailer_Read(FltObjects->Instance, FltObjects->FileObject, volCtx, &flag, &fileSize);
+			if ((NT_SUCCESS(status) || status == STATUS_NOT_FOUND) &&
+				cacheable && !SC_TEST_FLAG(streamCtx, SC_FLAG_WRITER))
+			{
+				FileCache_Insert(volCtx->FileCache, &fileId, &stamp, NT_SUCCESS(status) ? &flag : NULL);
+			}
+		}
+
+		if (status == STATUS_NOT_FOUND)
+		{
+			found = FALSE;
+		}
+		else if (NT_SUCCESS(status))
+		{
+			found = TRUE;
+
+			//files are transformed with the cipher of their volume
+			if (flag.CipherId != 0 && flag.CipherId != volCtx->CipherId)
+			{
+				LOG_PRINT(LOG_ERROR,
+					("[CryptMini]ProbeStream: %wZ encrypted with cipher %u, volume uses %u\n",
+					&streamCtx->FileName, flag.CipherId, volCtx->CipherId));
+				keyEntry = NULL;
+			}
+			else if (RtlEqualMemory(flag.szKeyHash, volCtx->szKeyHash, HASH_SIZE))
+			{
+				KeyCache_AddRef(volCtx->KeyEntry);
+				keyEntry = volCtx->KeyEntry;
+			}
+			else if (!NT_SUCCESS(KeyList_ReferenceKey(flag.szKeyHash, &keyEntry)))
+			{
+				LOG_PRINT(LOG_ERROR,
+					("[CryptMini]ProbeStream: %wZ encrypted with an unknown key\n", &streamCtx->FileName));
+				keyEntry = NULL;
+			}
+		}
+		else
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]ProbeStream: Trailer_Read failed, status=%08x\n", status));
+			leave;
+		}
+
+		status = STATUS_SUCCESS;
+
+		SC_LOCK(streamCtx, &oldIrql);
+
+		SC_SIZE_LOCK(streamCtx, &sizeIrql);
+		streamCtx->FileSize = fileSize;
+		if (found)
+			streamCtx->FileValidLength = flag.FileValidLength;
+		SC_SIZE_UNLOCK(streamCtx, sizeIrql);
+
+		if (found)
+		{
+			streamCtx->uTrailLength = volCtx->Layout.TailLength;
+			RtlCopyMemory(streamCtx->szKeyHash, flag.szKeyHash, HASH_SIZE);
+			RtlCopyMemory(streamCtx->szNonce, flag.szNonce, IV_LENGTH);
+
+			streamCtx->KeyEntry = keyEntry;
+
+			//counted before the flags are set, see Ctx_MayBeHandled.  Keyless
+			//streams too: what PreWrite and PreSetInformation deny them
+			Ctx_MarkStreamHandled(streamCtx, FltObjects->FileObject);
+
+			SC_SET_FLAG(streamCtx, SC_FLAG_FILE_CRYPT |
+				(volCtx->Layout.Kind == LayoutHeader ? SC_FLAG_HEADER : 0) |
+				(keyEntry != NULL ? SC_FLAG_DECRYPT_ON_READ | SC_FLAG_ENCRYPT_ON_WRITE : 0));
+			keyEntry = NULL;
+		}
+
+		SC_SET_FLAG(streamCtx, SC_FLAG_TRAILER_CHECKED);
+
+		SC_UNLOCK(streamCtx, oldIrql);
+	}
+	finally {
+
+		if (keyEntry != NULL)
+			KeyCache_Release(keyEntry);
+
+		if (volCtx != NULL)
+			FltReleaseContext(volCtx);
+	}
+
+	return status;
+}
+
+VOID
+ResolveStream(
+_In_ PCFLT_RELATED_OBJECTS FltObjects
+)
+/*++
+
+Routine Description:
+
+    This routine reads the file flag trailer of a stream pending since
+    PostCreate, before its first read, write or mapping goes on.  The
+    first accessors of a stream wait on its probe lock for the one that
+    probes.  A failed probe leaves the stream unencrypted until its next
+    create, as a failed trailer read in PostCreate used to.
+
+    The trailer is read through the file object of the operation, whatever
+    its access: access is checked on the handle, not by FltReadFile.
+
+    Called for non-paging I/O only: a paging I/O may hold file system
+    locks the trailer read needs.  Does nothing above PASSIVE_LEVEL.
+
+Arguments:
+
+    FltObjects - Objects of the operation
+
+Return Value:
+
+    None
+
+--*/
+{
+	NTSTATUS status;
+	PSTREAM_CONTEXT streamCtx = NULL;
+	LARGE_INTEGER start;
+	KIRQL oldIrql;
+
+	PAGED_CODE();
+
+	if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+		return;
+
+	status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamCtx);
+	if (!NT_SUCCESS(status))
+		return;
+
+	if (!SC_TEST_FLAG(streamCtx, SC_FLAG_PENDING))
+	{
+		FltReleaseContext(streamCtx);
+		return;
+	}
+
+	SC_iLOCK(&streamCtx->ProbeLock);
+
+	if (!SC_TEST_FLAG(streamCtx, SC_FLAG_PENDING))
+	{
+		InterlockedIncrement64(&gCreateStats.Coalesced);
+	}
+	else
+	{
+		start = KeQueryPerformanceCounter(NULL);
+
+		status = ProbeStream(FltObjects, streamCtx);
+		if (!NT_SUCCESS(status))
+			InterlockedIncrement64(&gCreateStats.ProbeFailures);
+
+		CountLatency(&gCreateStats.Probes, &gCreateStats.ProbeTime, &gCreateStats.ProbeMaxTime, start);
+
+		//after the flags, so a stream leaving the pending filter is already
+		//in the handled one
+		SC_LOCK(streamCtx, &oldIrql);
+		Ctx_UnmarkStreamPending(streamCtx);
+		SC_UNLOCK(streamCtx, oldIrql);
+	}
+
+	SC_iUNLOCK(&streamCtx->ProbeLock);
+
+	FltReleaseContext(streamCtx);
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PreAcquireForSection(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+)
+/*++
+
+Routine Description:
+
+    This routine resolves a pending stream before it is mapped: the
+    page faults on the view come as paging reads, which cannot probe.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - Unused.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_NO_CALLBACK
+
+--*/
+{
+	UNREFERENCED_PARAMETER(Data);
+
+	PAGED_CODE();
+
+	*CompletionContext = NULL;
+
+	if (Ctx_MayBePending(FltObjects->FileObject))
+		ResolveStream(FltObjects);
+
+	return FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PreRead(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+)
+/*++
+
+Routine Description:
+
+    This routine swaps in a pooled, page aligned buffer for non-cached and
+    paging reads of streams we decrypt, so the cipher text lands there and
+    never in the caller's buffer.  The read length is rounded up to the
+    sector size.  Cached reads are passed through untouched: the cache is
+    filled with plain text by the paging reads.  Non-paging reads of a file
+    with a header, cached or not, are moved past it.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - Receives the PRE_2_POST_CONTEXT for PostRead.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_WITH_CALLBACK - buffer swapped or offset moved
+    FLT_PREOP_SUCCESS_NO_CALLBACK - not our read
+    FLT_PREOP_COMPLETE - failed for lack of resources
+
+--*/
+{
+	NTSTATUS status;
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	FLT_PREOP_CALLBACK_STATUS retValue = FLT_PREOP_SUCCESS_NO_CALLBACK;
+	PVOLUME_CONTEXT volCtx = NULL;
+	PSTREAM_CONTEXT streamCtx = NULL;
+	PPRE_2_POST_CONTEXT p2pCtx = NULL;
+	PVOID newBuf = NULL;
+	PMDL newMdl = NULL;
+	ULONG readLen = iopb->Parameters.Read.Length;
+	LARGE_INTEGER validLength;
+	LONGLONG offset;
+
+	*CompletionContext = NULL;
+
+	if (readLen == 0)
+		return FastPathCount(FastPathRead, FLT_PREOP_SUCCESS_NO_CALLBACK);
+
+	//the first read of a stream, cached or not, reads its trailer
+	if (Ctx_MayBePending(FltObjects->FileObject) && !FlagOn(iopb->IrpFlags, IRP_PAGING_IO))
+	{
+		if (FLT_IS_FASTIO_OPERATION(Data))
+			return FastPathCount(FastPathRead, FLT_PREOP_DISALLOW_FASTIO);
+
+		ResolveStream(FltObjects);
+	}
+
+	//cached reads are only moved past file headers, most volumes have none
+	if (!FlagOn(iopb->IrpFlags, IRP_NOCACHE) && gHeaderLayoutVolumes == 0)
+		return FastPathCount(FastPathRead, FLT_PREOP_SUCCESS_NO_CALLBACK);
+
+	//most streams are not ours, tell without looking their context up
+	if (!Ctx_MayBeHandled(FltObjects->FileObject))
+		return FastPathCount(FastPathRead, FLT_PREOP_SUCCESS_NO_CALLBACK);
+
+	try {
+
+		status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamCtx);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		//set once by ResolveStream, before any read is let through
+		if (!SC_TEST_FLAG(streamCtx, SC_FLAG_DECRYPT_ON_READ))
+			leave;
+
+		if (!FlagOn(iopb->IrpFlags, IRP_NOCACHE) && !SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER))
+			leave;
+
+		if (FLT_IS_FASTIO_OPERATION(Data))
+		{
+			retValue = FLT_PREOP_DISALLOW_FASTIO;
+			leave;
+		}
+
+		status = FltGetVolumeContext(FltObjects->Filter, FltObjects->Volume, &volCtx);
+		if (!NT_SUCCESS(status))
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]PreRead: FltGetVolumeContext failed, status=%08x\n", status));
+			leave;
+		}
+
+		p2pCtx = ExAllocateFromNPagedLookasideList(&Pre2PostContextList);
+		if (p2pCtx == NULL)
+		{
+			Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			Data->IoStatus.Information = 0;
+			retValue = FLT_PREOP_COMPLETE;
+			leave;
+		}
+
+		p2pCtx->SwappedBuffer = NULL;
+		p2pCtx->SwappedLength = 0;
+		p2pCtx->VolCtx = volCtx;
+		p2pCtx->pStreamCtx = streamCtx;
+		p2pCtx->RangeHeld = FALSE;
+		p2pCtx->Remapped = MapIoOffset(Data, FltObjects, streamCtx, volCtx, &p2pCtx->FileOffset);
+
+		//a cached read of a file with a header, only moved
+		if (!FlagOn(iopb->IrpFlags, IRP_NOCACHE))
+		{
+			iopb->Parameters.Read.ByteOffset.QuadPart = p2pCtx->FileOffset;
+			FltSetCallbackDataDirty(Data);
+
+			*CompletionContext = p2pCtx;
+			retValue = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+			leave;
+		}
+
+		readLen = (ULONG)ROUND_TO_SIZE(readLen, volCtx->SectorSize);
+
+		newBuf = BufPool_Allocate(readLen);
+		if (newBuf == NULL)
+		{
+			Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			Data->IoStatus.Information = 0;
+			retValue = FLT_PREOP_COMPLETE;
+			leave;
+		}
+
+		//IRP based reads need an MDL for the new buffer too; FltMgr frees
+		//it when the operation completes
+		if (FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_IRP_OPERATION))
+		{
+			newMdl = IoAllocateMdl(newBuf, readLen, FALSE, FALSE, NULL);
+			if (newMdl == NULL)
+			{
+				Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+				Data->IoStatus.Information = 0;
+				retValue = FLT_PREOP_COMPLETE;
+				leave;
+			}
+
+			MmBuildMdlForNonPagedPool(newMdl);
+		}
+
+		//paging reads are serialized by the file system, which may issue
+		//them from inside a non-cached I/O holding its range; only user
+		//reads wait for the writes they overlap, to see their valid length
+		offset = ResolveIoOffset(Data, FltObjects);
+		p2pCtx->RangeHeld = !FlagOn(iopb->IrpFlags, IRP_PAGING_IO) && offset >= 0;
+		if (p2pCtx->RangeHeld)
+			RangeLock_Acquire(&streamCtx->RangeLock, &p2pCtx->Range,
+				offset, offset + iopb->Parameters.Read.Length, FALSE);
+
+		//KeyEntry is published by the flag tested above
+		SC_READ_SIZES(streamCtx, &validLength, NULL);
+		p2pCtx->ValidLength = validLength.QuadPart;
+		p2pCtx->KeyEntry = streamCtx->KeyEntry;
+
+		p2pCtx->SwappedBuffer = newBuf;
+		p2pCtx->SwappedLength = readLen;
+
+		//moved last, the range above is locked at plain text offsets.  A
+		//read at the file position is pinned to the offset it is decrypted
+		//at, too
+		iopb->Parameters.Read.ByteOffset.QuadPart = p2pCtx->FileOffset;
+
+		iopb->Parameters.Read.ReadBuffer = newBuf;
+		iopb->Parameters.Read.MdlAddress = newMdl;
+		FltSetCallbackDataDirty(Data);
+
+		*CompletionContext = p2pCtx;
+		retValue = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	}
+	finally {
+
+		if (retValue != FLT_PREOP_SUCCESS_WITH_CALLBACK)
+		{
+			if (newMdl != NULL)
+				IoFreeMdl(newMdl);
+
+			if (newBuf != NULL)
+				BufPool_Free(newBuf, readLen);
+
+			if (p2pCtx != NULL)
+				ExFreeToNPagedLookasideList(&Pre2PostContextList, p2pCtx);
+
+			if (volCtx != NULL)
+				FltReleaseContext(volCtx);
+
+			if (streamCtx != NULL)
+				FltReleaseContext(streamCtx);
+		}
+	}
+
+	return FastPathCount(FastPathRead, retValue);
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostRead(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    This routine decrypts the cipher text read into the swapped buffer
+    straight into the caller's buffer.  When the caller's buffer is a user
+    buffer without an MDL, the work is moved to a safe IRQL and thread
+    context by FltDoCompletionProcessingWhenSafe.  A long read completing
+    at DISPATCH_LEVEL is posted to a worker thread by PostReadDefer, so
+    bulk AES does not run at DPC level; short ones are decrypted inline.
+    A cached read moved past the header of its file only has the file
+    position moved back.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - The PRE_2_POST_CONTEXT set in PreRead.
+
+    Flags - Denotes whether the completion is successful or is being drained.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING, or FLT_POSTOP_MORE_PROCESSING_REQUIRED
+    when deferred.
+
+--*/
+{
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	PPRE_2_POST_CONTEXT p2pCtx = CompletionContext;
+	FLT_POSTOP_CALLBACK_STATUS retValue = FLT_POSTOP_FINISHED_PROCESSING;
+	BOOLEAN cleanupAllocatedBuffer = TRUE;
+	PVOID origBuf;
+	BOOLEAN atDpc;
+
+	if (!FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING))
+		UnmapFilePosition(Data, FltObjects, p2pCtx);
+
+	if (p2pCtx->SwappedBuffer == NULL)
+	{
+		FreePre2PostContext(p2pCtx);
+		return FLT_POSTOP_FINISHED_PROCESSING;
+	}
+
+	//FltMgr does not drain operations with swapped buffers
+	FLT_ASSERT(!FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING));
+
+	try {
+
+		if (!NT_SUCCESS(Data->IoStatus.Status) || (Data->IoStatus.Information == 0))
+			leave;
+
+		//iopb holds the original parameters again here
+		if (iopb->Parameters.Read.MdlAddress != NULL)
+		{
+			origBuf = MmGetSystemAddressForMdlSafe(iopb->Parameters.Read.MdlAddress, NormalPagePriority);
+			if (origBuf == NULL)
+			{
+				Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+				Data->IoStatus.Information = 0;
+				leave;
+			}
+		}
+		else if (FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER) ||
+			FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_FAST_IO_OPERATION))
+		{
+			origBuf = iopb->Parameters.Read.ReadBuffer;
+		}
+		else
+		{
+			if (FltDoCompletionProcessingWhenSafe(Data, FltObjects, CompletionContext, Flags,
+				PostReadWhenSafe, &retValue))
+			{
+				//PostReadWhenSafe frees it
+				cleanupAllocatedBuffer = FALSE;
+
+				if (retValue == FLT_POSTOP_MORE_PROCESSING_REQUIRED)
+					InterlockedIncrement64(&gReadStats.Deferred);
+				else
+					InterlockedIncrement64(&gReadStats.Inline);
+			}
+			else
+			{
+				Data->IoStatus.Status = STATUS_UNSUCCESSFUL;
+				Data->IoStatus.Information = 0;
+			}
+			leave;
+		}
+
+		atDpc = (BOOLEAN)(KeGetCurrentIrql() >= DISPATCH_LEVEL);
+
+		if (atDpc && Data->IoStatus.Information > gReadDeferThreshold)
+		{
+			p2pCtx->OrigBuffer = origBuf;
+
+			if (PostReadDefer(Data, p2pCtx))
+			{
+				//PostReadDeferred frees it and completes the read
+				cleanupAllocatedBuffer = FALSE;
+				retValue = FLT_POSTOP_MORE_PROCESSING_REQUIRED;
+				leave;
+			}
+
+			InterlockedIncrement64(&gReadStats.Overflow);
+		}
+		else
+		{
+			InterlockedIncrement64(&gReadStats.Inline);
+		}
+
+		DecryptReadBuffer(Data, p2pCtx, origBuf);
+	}
+	finally {
+
+		if (cleanupAllocatedBuffer)
+			FreePre2PostContext(p2pCtx);
+	}
+
+	return retValue;
+}
+
+BOOLEAN
+PostReadDefer(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PPRE_2_POST_CONTEXT p2pCtx
+)
+/*++
+
+Routine Description:
+
+    This routine posts the decryption of a completed read to a critical
+    worker thread.  It fails when gReadDeferMaxDepth reads are posted
+    already, so a storm of large reads cannot exhaust the worker threads;
+    or when FltMgr cannot post the operation, e.g. a paging read.  The
+    caller then decrypts inline.
+
+Arguments:
+
+    Data - Completed read
+
+    p2pCtx - Context from PreRead, with OrigBuffer set
+
+Return Value:
+
+    TRUE if posted; PostReadDeferred completes the read.
+
+--*/
+{
+	NTSTATUS status;
+	PFLT_DEFERRED_IO_WORKITEM workItem;
+
+	if (InterlockedIncrement(&gReadStats.Depth) > gReadDeferMaxDepth)
+	{
+		InterlockedDecrement(&gReadStats.Depth);
+		return FALSE;
+	}
+
+	workItem = FltAllocateDeferredIoWorkItem();
+	if (workItem == NULL)
+	{
+		InterlockedDecrement(&gReadStats.Depth);
+		return FALSE;
+	}
+
+	status = FltQueueDeferredIoWorkItem(workItem, Data, PostReadDeferred, CriticalWorkQueue, p2pCtx);
+	if (!NT_SUCCESS(status))
+	{
+		FltFreeDeferredIoWorkItem(workItem);
+		InterlockedDecrement(&gReadStats.Depth);
+		return FALSE;
+	}
+
+	InterlockedIncrement64(&gReadStats.Deferred);
+
+	return TRUE;
+}
+
+VOID
+PostReadDeferred(
+_In_ PFLT_DEFERRED_IO_WORKITEM WorkItem,
+_In_ PFLT_CALLBACK_DATA Data,
+_In_opt_ PVOID Context
+)
+/*++
+
+Routine Description:
+
+    Worker thread half of PostReadDefer: decrypt the read, free the
+    context and complete the pended post-operation.
+
+    Called at PASSIVE_LEVEL.
+
+Arguments:
+
+    WorkItem - Work item from PostReadDefer
+
+    Data - Completed read
+
+    Context - The PRE_2_POST_CONTEXT
+
+Return Value:
+
+    None
+
+--*/
+{
+	PPRE_2_POST_CONTEXT p2pCtx = Context;
+
+	DecryptReadBuffer(Data, p2pCtx, p2pCtx->OrigBuffer);
+
+	FreePre2PostContext(p2pCtx);
+	FltFreeDeferredIoWorkItem(WorkItem);
+	InterlockedDecrement(&gReadStats.Depth);
+
+	FltCompletePendedPostOperation(Data);
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostReadWhenSafe(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    PostRead for a user buffer, called at a safe IRQL in the requestor's
+    context: lock the user buffer and decrypt into it.
+
+Arguments:
+
+    Same as PostRead.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING
+
+--*/
+{
+	NTSTATUS status;
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	PPRE_2_POST_CONTEXT p2pCtx = CompletionContext;
+	PVOID origBuf;
+
+	UNREFERENCED_PARAMETER(FltObjects);
+	UNREFERENCED_PARAMETER(Flags);
+
+	status = FltLockUserBuffer(Data);
+	if (!NT_SUCCESS(status))
+	{
+		Data->IoStatus.Status = status;
+		Data->IoStatus.Information = 0;
+	}
+	else
+	{
+		origBuf = MmGetSystemAddressForMdlSafe(iopb->Parameters.Read.MdlAddress, NormalPagePriority);
+		if (origBuf == NULL)
+		{
+			Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			Data->IoStatus.Information = 0;
+		}
+		else
+		{
+			DecryptReadBuffer(Data, p2pCtx, origBuf);
+		}
+	}
+
+	FreePre2PostContext(p2pCtx);
+
+	return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+VOID
+DecryptReadBuffer(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PPRE_2_POST_CONTEXT p2pCtx,
+_Out_ PUCHAR OrigBuf
+)
+/*++
+
+Routine Description:
+
+    This routine decrypts a completed read from the swapped buffer into
+    the caller's buffer in one pass over memory.  Whole sectors are
+    decrypted straight into OrigBuf; a final partial sector is decrypted
+    in place in the swapped buffer and only its valid bytes are copied.
+    Both go through the AES pipeline as one batch.
+    The header a paging read of the first page of a file starts with is
+    copied as it is.
+
+    Nothing past FileValidLength is returned as data: those bytes are
+    zeroed and, for non-paging reads, the returned length is clamped, and
+    with it the position of a synchronous file object.  The cipher text
+    is at p2pCtx->FileOffset, which PreRead resolved for reads at the file
+    position.
+
+Arguments:
+
+    Data - Completed read, with its original parameters
+
+    p2pCtx - Context from PreRead
+
+    OrigBuf - System address of the caller's buffer
+
+Return Value:
+
+    None, Data->IoStatus is updated
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PVOLUME_CONTEXT volCtx = p2pCtx->VolCtx;
+	PSTREAM_CONTEXT streamCtx = p2pCtx->pStreamCtx;
+	PFILE_OBJECT fileObject = Data->Iopb->TargetFileObject;
+	PUCHAR swapped = p2pCtx->SwappedBuffer;
+	ULONG returned = (ULONG)min(Data->IoStatus.Information, Data->Iopb->Parameters.Read.Length);
+	LAYOUT_EXTENT extent;
+	AES_CTR_JOB jobs[2];
+	ULONG count = 0;
+	LONGLONG offset;
+	ULONG skip;
+	ULONG valid = 0;
+	ULONG full;
+
+	Layout_MapFileRange(&volCtx->Layout, p2pCtx->FileOffset, returned, &extent);
+	skip = (ULONG)extent.Skip;
+	offset = extent.Offset;
+
+	if (skip > 0)
+	{
+		RtlCopyMemory(OrigBuf, swapped, skip);
+		OrigBuf += skip;
+		swapped += skip;
+		returned -= skip;
+	}
+
+	if (offset < p2pCtx->ValidLength)
+		valid = (ULONG)min((LONGLONG)returned, p2pCtx->ValidLength - offset);
+
+	full = valid - valid % volCtx->SectorSize;
+
+	if (full > 0)
+	{
+		jobs[count].Key = &p2pCtx->KeyEntry->Key;
+		jobs[count].Nonce = streamCtx->szNonce;
+		jobs[count].ByteOffset = (ULONGLONG)offset;
+		jobs[count].In = swapped;
+		jobs[count].Out = OrigBuf;
+		jobs[count].Length = full;
+		count++;
+	}
+
+	if (valid > full)
+	{
+		jobs[count].Key = &p2pCtx->KeyEntry->Key;
+		jobs[count].Nonce = streamCtx->szNonce;
+		jobs[count].ByteOffset = (ULONGLONG)(offset + full);
+		jobs[count].In = swapped + full;
+		jobs[count].Out = swapped + full;
+		jobs[count].Length = volCtx->SectorSize;
+		count++;
+	}
+
+	if (count > 0)
+		status = Crypt_TransformBatch(volCtx, jobs, count, FALSE);
+
+	if (NT_SUCCESS(status) && valid > full)
+		RtlCopyMemory(OrigBuf + full, swapped + full, valid - full);
+
+	if (!NT_SUCCESS(status))
+	{
+		LOG_PRINT(LOG_ERROR,
+			("[CryptMini]DecryptReadBuffer: Crypt_TransformBatch failed, status=%08x\n", status));
+		Data->IoStatus.Status = status;
+		Data->IoStatus.Information = 0;
+		return;
+	}
+
+	if (returned > valid)
+		RtlZeroMemory(OrigBuf + valid, returned - valid);
+
+	//paging reads always return whole pages to the memory manager
+	if (FlagOn(Data->Iopb->IrpFlags, IRP_PAGING_IO))
+	{
+		Data->IoStatus.Information = skip + returned;
+		return;
+	}
+
+	Data->IoStatus.Information = skip + valid;
+
+	//the file system left the position past everything it read (moved
+	//back to plain text offsets by UnmapFilePosition); end it at the
+	//valid length too
+	if (returned > valid && FlagOn(fileObject->Flags, FO_SYNCHRONOUS_IO) &&
+		fileObject->CurrentByteOffset.QuadPart == offset + returned)
+	{
+		fileObject->CurrentByteOffset.QuadPart = offset + valid;
+	}
+}
+
+VOID
+FreePre2PostContext(
+_In_ PPRE_2_POST_CONTEXT p2pCtx
+)
+/*++
+
+Routine Description:
+
+    This routine frees the swapped buffer, if any, and the context passed
+    from a pre-operation to a post-operation callback, and drops its
+    references.
+
+Arguments:
+
+    p2pCtx - Context to free
+
+Return Value:
+
+    None
+
+--*/
+{
+	if (p2pCtx->SwappedBuffer != NULL)
+		BufPool_Free(p2pCtx->SwappedBuffer, p2pCtx->SwappedLength);
+
+	if (p2pCtx->RangeHeld)
+		RangeLock_Release(&p2pCtx->pStreamCtx->RangeLock, &p2pCtx->Range);
+
+	FltReleaseContext(p2pCtx->VolCtx);
+	FltReleaseContext(p2pCtx->pStreamCtx);
+	ExFreeToNPagedLookasideList(&Pre2PostContextList, p2pCtx);
+}
+
+LONGLONG
+ResolveIoOffset(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects
+)
+/*++
+
+Routine Description:
+
+    This routine returns the offset a read or write is at, as sent.  I/O
+    at FILE_USE_FILE_POINTER_POSITION is at the current position of its
+    file object, which is synchronous: the position cannot change under
+    the I/O.
+
+Arguments:
+
+    Data - Read or write, with its original parameters
+
+    FltObjects - Objects of the operation, for the file position
+
+Return Value:
+
+    The offset, -1 for an append (FILE_WRITE_TO_END_OF_FILE)
+
+--*/
+{
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	PLARGE_INTEGER byteOffset = (iopb->MajorFunction == IRP_MJ_READ) ?
+		&iopb->Parameters.Read.ByteOffset : &iopb->Parameters.Write.ByteOffset;
+
+	if (byteOffset->HighPart == -1)
+	{
+		if (byteOffset->LowPart == FILE_USE_FILE_POINTER_POSITION)
+			return FltObjects->FileObject->CurrentByteOffset.QuadPart;
+
+		return -1;
+	}
+
+	return byteOffset->QuadPart;
+}
+
+BOOLEAN
+MapIoOffset(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PSTREAM_CONTEXT streamCtx,
+_In_ PVOLUME_CONTEXT volCtx,
+_Out_ PLONGLONG FileOffset
+)
+/*++
+
+Routine Description:
+
+    This routine returns the offset in the file a read or write of a
+    stream we transform goes to.  Non-paging I/O of a file with a header
+    is at plain text offsets and goes past the header; paging I/O, from
+    the cache and memory managers, is at file offsets already.  The
+    caller sends the I/O to the new offset.
+
+Arguments:
+
+    Data - Read or write, with its original parameters
+
+    FltObjects - Objects of the operation, for the file position
+
+    streamCtx - Context of the stream
+
+    volCtx - Volume context, for the layout
+
+    FileOffset - Receives the offset, -1 for an append: the file system
+        writes it at the end of file whatever the layout
+
+Return Value:
+
+    TRUE if the I/O is to be moved to FileOffset
+
+--*/
+{
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	LONGLONG offset = ResolveIoOffset(Data, FltObjects);
+
+	if (offset < 0)
+	{
+		*FileOffset = -1;
+		return SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER) != 0;
+	}
+
+	*FileOffset = offset;
+
+	if (FlagOn(iopb->IrpFlags, IRP_PAGING_IO) || !SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER))
+		return FALSE;
+
+	*FileOffset = Layout_ToFile(&volCtx->Layout, offset);
+
+	return TRUE;
+}
+
+VOID
+UnmapFilePosition(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PPRE_2_POST_CONTEXT p2pCtx
+)
+/*++
+
+Routine Description:
+
+    This routine moves the file position of a synchronous file object
+    back to plain text offsets after a read or write MapIoOffset moved:
+    the file system left it at the end of the I/O in the file.
+
+    May be called at DPC level.
+
+Arguments:
+
+    Data - Completed read or write
+
+    FltObjects - Objects of the operation
+
+    p2pCtx - Context from the pre-operation
+
+Return Value:
+
+    None
+
+--*/
+{
+	PFILE_OBJECT fileObject = FltObjects->FileObject;
+	LONGLONG head = p2pCtx->VolCtx->Layout.HeadLength;
+	LONGLONG position = fileObject->CurrentByteOffset.QuadPart;
+
+	if (!p2pCtx->Remapped || !FlagOn(fileObject->Flags, FO_SYNCHRONOUS_IO) ||
+		!NT_SUCCESS(Data->IoStatus.Status))
+		return;
+
+	//left alone by I/O asking so, e.g. FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET
+	if (p2pCtx->FileOffset >= 0)
+	{
+		if (position != p2pCtx->FileOffset + (LONGLONG)Data->IoStatus.Information)
+			return;
+	}
+	else if (position < head)
+	{
+		return;
+	}
+
+	fileObject->CurrentByteOffset.QuadPart = position - head;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PreWrite(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+)
+/*++
+
+Routine Description:
+
+    This routine encrypts non-cached and paging writes of streams we
+    encrypt.  The plain text is read once from the caller's buffer and the
+    cipher text is written straight into a pooled swap buffer, which is
+    sent down in place of the caller's buffer; the caller's data is never
+    modified.  Cached writes are not transformed, the paging writes that
+    flush them are, but still get a PostWrite to track the valid length.
+    Non-paging writes of a file with a header, cached or not, are moved
+    past it.
+
+    A write extending a file with a trailer, cached or not, moves the
+    trailer behind it in PostWrite; an append to such a file goes to its
+    valid length, not behind the trailer.  Paging writes stop before the
+    trailer: the pages past the valid length hold zeros, not the trailer.
+
+    Writes of an encrypted file whose key is unknown are denied, plain
+    text would land amid its cipher text.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - Receives the PRE_2_POST_CONTEXT for PostWrite.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_WITH_CALLBACK - write of a stream we encrypt
+    FLT_PREOP_SUCCESS_NO_CALLBACK - not our write
+    FLT_PREOP_COMPLETE - failed, or denied
+
+--*/
+{
+	NTSTATUS status;
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	FLT_PREOP_CALLBACK_STATUS retValue = FLT_PREOP_SUCCESS_NO_CALLBACK;
+	PVOLUME_CONTEXT volCtx = NULL;
+	PSTREAM_CONTEXT streamCtx = NULL;
+	PPRE_2_POST_CONTEXT p2pCtx = NULL;
+	PVOID newBuf = NULL;
+	PMDL newMdl = NULL;
+	PUCHAR origBuf;
+	ULONG writeLen = iopb->Parameters.Write.Length;
+	ULONG bufLen = 0;
+	LARGE_INTEGER validLength;
+	LARGE_INTEGER fileSize;
+	LONGLONG flagOffset;
+	LONGLONG offset;
+	LONGLONG end;
+	BOOLEAN trailer;
+	KIRQL oldIrql;
+
+	*CompletionContext = NULL;
+
+	if (writeLen == 0)
+		return FastPathCount(FastPathWrite, FLT_PREOP_SUCCESS_NO_CALLBACK);
+
+	//the first write of a stream, cached or not, reads its trailer
+	if (Ctx_MayBePending(FltObjects->FileObject) && !FlagOn(iopb->IrpFlags, IRP_PAGING_IO))
+	{
+		if (FLT_IS_FASTIO_OPERATION(Data))
+			return FastPathCount(FastPathWrite, FLT_PREOP_DISALLOW_FASTIO);
+
+		ResolveStream(FltObjects);
+	}
+
+	if (!Ctx_MayBeHandled(FltObjects->FileObject))
+		return FastPathCount(FastPathWrite, FLT_PREOP_SUCCESS_NO_CALLBACK);
+
+	try {
+
+		status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamCtx);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		if (!SC_TEST_FLAG(streamCtx, SC_FLAG_ENCRYPT_ON_WRITE))
+		{
+			if (SC_TEST_FLAG(streamCtx, SC_FLAG_FILE_CRYPT))
+			{
+				Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+				Data->IoStatus.Information = 0;
+				retValue = FLT_PREOP_COMPLETE;
+			}
+			leave;
+		}
+
+		if (FLT_IS_FASTIO_OPERATION(Data))
+		{
+			retValue = FLT_PREOP_DISALLOW_FASTIO;
+			leave;
+		}
+
+		status = FltGetVolumeContext(FltObjects->Filter, FltObjects->Volume, &volCtx);
+		if (!NT_SUCCESS(status))
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]PreWrite: FltGetVolumeContext failed, status=%08x\n", status));
+			leave;
+		}
+
+		p2pCtx = ExAllocateFromNPagedLookasideList(&Pre2PostContextList);
+		if (p2pCtx == NULL)
+		{
+			Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			Data->IoStatus.Information = 0;
+			retValue = FLT_PREOP_COMPLETE;
+			leave;
+		}
+
+		//KeyEntry is published by the flag tested above
+		SC_READ_SIZES(streamCtx, &validLength, &fileSize);
+		p2pCtx->ValidLength = validLength.QuadPart;
+		p2pCtx->KeyEntry = streamCtx->KeyEntry;
+
+		p2pCtx->SwappedBuffer = NULL;
+		p2pCtx->SwappedLength = 0;
+		p2pCtx->VolCtx = volCtx;
+		p2pCtx->pStreamCtx = streamCtx;
+		p2pCtx->RangeHeld = FALSE;
+		p2pCtx->MovesTrailer = FALSE;
+		p2pCtx->Clipped = FALSE;
+		p2pCtx->Remapped = MapIoOffset(Data, FltObjects, streamCtx, volCtx, &p2pCtx->FileOffset);
+		p2pCtx->PlainOffset = ResolveIoOffset(Data, FltObjects);
+
+		trailer = !SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER);
+
+		//the file system picks the offset of an append, too late for us
+		//to pick the counter of a non-cached one
+		if (p2pCtx->PlainOffset < 0 && FlagOn(iopb->IrpFlags, IRP_NOCACHE))
+		{
+			Data->IoStatus.Status = STATUS_NOT_SUPPORTED;
+			Data->IoStatus.Information = 0;
+			retValue = FLT_PREOP_COMPLETE;
+			leave;
+		}
+
+		if (FlagOn(iopb->IrpFlags, IRP_PAGING_IO))
+		{
+			//cut short before the trailer; past it there is nothing to write
+			flagOffset = trailer ? Layout_FlagOffset(&volCtx->Layout, fileSize.QuadPart) : -1;
+			if (flagOffset >= 0 && p2pCtx->FileOffset + writeLen > flagOffset)
+			{
+				if (p2pCtx->FileOffset >= flagOffset)
+				{
+					Data->IoStatus.Status = STATUS_SUCCESS;
+					Data->IoStatus.Information = writeLen;
+					retValue = FLT_PREOP_COMPLETE;
+					leave;
+				}
+
+				writeLen = (ULONG)(flagOffset - p2pCtx->FileOffset);
+				iopb->Parameters.Write.Length = writeLen;
+				FltSetCallbackDataDirty(Data);
+				p2pCtx->Clipped = TRUE;
+			}
+		}
+		else if (FlagOn(iopb->IrpFlags, IRP_NOCACHE) || trailer)
+		{
+			//non-cached user writes exclude the reads and writes they
+			//overlap.  One extending the file, and any write extending a
+			//trailer, locks from the old valid length to the end until
+			//PostWrite has published the new one and moved the trailer.
+			//Paging writes are left out, see PreRead.
+			offset = p2pCtx->PlainOffset;
+			end = offset + writeLen;
+			if (offset < 0 || end > validLength.QuadPart)
+			{
+				offset = (offset < 0) ? validLength.QuadPart : min(offset, validLength.QuadPart);
+				end = RANGE_LOCK_TO_END_OF_FILE;
+			}
+
+			if (FlagOn(iopb->IrpFlags, IRP_NOCACHE) || end == RANGE_LOCK_TO_END_OF_FILE)
+			{
+				RangeLock_Acquire(&streamCtx->RangeLock, &p2pCtx->Range, offset, end, TRUE);
+				p2pCtx->RangeHeld = TRUE;
+
+				//extensions of a trailer are serialized from here on
+				SC_READ_SIZES(streamCtx, &validLength, NULL);
+				p2pCtx->ValidLength = validLength.QuadPart;
+			}
+
+			if (trailer && end == RANGE_LOCK_TO_END_OF_FILE)
+			{
+				if (p2pCtx->PlainOffset < 0)
+				{
+					p2pCtx->PlainOffset = validLength.QuadPart;
+					p2pCtx->FileOffset = validLength.QuadPart;
+					iopb->Parameters.Write.ByteOffset.QuadPart = validLength.QuadPart;
+					FltSetCallbackDataDirty(Data);
+				}
+
+				p2pCtx->MovesTrailer = (BOOLEAN)(p2pCtx->PlainOffset + writeLen > validLength.QuadPart);
+			}
+		}
+
+		if (FlagOn(iopb->IrpFlags, IRP_NOCACHE))
+		{
+			//a user buffer is locked here, in the requestor's context
+			if (iopb->Parameters.Write.MdlAddress == NULL &&
+				!FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER))
+			{
+				status = FltLockUserBuffer(Data);
+				if (!NT_SUCCESS(status))
+				{
+					Data->IoStatus.Status = status;
+					Data->IoStatus.Information = 0;
+					retValue = FLT_PREOP_COMPLETE;
+					leave;
+				}
+			}
+
+			if (iopb->Parameters.Write.MdlAddress != NULL)
+			{
+				origBuf = MmGetSystemAddressForMdlSafe(iopb->Parameters.Write.MdlAddress, NormalPagePriority);
+				if (origBuf == NULL)
+				{
+					Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+					Data->IoStatus.Information = 0;
+					retValue = FLT_PREOP_COMPLETE;
+					leave;
+				}
+			}
+			else
+			{
+				origBuf = iopb->Parameters.Write.WriteBuffer;
+			}
+
+			bufLen = (ULONG)ROUND_TO_SIZE(writeLen, volCtx->SectorSize);
+
+			newBuf = BufPool_Allocate(bufLen);
+			if (newBuf == NULL)
+			{
+				Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+				Data->IoStatus.Information = 0;
+				retValue = FLT_PREOP_COMPLETE;
+				leave;
+			}
+
+			//FltMgr frees the MDL when the operation completes
+			if (FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_IRP_OPERATION))
+			{
+				newMdl = IoAllocateMdl(newBuf, bufLen, FALSE, FALSE, NULL);
+				if (newMdl == NULL)
+				{
+					Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+					Data->IoStatus.Information = 0;
+					retValue = FLT_PREOP_COMPLETE;
+					leave;
+				}
+
+				MmBuildMdlForNonPagedPool(newMdl);
+			}
+
+			p2pCtx->SwappedBuffer = newBuf;
+			p2pCtx->SwappedLength = bufLen;
+
+			status = EncryptWriteBuffer(Data, p2pCtx, origBuf);
+			if (!NT_SUCCESS(status))
+			{
+				LOG_PRINT(LOG_ERROR,
+					("[CryptMini]PreWrite: EncryptWriteBuffer failed, status=%08x\n", status));
+				Data->IoStatus.Status = status;
+				Data->IoStatus.Information = 0;
+				retValue = FLT_PREOP_COMPLETE;
+				leave;
+			}
+
+			iopb->Parameters.Write.WriteBuffer = newBuf;
+			iopb->Parameters.Write.MdlAddress = newMdl;
+			FltSetCallbackDataDirty(Data);
+		}
+
+		//paging writes may reach the new end from here on, where
+		//PostWrite moves the trailer
+		if (p2pCtx->MovesTrailer)
+		{
+			SC_SIZE_LOCK(streamCtx, &oldIrql);
+			streamCtx->FileSize.QuadPart = max(streamCtx->FileSize.QuadPart,
+				Layout_FileSize(&volCtx->Layout, p2pCtx->PlainOffset + writeLen));
+			SC_SIZE_UNLOCK(streamCtx, oldIrql);
+		}
+
+		//moved last, the range above is locked at plain text offsets.  A
+		//non-cached write at the file position is pinned to the offset it
+		//is encrypted at, too
+		if (p2pCtx->FileOffset >= 0 && !FlagOn(iopb->IrpFlags, IRP_PAGING_IO) &&
+			(p2pCtx->Remapped || FlagOn(iopb->IrpFlags, IRP_NOCACHE)))
+		{
+			iopb->Parameters.Write.ByteOffset.QuadPart = p2pCtx->FileOffset;
+			FltSetCallbackDataDirty(Data);
+		}
+
+		*CompletionContext = p2pCtx;
+		retValue = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	}
+	finally {
+
+		if (retValue != FLT_PREOP_SUCCESS_WITH_CALLBACK)
+		{
+			if (newMdl != NULL)
+				IoFreeMdl(newMdl);
+
+			if (newBuf != NULL)
+				BufPool_Free(newBuf, bufLen);
+
+			if (p2pCtx != NULL)
+			{
+				if (p2pCtx->RangeHeld)
+					RangeLock_Release(&streamCtx->RangeLock, &p2pCtx->Range);
+
+				ExFreeToNPagedLookasideList(&Pre2PostContextList, p2pCtx);
+			}
+
+			if (volCtx != NULL)
+				FltReleaseContext(volCtx);
+
+			if (streamCtx != NULL)
+				FltReleaseContext(streamCtx);
+		}
+	}
+
+	return FastPathCount(FastPathWrite, retValue);
+}
+
+NTSTATUS
+EncryptWriteBuffer(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PPRE_2_POST_CONTEXT p2pCtx,
+_In_ PUCHAR OrigBuf
+)
+/*++
+
+Routine Description:
+
+    This routine encrypts a write from the caller's buffer into the
+    swapped buffer in one pass over memory.  Whole sectors are encrypted
+    straight from OrigBuf; a final partial sector is copied, zero padded
+    to the sector size and encrypted in place, so the cipher text on disk
+    always covers whole sectors.  Unless the whole sectors are split over
+    the worker pool, both go through the AES pipeline as one batch.  The
+    header a paging write of the first page of a file starts with is
+    copied as it is.
+
+Arguments:
+
+    Data - Write being sent down, with its original parameters
+
+    p2pCtx - Context from PreWrite, with the swapped buffer
+
+    OrigBuf - System address of the caller's buffer
+
+Return Value:
+
+    Status of the transform
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PVOLUME_CONTEXT volCtx = p2pCtx->VolCtx;
+	PSTREAM_CONTEXT streamCtx = p2pCtx->pStreamCtx;
+	PUCHAR swapped = p2pCtx->SwappedBuffer;
+	LAYOUT_EXTENT extent;
+	AES_CTR_JOB jobs[2];
+	ULONG count = 0;
+	LONGLONG offset;
+	ULONG length;
+	ULONG full;
+
+	Layout_MapFileRange(&volCtx->Layout, p2pCtx->FileOffset, Data->Iopb->Parameters.Write.Length, &extent);
+	offset = extent.Offset;
+	length = (ULONG)extent.Length;
+	full = length - length % volCtx->SectorSize;
+
+	if (extent.Skip > 0)
+	{
+		RtlCopyMemory(swapped, OrigBuf, extent.Skip);
+		OrigBuf += extent.Skip;
+		swapped += extent.Skip;
+	}
+
+	//multi-megabyte paging writes are split over the worker pool
+	if (Crypt_IsParallel(full))
+	{
+		status = Crypt_TransformParallel(volCtx, p2pCtx->KeyEntry, streamCtx->szNonce, offset,
+			OrigBuf, swapped, full, TRUE);
+	}
+	else if (full > 0)
+	{
+		jobs[count].Key = &p2pCtx->KeyEntry->Key;
+		jobs[count].Nonce = streamCtx->szNonce;
+		jobs[count].ByteOffset = (ULONGLONG)offset;
+		jobs[count].In = OrigBuf;
+		jobs[count].Out = swapped;
+		jobs[count].Length = full;
+		count++;
+	}
+
+	if (length > full)
+	{
+		RtlCopyMemory(swapped + full, OrigBuf + full, length - full);
+		RtlZeroMemory(swapped + length, volCtx->SectorSize - (length - full));
+
+		jobs[count].Key = &p2pCtx->KeyEntry->Key;
+		jobs[count].Nonce = streamCtx->szNonce;
+		jobs[count].ByteOffset = (ULONGLONG)(offset + full);
+		jobs[count].In = swapped + full;
+		jobs[count].Out = swapped + full;
+		jobs[count].Length = volCtx->SectorSize;
+		count++;
+	}
+
+	if (NT_SUCCESS(status) && count > 0)
+		status = Crypt_TransformBatch(volCtx, jobs, count, TRUE);
+
+	return status;
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostWrite(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    This routine frees the swapped buffer of a write and records the data
+    written: the valid length grows with non-paging writes past it, and
+    bHasWriteData marks the stream for a new file flag.  The file position
+    of a write moved past a header is moved back first.  A write that
+    extended a file with a trailer moves it in UpdateFileFlagWhenSafe,
+    at a safe IRQL, still holding its range.
+
+    May be called at DPC level.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - The PRE_2_POST_CONTEXT set in PreWrite.
+
+    Flags - Denotes whether the completion is successful or is being drained.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING, or FLT_POSTOP_MORE_PROCESSING_REQUIRED
+    when the trailer is moved in a worker thread.
+
+--*/
+{
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	PPRE_2_POST_CONTEXT p2pCtx = CompletionContext;
+	PSTREAM_CONTEXT streamCtx = p2pCtx->pStreamCtx;
+	FLT_POSTOP_CALLBACK_STATUS retValue = FLT_POSTOP_FINISHED_PROCESSING;
+	LONGLONG end = -1;
+	LARGE_INTEGER validLength;
+	KIRQL oldIrql;
+
+	if (!FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) &&
+		NT_SUCCESS(Data->IoStatus.Status) && (Data->IoStatus.Information != 0))
+	{
+		UnmapFilePosition(Data, FltObjects, p2pCtx);
+
+		//paging writes carry whole pages past the end of the valid data.
+		//The offset is the one PreWrite resolved, plain text
+		if (!FlagOn(iopb->IrpFlags, IRP_PAGING_IO))
+		{
+			if (p2pCtx->PlainOffset >= 0)
+				end = p2pCtx->PlainOffset + Data->IoStatus.Information;
+			else if (FlagOn(FltObjects->FileObject->Flags, FO_SYNCHRONOUS_IO))
+				end = FltObjects->FileObject->CurrentByteOffset.QuadPart;
+		}
+
+		//most writes do not extend the file, check without writing the context
+		SC_READ_SIZES(streamCtx, &validLength, NULL);
+		if (end > validLength.QuadPart)
+		{
+			SC_SIZE_LOCK(streamCtx, &oldIrql);
+			if (end > streamCtx->FileValidLength.QuadPart)
+				streamCtx->FileValidLength.QuadPart = end;
+			SC_SIZE_UNLOCK(streamCtx, oldIrql);
+		}
+
+		//set once, do not dirty the hot line on every write
+		if (!SC_TEST_FLAG(streamCtx, SC_FLAG_HAS_WRITE_DATA))
+			SC_SET_FLAG(streamCtx, SC_FLAG_HAS_WRITE_DATA);
+	}
+
+	//a paging write cut short before the trailer wrote all it had to
+	if (p2pCtx->Clipped && NT_SUCCESS(Data->IoStatus.Status))
+		Data->IoStatus.Information = iopb->Parameters.Write.Length;
+
+	//moved whether the write succeeded or not: paging writes may have
+	//reached the old trailer since PreWrite
+	if (p2pCtx->MovesTrailer && !FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING))
+	{
+		if (FltDoCompletionProcessingWhenSafe(Data, FltObjects, CompletionContext, Flags,
+			UpdateFileFlagWhenSafe, &retValue))
+		{
+			//UpdateFileFlagWhenSafe frees it
+			return retValue;
+		}
+
+		LOG_PRINT(LOG_ERROR,
+			("[CryptMini]PostWrite: trailer of %wZ not moved\n", &streamCtx->FileName));
+		Data->IoStatus.Status = STATUS_UNSUCCESSFUL;
+		Data->IoStatus.Information = 0;
+	}
+
+	FreePre2PostContext(p2pCtx);
+
+	return retValue;
+}
+
+NTSTATUS
+UpdateFileFlag(
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PPRE_2_POST_CONTEXT p2pCtx,
+_In_ LONGLONG ZeroEnd
+)
+/*++
+
+Routine Description:
+
+    This routine moves the file flag trailer of a stream behind its valid
+    length, after a write or size change moved the valid length; see
+    layout.h.  Paging writes are cut short before the new trailer first,
+    so none lands on it once written.
+
+    A file extended past its old trailer first gets the cipher text of
+    zeros from the old trailer up to ZeroEnd: the old trailer, and what
+    the file system zeroed behind it, are plain text now and must read
+    back as zeros.
+
+    Called at PASSIVE_LEVEL, holding the range of the write or size change
+    to the end of file.
+
+Arguments:
+
+    FltObjects - Objects of the operation, its file object has write access
+
+    p2pCtx - Context from the pre-operation, ValidLength is the valid
+        length before the operation
+
+    ZeroEnd - Sector aligned end of the range the operation did not write
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PVOLUME_CONTEXT volCtx = p2pCtx->VolCtx;
+	PSTREAM_CONTEXT streamCtx = p2pCtx->pStreamCtx;
+	LONGLONG sectorMask = (LONGLONG)volCtx->SectorSize - 1;
+	LARGE_INTEGER validLength;
+	LARGE_INTEGER offset;
+	FILE_FLAG flag;
+	PUCHAR buffer;
+	ULONG length;
+	ULONG bytesWritten;
+	KIRQL oldIrql;
+
+	PAGED_CODE();
+
+	SC_READ_SIZES(streamCtx, &validLength, NULL);
+
+	SC_SIZE_LOCK(streamCtx, &oldIrql);
+	streamCtx->FileSize.QuadPart = Layout_FileSize(&volCtx->Layout, validLength.QuadPart);
+	SC_SIZE_UNLOCK(streamCtx, oldIrql);
+
+	offset.QuadPart = (p2pCtx->ValidLength + sectorMask) & ~sectorMask;
+	ZeroEnd = min(ZeroEnd, (validLength.QuadPart + sectorMask) & ~sectorMask);
+
+	if (offset.QuadPart < ZeroEnd)
+	{
+		buffer = BufPool_Allocate(ZERO_FILL_CHUNK);
+		if (buffer == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		while (NT_SUCCESS(status) && offset.QuadPart < ZeroEnd)
+		{
+			length = (ULONG)min(ZeroEnd - offset.QuadPart, ZERO_FILL_CHUNK);
+
+			RtlZeroMemory(buffer, length);
+			status = Crypt_Transform(volCtx, p2pCtx->KeyEntry, streamCtx->szNonce, offset.QuadPart,
+				buffer, buffer, length, TRUE);
+
+			if (NT_SUCCESS(status))
+				status = FltWriteFile(FltObjects->Instance, FltObjects->FileObject, &offset, length, buffer,
+					FLTFL_IO_OPERATION_NON_CACHED | FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET,
+					&bytesWritten, NULL, NULL);
+
+			offset.QuadPart += length;
+		}
+
+		BufPool_Free(buffer, ZERO_FILL_CHUNK);
+
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	flag.uVersion = FLAGFMT_VERSION_2;
+	flag.CipherId = volCtx->CipherId;
+	RtlCopyMemory(flag.szKeyHash, streamCtx->szKeyHash, HASH_SIZE);
+	RtlCopyMemory(flag.szNonce, streamCtx->szNonce, IV_LENGTH);
+	flag.FileValidLength = validLength;
+
+	return Trailer_Write(FltObjects->Instance, FltObjects->FileObject, volCtx, &flag);
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+UpdateFileFlagWhenSafe(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    PostWrite or PostSetInformation of an operation moving the trailer of
+    its stream, called at a safe IRQL: move it and free the context, which
+    releases the range of the operation.  What a write did not write is
+    the range from the old trailer to the sector of its offset; a size
+    change writes nothing.
+
+Arguments:
+
+    Same as PostWrite.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING
+
+--*/
+{
+	NTSTATUS status;
+	PPRE_2_POST_CONTEXT p2pCtx = CompletionContext;
+	LONGLONG zeroEnd = MAXLONGLONG;
+
+	UNREFERENCED_PARAMETER(Flags);
+
+	if (Data->Iopb->MajorFunction == IRP_MJ_WRITE)
+		zeroEnd = p2pCtx->PlainOffset & ~((LONGLONG)p2pCtx->VolCtx->SectorSize - 1);
+
+	status = UpdateFileFlag(FltObjects, p2pCtx, zeroEnd);
+	if (!NT_SUCCESS(status))
+	{
+		LOG_PRINT(LOG_ERROR,
+			("[CryptMini]UpdateFileFlagWhenSafe: trailer of %wZ not moved, status=%08x\n",
+			&p2pCtx->pStreamCtx->FileName, status));
+
+		if (NT_SUCCESS(Data->IoStatus.Status))
+		{
+			Data->IoStatus.Status = status;
+			Data->IoStatus.Information = 0;
+		}
+	}
+
+	FreePre2PostContext(p2pCtx);
+
+	return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PreSetInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+)
+/*++
+
+Routine Description:
+
+    This routine moves the end of file or allocation size set on a stream
+    we encrypt from plain text to file offsets: past the header, or to the
+    end of the trailer behind the new size, which PostSetInformation moves
+    there.  The range from the new size, or the old valid length if lower,
+    to the end of file is held until then.  Sizes the cache manager
+    advances are file offsets already.  Encrypted files whose key is
+    unknown cannot be resized: their flag could not be moved.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - Receives the PRE_2_POST_CONTEXT for PostSetInformation.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_WITH_CALLBACK - size change of a stream we encrypt
+    FLT_PREOP_SUCCESS_NO_CALLBACK - not ours
+    FLT_PREOP_COMPLETE - failed for lack of resources, or denied
+
+--*/
+{
+	NTSTATUS status;
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	FILE_INFORMATION_CLASS infoClass = iopb->Parameters.SetFileInformation.FileInformationClass;
+	FLT_PREOP_CALLBACK_STATUS retValue = FLT_PREOP_SUCCESS_NO_CALLBACK;
+	PVOLUME_CONTEXT volCtx = NULL;
+	PSTREAM_CONTEXT streamCtx = NULL;
+	PPRE_2_POST_CONTEXT p2pCtx = NULL;
+	LARGE_INTEGER validLength;
+	PLARGE_INTEGER size;
+
+	*CompletionContext = NULL;
+
+	if (infoClass == FileEndOfFileInformation && !iopb->Parameters.SetFileInformation.AdvanceOnly)
+		size = &((PFILE_END_OF_FILE_INFORMATION)iopb->Parameters.SetFileInformation.InfoBuffer)->EndOfFile;
+	else if (infoClass == FileAllocationInformation)
+		size = &((PFILE_ALLOCATION_INFORMATION)iopb->Parameters.SetFileInformation.InfoBuffer)->AllocationSize;
+	else
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	if (Ctx_MayBePending(FltObjects->FileObject))
+		ResolveStream(FltObjects);
+
+	if (!Ctx_MayBeHandled(FltObjects->FileObject))
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	try {
+
+		status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamCtx);
+		if (!NT_SUCCESS(status))
+			leave;
+
+		if (!SC_TEST_FLAG(streamCtx, SC_FLAG_ENCRYPT_ON_WRITE))
+		{
+			if (SC_TEST_FLAG(streamCtx, SC_FLAG_FILE_CRYPT))
+			{
+				Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+				Data->IoStatus.Information = 0;
+				retValue = FLT_PREOP_COMPLETE;
+			}
+			leave;
+		}
+
+		//the file system fails negative sizes
+		if (size->QuadPart < 0)
+			leave;
+
+		status = FltGetVolumeContext(FltObjects->Filter, FltObjects->Volume, &volCtx);
+		if (!NT_SUCCESS(status))
+		{
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]PreSetInformation: FltGetVolumeContext failed, status=%08x\n", status));
+			leave;
+		}
+
+		p2pCtx = ExAllocateFromNPagedLookasideList(&Pre2PostContextList);
+		if (p2pCtx == NULL)
+		{
+			Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			Data->IoStatus.Information = 0;
+			retValue = FLT_PREOP_COMPLETE;
+			leave;
+		}
+
+		SC_READ_SIZES(streamCtx, &validLength, NULL);
+
+		p2pCtx->SwappedBuffer = NULL;
+		p2pCtx->SwappedLength = 0;
+		p2pCtx->VolCtx = volCtx;
+		p2pCtx->pStreamCtx = streamCtx;
+		p2pCtx->KeyEntry = streamCtx->KeyEntry;
+		p2pCtx->Remapped = FALSE;
+		p2pCtx->Clipped = FALSE;
+		p2pCtx->PlainOffset = size->QuadPart;
+
+		RangeLock_Acquire(&streamCtx->RangeLock, &p2pCtx->Range,
+			min(size->QuadPart, validLength.QuadPart), RANGE_LOCK_TO_END_OF_FILE, TRUE);
+		p2pCtx->RangeHeld = TRUE;
+
+		SC_READ_SIZES(streamCtx, &validLength, NULL);
+		p2pCtx->ValidLength = validLength.QuadPart;
+
+		//an allocation size above the valid length leaves the file as it is
+		p2pCtx->MovesTrailer = (BOOLEAN)(!SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER) &&
+			(infoClass == FileEndOfFileInformation ? size->QuadPart != validLength.QuadPart : size->QuadPart < validLength.QuadPart));
+
+		//the caller's buffer is a copy, its size can be moved in place
+		if (SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER))
+			size->QuadPart = Layout_ToFile(&volCtx->Layout, size->QuadPart);
+		else
+			size->QuadPart = Layout_FileSize(&volCtx->Layout, size->QuadPart);
+
+		p2pCtx->FileOffset = size->QuadPart;
+
+		*CompletionContext = p2pCtx;
+		retValue = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	}
+	finally {
+
+		if (retValue != FLT_PREOP_SUCCESS_WITH_CALLBACK)
+		{
+			if (p2pCtx != NULL)
+				ExFreeToNPagedLookasideList(&Pre2PostContextList, p2pCtx);
+
+			if (volCtx != NULL)
+				FltReleaseContext(volCtx);
+
+			if (streamCtx != NULL)
+				FltReleaseContext(streamCtx);
+		}
+	}
+
+	return retValue;
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostSetInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    This routine publishes the valid length a size change left, and moves
+    the trailer behind it in UpdateFileFlagWhenSafe.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - The PRE_2_POST_CONTEXT set in PreSetInformation.
+
+    Flags - Denotes whether the completion is successful or is being drained.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING, or FLT_POSTOP_MORE_PROCESSING_REQUIRED
+    when the trailer is moved in a worker thread.
+
+--*/
+{
+	PPRE_2_POST_CONTEXT p2pCtx = CompletionContext;
+	PSTREAM_CONTEXT streamCtx = p2pCtx->pStreamCtx;
+	FLT_POSTOP_CALLBACK_STATUS retValue = FLT_POSTOP_FINISHED_PROCESSING;
+	KIRQL oldIrql;
+
+	if (!FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) && NT_SUCCESS(Data->IoStatus.Status))
+	{
+		SC_SIZE_LOCK(streamCtx, &oldIrql);
+		if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileEndOfFileInformation ||
+			p2pCtx->PlainOffset < streamCtx->FileValidLength.QuadPart)
+		{
+			streamCtx->FileValidLength.QuadPart = p2pCtx->PlainOffset;
+			if (SC_TEST_FLAG(streamCtx, SC_FLAG_HEADER))
+				streamCtx->FileSize.QuadPart = p2pCtx->FileOffset;
+		}
+		SC_SIZE_UNLOCK(streamCtx, oldIrql);
+
+		if (!SC_TEST_FLAG(streamCtx, SC_FLAG_HAS_WRITE_DATA))
+			SC_SET_FLAG(streamCtx, SC_FLAG_HAS_WRITE_DATA);
+
+		if (p2pCtx->MovesTrailer)
+		{
+			if (FltDoCompletionProcessingWhenSafe(Data, FltObjects, CompletionContext, Flags,
+				UpdateFileFlagWhenSafe, &retValue))
+			{
+				//UpdateFileFlagWhenSafe frees it
+				return retValue;
+			}
+
+			LOG_PRINT(LOG_ERROR,
+				("[CryptMini]PostSetInformation: trailer of %wZ not moved\n", &streamCtx->FileName));
+			Data->IoStatus.Status = STATUS_UNSUCCESSFUL;
+		}
+	}
+
+	FreePre2PostContext(p2pCtx);
+
+	return retValue;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PreQueryInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+)
+/*++
+
+Routine Description:
+
+    This routine asks for a PostQueryInformation of the size queries of
+    streams we encrypt: their file flag is not part of the file to its
+    users, who would otherwise append behind the trailer.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - Receives the referenced stream context.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_WITH_CALLBACK - size query of a stream we encrypt
+    FLT_PREOP_SUCCESS_NO_CALLBACK - not ours
+    FLT_PREOP_DISALLOW_FASTIO - a pending stream, retried as an IRP
+
+--*/
+{
+	NTSTATUS status;
+	FILE_INFORMATION_CLASS infoClass = Data->Iopb->Parameters.QueryFileInformation.FileInformationClass;
+	PSTREAM_CONTEXT streamCtx = NULL;
+
+	*CompletionContext = NULL;
+
+	if (infoClass != FileStandardInformation &&
+		infoClass != FileAllInformation &&
+		infoClass != FileNetworkOpenInformation)
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	if (Ctx_MayBePending(FltObjects->FileObject))
+	{
+		if (FLT_IS_FASTIO_OPERATION(Data))
+			return FLT_PREOP_DISALLOW_FASTIO;
+
+		ResolveStream(FltObjects);
+	}
+
+	if (!Ctx_MayBeHandled(FltObjects->FileObject))
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamCtx);
+	if (!NT_SUCCESS(status))
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	if (!SC_TEST_FLAG(streamCtx, SC_FLAG_FILE_CRYPT))
+	{
+		FltReleaseContext(streamCtx);
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+	}
+
+	*CompletionContext = streamCtx;
+
+	return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostQueryInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+
+Routine Description:
+
+    This routine reports the valid length of a stream we encrypt as its
+    end of file.  FileAllInformation may come back partial, with
+    STATUS_BUFFER_OVERFLOW; its standard information is early enough.
+
+    May be called at DPC level.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Unused.
+
+    CompletionContext - The stream context referenced in PreQueryInformation.
+
+    Flags - Denotes whether the completion is successful or is being drained.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING
+
+--*/
+{
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+	PSTREAM_CONTEXT streamCtx = CompletionContext;
+	PVOID buffer = iopb->Parameters.QueryFileInformation.InfoBuffer;
+	ULONG_PTR returned = Data->IoStatus.Information;
+	LARGE_INTEGER validLength;
+
+	UNREFERENCED_PARAMETER(FltObjects);
+
+	if (!FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) &&
+		(NT_SUCCESS(Data->IoStatus.Status) || Data->IoStatus.Status == STATUS_BUFFER_OVERFLOW))
+	{
+		SC_READ_SIZES(streamCtx, &validLength, NULL);
+
+		switch (iopb->Parameters.QueryFileInformation.FileInformationClass)
+		{
+		case FileStandardInformation:
+			if (returned >= sizeof(FILE_STANDARD_INFORMATION))
+				((PFILE_STANDARD_INFORMATION)buffer)->EndOfFile = validLength;
+			break;
+
+		case FileAllInformation:
+			if (returned >= FIELD_OFFSET(FILE_ALL_INFORMATION, StandardInformation) + sizeof(FILE_STANDARD_INFORMATION))
+				((PFILE_ALL_INFORMATION)buffer)->StandardInformation.EndOfFile = validLength;
+			break;
+
+		case FileNetworkOpenInformation:
+			if (returned >= sizeof(FILE_NETWORK_OPEN_INFORMATION))
+				((PFILE_NETWORK_OPEN_INFORMATION)buffer)->EndOfFile = validLength;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	FltReleaseContext(streamCtx);
 
 	return FLT_POSTOP_FINISHED_PROCESSING;
 }
@@ -5,6 +5,18 @@
 
 #include "common.h"
 #include "ctx.h"
+#include "crypt.h"
+#include "keycache.h"
+#include "keylist.h"
+#include "proclist.h"
+#include "pidcache.h"
+#include "policylist.h"
+#include "rangelock.h"
+#include "msg.h"
+#include "bufpool.h"
+#include "filecache.h"
+#include "workpool.h"
+#include "trailer.h"
 
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
@@ -30,10 +42,10 @@ ULONG gLogFlags = 3;		//
 /*************************************************************************
 Pool Tags
 *************************************************************************/
-#define BUFFER_SWAP_TAG     'bdBS'
 #define CONTEXT_TAG         'xcBS'
 #define NAME_TAG            'mnBS'
 #define PRE_2_POST_TAG      'ppBS'
+#define STATS_TAG           'tsBS'
 
 
 /*************************************************************************
@@ -63,12 +75,178 @@ typedef struct _PRE_2_POST_CONTEXT {
 	//
 	PVOID SwappedBuffer;
 
+	//
+	//  Length the swapped buffer was allocated with, for BufPool_Free.
+	//
+
+	ULONG SwappedLength;
+
+	//
+	//  Snapshot of the stream's crypt state taken in the pre-operation
+	//  path, where the stream context can be locked.
+	//
+
+	LONGLONG ValidLength;
+
+	PKEY_CACHE_ENTRY KeyEntry;
+
+	//
+	//  System address of the caller's buffer, for a deferred PostRead.
+	//
+
+	PUCHAR OrigBuffer;
+
+	//
+	//  Offset in the file the I/O was sent to, -1 for an append, and
+	//  whether it was moved there from a plain text offset, see
+	//  MapIoOffset.
+	//
+
+	LONGLONG FileOffset;
+
+	BOOLEAN Remapped;
+
+	//
+	//  Plain text offset a non-paging write was at, resolved for writes at
+	//  the file position and for appends to a trailer, -1 for other
+	//  appends.  The new size of a size change.
+	//
+
+	LONGLONG PlainOffset;
+
+	//
+	//  Set when the post-operation moves the file flag trailer behind the
+	//  new valid length, see UpdateFileFlag; and when a paging write was
+	//  cut short before the trailer, see PreWrite.
+	//
+
+	BOOLEAN MovesTrailer;
+
+	BOOLEAN Clipped;
+
+	//
+	//  Range of a non-cached non-paging I/O, held until the post-operation
+	//  frees this context.
+	//
+
+	BOOLEAN RangeHeld;
+
+	RANGE_LOCK_ENTRY Range;
+
 } PRE_2_POST_CONTEXT, *PPRE_2_POST_CONTEXT;
 //
 //  This is a lookAside list used to allocate our pre-2-post structure.
 //
 NPAGED_LOOKASIDE_LIST Pre2PostContextList;
 
+//
+//  Read completions at DISPATCH_LEVEL longer than gReadDeferThreshold are
+//  decrypted in a worker thread instead of stalling the processor.  At
+//  most gReadDeferMaxDepth are posted at once; past that they are
+//  decrypted inline.
+//
+
+#define READ_DEFER_THRESHOLD    (64 * 1024)
+#define READ_DEFER_MAX_DEPTH    64
+
+typedef struct _READ_COMPLETION_STATS {
+
+	//decrypted in PostRead
+	volatile LONG64 Inline;
+
+	//decrypted in a worker thread
+	volatile LONG64 Deferred;
+
+	//decrypted inline at DISPATCH_LEVEL: queue full, or posting failed
+	volatile LONG64 Overflow;
+
+	//posted and not decrypted yet
+	volatile LONG Depth;
+
+} READ_COMPLETION_STATS, *PREAD_COMPLETION_STATS;
+
+ULONG gReadDeferThreshold = READ_DEFER_THRESHOLD;
+LONG gReadDeferMaxDepth = READ_DEFER_MAX_DEPTH;
+READ_COMPLETION_STATS gReadStats;
+
+//
+//  Volumes whose files have a header, see layout.h.  While there are
+//  none, cached reads are passed through without a context lookup.
+//
+
+volatile LONG gHeaderLayoutVolumes = 0;
+
+//
+//  A file extended past its trailer gets the cipher text of zeros where
+//  the trailer was, written in chunks of this size, see UpdateFileFlag.
+//
+
+#define ZERO_FILL_CHUNK         (64 * 1024)
+
+//
+//  Pre-operation fast path: how many callbacks returned without asking
+//  for a post-operation callback.  One cache line per processor,
+//  processors past FAST_PATH_SLOTS share one.
+//
+
+#define FAST_PATH_SLOTS         64
+
+typedef enum _FAST_PATH_OPERATION {
+
+	FastPathCreate = 0,
+	FastPathRead,
+	FastPathWrite,
+	FastPathMaximum
+
+} FAST_PATH_OPERATION;
+
+typedef struct DECLSPEC_ALIGN(64) _FAST_PATH_SLOT {
+
+	//pre-operation callbacks
+	volatile LONG64 Calls[FastPathMaximum];
+
+	//of which returned FLT_PREOP_SUCCESS_NO_CALLBACK
+	volatile LONG64 NoCallback[FastPathMaximum];
+
+} FAST_PATH_SLOT, *PFAST_PATH_SLOT;
+
+typedef struct _FAST_PATH_STATS {
+
+	LONG64 Calls[FastPathMaximum];
+	LONG64 NoCallback[FastPathMaximum];
+
+} FAST_PATH_STATS, *PFAST_PATH_STATS;
+
+FAST_PATH_SLOT gFastPath[FAST_PATH_SLOTS];
+
+//
+//  Create latency.  PostCreate does not read the trailer; the first read,
+//  write or mapping of a stream probes it, see ResolveStream.  Times are
+//  in 100ns units.
+//
+
+typedef struct _CREATE_STATS {
+
+	//PostCreate callbacks past the directory check
+	volatile LONG64 Creates;
+	volatile LONG64 CreateTime;
+	volatile LONG64 CreateMaxTime;
+
+	//trailer probes, each run by the first accessor of a stream
+	volatile LONG64 Probes;
+	volatile LONG64 ProbeTime;
+	volatile LONG64 ProbeMaxTime;
+
+	//first accessors that waited for another one's probe
+	volatile LONG64 Coalesced;
+
+	//probes that failed; retried after the next create of the stream
+	volatile LONG64 ProbeFailures;
+
+} CREATE_STATS, *PCREATE_STATS;
+
+CREATE_STATS gCreateStats;
+
 /*************************************************************************
 	ܶ庯
 *************************************************************************/
@@ -172,6 +350,47 @@ _In_opt_ PVOID CompletionContext,
 _In_ FLT_POST_OPERATION_FLAGS Flags
 );
 
+//
+//  Completion context of PreCreate: the PROCESS_DECISION of the requestor,
+//  and whether the file the create truncates held a file flag
+//
+
+#define CREATE_CONTEXT_DECISION     0x0000FFFF
+#define CREATE_CONTEXT_WAS_CRYPT    0x00010000
+
+BOOLEAN
+ProbeOverwrittenFile(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects
+);
+
+NTSTATUS
+SetupTruncatedStream(
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PVOLUME_CONTEXT volCtx,
+_Inout_ PSTREAM_CONTEXT streamCtx,
+_In_ PROCESS_DECISION Decision,
+_In_ BOOLEAN WasEncrypted
+);
+
+NTSTATUS
+ProbeStream(
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Inout_ PSTREAM_CONTEXT streamCtx
+);
+
+VOID
+ResolveStream(
+_In_ PCFLT_RELATED_OBJECTS FltObjects
+);
+
+FLT_PREOP_CALLBACK_STATUS
+PreAcquireForSection(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+);
+
 FLT_PREOP_CALLBACK_STATUS
 PreRead(
 _Inout_ PFLT_CALLBACK_DATA Data,
@@ -187,6 +406,61 @@ _In_opt_ PVOID CompletionContext,
 _In_ FLT_POST_OPERATION_FLAGS Flags
 );
 
+FLT_POSTOP_CALLBACK_STATUS
+PostReadWhenSafe(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
+BOOLEAN
+PostReadDefer(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PPRE_2_POST_CONTEXT p2pCtx
+);
+
+VOID
+PostReadDeferred(
+_In_ PFLT_DEFERRED_IO_WORKITEM WorkItem,
+_In_ PFLT_CALLBACK_DATA Data,
+_In_opt_ PVOID Context
+);
+
+VOID
+DecryptReadBuffer(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PPRE_2_POST_CONTEXT p2pCtx,
+_Out_ PUCHAR OrigBuf
+);
+
+VOID
+FreePre2PostContext(
+_In_ PPRE_2_POST_CONTEXT p2pCtx
+);
+
+LONGLONG
+ResolveIoOffset(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects
+);
+
+BOOLEAN
+MapIoOffset(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PSTREAM_CONTEXT streamCtx,
+_In_ PVOLUME_CONTEXT volCtx,
+_Out_ PLONGLONG FileOffset
+);
+
+VOID
+UnmapFilePosition(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PPRE_2_POST_CONTEXT p2pCtx
+);
+
 FLT_PREOP_CALLBACK_STATUS
 PreWrite(
 _Inout_ PFLT_CALLBACK_DATA Data,
@@ -194,6 +468,13 @@ _In_ PCFLT_RELATED_OBJECTS FltObjects,
 _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
 );
 
+NTSTATUS
+EncryptWriteBuffer(
+_In_ PFLT_CALLBACK_DATA Data,
+_In_ PPRE_2_POST_CONTEXT p2pCtx,
+_In_ PUCHAR OrigBuf
+);
+
 FLT_POSTOP_CALLBACK_STATUS
 PostWrite(
 _Inout_ PFLT_CALLBACK_DATA Data,
@@ -202,6 +483,77 @@ _In_opt_ PVOID CompletionContext,
 _In_ FLT_POST_OPERATION_FLAGS Flags
 );
 
+NTSTATUS
+UpdateFileFlag(
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_ PPRE_2_POST_CONTEXT p2pCtx,
+_In_ LONGLONG ZeroEnd
+);
+
+FLT_POSTOP_CALLBACK_STATUS
+UpdateFileFlagWhenSafe(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
+FLT_PREOP_CALLBACK_STATUS
+PreSetInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+);
+
+FLT_POSTOP_CALLBACK_STATUS
+PostSetInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
+FLT_PREOP_CALLBACK_STATUS
+PreQueryInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+);
+
+FLT_POSTOP_CALLBACK_STATUS
+PostQueryInformation(
+_Inout_ PFLT_CALLBACK_DATA Data,
+_In_ PCFLT_RELATED_OBJECTS FltObjects,
+_In_opt_ PVOID CompletionContext,
+_In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
+FLT_PREOP_CALLBACK_STATUS
+FastPathCount(
+_In_ FAST_PATH_OPERATION Operation,
+_In_ FLT_PREOP_CALLBACK_STATUS Status
+);
+
+VOID
+QueryFastPathStats(
+_Out_ PFAST_PATH_STATS Stats
+);
+
+VOID
+CountLatency(
+_Inout_ volatile LONG64 *Count,
+_Inout_ volatile LONG64 *Time,
+_Inout_ volatile LONG64 *MaxTime,
+_In_ LARGE_INTEGER Start
+);
+
+VOID
+QueryCreateStats(
+_Out_ PCREATE_STATS Stats
+);
+
+C_ASSERT(FastPathMaximum == STATS_OPERATIONS);
+
 //
 //  Assign text sections for each routine.
 //
@@ -213,6 +565,14 @@ _In_ FLT_POST_OPERATION_FLAGS Flags
 #pragma alloc_text(PAGE, CryptMiniInstanceSetup)
 #pragma alloc_text(PAGE, CryptMiniInstanceTeardownStart)
 #pragma alloc_text(PAGE, CryptMiniInstanceTeardownComplete)
+#pragma alloc_text(PAGE, PostCreate)
+#pragma alloc_text(PAGE, ProbeOverwrittenFile)
+#pragma alloc_text(PAGE, SetupTruncatedStream)
+#pragma alloc_text(PAGE, ProbeStream)
+#pragma alloc_text(PAGE, ResolveStream)
+#pragma alloc_text(PAGE, PreAcquireForSection)
+#pragma alloc_text(PAGE, UpdateFileFlag)
+#pragma alloc_text(PAGE, QueryDriverStats)
 #endif
 
 //
@@ -251,6 +611,21 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
 	PreWrite,
 	PostWrite },
 
+	{ IRP_MJ_QUERY_INFORMATION,
+	0,
+	PreQueryInformation,
+	PostQueryInformation },
+
+	{ IRP_MJ_SET_INFORMATION,
+	FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO,
+	PreSetInformation,
+	PostSetInformation },
+
+	{ IRP_MJ_ACQUIRE_FOR_SECTION_SYNCHRONIZATION,
+	0,
+	PreAcquireForSection,
+	NULL },
+
 #if 0 // TODO - List all of the requests to filter.
 
 	{ IRP_MJ_CREATE_NAMED_PIPE,
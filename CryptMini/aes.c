@@ -0,0 +1,1444 @@
+/*++
+
+Module Name:
+
+    aes.c
+
+Abstract:
+
+    AES-256 block cipher, counter mode and XTS mode.
+
+    The scalar kernel does not use lookup tables: SubBytes is evaluated as a
+    bitsliced boolean circuit over 4 blocks at a time, so its timing does not
+    depend on key or data.
+    The AES-NI kernel keeps 8 blocks in flight per loop iteration to hide
+    the latency of the AESENC instruction.
+
+Environment:
+
+    Kernel mode or user mode.
+
+--*/
+#include "aes.h"
+
+#if AES_HAVE_NI
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AES_NI_FN
+#else
+#include <cpuid.h>
+#define AES_NI_FN __attribute__((target("aes,sse2")))
+#endif
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+typedef unsigned int       aes_u32 ;
+typedef unsigned long long aes_u64 ;
+
+static AES_IMPL g_AesImpl = AesImplScalar ;
+
+
+/*************************************************************************
+    Byte order helpers
+*************************************************************************/
+
+static aes_u32
+iAes_Load32(const unsigned char *p)
+{
+	return (aes_u32)p[0] | ((aes_u32)p[1] << 8) | ((aes_u32)p[2] << 16) | ((aes_u32)p[3] << 24) ;
+}
+
+static void
+iAes_Store32(unsigned char *p, aes_u32 v)
+{
+	p[0] = (unsigned char)v ;
+	p[1] = (unsigned char)(v >> 8) ;
+	p[2] = (unsigned char)(v >> 16) ;
+	p[3] = (unsigned char)(v >> 24) ;
+}
+
+static aes_u64
+iAes_LoadBe64(const unsigned char *p)
+{
+	aes_u64 v = 0 ;
+	int i ;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i] ;
+
+	return v ;
+}
+
+static void
+iAes_StoreBe64(unsigned char *p, aes_u64 v)
+{
+	int i ;
+
+	for (i = 7; i >= 0; i--)
+	{
+		p[i] = (unsigned char)v ;
+		v >>= 8 ;
+	}
+}
+
+static aes_u64
+iAes_LoadLe64(const unsigned char *p)
+{
+	aes_u64 v = 0 ;
+	int i ;
+
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i] ;
+
+	return v ;
+}
+
+static void
+iAes_StoreLe64(unsigned char *p, aes_u64 v)
+{
+	int i ;
+
+	for (i = 0; i < 8; i++)
+	{
+		p[i] = (unsigned char)v ;
+		v >>= 8 ;
+	}
+}
+
+static aes_u64
+iAes_Bswap64(aes_u64 v)
+{
+	v = ((v & 0x00ff00ff00ff00ffULL) << 8) | ((v >> 8) & 0x00ff00ff00ff00ffULL) ;
+	v = ((v & 0x0000ffff0000ffffULL) << 16) | ((v >> 16) & 0x0000ffff0000ffffULL) ;
+
+	return (v << 32) | (v >> 32) ;
+}
+
+static aes_u32
+iAes_Ror32(aes_u32 v, int n)
+{
+	return (v >> n) | (v << (32 - n)) ;
+}
+
+
+/*************************************************************************
+    Table-free scalar kernel
+*************************************************************************/
+
+//
+//  The scalar kernel works on up to 4 blocks at once.  The state is held
+//  as 16 column words, four per block; byte r of a column word is row r.
+//  SubBytes transposes the 64 state bytes into 8 bit planes and evaluates
+//  the Boyar-Peralta S-box circuit on all of them with 64-bit logic ops.
+//
+
+#define AES_SCALAR_LANES 4
+
+static aes_u32
+iAes_Xtime(aes_u32 w)
+{
+	return ((w & 0x7f7f7f7f) << 1) ^ (((w >> 7) & 0x01010101) * 0x1b) ;
+}
+
+static void
+iAes_Ortho(aes_u64 *q)
+{
+	//bit-matrix transpose, its own inverse: afterwards q[i] holds bit i of every byte
+#define AES_SWAPN(cl, ch, s, x, y) \
+	{ \
+		aes_u64 a = (x), b = (y) ; \
+		(x) = (a & (aes_u64)(cl)) | ((b & (aes_u64)(cl)) << (s)) ; \
+		(y) = ((a & (aes_u64)(ch)) >> (s)) | (b & (aes_u64)(ch)) ; \
+	}
+#define AES_SWAP2(x, y) AES_SWAPN(0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1, x, y)
+#define AES_SWAP4(x, y) AES_SWAPN(0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2, x, y)
+#define AES_SWAP8(x, y) AES_SWAPN(0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4, x, y)
+
+	AES_SWAP2(q[0], q[1]) ;
+	AES_SWAP2(q[2], q[3]) ;
+	AES_SWAP2(q[4], q[5]) ;
+	AES_SWAP2(q[6], q[7]) ;
+
+	AES_SWAP4(q[0], q[2]) ;
+	AES_SWAP4(q[1], q[3]) ;
+	AES_SWAP4(q[4], q[6]) ;
+	AES_SWAP4(q[5], q[7]) ;
+
+	AES_SWAP8(q[0], q[4]) ;
+	AES_SWAP8(q[1], q[5]) ;
+	AES_SWAP8(q[2], q[6]) ;
+	AES_SWAP8(q[3], q[7]) ;
+
+#undef AES_SWAP8
+#undef AES_SWAP4
+#undef AES_SWAP2
+#undef AES_SWAPN
+}
+
+static void
+iAes_SboxPlanes(aes_u64 *q)
+{
+	aes_u64 x0, x1, x2, x3, x4, x5, x6, x7 ;
+	aes_u64 y1, y2, y3, y4, y5, y6, y7, y8, y9 ;
+	aes_u64 y10, y11, y12, y13, y14, y15, y16, y17, y18, y19 ;
+	aes_u64 y20, y21 ;
+	aes_u64 z0, z1, z2, z3, z4, z5, z6, z7, z8, z9 ;
+	aes_u64 z10, z11, z12, z13, z14, z15, z16, z17 ;
+	aes_u64 t0, t1, t2, t3, t4, t5, t6, t7, t8, t9 ;
+	aes_u64 t10, t11, t12, t13, t14, t15, t16, t17, t18, t19 ;
+	aes_u64 t20, t21, t22, t23, t24, t25, t26, t27, t28, t29 ;
+	aes_u64 t30, t31, t32, t33, t34, t35, t36, t37, t38, t39 ;
+	aes_u64 t40, t41, t42, t43, t44, t45, t46, t47, t48, t49 ;
+	aes_u64 t50, t51, t52, t53, t54, t55, t56, t57, t58, t59 ;
+	aes_u64 t60, t61, t62, t63, t64, t65, t66, t67 ;
+	aes_u64 s0, s1, s2, s3, s4, s5, s6, s7 ;
+
+	x0 = q[7] ;
+	x1 = q[6] ;
+	x2 = q[5] ;
+	x3 = q[4] ;
+	x4 = q[3] ;
+	x5 = q[2] ;
+	x6 = q[1] ;
+	x7 = q[0] ;
+
+	//top linear transformation
+	y14 = x3 ^ x5 ;
+	y13 = x0 ^ x6 ;
+	y9 = x0 ^ x3 ;
+	y8 = x0 ^ x5 ;
+	t0 = x1 ^ x2 ;
+	y1 = t0 ^ x7 ;
+	y4 = y1 ^ x3 ;
+	y12 = y13 ^ y14 ;
+	y2 = y1 ^ x0 ;
+	y5 = y1 ^ x6 ;
+	y3 = y5 ^ y8 ;
+	t1 = x4 ^ y12 ;
+	y15 = t1 ^ x5 ;
+	y20 = t1 ^ x1 ;
+	y6 = y15 ^ x7 ;
+	y10 = y15 ^ t0 ;
+	y11 = y20 ^ y9 ;
+	y7 = x7 ^ y11 ;
+	y17 = y10 ^ y11 ;
+	y19 = y10 ^ y8 ;
+	y16 = t0 ^ y11 ;
+	y21 = y13 ^ y16 ;
+	y18 = x0 ^ y16 ;
+
+	//non-linear section
+	t2 = y12 & y15 ;
+	t3 = y3 & y6 ;
+	t4 = t3 ^ t2 ;
+	t5 = y4 & x7 ;
+	t6 = t5 ^ t2 ;
+	t7 = y13 & y16 ;
+	t8 = y5 & y1 ;
+	t9 = t8 ^ t7 ;
+	t10 = y2 & y7 ;
+	t11 = t10 ^ t7 ;
+	t12 = y9 & y11 ;
+	t13 = y14 & y17 ;
+	t14 = t13 ^ t12 ;
+	t15 = y8 & y10 ;
+	t16 = t15 ^ t12 ;
+	t17 = t4 ^ t14 ;
+	t18 = t6 ^ t16 ;
+	t19 = t9 ^ t14 ;
+	t20 = t11 ^ t16 ;
+	t21 = t17 ^ y20 ;
+	t22 = t18 ^ y19 ;
+	t23 = t19 ^ y21 ;
+	t24 = t20 ^ y18 ;
+
+	t25 = t21 ^ t22 ;
+	t26 = t21 & t23 ;
+	t27 = t24 ^ t26 ;
+	t28 = t25 & t27 ;
+	t29 = t28 ^ t22 ;
+	t30 = t23 ^ t24 ;
+	t31 = t22 ^ t26 ;
+	t32 = t31 & t30 ;
+	t33 = t32 ^ t24 ;
+	t34 = t23 ^ t33 ;
+	t35 = t27 ^ t33 ;
+	t36 = t24 & t35 ;
+	t37 = t36 ^ t34 ;
+	t38 = t27 ^ t36 ;
+	t39 = t29 & t38 ;
+	t40 = t25 ^ t39 ;
+
+	t41 = t40 ^ t37 ;
+	t42 = t29 ^ t33 ;
+	t43 = t29 ^ t40 ;
+	t44 = t33 ^ t37 ;
+	t45 = t42 ^ t41 ;
+	z0 = t44 & y15 ;
+	z1 = t37 & y6 ;
+	z2 = t33 & x7 ;
+	z3 = t43 & y16 ;
+	z4 = t40 & y1 ;
+	z5 = t29 & y7 ;
+	z6 = t42 & y11 ;
+	z7 = t45 & y17 ;
+	z8 = t41 & y10 ;
+	z9 = t44 & y12 ;
+	z10 = t37 & y3 ;
+	z11 = t33 & y4 ;
+	z12 = t43 & y13 ;
+	z13 = t40 & y5 ;
+	z14 = t29 & y2 ;
+	z15 = t42 & y9 ;
+	z16 = t45 & y14 ;
+	z17 = t41 & y8 ;
+
+	//bottom linear transformation
+	t46 = z15 ^ z16 ;
+	t47 = z10 ^ z11 ;
+	t48 = z5 ^ z13 ;
+	t49 = z9 ^ z10 ;
+	t50 = z2 ^ z12 ;
+	t51 = z2 ^ z5 ;
+	t52 = z7 ^ z8 ;
+	t53 = z0 ^ z3 ;
+	t54 = z6 ^ z7 ;
+	t55 = z16 ^ z17 ;
+	t56 = z12 ^ t48 ;
+	t57 = t50 ^ t53 ;
+	t58 = z4 ^ t46 ;
+	t59 = z3 ^ t54 ;
+	t60 = t46 ^ t57 ;
+	t61 = z14 ^ t57 ;
+	t62 = t52 ^ t58 ;
+	t63 = t49 ^ t58 ;
+	t64 = z4 ^ t59 ;
+	t65 = t61 ^ t62 ;
+	t66 = z1 ^ t63 ;
+	s0 = t59 ^ t63 ;
+	s6 = t56 ^ ~t62 ;
+	s7 = t48 ^ ~t60 ;
+	t67 = t64 ^ t65 ;
+	s3 = t53 ^ t66 ;
+	s4 = t51 ^ t66 ;
+	s5 = t47 ^ t65 ;
+	s1 = t64 ^ ~s3 ;
+	s2 = t55 ^ ~t67 ;
+
+	q[7] = s0 ;
+	q[6] = s1 ;
+	q[5] = s2 ;
+	q[4] = s3 ;
+	q[3] = s4 ;
+	q[2] = s5 ;
+	q[1] = s6 ;
+	q[0] = s7 ;
+}
+
+static void
+iAes_InvAffinePlanes(aes_u64 *q)
+{
+	//inverse of the S-box affine map: b[i] = q[i+2] ^ q[i+5] ^ q[i+7] ^ bit i of 0x05
+	aes_u64 r[8] ;
+	int i ;
+
+	for (i = 0; i < 8; i++)
+		r[i] = q[(i + 2) & 7] ^ q[(i + 5) & 7] ^ q[(i + 7) & 7] ;
+
+	r[0] = ~r[0] ;
+	r[2] = ~r[2] ;
+
+	for (i = 0; i < 8; i++)
+		q[i] = r[i] ;
+}
+
+static void
+iAes_SubBytes(aes_u32 *s, int Inverse)
+{
+	aes_u64 q[8] ;
+	int i ;
+
+	for (i = 0; i < 8; i++)
+		q[i] = (aes_u64)s[2 * i] | ((aes_u64)s[2 * i + 1] << 32) ;
+
+	iAes_Ortho(q) ;
+
+	//InvSubBytes(x) == InvAffine(SubBytes(InvAffine(x)))
+	if (Inverse)
+		iAes_InvAffinePlanes(q) ;
+
+	iAes_SboxPlanes(q) ;
+
+	if (Inverse)
+		iAes_InvAffinePlanes(q) ;
+
+	iAes_Ortho(q) ;
+
+	for (i = 0; i < 8; i++)
+	{
+		s[2 * i] = (aes_u32)q[i] ;
+		s[2 * i + 1] = (aes_u32)(q[i] >> 32) ;
+	}
+}
+
+static aes_u32
+iAes_SubWord(aes_u32 w)
+{
+	aes_u32 s[AES_SCALAR_LANES * 4] = { 0 } ;
+
+	s[0] = w ;
+	iAes_SubBytes(s, 0) ;
+
+	return s[0] ;
+}
+
+static aes_u32
+iAes_MixColumn(aes_u32 w)
+{
+	aes_u32 r8 = iAes_Ror32(w, 8) ;
+
+	return iAes_Xtime(w ^ r8) ^ r8 ^ iAes_Ror32(w, 16) ^ iAes_Ror32(w, 24) ;
+}
+
+static aes_u32
+iAes_InvMixColumn(aes_u32 w)
+{
+	w ^= iAes_Xtime(iAes_Xtime(w ^ iAes_Ror32(w, 16))) ;
+
+	return iAes_MixColumn(w) ;
+}
+
+static void
+iAes_ShiftRows(aes_u32 *s)
+{
+	aes_u32 t0 = s[0], t1 = s[1], t2 = s[2], t3 = s[3] ;
+
+	s[0] = (t0 & 0xff) | (t1 & 0xff00) | (t2 & 0xff0000) | (t3 & 0xff000000) ;
+	s[1] = (t1 & 0xff) | (t2 & 0xff00) | (t3 & 0xff0000) | (t0 & 0xff000000) ;
+	s[2] = (t2 & 0xff) | (t3 & 0xff00) | (t0 & 0xff0000) | (t1 & 0xff000000) ;
+	s[3] = (t3 & 0xff) | (t0 & 0xff00) | (t1 & 0xff0000) | (t2 & 0xff000000) ;
+}
+
+static void
+iAes_InvShiftRows(aes_u32 *s)
+{
+	aes_u32 t0 = s[0], t1 = s[1], t2 = s[2], t3 = s[3] ;
+
+	s[0] = (t0 & 0xff) | (t3 & 0xff00) | (t2 & 0xff0000) | (t1 & 0xff000000) ;
+	s[1] = (t1 & 0xff) | (t0 & 0xff00) | (t3 & 0xff0000) | (t2 & 0xff000000) ;
+	s[2] = (t2 & 0xff) | (t1 & 0xff00) | (t0 & 0xff0000) | (t3 & 0xff000000) ;
+	s[3] = (t3 & 0xff) | (t2 & 0xff00) | (t1 & 0xff0000) | (t0 & 0xff000000) ;
+}
+
+static void
+iAes_AddRoundKey(aes_u32 *s, const unsigned char *rk)
+{
+	aes_u32 k0 = iAes_Load32(rk) ;
+	aes_u32 k1 = iAes_Load32(rk + 4) ;
+	aes_u32 k2 = iAes_Load32(rk + 8) ;
+	aes_u32 k3 = iAes_Load32(rk + 12) ;
+	int b ;
+
+	for (b = 0; b < AES_SCALAR_LANES; b++)
+	{
+		s[4 * b] ^= k0 ;
+		s[4 * b + 1] ^= k1 ;
+		s[4 * b + 2] ^= k2 ;
+		s[4 * b + 3] ^= k3 ;
+	}
+}
+
+static void
+iAes_CryptLanes(const AES_KEY *Key, int Decrypt, const unsigned char *In, unsigned char *Out, size_t Blocks)
+{
+	const unsigned char *sched = Decrypt ? Key->DecKey : Key->EncKey ;
+	aes_u32 s[AES_SCALAR_LANES * 4] = { 0 } ;
+	int n = (int)Blocks * 4 ;
+	int r, i ;
+
+	for (i = 0; i < n; i++)
+		s[i] = iAes_Load32(In + 4 * i) ;
+
+	iAes_AddRoundKey(s, sched) ;
+
+	for (r = 1; r <= AES_ROUNDS; r++)
+	{
+		iAes_SubBytes(s, Decrypt) ;
+
+		for (i = 0; i < AES_SCALAR_LANES * 4; i += 4)
+		{
+			if (Decrypt)
+				iAes_InvShiftRows(s + i) ;
+			else
+				iAes_ShiftRows(s + i) ;
+		}
+
+		if (r != AES_ROUNDS)
+		{
+			for (i = 0; i < AES_SCALAR_LANES * 4; i++)
+				s[i] = Decrypt ? iAes_InvMixColumn(s[i]) : iAes_MixColumn(s[i]) ;
+		}
+
+		iAes_AddRoundKey(s, sched + r * AES_BLOCK_SIZE) ;
+	}
+
+	for (i = 0; i < n; i++)
+		iAes_Store32(Out + 4 * i, s[i]) ;
+}
+
+static void
+iAes_CryptBlocks(const AES_KEY *Key, int Decrypt, const unsigned char *In, unsigned char *Out, size_t Blocks)
+{
+	while (Blocks > 0)
+	{
+		size_t lanes = Blocks >= AES_SCALAR_LANES ? AES_SCALAR_LANES : Blocks ;
+
+		iAes_CryptLanes(Key, Decrypt, In, Out, lanes) ;
+
+		In += lanes * AES_BLOCK_SIZE ;
+		Out += lanes * AES_BLOCK_SIZE ;
+		Blocks -= lanes ;
+	}
+}
+
+static void
+iAes_CtrBlocks(
+	const AES_KEY *Key,
+	aes_u64 Hi,
+	aes_u64 Lo,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Blocks
+	)
+{
+	unsigned char ks[AES_SCALAR_LANES * AES_BLOCK_SIZE] ;
+	size_t lanes, i ;
+
+	while (Blocks > 0)
+	{
+		lanes = Blocks >= AES_SCALAR_LANES ? AES_SCALAR_LANES : Blocks ;
+
+		for (i = 0; i < lanes; i++)
+		{
+			iAes_StoreBe64(ks + i * AES_BLOCK_SIZE, Hi) ;
+			iAes_StoreBe64(ks + i * AES_BLOCK_SIZE + 8, Lo) ;
+			if (++Lo == 0)
+				Hi++ ;
+		}
+
+		iAes_CryptLanes(Key, 0, ks, ks, lanes) ;
+
+		for (i = 0; i < lanes * AES_BLOCK_SIZE; i++)
+			Out[i] = In[i] ^ ks[i] ;
+
+		In += lanes * AES_BLOCK_SIZE ;
+		Out += lanes * AES_BLOCK_SIZE ;
+		Blocks -= lanes ;
+	}
+}
+
+static void
+iAes_XtsUnit(
+	const AES_KEY *Key,
+	int Decrypt,
+	const unsigned char *Tweak,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Blocks
+	)
+{
+	unsigned char buf[AES_SCALAR_LANES * AES_BLOCK_SIZE] ;
+	unsigned char tw[AES_SCALAR_LANES * AES_BLOCK_SIZE] ;
+	aes_u64 lo = iAes_LoadLe64(Tweak) ;
+	aes_u64 hi = iAes_LoadLe64(Tweak + 8) ;
+	size_t lanes, i ;
+
+	while (Blocks > 0)
+	{
+		lanes = Blocks >= AES_SCALAR_LANES ? AES_SCALAR_LANES : Blocks ;
+
+		for (i = 0; i < lanes; i++)
+		{
+			aes_u64 carry = hi >> 63 ;
+
+			iAes_StoreLe64(tw + i * AES_BLOCK_SIZE, lo) ;
+			iAes_StoreLe64(tw + i * AES_BLOCK_SIZE + 8, hi) ;
+
+			//multiply by alpha in GF(2^128)
+			hi = (hi << 1) | (lo >> 63) ;
+			lo = (lo << 1) ^ (carry * 0x87) ;
+		}
+
+		for (i = 0; i < lanes * AES_BLOCK_SIZE; i++)
+			buf[i] = In[i] ^ tw[i] ;
+
+		iAes_CryptLanes(Key, Decrypt, buf, buf, lanes) ;
+
+		for (i = 0; i < lanes * AES_BLOCK_SIZE; i++)
+			Out[i] = buf[i] ^ tw[i] ;
+
+		In += lanes * AES_BLOCK_SIZE ;
+		Out += lanes * AES_BLOCK_SIZE ;
+		Blocks -= lanes ;
+	}
+}
+
+
+/*************************************************************************
+    AES-NI kernel
+*************************************************************************/
+
+#if AES_HAVE_NI
+
+static int
+iAes_CpuHasNi(void)
+{
+	unsigned int ecx ;
+
+#if defined(_MSC_VER)
+	int regs[4] ;
+
+	__cpuid(regs, 1) ;
+	ecx = (unsigned int)regs[2] ;
+#else
+	unsigned int eax, ebx, edx ;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0 ;
+#endif
+
+	//CPUID.01H:ECX.AES[bit 25]
+	return (ecx & (1u << 25)) != 0 ;
+}
+
+#define AES_NI_LANES 8
+
+//
+//  The 8 lanes are spelled out so that every block stays in a register
+//  regardless of how far the compiler is willing to unroll.
+//
+
+#define AES_NI_EACH8(_op) \
+	_op(0) _op(1) _op(2) _op(3) _op(4) _op(5) _op(6) _op(7)
+
+AES_NI_FN static void
+iAesNi_LoadKeys(const unsigned char *Sched, __m128i *rk)
+{
+	int r ;
+
+	for (r = 0; r <= AES_ROUNDS; r++)
+		rk[r] = _mm_loadu_si128((const __m128i *)(Sched + r * AES_BLOCK_SIZE)) ;
+}
+
+AES_NI_FN static void
+iAesNi_EncryptBlocks(const AES_KEY *Key, const unsigned char *In, unsigned char *Out, size_t Blocks)
+{
+	__m128i rk[AES_ROUNDS + 1] ;
+	__m128i b[AES_NI_LANES] ;
+	int r ;
+
+	iAesNi_LoadKeys(Key->EncKey, rk) ;
+
+	for (; Blocks >= AES_NI_LANES; Blocks -= AES_NI_LANES)
+	{
+#define AES_NI_LOAD(_j)  b[_j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)In + _j), rk[0]) ;
+#define AES_NI_ROUND(_j) b[_j] = _mm_aesenc_si128(b[_j], rk[r]) ;
+#define AES_NI_STORE(_j) _mm_storeu_si128((__m128i *)Out + _j, _mm_aesenclast_si128(b[_j], rk[AES_ROUNDS])) ;
+
+		AES_NI_EACH8(AES_NI_LOAD)
+
+		for (r = 1; r < AES_ROUNDS; r++)
+		{
+			AES_NI_EACH8(AES_NI_ROUND)
+		}
+
+		AES_NI_EACH8(AES_NI_STORE)
+
+#undef AES_NI_STORE
+#undef AES_NI_ROUND
+#undef AES_NI_LOAD
+
+		In += AES_NI_LANES * AES_BLOCK_SIZE ;
+		Out += AES_NI_LANES * AES_BLOCK_SIZE ;
+	}
+
+	for (; Blocks > 0; Blocks--)
+	{
+		b[0] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)In), rk[0]) ;
+		for (r = 1; r < AES_ROUNDS; r++)
+			b[0] = _mm_aesenc_si128(b[0], rk[r]) ;
+		_mm_storeu_si128((__m128i *)Out, _mm_aesenclast_si128(b[0], rk[AES_ROUNDS])) ;
+
+		In += AES_BLOCK_SIZE ;
+		Out += AES_BLOCK_SIZE ;
+	}
+}
+
+AES_NI_FN static void
+iAesNi_DecryptBlocks(const AES_KEY *Key, const unsigned char *In, unsigned char *Out, size_t Blocks)
+{
+	__m128i rk[AES_ROUNDS + 1] ;
+	__m128i b[AES_NI_LANES] ;
+	int r ;
+
+	iAesNi_LoadKeys(Key->DecKey, rk) ;
+
+	for (; Blocks >= AES_NI_LANES; Blocks -= AES_NI_LANES)
+	{
+#define AES_NI_LOAD(_j)  b[_j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)In + _j), rk[0]) ;
+#define AES_NI_ROUND(_j) b[_j] = _mm_aesdec_si128(b[_j], rk[r]) ;
+#define AES_NI_STORE(_j) _mm_storeu_si128((__m128i *)Out + _j, _mm_aesdeclast_si128(b[_j], rk[AES_ROUNDS])) ;
+
+		AES_NI_EACH8(AES_NI_LOAD)
+
+		for (r = 1; r < AES_ROUNDS; r++)
+		{
+			AES_NI_EACH8(AES_NI_ROUND)
+		}
+
+		AES_NI_EACH8(AES_NI_STORE)
+
+#undef AES_NI_STORE
+#undef AES_NI_ROUND
+#undef AES_NI_LOAD
+
+		In += AES_NI_LANES * AES_BLOCK_SIZE ;
+		Out += AES_NI_LANES * AES_BLOCK_SIZE ;
+	}
+
+	for (; Blocks > 0; Blocks--)
+	{
+		b[0] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)In), rk[0]) ;
+		for (r = 1; r < AES_ROUNDS; r++)
+			b[0] = _mm_aesdec_si128(b[0], rk[r]) ;
+		_mm_storeu_si128((__m128i *)Out, _mm_aesdeclast_si128(b[0], rk[AES_ROUNDS])) ;
+
+		In += AES_BLOCK_SIZE ;
+		Out += AES_BLOCK_SIZE ;
+	}
+}
+
+AES_NI_FN static __m128i
+iAesNi_Counter(aes_u64 Hi, aes_u64 Lo)
+{
+	return _mm_set_epi64x((long long)iAes_Bswap64(Lo), (long long)iAes_Bswap64(Hi)) ;
+}
+
+AES_NI_FN static void
+iAesNi_CtrBlocks(
+	const AES_KEY *Key,
+	aes_u64 Hi,
+	aes_u64 Lo,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Blocks
+	)
+{
+	__m128i rk[AES_ROUNDS + 1] ;
+	__m128i b[AES_NI_LANES] ;
+	int r ;
+
+	iAesNi_LoadKeys(Key->EncKey, rk) ;
+
+	for (; Blocks >= AES_NI_LANES; Blocks -= AES_NI_LANES)
+	{
+#define AES_NI_COUNTER(_j) b[_j] = _mm_xor_si128(iAesNi_Counter(Hi, Lo + _j), rk[0]) ;
+#define AES_NI_ROUND(_j)   b[_j] = _mm_aesenc_si128(b[_j], rk[r]) ;
+#define AES_NI_XOR(_j) \
+		_mm_storeu_si128((__m128i *)Out + _j, \
+			_mm_xor_si128(_mm_aesenclast_si128(b[_j], rk[AES_ROUNDS]), _mm_loadu_si128((const __m128i *)In + _j))) ;
+
+		if (Lo > ~(aes_u64)0 - AES_NI_LANES)
+			break ; //the low half wraps inside this batch, let the block loop carry it
+
+		AES_NI_EACH8(AES_NI_COUNTER)
+		Lo += AES_NI_LANES ;
+
+		for (r = 1; r < AES_ROUNDS; r++)
+		{
+			AES_NI_EACH8(AES_NI_ROUND)
+		}
+
+		AES_NI_EACH8(AES_NI_XOR)
+
+#undef AES_NI_XOR
+#undef AES_NI_ROUND
+#undef AES_NI_COUNTER
+
+		In += AES_NI_LANES * AES_BLOCK_SIZE ;
+		Out += AES_NI_LANES * AES_BLOCK_SIZE ;
+	}
+
+	for (; Blocks > 0; Blocks--)
+	{
+		b[0] = _mm_xor_si128(iAesNi_Counter(Hi, Lo), rk[0]) ;
+		if (++Lo == 0)
+			Hi++ ;
+
+		for (r = 1; r < AES_ROUNDS; r++)
+			b[0] = _mm_aesenc_si128(b[0], rk[r]) ;
+
+		b[0] = _mm_aesenclast_si128(b[0], rk[AES_ROUNDS]) ;
+		_mm_storeu_si128((__m128i *)Out, _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *)In))) ;
+
+		In += AES_BLOCK_SIZE ;
+		Out += AES_BLOCK_SIZE ;
+	}
+}
+
+AES_NI_FN static __m128i
+iAesNi_MulAlpha(__m128i t)
+{
+	//shift each dword left by one and carry the top bits into the next
+	//dword; the bit leaving the top dword folds back in as 0x87
+	__m128i carry = _mm_srai_epi32(t, 31) ;
+
+	carry = _mm_and_si128(carry, _mm_set_epi32(0x87, 1, 1, 1)) ;
+	carry = _mm_shuffle_epi32(carry, 0x93) ;
+
+	return _mm_xor_si128(_mm_slli_epi32(t, 1), carry) ;
+}
+
+AES_NI_FN static void
+iAesNi_XtsUnit(
+	const AES_KEY *Key,
+	int Decrypt,
+	const unsigned char *Tweak,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Blocks
+	)
+{
+	__m128i rk[AES_ROUNDS + 1] ;
+	__m128i b[AES_NI_LANES] ;
+	__m128i tw[AES_NI_LANES] ;
+	__m128i t = _mm_loadu_si128((const __m128i *)Tweak) ;
+	int r ;
+
+	iAesNi_LoadKeys(Decrypt ? Key->DecKey : Key->EncKey, rk) ;
+
+	for (; Blocks >= AES_NI_LANES; Blocks -= AES_NI_LANES)
+	{
+#define AES_NI_TWEAK(_j) tw[_j] = t ; t = iAesNi_MulAlpha(t) ;
+#define AES_NI_LOAD(_j) \
+		b[_j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)In + _j), tw[_j]), rk[0]) ;
+#define AES_NI_ENC(_j)  b[_j] = _mm_aesenc_si128(b[_j], rk[r]) ;
+#define AES_NI_DEC(_j)  b[_j] = _mm_aesdec_si128(b[_j], rk[r]) ;
+#define AES_NI_ENCLAST(_j) b[_j] = _mm_aesenclast_si128(b[_j], rk[AES_ROUNDS]) ;
+#define AES_NI_DECLAST(_j) b[_j] = _mm_aesdeclast_si128(b[_j], rk[AES_ROUNDS]) ;
+#define AES_NI_STORE(_j) _mm_storeu_si128((__m128i *)Out + _j, _mm_xor_si128(b[_j], tw[_j])) ;
+
+		AES_NI_EACH8(AES_NI_TWEAK)
+		AES_NI_EACH8(AES_NI_LOAD)
+
+		if (Decrypt)
+		{
+			for (r = 1; r < AES_ROUNDS; r++)
+			{
+				AES_NI_EACH8(AES_NI_DEC)
+			}
+			AES_NI_EACH8(AES_NI_DECLAST)
+		}
+		else
+		{
+			for (r = 1; r < AES_ROUNDS; r++)
+			{
+				AES_NI_EACH8(AES_NI_ENC)
+			}
+			AES_NI_EACH8(AES_NI_ENCLAST)
+		}
+
+		AES_NI_EACH8(AES_NI_STORE)
+
+#undef AES_NI_STORE
+#undef AES_NI_DECLAST
+#undef AES_NI_ENCLAST
+#undef AES_NI_DEC
+#undef AES_NI_ENC
+#undef AES_NI_LOAD
+#undef AES_NI_TWEAK
+
+		In += AES_NI_LANES * AES_BLOCK_SIZE ;
+		Out += AES_NI_LANES * AES_BLOCK_SIZE ;
+	}
+
+	for (; Blocks > 0; Blocks--)
+	{
+		b[0] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)In), t), rk[0]) ;
+
+		for (r = 1; r < AES_ROUNDS; r++)
+			b[0] = Decrypt ? _mm_aesdec_si128(b[0], rk[r]) : _mm_aesenc_si128(b[0], rk[r]) ;
+
+		b[0] = Decrypt ? _mm_aesdeclast_si128(b[0], rk[AES_ROUNDS]) : _mm_aesenclast_si128(b[0], rk[AES_ROUNDS]) ;
+		_mm_storeu_si128((__m128i *)Out, _mm_xor_si128(b[0], t)) ;
+
+		t = iAesNi_MulAlpha(t) ;
+		In += AES_BLOCK_SIZE ;
+		Out += AES_BLOCK_SIZE ;
+	}
+}
+
+//
+//  One block of a mixed batch: its own key schedule and counter.  A partial
+//  block (buffer head or tail) is staged in Buf: Count bytes at Buf + Skip
+//  are copied back to Dst after the lane has run.
+//
+
+typedef struct _AES_NI_LANE {
+
+	const unsigned char *Sched ;
+	const unsigned char *In ;
+	unsigned char *Out ;
+	aes_u64 Hi ;
+	aes_u64 Lo ;
+	unsigned char *Dst ;
+	size_t Skip ;
+	size_t Count ;
+	unsigned char Buf[AES_BLOCK_SIZE] ;
+
+} AES_NI_LANE ;
+
+AES_NI_FN static void
+iAesNi_CtrLanes(AES_NI_LANE *Lane, int Lanes)
+{
+	__m128i b[AES_NI_LANES] ;
+	size_t i ;
+	int r, j ;
+
+	if (Lanes == AES_NI_LANES)
+	{
+#define AES_NI_RK(_j, _r) _mm_loadu_si128((const __m128i *)(Lane[_j].Sched + (_r) * AES_BLOCK_SIZE))
+#define AES_NI_COUNTER(_j) b[_j] = _mm_xor_si128(iAesNi_Counter(Lane[_j].Hi, Lane[_j].Lo), AES_NI_RK(_j, 0)) ;
+#define AES_NI_ROUND(_j)   b[_j] = _mm_aesenc_si128(b[_j], AES_NI_RK(_j, r)) ;
+#define AES_NI_XOR(_j) \
+		_mm_storeu_si128((__m128i *)Lane[_j].Out, \
+			_mm_xor_si128(_mm_aesenclast_si128(b[_j], AES_NI_RK(_j, AES_ROUNDS)), \
+				_mm_loadu_si128((const __m128i *)Lane[_j].In))) ;
+
+		AES_NI_EACH8(AES_NI_COUNTER)
+
+		for (r = 1; r < AES_ROUNDS; r++)
+		{
+			AES_NI_EACH8(AES_NI_ROUND)
+		}
+
+		AES_NI_EACH8(AES_NI_XOR)
+
+#undef AES_NI_XOR
+#undef AES_NI_ROUND
+#undef AES_NI_COUNTER
+#undef AES_NI_RK
+	}
+	else
+	{
+		for (j = 0; j < Lanes; j++)
+		{
+			const unsigned char *sched = Lane[j].Sched ;
+
+			b[0] = _mm_xor_si128(iAesNi_Counter(Lane[j].Hi, Lane[j].Lo), _mm_loadu_si128((const __m128i *)sched)) ;
+			for (r = 1; r < AES_ROUNDS; r++)
+				b[0] = _mm_aesenc_si128(b[0], _mm_loadu_si128((const __m128i *)(sched + r * AES_BLOCK_SIZE))) ;
+			b[0] = _mm_aesenclast_si128(b[0], _mm_loadu_si128((const __m128i *)(sched + AES_ROUNDS * AES_BLOCK_SIZE))) ;
+
+			_mm_storeu_si128((__m128i *)Lane[j].Out, _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *)Lane[j].In))) ;
+		}
+	}
+
+	for (j = 0; j < Lanes; j++)
+	{
+		for (i = 0; i < Lane[j].Count; i++)
+			Lane[j].Dst[i] = Lane[j].Buf[Lane[j].Skip + i] ;
+	}
+}
+
+static void
+iAes_QueueLane(
+	AES_NI_LANE *Lane,
+	int *Lanes,
+	const AES_KEY *Key,
+	aes_u64 Hi,
+	aes_u64 Lo,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Skip,
+	size_t Count
+	)
+{
+	AES_NI_LANE *l = &Lane[*Lanes] ;
+	size_t i ;
+
+	l->Sched = Key->EncKey ;
+	l->Hi = Hi ;
+	l->Lo = Lo ;
+
+	if (Count == AES_BLOCK_SIZE)
+	{
+		l->In = In ;
+		l->Out = Out ;
+		l->Count = 0 ;
+	}
+	else
+	{
+		for (i = 0; i < Count; i++)
+			l->Buf[Skip + i] = In[i] ;
+
+		l->In = l->Buf ;
+		l->Out = l->Buf ;
+		l->Dst = Out ;
+		l->Skip = Skip ;
+		l->Count = Count ;
+	}
+
+	if (++*Lanes == AES_NI_LANES)
+	{
+		iAesNi_CtrLanes(Lane, *Lanes) ;
+		*Lanes = 0 ;
+	}
+}
+
+#endif//AES_HAVE_NI
+
+
+/*************************************************************************
+    Public routines
+*************************************************************************/
+
+static void
+iAes_Ctr(
+	const AES_KEY *Key,
+	aes_u64 Hi,
+	aes_u64 Lo,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Blocks
+	)
+{
+#if AES_HAVE_NI
+	if (g_AesImpl == AesImplNi)
+	{
+		iAesNi_CtrBlocks(Key, Hi, Lo, In, Out, Blocks) ;
+		return ;
+	}
+#endif
+
+	iAes_CtrBlocks(Key, Hi, Lo, In, Out, Blocks) ;
+}
+
+void
+Aes_Init(AES_IMPL MaxImpl)
+/*++
+
+Routine Description:
+
+    Selects the fastest kernel supported by the processor, but not faster
+    than MaxImpl.  Must be called before any other routine of this module.
+
+--*/
+{
+	g_AesImpl = AesImplScalar ;
+
+#if AES_HAVE_NI
+	if (MaxImpl >= AesImplNi && iAes_CpuHasNi())
+		g_AesImpl = AesImplNi ;
+#else
+	(void)MaxImpl ;
+#endif
+}
+
+AES_IMPL
+Aes_GetImpl(void)
+{
+	return g_AesImpl ;
+}
+
+void
+Aes_SetKey(AES_KEY *Key, const unsigned char *KeyBytes)
+/*++
+
+Routine Description:
+
+    Expands a 256-bit key into the encryption and decryption schedules.
+
+--*/
+{
+	aes_u32 w[(AES_ROUNDS + 1) * 4] ;
+	aes_u32 rcon = 1 ;
+	int i ;
+
+	for (i = 0; i < 8; i++)
+		w[i] = iAes_Load32(KeyBytes + 4 * i) ;
+
+	for (i = 8; i < (AES_ROUNDS + 1) * 4; i++)
+	{
+		aes_u32 t = w[i - 1] ;
+
+		if (i % 8 == 0)
+		{
+			t = iAes_SubWord(iAes_Ror32(t, 8)) ^ rcon ;
+			rcon = iAes_Xtime(rcon) ;
+		}
+		else if (i % 8 == 4)
+		{
+			t = iAes_SubWord(t) ;
+		}
+
+		w[i] = w[i - 8] ^ t ;
+	}
+
+	for (i = 0; i < (AES_ROUNDS + 1) * 4; i++)
+		iAes_Store32(Key->EncKey + 4 * i, w[i]) ;
+
+	//equivalent inverse cipher: reversed order, InvMixColumns on inner rounds
+	for (i = 0; i <= AES_ROUNDS; i++)
+	{
+		int src = (AES_ROUNDS - i) * 4 ;
+		int c ;
+
+		for (c = 0; c < 4; c++)
+		{
+			aes_u32 t = w[src + c] ;
+
+			if (i != 0 && i != AES_ROUNDS)
+				t = iAes_InvMixColumn(t) ;
+
+			iAes_Store32(Key->DecKey + i * AES_BLOCK_SIZE + 4 * c, t) ;
+		}
+	}
+
+	for (i = 0; i < (AES_ROUNDS + 1) * 4; i++)
+		w[i] = 0 ;
+}
+
+void
+Aes_EncryptBlocks(const AES_KEY *Key, const unsigned char *In, unsigned char *Out, size_t Blocks)
+{
+#if AES_HAVE_NI
+	if (g_AesImpl == AesImplNi)
+	{
+		iAesNi_EncryptBlocks(Key, In, Out, Blocks) ;
+		return ;
+	}
+#endif
+
+	iAes_CryptBlocks(Key, 0, In, Out, Blocks) ;
+}
+
+void
+Aes_DecryptBlocks(const AES_KEY *Key, const unsigned char *In, unsigned char *Out, size_t Blocks)
+{
+#if AES_HAVE_NI
+	if (g_AesImpl == AesImplNi)
+	{
+		iAesNi_DecryptBlocks(Key, In, Out, Blocks) ;
+		return ;
+	}
+#endif
+
+	iAes_CryptBlocks(Key, 1, In, Out, Blocks) ;
+}
+
+void
+Aes_CtrXor(
+	const AES_KEY *Key,
+	const unsigned char *Iv,
+	unsigned long long BlockIndex,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Length
+	)
+/*++
+
+Routine Description:
+
+    XORs Length bytes of In with the AES-CTR keystream and stores the result
+    in Out.  In and Out may be the same buffer.
+
+    The first counter block is Iv + BlockIndex, treating the 16-byte Iv as a
+    big-endian 128-bit integer, so any block of a stream can be processed
+    without touching the blocks before it.
+
+Arguments:
+
+    Key        - Expanded key schedule.
+    Iv         - 16-byte initial counter block.
+    BlockIndex - Index of the first block to process.
+    In         - Source bytes.
+    Out        - Destination bytes.
+    Length     - Number of bytes; a trailing partial block is allowed.
+
+--*/
+{
+	aes_u64 hi = iAes_LoadBe64(Iv) ;
+	aes_u64 lo = iAes_LoadBe64(Iv + 8) ;
+	size_t blocks = Length / AES_BLOCK_SIZE ;
+	size_t tail = Length % AES_BLOCK_SIZE ;
+
+	lo += BlockIndex ;
+	if (lo < BlockIndex)
+		hi++ ;
+
+	if (blocks > 0)
+	{
+		iAes_Ctr(Key, hi, lo, In, Out, blocks) ;
+
+		In += blocks * AES_BLOCK_SIZE ;
+		Out += blocks * AES_BLOCK_SIZE ;
+		lo += blocks ;
+		if (lo < blocks)
+			hi++ ;
+	}
+
+	if (tail > 0)
+	{
+		unsigned char buf[AES_BLOCK_SIZE] = { 0 } ;
+		size_t i ;
+
+		for (i = 0; i < tail; i++)
+			buf[i] = In[i] ;
+
+		iAes_Ctr(Key, hi, lo, buf, buf, 1) ;
+
+		for (i = 0; i < tail; i++)
+			Out[i] = buf[i] ;
+	}
+}
+
+void
+Aes_CtrXorAt(
+	const AES_KEY *Key,
+	const unsigned char *Nonce,
+	unsigned long long ByteOffset,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Length
+	)
+/*++
+
+Routine Description:
+
+    Counter mode addressed by byte offset.  Byte N of a stream is XORed
+    with byte N % 16 of E(Nonce + N / 16), so any range of a file can be
+    transformed on its own, in any order and on any number of processors
+    at once, without shared cipher state.
+
+Arguments:
+
+    Key        - Expanded key schedule.
+    Nonce      - 16-byte per-file nonce, the counter block of offset 0.
+    ByteOffset - Stream offset of the first byte of In.
+    In         - Source bytes.
+    Out        - Destination bytes, may equal In.
+    Length     - Number of bytes, no alignment required.
+
+--*/
+{
+	size_t skip = (size_t)(ByteOffset % AES_BLOCK_SIZE) ;
+	unsigned long long block = ByteOffset / AES_BLOCK_SIZE ;
+
+	if (skip != 0 && Length > 0)
+	{
+		unsigned char buf[AES_BLOCK_SIZE] = { 0 } ;
+		size_t n = AES_BLOCK_SIZE - skip ;
+		size_t i ;
+
+		if (n > Length)
+			n = Length ;
+
+		for (i = 0; i < n; i++)
+			buf[skip + i] = In[i] ;
+
+		Aes_CtrXor(Key, Nonce, block, buf, buf, AES_BLOCK_SIZE) ;
+
+		for (i = 0; i < n; i++)
+			Out[i] = buf[skip + i] ;
+
+		In += n ;
+		Out += n ;
+		Length -= n ;
+		block++ ;
+	}
+
+	if (Length > 0)
+		Aes_CtrXor(Key, Nonce, block, In, Out, Length) ;
+}
+
+void
+Aes_CtrXorBatch(const AES_CTR_JOB *Jobs, size_t Count)
+/*++
+
+Routine Description:
+
+    Counter mode over a list of independent buffers (Aes_CtrXorAt for each
+    job) in one pass.
+
+    A job with 8 or more whole blocks runs them through the register-keyed
+    8-lane loop.  Everything else - the blocks of short jobs, and the
+    partial blocks at unaligned buffer heads and tails - is packed into
+    shared 8-lane groups, each lane with its own key and counter, so short
+    buffers from many files still fill the AES pipeline.
+
+Arguments:
+
+    Jobs  - Array of jobs.
+    Count - Number of jobs.
+
+--*/
+{
+	size_t i ;
+
+#if AES_HAVE_NI
+	if (g_AesImpl == AesImplNi)
+	{
+		AES_NI_LANE lane[AES_NI_LANES] ;
+		int lanes = 0 ;
+
+		for (i = 0; i < Count; i++)
+		{
+			const AES_CTR_JOB *job = &Jobs[i] ;
+			const unsigned char *in = job->In ;
+			unsigned char *out = job->Out ;
+			size_t length = job->Length ;
+			size_t skip = (size_t)(job->ByteOffset % AES_BLOCK_SIZE) ;
+			aes_u64 index = job->ByteOffset / AES_BLOCK_SIZE ;
+			aes_u64 hi = iAes_LoadBe64(job->Nonce) ;
+			aes_u64 lo = iAes_LoadBe64(job->Nonce + 8) ;
+			size_t blocks, bulk ;
+
+			lo += index ;
+			if (lo < index)
+				hi++ ;
+
+			if (skip != 0 && length > 0)
+			{
+				size_t n = AES_BLOCK_SIZE - skip ;
+
+				if (n > length)
+					n = length ;
+
+				iAes_QueueLane(lane, &lanes, job->Key, hi, lo, in, out, skip, n) ;
+				in += n ;
+				out += n ;
+				length -= n ;
+				if (++lo == 0)
+					hi++ ;
+			}
+
+			blocks = length / AES_BLOCK_SIZE ;
+			bulk = blocks >= AES_NI_LANES ? blocks : 0 ;
+
+			if (bulk > 0)
+			{
+				iAesNi_CtrBlocks(job->Key, hi, lo, in, out, bulk) ;
+
+				in += bulk * AES_BLOCK_SIZE ;
+				out += bulk * AES_BLOCK_SIZE ;
+				length -= bulk * AES_BLOCK_SIZE ;
+				lo += bulk ;
+				if (lo < bulk)
+					hi++ ;
+			}
+
+			while (length > 0)
+			{
+				size_t n = length >= AES_BLOCK_SIZE ? AES_BLOCK_SIZE : length ;
+
+				iAes_QueueLane(lane, &lanes, job->Key, hi, lo, in, out, 0, n) ;
+				in += n ;
+				out += n ;
+				length -= n ;
+				if (++lo == 0)
+					hi++ ;
+			}
+		}
+
+		if (lanes > 0)
+			iAesNi_CtrLanes(lane, lanes) ;
+
+		return ;
+	}
+#endif
+
+	for (i = 0; i < Count; i++)
+		Aes_CtrXorAt(Jobs[i].Key, Jobs[i].Nonce, Jobs[i].ByteOffset, Jobs[i].In, Jobs[i].Out, Jobs[i].Length) ;
+}
+
+void
+Aes_XtsCrypt(
+	const AES_KEY *DataKey,
+	const AES_KEY *TweakKey,
+	const unsigned char *Nonce,
+	unsigned long long UnitIndex,
+	size_t UnitSize,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Length,
+	int Decrypt
+	)
+/*++
+
+Routine Description:
+
+    XTS-AES-256 (IEEE 1619) over whole data units.  The tweak of data unit
+    N is Nonce + N, added as a little-endian 128-bit integer, so a unit can
+    be transformed in place with no state carried from the units before it.
+
+    The initial tweaks of up to AES_XTS_BATCH units are encrypted in one
+    multi-block call, and inside a unit the per-block tweaks are stepped
+    in registers alongside the data blocks.
+
+Arguments:
+
+    DataKey   - Key schedule for the data (K1).
+    TweakKey  - Key schedule for the tweak (K2).
+    Nonce     - 16-byte per-file nonce.
+    UnitIndex - Index of the first data unit in In.
+    UnitSize  - Data unit size in bytes, a multiple of 16 (usually the
+                volume sector size).
+    In        - Source bytes.
+    Out       - Destination bytes, may equal In.
+    Length    - Number of bytes, a multiple of UnitSize.
+    Decrypt   - Non-zero to decrypt.
+
+--*/
+{
+	unsigned char tin[AES_XTS_BATCH * AES_BLOCK_SIZE] = { 0 } ;
+	unsigned char tout[AES_XTS_BATCH * AES_BLOCK_SIZE] ;
+	aes_u64 nlo = iAes_LoadLe64(Nonce) ;
+	aes_u64 nhi = iAes_LoadLe64(Nonce + 8) ;
+	size_t units = Length / UnitSize ;
+	size_t blocks = UnitSize / AES_BLOCK_SIZE ;
+	size_t n, i ;
+
+	while (units > 0)
+	{
+		n = units >= AES_XTS_BATCH ? AES_XTS_BATCH : units ;
+
+		for (i = 0; i < n; i++)
+		{
+			aes_u64 lo = nlo + UnitIndex + i ;
+			aes_u64 hi = nhi + (lo < nlo ? 1 : 0) ;
+
+			iAes_StoreLe64(tin + i * AES_BLOCK_SIZE, lo) ;
+			iAes_StoreLe64(tin + i * AES_BLOCK_SIZE + 8, hi) ;
+		}
+
+		Aes_EncryptBlocks(TweakKey, tin, tout, n) ;
+
+		for (i = 0; i < n; i++)
+		{
+#if AES_HAVE_NI
+			if (g_AesImpl == AesImplNi)
+				iAesNi_XtsUnit(DataKey, Decrypt, tout + i * AES_BLOCK_SIZE, In, Out, blocks) ;
+			else
+#endif
+				iAes_XtsUnit(DataKey, Decrypt, tout + i * AES_BLOCK_SIZE, In, Out, blocks) ;
+
+			In += UnitSize ;
+			Out += UnitSize ;
+		}
+
+		UnitIndex += n ;
+		units -= n ;
+	}
+}
@@ -0,0 +1,118 @@
+#ifndef _AES_H_
+#define _AES_H_
+
+//
+//  AES-256 cipher engine.
+//
+//  This module is freestanding: it does not include fltKernel.h or any
+//  other system header besides <stddef.h>, so it can be linked into the
+//  driver as well as into a user mode test or benchmark program.
+//
+//  Two kernels are provided.  A table-free scalar kernel that works on any
+//  processor, and an AES-NI kernel that processes 8 blocks per loop
+//  iteration.  Aes_Init selects the kernel once by CPUID.
+//
+
+#include <stddef.h>
+
+#define AES_BLOCK_SIZE   16
+#define AES_KEY_SIZE     32
+#define AES_ROUNDS       14
+#define AES_XTS_BATCH    8
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AES_HAVE_NI 1
+#else
+#define AES_HAVE_NI 0
+#endif
+
+//
+//  Kernels Aes_Init can select.
+//
+
+typedef enum _AES_IMPL {
+	AesImplScalar = 0,
+	AesImplNi
+} AES_IMPL;
+
+//
+//  Expanded key schedule.  DecKey holds the round keys of the equivalent
+//  inverse cipher (InvMixColumns applied to rounds 1..13), which is the
+//  form both kernels consume.
+//
+
+typedef struct _AES_KEY {
+
+	unsigned char EncKey[(AES_ROUNDS + 1) * AES_BLOCK_SIZE] ;
+	unsigned char DecKey[(AES_ROUNDS + 1) * AES_BLOCK_SIZE] ;
+
+} AES_KEY, *PAES_KEY ;
+
+//
+//  One buffer of a counter mode batch.  Jobs are independent: each has its
+//  own key schedule, nonce and offset, so a batch may span several files.
+//
+
+typedef struct _AES_CTR_JOB {
+
+	const AES_KEY *Key ;
+	const unsigned char *Nonce ;
+	unsigned long long ByteOffset ;
+	const unsigned char *In ;
+	unsigned char *Out ;
+	size_t Length ;
+
+} AES_CTR_JOB, *PAES_CTR_JOB ;
+
+void
+Aes_Init(AES_IMPL MaxImpl) ;
+
+AES_IMPL
+Aes_GetImpl(void) ;
+
+void
+Aes_SetKey(AES_KEY *Key, const unsigned char *KeyBytes) ;
+
+void
+Aes_EncryptBlocks(const AES_KEY *Key, const unsigned char *In, unsigned char *Out, size_t Blocks) ;
+
+void
+Aes_DecryptBlocks(const AES_KEY *Key, const unsigned char *In, unsigned char *Out, size_t Blocks) ;
+
+void
+Aes_CtrXor(
+	const AES_KEY *Key,
+	const unsigned char *Iv,
+	unsigned long long BlockIndex,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Length
+	) ;
+
+void
+Aes_CtrXorAt(
+	const AES_KEY *Key,
+	const unsigned char *Nonce,
+	unsigned long long ByteOffset,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Length
+	) ;
+
+void
+Aes_CtrXorBatch(const AES_CTR_JOB *Jobs, size_t Count) ;
+
+void
+Aes_XtsCrypt(
+	const AES_KEY *DataKey,
+	const AES_KEY *TweakKey,
+	const unsigned char *Nonce,
+	unsigned long long UnitIndex,
+	size_t UnitSize,
+	const unsigned char *In,
+	unsigned char *Out,
+	size_t Length,
+	int Decrypt
+	) ;
+
+#endif//_AES_H_
@@ -0,0 +1,472 @@
+/*++
+
+Module Name:
+
+    bufpool.c
+
+Abstract:
+
+    Swap buffer pool.  Every non-cached read and write of an encrypted
+    file swaps in a buffer of its own, so buffers are recycled instead of
+    going to the system pool per I/O.
+
+    Requests are rounded up to one of three size classes (4 KiB, 64 KiB,
+    1 MiB).  Buffers come from non-paged pool in whole pages, so they are
+    page aligned as non-cached I/O requires.
+
+    Each processor has a magazine (a small LIFO array) per class, touched
+    only by that processor at DISPATCH_LEVEL, so the common path takes no
+    lock and shares no cache line.  An empty magazine refills half way
+    from a per-class depot, a lock-free SLIST of cached buffers; a full
+    one spills half into it.  The depot is the only place buffers move
+    between processors.
+
+    All buffer memory held by the pool - in use or cached - is charged
+    against a ceiling.  An allocation that would exceed it first releases
+    the depots, then fails.
+
+Environment:
+
+    Kernel mode, IRQL <= DISPATCH_LEVEL
+
+--*/
+#include "bufpool.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, BufPool_Init)
+#pragma alloc_text(PAGE, BufPool_Uninit)
+#endif
+
+typedef struct _BUFPOOL_MAGAZINE {
+
+	ULONG uCount ;
+
+	PVOID Buffers[BUFPOOL_MAGAZINE_MAX] ;
+
+} BUFPOOL_MAGAZINE, *PBUFPOOL_MAGAZINE ;
+
+typedef struct DECLSPEC_ALIGN(64) _BUFPOOL_CPU {
+
+	BUFPOOL_MAGAZINE Magazine[BUFPOOL_CLASSES] ;
+
+	//only updated by the owning processor
+	LONG64 MagazineHits ;
+	LONG64 DepotHits ;
+
+} BUFPOOL_CPU, *PBUFPOOL_CPU ;
+
+static const ULONG g_BufPoolClassSize[BUFPOOL_CLASSES] = { PAGE_SIZE, 64 * 1024, BUFPOOL_MAX_CACHED_SIZE } ;
+
+//about 128 KiB cached per processor for the small classes
+static const ULONG g_BufPoolMagazineSize[BUFPOOL_CLASSES] = { BUFPOOL_MAGAZINE_MAX, 4, 1 } ;
+
+static DECLSPEC_ALIGN(16) SLIST_HEADER g_BufPoolDepot[BUFPOOL_CLASSES] ;
+
+static PBUFPOOL_CPU g_BufPoolCpu = NULL ;
+
+static PVOID g_BufPoolCpuBlock = NULL ;
+
+static ULONG g_BufPoolCpuCount = 0 ;
+
+static volatile LONG64 g_BufPoolBytes = 0 ;
+
+static volatile LONG64 g_BufPoolLimit = BUFPOOL_DEFAULT_LIMIT ;
+
+static volatile LONG64 g_BufPoolMisses = 0 ;
+
+static volatile LONG64 g_BufPoolFailures = 0 ;
+
+
+static LONG
+iBufPool_Class(
+    __in ULONG Length
+    )
+{
+	LONG i ;
+
+	for (i = 0; i < BUFPOOL_CLASSES; i++)
+	{
+		if (Length <= g_BufPoolClassSize[i])
+			return i ;
+	}
+
+	return -1 ;
+}
+
+
+static BOOLEAN
+iBufPool_Charge(
+    __in LONG64 Bytes
+    )
+{
+	LONG64 cur = g_BufPoolBytes ;
+	LONG64 old ;
+
+	for (;;)
+	{
+		if (cur + Bytes > g_BufPoolLimit)
+			return FALSE ;
+
+		old = InterlockedCompareExchange64(&g_BufPoolBytes, cur + Bytes, cur) ;
+		if (old == cur)
+			return TRUE ;
+		cur = old ;
+	}
+}
+
+
+static VOID
+iBufPool_Release(
+    __in PVOID Buffer,
+    __in LONG64 Bytes
+    )
+{
+	ExFreePoolWithTag(Buffer, BUFFER_SWAP_TAG) ;
+	InterlockedExchangeAdd64(&g_BufPoolBytes, -Bytes) ;
+}
+
+
+NTSTATUS
+BufPool_Init(
+    __in SIZE_T Limit
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates the per-processor magazines.  Called from
+    DriverEntry.  Pool blocks smaller than a page are only 16 byte
+    aligned, so the block is over-allocated and the magazines placed on
+    the next cache line boundary.
+
+Arguments:
+
+    Limit - Ceiling of buffer memory held by the pool, in bytes
+
+Return Value:
+
+    Status
+
+--*/
+{
+	ULONG i ;
+
+	C_ASSERT(TYPE_ALIGNMENT(BUFPOOL_CPU) == BUFPOOL_CPU_ALIGNMENT) ;
+
+	g_BufPoolCpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS) ;
+
+	g_BufPoolCpuBlock = ExAllocatePoolWithTag(NonPagedPool,
+		g_BufPoolCpuCount * sizeof(BUFPOOL_CPU) + BUFPOOL_CPU_ALIGNMENT - 1, BUFFER_SWAP_TAG) ;
+	if (g_BufPoolCpuBlock == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	g_BufPoolCpu = (PBUFPOOL_CPU)(((ULONG_PTR)g_BufPoolCpuBlock + BUFPOOL_CPU_ALIGNMENT - 1) &
+		~(ULONG_PTR)(BUFPOOL_CPU_ALIGNMENT - 1)) ;
+
+	RtlZeroMemory(g_BufPoolCpu, g_BufPoolCpuCount * sizeof(BUFPOOL_CPU)) ;
+
+	for (i = 0; i < BUFPOOL_CLASSES; i++)
+		InitializeSListHead(&g_BufPoolDepot[i]) ;
+
+	g_BufPoolBytes = 0 ;
+	g_BufPoolLimit = Limit ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+VOID
+BufPool_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees every cached buffer.  Called on unload, when no I/O
+    holds a buffer any more.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PBUFPOOL_MAGAZINE mag ;
+	ULONG i, j ;
+
+	PAGED_CODE() ;
+
+	if (g_BufPoolCpu == NULL)
+		return ;
+
+	for (i = 0; i < g_BufPoolCpuCount; i++)
+	{
+		for (j = 0; j < BUFPOOL_CLASSES; j++)
+		{
+			mag = &g_BufPoolCpu[i].Magazine[j] ;
+			while (mag->uCount > 0)
+				iBufPool_Release(mag->Buffers[--mag->uCount], g_BufPoolClassSize[j]) ;
+		}
+	}
+
+	BufPool_Trim() ;
+
+	ASSERT(g_BufPoolBytes == 0) ;
+
+	ExFreePoolWithTag(g_BufPoolCpuBlock, BUFFER_SWAP_TAG) ;
+	g_BufPoolCpuBlock = NULL ;
+	g_BufPoolCpu = NULL ;
+}
+
+
+VOID
+BufPool_SetLimit(
+    __in SIZE_T Limit
+    )
+/*++
+
+Routine Description:
+
+    This routine changes the memory ceiling.  When it is lowered below the
+    memory currently held, buffers are returned to the system as they are
+    freed until the pool is under the new ceiling.
+
+Arguments:
+
+    Limit - New ceiling, in bytes
+
+Return Value:
+
+    None
+
+--*/
+{
+	InterlockedExchange64(&g_BufPoolLimit, Limit) ;
+
+	if (g_BufPoolBytes > (LONG64)Limit)
+		BufPool_Trim() ;
+}
+
+
+VOID
+BufPool_Trim(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the buffers cached in the depots to the system.
+    Magazines are left alone; they are small and private to a processor.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PSLIST_ENTRY entry ;
+	ULONG i ;
+
+	for (i = 0; i < BUFPOOL_CLASSES; i++)
+	{
+		while ((entry = InterlockedPopEntrySList(&g_BufPoolDepot[i])) != NULL)
+			iBufPool_Release(entry, g_BufPoolClassSize[i]) ;
+	}
+}
+
+
+PVOID
+BufPool_Allocate(
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a page aligned non-paged buffer of at least
+    Length bytes.
+
+Arguments:
+
+    Length - Bytes needed
+
+Return Value:
+
+    The buffer, to be freed with BufPool_Free and the same Length, or
+    NULL if the pool is at its ceiling or out of memory
+
+--*/
+{
+	LONG cls = iBufPool_Class(Length) ;
+	SIZE_T size = cls >= 0 ? g_BufPoolClassSize[cls] : ROUND_TO_PAGES(Length) ;
+	PBUFPOOL_CPU cpu ;
+	PBUFPOOL_MAGAZINE mag ;
+	PSLIST_ENTRY entry ;
+	PVOID buffer = NULL ;
+	KIRQL oldIrql ;
+
+	if (cls >= 0)
+	{
+		KeRaiseIrql(DISPATCH_LEVEL, &oldIrql) ;
+
+		cpu = &g_BufPoolCpu[KeGetCurrentProcessorNumberEx(NULL)] ;
+		mag = &cpu->Magazine[cls] ;
+
+		if (mag->uCount > 0)
+		{
+			buffer = mag->Buffers[--mag->uCount] ;
+			cpu->MagazineHits++ ;
+		}
+		else if ((entry = InterlockedPopEntrySList(&g_BufPoolDepot[cls])) != NULL)
+		{
+			//take one, and refill the magazine half way
+			buffer = entry ;
+			cpu->DepotHits++ ;
+
+			while (mag->uCount < g_BufPoolMagazineSize[cls] / 2 &&
+				(entry = InterlockedPopEntrySList(&g_BufPoolDepot[cls])) != NULL)
+			{
+				mag->Buffers[mag->uCount++] = entry ;
+			}
+		}
+
+		KeLowerIrql(oldIrql) ;
+
+		if (buffer != NULL)
+			return buffer ;
+	}
+
+	if (!iBufPool_Charge(size))
+	{
+		BufPool_Trim() ;
+
+		if (!iBufPool_Charge(size))
+		{
+			InterlockedIncrement64(&g_BufPoolFailures) ;
+			return NULL ;
+		}
+	}
+
+	//whole pages from non-paged pool are page aligned
+	buffer = ExAllocatePoolWithTag(NonPagedPool, size, BUFFER_SWAP_TAG) ;
+	if (buffer == NULL)
+	{
+		InterlockedExchangeAdd64(&g_BufPoolBytes, -(LONG64)size) ;
+		InterlockedIncrement64(&g_BufPoolFailures) ;
+		return NULL ;
+	}
+
+	InterlockedIncrement64(&g_BufPoolMisses) ;
+
+	return buffer ;
+}
+
+
+VOID
+BufPool_Free(
+    __in PVOID Buffer,
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a buffer to the pool.
+
+Arguments:
+
+    Buffer - Buffer from BufPool_Allocate
+    Length - Length passed to BufPool_Allocate
+
+Return Value:
+
+    None
+
+--*/
+{
+	LONG cls = iBufPool_Class(Length) ;
+	PBUFPOOL_MAGAZINE mag ;
+	KIRQL oldIrql ;
+
+	if (cls < 0)
+	{
+		iBufPool_Release(Buffer, ROUND_TO_PAGES(Length)) ;
+		return ;
+	}
+
+	//over the ceiling after BufPool_SetLimit lowered it
+	if (g_BufPoolBytes > g_BufPoolLimit)
+	{
+		iBufPool_Release(Buffer, g_BufPoolClassSize[cls]) ;
+		return ;
+	}
+
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql) ;
+
+	mag = &g_BufPoolCpu[KeGetCurrentProcessorNumberEx(NULL)].Magazine[cls] ;
+
+	if (mag->uCount == g_BufPoolMagazineSize[cls])
+	{
+		//spill the older half into the depot
+		ULONG keep = mag->uCount / 2 ;
+		ULONG i ;
+
+		for (i = 0; i < mag->uCount - keep; i++)
+			InterlockedPushEntrySList(&g_BufPoolDepot[cls], (PSLIST_ENTRY)mag->Buffers[i]) ;
+
+		for (i = 0; i < keep; i++)
+			mag->Buffers[i] = mag->Buffers[mag->uCount - keep + i] ;
+
+		mag->uCount = keep ;
+	}
+
+	mag->Buffers[mag->uCount++] = Buffer ;
+
+	KeLowerIrql(oldIrql) ;
+}
+
+
+VOID
+BufPool_QueryStats(
+    __out PBUFPOOL_STATS Stats
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a snapshot of the pool counters.
+
+Arguments:
+
+    Stats - Receives the counters
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG i ;
+
+	RtlZeroMemory(Stats, sizeof(BUFPOOL_STATS)) ;
+
+	for (i = 0; i < g_BufPoolCpuCount; i++)
+	{
+		Stats->MagazineHits += g_BufPoolCpu[i].MagazineHits ;
+		Stats->DepotHits += g_BufPoolCpu[i].DepotHits ;
+	}
+
+	Stats->Misses = g_BufPoolMisses ;
+	Stats->Failures = g_BufPoolFailures ;
+	Stats->Bytes = g_BufPoolBytes ;
+}
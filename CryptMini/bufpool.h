@@ -0,0 +1,75 @@
+#include "common.h"
+
+//
+//  Pool of swap buffers for read/write buffer swapping
+//
+
+#define BUFFER_SWAP_TAG     'bdBS'
+
+//size classes; larger requests go to the system pool directly
+#define BUFPOOL_CLASSES                   3
+#define BUFPOOL_MAX_CACHED_SIZE           (1024 * 1024)
+
+//magazine capacity of the smallest class
+#define BUFPOOL_MAGAZINE_MAX              32
+
+//alignment of the per-processor magazines, a cache line
+#define BUFPOOL_CPU_ALIGNMENT             64
+
+//default ceiling of buffer memory held by the pool, in use or cached
+#define BUFPOOL_DEFAULT_LIMIT             (64 * 1024 * 1024)
+
+typedef struct _BUFPOOL_STATS {
+
+	//served from a per-CPU magazine
+	LONG64 MagazineHits ;
+
+	//served from the shared depot
+	LONG64 DepotHits ;
+
+	//allocated from the system pool
+	LONG64 Misses ;
+
+	//refused because of the ceiling, or the system pool failed
+	LONG64 Failures ;
+
+	//buffer memory held by the pool, in use or cached
+	LONG64 Bytes ;
+
+} BUFPOOL_STATS, *PBUFPOOL_STATS ;
+
+NTSTATUS
+BufPool_Init(
+    __in SIZE_T Limit
+    ) ;
+
+VOID
+BufPool_Uninit(
+    VOID
+    ) ;
+
+VOID
+BufPool_SetLimit(
+    __in SIZE_T Limit
+    ) ;
+
+PVOID
+BufPool_Allocate(
+    __in ULONG Length
+    ) ;
+
+VOID
+BufPool_Free(
+    __in PVOID Buffer,
+    __in ULONG Length
+    ) ;
+
+VOID
+BufPool_Trim(
+    VOID
+    ) ;
+
+VOID
+BufPool_QueryStats(
+    __out PBUFPOOL_STATS Stats
+    ) ;
@@ -6,6 +6,9 @@
 #include <suppress.h>
 #include "..\include\error.h"
 #include "..\include\iocommon.h"
+#include "..\include\interface.h"
+#include "aes.h"
+#include "layout.h"
 
 #ifndef MAX_PATH
 #define MAX_PATH 260 
@@ -25,6 +28,94 @@
 
 #define FS_NAME_LENGTH 6*sizeof(WCHAR) // useless now
 
+//
+//  Ciphers a volume can be encrypted with
+//
+
+#define CRYPT_CIPHER_AES256_CTR 1
+#define CRYPT_CIPHER_AES256_XTS 2
+
+#define CRYPT_DEFAULT_CIPHER CRYPT_CIPHER_AES256_CTR
+
+//
+//  LAYOUT_KIND of the files of a volume, see layout.h.  The header layout
+//  suits volumes of files mostly appended to, e.g. logs.
+//
+
+#define CRYPT_DEFAULT_LAYOUT LayoutTrailer
+
+//
+//  Expanded key schedules of one key, shared through the key cache
+//  (keycache.c) by every volume and stream using that key.  Immutable
+//  while referenced.
+//
+
+typedef struct DECLSPEC_ALIGN(64) _KEY_CACHE_ENTRY {
+
+	// expanded AES-256 key schedule
+	AES_KEY Key ;
+
+	// XTS tweak key schedule, derived from the key
+	AES_KEY TweakKey ;
+
+	// key digest, the cache key
+	UCHAR szKeyHash[HASH_SIZE] ;
+
+	// 0 free, -1 being filled or evicted, otherwise 1 for the cache
+	// plus one per holder
+	volatile LONG RefCount ;
+
+	// CLOCK bit, set on every hit
+	volatile LONG Referenced ;
+
+	// allocated outside the cache table because its set was full of
+	// referenced entries, freed with the last reference
+	BOOLEAN bUncached ;
+
+	// pool block an uncached entry was carved from
+	PVOID Allocation ;
+
+} KEY_CACHE_ENTRY, *PKEY_CACHE_ENTRY ;
+
+//
+//  Byte range lock of a stream, see rangelock.c.  Granted and waiting
+//  ranges are kept in lists, in-flight I/Os of one stream are few.
+//
+
+#define RANGE_LOCK_TO_END_OF_FILE   MAXLONGLONG
+
+typedef struct _RANGE_LOCK {
+
+	KSPIN_LOCK Lock ;
+
+	//granted RANGE_LOCK_ENTRY
+	LIST_ENTRY Granted ;
+
+	//waiting RANGE_LOCK_ENTRY, in arrival order
+	LIST_ENTRY Waiting ;
+
+} RANGE_LOCK, *PRANGE_LOCK ;
+
+//
+//  One acquired range, provided by the caller and held until
+//  RangeLock_Release
+//
+
+typedef struct _RANGE_LOCK_ENTRY {
+
+	LIST_ENTRY Link ;
+
+	//[Start, End), End may be RANGE_LOCK_TO_END_OF_FILE
+	LONGLONG Start ;
+	LONGLONG End ;
+
+	BOOLEAN Exclusive ;
+
+	//signaled when a waiting range is granted
+	KEVENT Granted ;
+
+} RANGE_LOCK_ENTRY, *PRANGE_LOCK_ENTRY ;
+
 //
 //  This is a volume context, one of these are attached to each volume
 //  we monitor.  This is used to get a "DOS" name for debug display.
@@ -47,8 +138,19 @@ typedef struct _VOLUME_CONTEXT {
 
     ULONG SectorSize;
 
-	// Holds encryption/decryption context
-	///COUNTER_MODE_CONTEXT* aes_ctr_ctx ;
+	//
+	//  CRYPT_CIPHER_XXX used for files on this volume.  For XTS the
+	//  data unit is SectorSize.
+	//
+
+	ULONG CipherId;
+
+	//
+	//  Where the file flag of encrypted files is, and where their plain
+	//  text starts.  Files of the other layout are not recognized.
+	//
+
+	LAYOUT Layout;
 
 	// key. used to encrypt/decrypt files in the volume
 	UCHAR szKey[MAX_KEY_LENGTH] ;
@@ -56,38 +158,79 @@ typedef struct _VOLUME_CONTEXT {
 	// can be decrypted/encrypted by this key
 	UCHAR szKeyHash[HASH_SIZE] ;
 
-	//spinlock to synchornize encryption/decryption process
-	KSPIN_LOCK FsCryptSpinLock ;
+	// referenced key cache entry holding the schedules of szKey.
+	// Schedules are immutable and counters are derived from the file
+	// nonce and offset, so encryption/decryption takes no volume lock.
+	PKEY_CACHE_ENTRY KeyEntry ;
 
-	// Table to hold file context defined in file.h(old)
-	// Now it is useless
-	RTL_GENERIC_TABLE FsCtxTable ;
-	
-	// mutex to synchronize file context table(old)
-	// Now it is used to synchronize encryption/decryption process
-	FAST_MUTEX FsCtxTableMutex ;
+	// file flags of recently opened files, by file id.  NULL if it could
+	// not be allocated.
+	struct _FILE_CACHE *FileCache ;
 
 } VOLUME_CONTEXT, *PVOLUME_CONTEXT;
 
 
+//
+//  Stream context flags, kept in one LONG so that they are read with a
+//  plain load and changed with one interlocked operation, see SC_TEST_FLAG
+//
+
+#define SC_FLAG_FILE_CRYPT          0x00000001  //set after file flag is written into end of file
+#define SC_FLAG_ENCRYPT_ON_WRITE    0x00000002  //set when file is to be supervised, or set when file is already encrypted.
+#define SC_FLAG_DECRYPT_ON_READ     0x00000004  //set when non-encrypted file is first paging written, or set when file is already encrypted.
+#define SC_FLAG_HAS_WRITE_DATA      0x00000008  //If data is written into file during the life cycle of the stream context. This flag is used to judge whether to write tail flag when file is closed.
+#define SC_FLAG_HAS_PPT_WRITE_DATA  0x00000010  //If user click save button in un-encrypts ppt file, this flag is set and this file will be encrypted in THE LAST IRP_MJ_CLOSE
+#define SC_FLAG_TRAILER_CHECKED     0x00000020  //set once the file flag trailer has been looked for
+#define SC_FLAG_FILTERED            0x00000040  //set once counted in the handled stream filter, see Ctx_MarkStreamHandled
+#define SC_FLAG_UNNAMED_STREAM      0x00000080  //set when the stream is the unnamed data stream of its file, the only one the file cache keeps
+#define SC_FLAG_FILE_ID             0x00000100  //set once FileId is known
+#define SC_FLAG_WRITER              0x00000200  //set when the stream is opened with write access, its file cache entry is dropped with the context
+#define SC_FLAG_PENDING             0x00000400  //set while counted in the pending stream filter: the trailer is to be read by the first access, see Ctx_MarkStreamPending
+#define SC_FLAG_HEADER              0x00000800  //set with SC_FLAG_FILE_CRYPT when the file flag is a header: I/O at plain text offsets is moved past it, see MapIoOffset
+
+//
+//  Fields every read and write touches come first and fit in
+//  STREAM_CONTEXT_HOT_SIZE bytes.  FltMgr only aligns the context to the
+//  pool granularity, so they may still straddle two lines, but never more.
+//
+
+#define STREAM_CONTEXT_HOT_SIZE 64
+
+//bytes of the hot fields, without padding on x86 and x64
+#define STREAM_CONTEXT_HOT_FIELDS (2 * sizeof(LONG) + 2 * sizeof(LARGE_INTEGER) + sizeof(PVOID) + IV_LENGTH + sizeof(ULONG))
+
+//
+//  128-bit file id; a 64-bit id has High 0
+//
+
+typedef struct _FILE_CACHE_ID {
+
+	ULONGLONG Low ;
+	ULONGLONG High ;
+
+} FILE_CACHE_ID, *PFILE_CACHE_ID ;
+
+//
+//  Characters of a file name stored in the stream context itself
+//
+
+#define STREAM_CONTEXT_NAME_INLINE 64
+
 //
 //  Stream context data structure
 //
 typedef struct _STREAM_CONTEXT {
 
-    //Name of the file associated with this context.
-    UNICODE_STRING FileName;
+	//
+	//  Hot fields
+	//
 
-	//Volume Name
-	WCHAR wszVolumeName[64] ;
+	//SC_FLAG_XXX
+	volatile LONG Flags ;
 
-	//file key hash
-	UCHAR szKeyHash[HASH_SIZE] ;
-
-    //Number of times we saw a create on this stream
-	//used to verify whether a file flag can be written
-	//into end of file and file data can be flush back.
-    LONG RefCount;
+	//sequence lock of FileValidLength and FileSize, odd while they
+	//change.  See SC_READ_SIZES and SC_SIZE_LOCK.
+	volatile LONG SizeSequence ;
 
 	//File Valid Size
 	LARGE_INTEGER FileValidLength ;
@@ -95,31 +238,102 @@ typedef struct _STREAM_CONTEXT {
 	//File Size(including real file size, padding length, and file flag data)
 	LARGE_INTEGER FileSize ;
 
+	//referenced key cache entry of szKeyHash, NULL if the key is unknown
+	PKEY_CACHE_ENTRY KeyEntry ;
+
+	//file nonce, read from the file flag. Counter block of file offset 0.
+	UCHAR szNonce[IV_LENGTH] ;
+
 	//Trail Length
 	ULONG uTrailLength ;
 
-	//desired access
-	ULONG uAccess ;
+	//the rest of the line: cold writes, RefCount first, stay off it
+	UCHAR HotPad[STREAM_CONTEXT_HOT_SIZE - STREAM_CONTEXT_HOT_FIELDS] ;
 
-	//Flags
-	BOOLEAN bIsFileCrypt ;    //(init false)set after file flag is written into end of file
-	BOOLEAN bEncryptOnWrite ; //(init true)set when file is to be supervised, or set when file is already encrypted.
-	BOOLEAN bDecryptOnRead ;  //(init false)set when non-encrypted file is first paging written, or set when file is already encrypted.
-	BOOLEAN bHasWriteData ;    //(init false)If data is written into file during the life cycle of the stream context. This flag is used to judge whether to write tail flag when file is closed.
-	BOOLEAN bFirstWriteNotFromBeg ; //(useless now.)if file is not encrypted yet, whether the first write offset is 0
-	BOOLEAN bHasPPTWriteData ;  //(init false)If user click save button in un-encrypts ppt file, this flag is set to TRUE and this file will be encrypted in THE LAST IRP_MJ_CLOSE 
+	//
+	//  Cold fields, only touched by create, cleanup and at raised irql
+	//
 
-	// Holds encryption/decryption context specified to this file
-	///COUNTER_MODE_CONTEXT* aes_ctr_ctx ;
-   
-	//Lock used to protect this context.
-    PERESOURCE Resource;
+	//Number of times we saw a create on this stream
+	//used to verify whether a file flag can be written
+	//into end of file and file data can be flush back.
+	LONG RefCount;
 
-	//Spin lock used to protect this context when irql is too high
+	//slot of the handled stream filter counting this stream
+	ULONG uFilterSlot ;
+
+	//Spin lock used to protect this context when irql is too high.
+	//Kept after the hot fields, acquiring it writes its line.
 	KSPIN_LOCK Resource1 ;
 
+	//ranges of the non-cached non-paging I/Os in flight
+	RANGE_LOCK RangeLock ;
+
+	//Lock used to protect this context.
+	ERESOURCE Resource;
+
+	//held by the first accessors of a pending stream while one of them
+	//reads the trailer, see ResolveStream
+	ERESOURCE ProbeLock ;
+
+	//file key hash
+	UCHAR szKeyHash[HASH_SIZE] ;
+
+	//key of the contents a create truncated, replaced by the volume key
+	//in SetupTruncatedStream but kept for the I/O still in flight on
+	//them.  The volume key never changes, so there is one at most
+	PKEY_CACHE_ENTRY RetiredKeyEntry ;
+
+	//referenced volume context, its Name is the volume name of the file
+	struct _VOLUME_CONTEXT *VolumeContext ;
+
+	//id of the file in the file cache of the volume, valid once
+	//SC_FLAG_FILE_ID is set
+	FILE_CACHE_ID FileId ;
+
+	//Name of the file associated with this context.  Its buffer is
+	//NameInline when it fits, see Ctx_UpdateNameInStreamContext
+	UNICODE_STRING FileName;
+
+	WCHAR NameInline[STREAM_CONTEXT_NAME_INLINE] ;
+
 } STREAM_CONTEXT, *PSTREAM_CONTEXT;
 
 #define STREAM_CONTEXT_SIZE sizeof(STREAM_CONTEXT)
 
+C_ASSERT(FIELD_OFFSET(STREAM_CONTEXT, Flags) == 0) ;
+C_ASSERT(FIELD_OFFSET(STREAM_CONTEXT, uTrailLength) + sizeof(ULONG) <= STREAM_CONTEXT_HOT_SIZE) ;
+C_ASSERT(FIELD_OFFSET(STREAM_CONTEXT, RefCount) == STREAM_CONTEXT_HOT_SIZE) ;
+
+//  Flags are set after the fields they publish, e.g. KeyEntry, so they are
+//  read with acquire semantics
+#define SC_TEST_FLAG(_sc, _flag)  FlagOn(ReadAcquire(&(_sc)->Flags), (_flag))
+#define SC_SET_FLAG(_sc, _flag)   InterlockedOr(&(_sc)->Flags, (_flag))
+#define SC_CLEAR_FLAG(_sc, _flag) InterlockedAnd(&(_sc)->Flags, ~(LONG)(_flag))
+
+//
+//  File flag of an encrypted file, as read from its trailer or header.
+//  See flagfmt.h for the on-disk formats.
+//
+
+typedef struct _FILE_FLAG {
+
+	//FLAGFMT_VERSION_XXX of the trailer
+	ULONG uVersion ;
+
+	//CRYPT_CIPHER_XXX the file is encrypted with, 0 if the trailer does
+	//not record it: the cipher of the volume
+	ULONG CipherId ;
+
+	//digest of the key the file is encrypted with
+	UCHAR szKeyHash[HASH_SIZE] ;
+
+	//random per-file nonce, generated when the file is first encrypted
+	UCHAR szNonce[IV_LENGTH] ;
+
+	//length of the plain text
+	LARGE_INTEGER FileValidLength ;
+
+} FILE_FLAG, *PFILE_FLAG;
+
 #endif
\ No newline at end of file
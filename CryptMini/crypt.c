@@ -0,0 +1,514 @@
+/*++
+
+Module Name:
+
+    crypt.c
+
+Abstract:
+
+    Kernel glue around the AES engine: per-file nonce generation, key
+    expansion and offset-addressed encryption/decryption of file data.
+
+    Two ciphers are supported, selected per volume:
+
+    CRYPT_CIPHER_AES256_CTR - keystream for byte N of a file is derived
+        from the file nonce and N only. Any byte range can be transformed.
+
+    CRYPT_CIPHER_AES256_XTS - the data unit is the volume sector; its
+        tweak is the file nonce plus the sector index. Only whole sectors
+        can be transformed, which is all non-cached and paging I/O does.
+        The data key K1 is the file key; the tweak key K2 is derived from
+        it with the SP 800-108 counter mode KDF over HMAC-SHA256.
+
+    Either way there is no cipher state shared between I/Os: key schedules
+    are read-only, counters and tweaks are computed from the nonce and the
+    offset, and scratch blocks live on the stack of the calling processor.
+    Any number of I/Os on a volume can be transformed concurrently without
+    a lock.
+
+Environment:
+
+    Kernel mode
+
+--*/
+#include <bcrypt.h>
+#include "crypt.h"
+#include "workpool.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, Crypt_Init)
+#pragma alloc_text(PAGE, Crypt_Uninit)
+#pragma alloc_text(PAGE, Crypt_GenerateNonce)
+#endif
+
+//
+//  Label of the XTS tweak key derivation, its terminating NUL is the 0x00
+//  separator SP 800-108 puts between label and (empty) context
+//
+
+static const UCHAR g_CryptTweakLabel[] = "CryptMini XTS-AES-256 tweak key";
+
+C_ASSERT(AES_KEY_SIZE == 32);
+
+//
+//  On x86 the SSE registers used by the AES-NI kernel are not preserved
+//  for kernel mode code, so save them around every call into the engine.
+//
+
+#if defined(_X86_)
+
+#define CRYPT_ENTER_SSE(_status) \
+	XSTATE_SAVE _xstate; \
+	(_status) = KeSaveExtendedProcessorState(XSTATE_MASK_LEGACY, &_xstate)
+
+#define CRYPT_LEAVE_SSE() \
+	KeRestoreExtendedProcessorState(&_xstate)
+
+#else
+
+#define CRYPT_ENTER_SSE(_status) \
+	(_status) = STATUS_SUCCESS
+
+#define CRYPT_LEAVE_SSE()
+
+#endif
+
+//
+//  One Crypt_TransformParallel call, shared by its chunks
+//
+
+typedef struct _CRYPT_PARALLEL_JOB {
+
+	PVOLUME_CONTEXT VolCtx;
+	PKEY_CACHE_ENTRY KeyEntry;
+	const UCHAR *Nonce;
+	LONGLONG ByteOffset;
+	const UCHAR *In;
+	PUCHAR Out;
+	ULONG Length;
+	BOOLEAN Encrypt;
+
+	//first failure of a chunk
+	volatile LONG Status;
+
+} CRYPT_PARALLEL_JOB, *PCRYPT_PARALLEL_JOB;
+
+static volatile LONG g_CryptParallelThreshold = CRYPT_PARALLEL_THRESHOLD;
+
+//HMAC-SHA256 provider of the tweak key derivation, usable at DISPATCH_LEVEL
+static BCRYPT_ALG_HANDLE g_CryptHmacAlg = NULL;
+
+
+NTSTATUS
+Crypt_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine opens the HMAC-SHA256 provider Crypt_ExpandKey derives
+    tweak keys with.  It is loaded into nonpaged memory, since key cache
+    misses happen at up to DISPATCH_LEVEL.
+
+Return Value:
+
+    Status
+
+--*/
+{
+	PAGED_CODE();
+
+	return BCryptOpenAlgorithmProvider(&g_CryptHmacAlg,
+		BCRYPT_SHA256_ALGORITHM,
+		NULL,
+		BCRYPT_ALG_HANDLE_HMAC_FLAG | BCRYPT_PROV_DISPATCH);
+}
+
+
+VOID
+Crypt_Uninit(
+    VOID
+    )
+{
+	PAGED_CODE();
+
+	if (g_CryptHmacAlg != NULL)
+	{
+		BCryptCloseAlgorithmProvider(g_CryptHmacAlg, 0);
+		g_CryptHmacAlg = NULL;
+	}
+}
+
+
+NTSTATUS
+Crypt_GenerateNonce(
+    __out_bcount(IV_LENGTH) PUCHAR Nonce
+    )
+/*++
+
+Routine Description:
+
+    This routine generates a random nonce for a file which is about to be
+    encrypted for the first time.  The nonce is stored in the file flag
+    and in the stream context.
+
+Arguments:
+
+    Nonce - Receives IV_LENGTH random bytes
+
+Return Value:
+
+    Status
+
+--*/
+{
+	PAGED_CODE();
+
+	return BCryptGenRandom(NULL, Nonce, IV_LENGTH, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+}
+
+
+NTSTATUS
+Crypt_ExpandKey(
+    __in_bcount(MAX_KEY_LENGTH) const UCHAR *Key,
+    __out PAES_KEY DataKey,
+    __out PAES_KEY TweakKey
+    )
+/*++
+
+Routine Description:
+
+    This routine expands Key into the data key schedule and derives the
+    XTS tweak key from it, so a single 256-bit key serves both ciphers.
+
+    XTS needs two independent keys.  K2 is the NIST SP 800-108 KDF in
+    counter mode with HMAC-SHA256 as the PRF, keyed with K1, for one
+    256-bit block:
+
+        K2 = HMAC-SHA256(K1, [1]_32 || Label || 0x00 || [256]_32)
+
+    with Label g_CryptTweakLabel, an empty context and big endian
+    counters.  K2 reveals nothing about K1 and differs from it, as IEEE
+    1619 requires.
+
+    Used by the key cache on a miss.  Callable at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+
+    Key      - Raw AES-256 key
+    DataKey  - Receives the data key schedule
+    TweakKey - Receives the tweak key schedule
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status;
+	BCRYPT_HASH_HANDLE hash = NULL;
+	UCHAR counter[4] = { 0, 0, 0, 1 };
+	UCHAR length[4] = { 0, 0, 1, 0 };
+	UCHAR tweakKey[AES_KEY_SIZE] = { 0 };
+
+	Aes_SetKey(DataKey, Key);
+
+	//the hash object is left to CNG, allocated nonpaged by the dispatch provider
+	status = BCryptCreateHash(g_CryptHmacAlg, &hash, NULL, 0, (PUCHAR)Key, AES_KEY_SIZE, 0);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = BCryptHashData(hash, counter, sizeof(counter), 0);
+	if (NT_SUCCESS(status))
+		status = BCryptHashData(hash, (PUCHAR)g_CryptTweakLabel, sizeof(g_CryptTweakLabel), 0);
+	if (NT_SUCCESS(status))
+		status = BCryptHashData(hash, length, sizeof(length), 0);
+	if (NT_SUCCESS(status))
+		status = BCryptFinishHash(hash, tweakKey, sizeof(tweakKey), 0);
+
+	BCryptDestroyHash(hash);
+
+	if (NT_SUCCESS(status))
+		Aes_SetKey(TweakKey, tweakKey);
+
+	RtlSecureZeroMemory(tweakKey, sizeof(tweakKey));
+
+	return status;
+}
+
+
+NTSTATUS
+Crypt_Transform(
+    __in PVOLUME_CONTEXT VolCtx,
+    __in PKEY_CACHE_ENTRY KeyEntry,
+    __in_bcount(IV_LENGTH) const UCHAR *Nonce,
+    __in LONGLONG ByteOffset,
+    __in_bcount(Length) const UCHAR *In,
+    __out_bcount(Length) PUCHAR Out,
+    __in ULONG Length,
+    __in BOOLEAN Encrypt
+    )
+/*++
+
+Routine Description:
+
+    This routine encrypts or decrypts Length bytes of file data located at
+    ByteOffset in the file, with the cipher selected for the volume.
+
+    Callable at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+
+    VolCtx     - Volume context selecting the cipher
+    KeyEntry   - Referenced key cache entry of the file key
+    Nonce      - File nonce
+    ByteOffset - File offset of the first byte
+    In         - Source buffer
+    Out        - Destination buffer, may be the same as In
+    Length     - Number of bytes. Sector aligned for XTS.
+    Encrypt    - TRUE to encrypt, FALSE to decrypt
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status;
+	ULONG unit = VolCtx->SectorSize;
+
+	ASSERT(ByteOffset >= 0);
+
+	if (VolCtx->CipherId == CRYPT_CIPHER_AES256_XTS &&
+		(((ULONGLONG)ByteOffset % unit) != 0 || (Length % unit) != 0))
+	{
+		ASSERT(!"XTS transform of a partial sector");
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	CRYPT_ENTER_SSE(status);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (VolCtx->CipherId == CRYPT_CIPHER_AES256_XTS)
+	{
+		Aes_XtsCrypt(&KeyEntry->Key, &KeyEntry->TweakKey, Nonce,
+			(ULONGLONG)ByteOffset / unit, unit, In, Out, Length, !Encrypt);
+	}
+	else
+	{
+		//counter mode, encryption and decryption are the same operation
+		Aes_CtrXorAt(&KeyEntry->Key, Nonce, (ULONGLONG)ByteOffset, In, Out, Length);
+	}
+
+	CRYPT_LEAVE_SSE();
+
+	return STATUS_SUCCESS;
+}
+
+
+static VOID
+iCrypt_TransformChunk(
+    __in PVOID Context,
+    __in ULONG Index
+    )
+{
+	PCRYPT_PARALLEL_JOB job = Context;
+	ULONG start = Index * CRYPT_PARALLEL_CHUNK;
+	NTSTATUS status;
+
+	status = Crypt_Transform(job->VolCtx, job->KeyEntry, job->Nonce, job->ByteOffset + start,
+		job->In + start, job->Out + start, min(job->Length - start, CRYPT_PARALLEL_CHUNK), job->Encrypt);
+
+	if (!NT_SUCCESS(status))
+		InterlockedCompareExchange(&job->Status, status, STATUS_SUCCESS);
+}
+
+
+NTSTATUS
+Crypt_TransformParallel(
+    __in PVOLUME_CONTEXT VolCtx,
+    __in PKEY_CACHE_ENTRY KeyEntry,
+    __in_bcount(IV_LENGTH) const UCHAR *Nonce,
+    __in LONGLONG ByteOffset,
+    __in_bcount(Length) const UCHAR *In,
+    __out_bcount(Length) PUCHAR Out,
+    __in ULONG Length,
+    __in BOOLEAN Encrypt
+    )
+/*++
+
+Routine Description:
+
+    This routine is Crypt_Transform for large buffers.  A buffer of at
+    least the parallel threshold is split into CRYPT_PARALLEL_CHUNK chunks
+    which the worker pool and the calling thread transform concurrently;
+    the routine returns once every chunk is done.  Counters and tweaks
+    depend on the offset only, so chunks are independent.
+
+    Shorter buffers, and calls above APC_LEVEL where the caller cannot
+    wait for the workers, are transformed inline.
+
+Arguments:
+
+    Same as Crypt_Transform.
+
+Return Value:
+
+    Status
+
+--*/
+{
+	CRYPT_PARALLEL_JOB job;
+
+	if (!Crypt_IsParallel(Length))
+	{
+		return Crypt_Transform(VolCtx, KeyEntry, Nonce, ByteOffset, In, Out, Length, Encrypt);
+	}
+
+	job.VolCtx = VolCtx;
+	job.KeyEntry = KeyEntry;
+	job.Nonce = Nonce;
+	job.ByteOffset = ByteOffset;
+	job.In = In;
+	job.Out = Out;
+	job.Length = Length;
+	job.Encrypt = Encrypt;
+	job.Status = STATUS_SUCCESS;
+
+	WorkPool_Run(iCrypt_TransformChunk, &job,
+		(Length + CRYPT_PARALLEL_CHUNK - 1) / CRYPT_PARALLEL_CHUNK);
+
+	return job.Status;
+}
+
+
+BOOLEAN
+Crypt_IsParallel(
+    __in ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine tells whether Crypt_TransformParallel would split a
+    buffer of Length bytes over the worker pool at the current IRQL.
+
+Arguments:
+
+    Length - Length of the buffer
+
+Return Value:
+
+    TRUE if the buffer would be split
+
+--*/
+{
+	return Length >= (ULONG)g_CryptParallelThreshold &&
+		WorkPool_GetWorkerCount() >= 2 &&
+		KeGetCurrentIrql() <= APC_LEVEL;
+}
+
+
+VOID
+Crypt_SetParallelThreshold(
+    __in ULONG Threshold
+    )
+/*++
+
+Routine Description:
+
+    This routine changes the length from which Crypt_TransformParallel
+    splits a buffer over the worker pool.  It is never below one chunk.
+
+Arguments:
+
+    Threshold - New threshold, in bytes
+
+Return Value:
+
+    None
+
+--*/
+{
+	InterlockedExchange(&g_CryptParallelThreshold, max(Threshold, CRYPT_PARALLEL_CHUNK));
+}
+
+
+NTSTATUS
+Crypt_TransformBatch(
+    __in PVOLUME_CONTEXT VolCtx,
+    __in_ecount(Count) PAES_CTR_JOB Jobs,
+    __in ULONG Count,
+    __in BOOLEAN Encrypt
+    )
+/*++
+
+Routine Description:
+
+    This routine transforms a scatter list of buffers in one call, e.g. the
+    whole sectors of a read or write together with its padded partial
+    last sector.  Each job carries its own nonce
+    and file offset, and for counter mode its own key schedule, so a batch
+    may mix files.  The jobs are interleaved in the AES pipeline and the
+    SSE state is saved once for the whole batch.
+
+    Every job's Key must be the Key of a referenced KEY_CACHE_ENTRY.  For
+    XTS the jobs are processed one after another with the entry's data and
+    tweak keys; every job must be sector aligned.
+
+    Callable at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+
+    VolCtx  - Volume context selecting the cipher
+    Jobs    - Array of buffers to transform
+    Count   - Number of jobs
+    Encrypt - TRUE to encrypt, FALSE to decrypt
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status;
+	ULONG unit = VolCtx->SectorSize;
+	PKEY_CACHE_ENTRY entry;
+	ULONG i;
+
+	if (VolCtx->CipherId == CRYPT_CIPHER_AES256_XTS)
+	{
+		for (i = 0; i < Count; i++)
+		{
+			if ((Jobs[i].ByteOffset % unit) != 0 || (Jobs[i].Length % unit) != 0)
+			{
+				ASSERT(!"XTS transform of a partial sector");
+				return STATUS_INVALID_PARAMETER;
+			}
+		}
+	}
+
+	CRYPT_ENTER_SSE(status);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (VolCtx->CipherId == CRYPT_CIPHER_AES256_XTS)
+	{
+		for (i = 0; i < Count; i++)
+		{
+			entry = CONTAINING_RECORD(Jobs[i].Key, KEY_CACHE_ENTRY, Key);
+			Aes_XtsCrypt(&entry->Key, &entry->TweakKey, Jobs[i].Nonce,
+				Jobs[i].ByteOffset / unit, unit, Jobs[i].In, Jobs[i].Out, Jobs[i].Length, !Encrypt);
+		}
+	}
+	else
+	{
+		Aes_CtrXorBatch(Jobs, Count);
+	}
+
+	CRYPT_LEAVE_SSE();
+
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#include "common.h"
+
+//
+//  Kernel glue around the AES engine in aes.c
+//
+
+//transforms at least this long are split over the worker pool: four
+//chunks, so four processors get work (see test/workpool_bench.c)
+#define CRYPT_PARALLEL_THRESHOLD          (1024 * 1024)
+
+//chunk handed to one worker, a multiple of any sector size; tens of
+//microseconds of AES, many times the cost of waking a worker
+#define CRYPT_PARALLEL_CHUNK              (256 * 1024)
+
+NTSTATUS
+Crypt_Init(
+    VOID
+    ) ;
+
+VOID
+Crypt_Uninit(
+    VOID
+    ) ;
+
+NTSTATUS
+Crypt_GenerateNonce(
+    __out_bcount(IV_LENGTH) PUCHAR Nonce
+    ) ;
+
+NTSTATUS
+Crypt_ExpandKey(
+    __in_bcount(MAX_KEY_LENGTH) const UCHAR *Key,
+    __out PAES_KEY DataKey,
+    __out PAES_KEY TweakKey
+    ) ;
+
+NTSTATUS
+Crypt_Transform(
+    __in PVOLUME_CONTEXT VolCtx,
+    __in PKEY_CACHE_ENTRY KeyEntry,
+    __in_bcount(IV_LENGTH) const UCHAR *Nonce,
+    __in LONGLONG ByteOffset,
+    __in_bcount(Length) const UCHAR *In,
+    __out_bcount(Length) PUCHAR Out,
+    __in ULONG Length,
+    __in BOOLEAN Encrypt
+    ) ;
+
+NTSTATUS
+Crypt_TransformParallel(
+    __in PVOLUME_CONTEXT VolCtx,
+    __in PKEY_CACHE_ENTRY KeyEntry,
+    __in_bcount(IV_LENGTH) const UCHAR *Nonce,
+    __in LONGLONG ByteOffset,
+    __in_bcount(Length) const UCHAR *In,
+    __out_bcount(Length) PUCHAR Out,
+    __in ULONG Length,
+    __in BOOLEAN Encrypt
+    ) ;
+
+BOOLEAN
+Crypt_IsParallel(
+    __in ULONG Length
+    ) ;
+
+VOID
+Crypt_SetParallelThreshold(
+    __in ULONG Threshold
+    ) ;
+
+NTSTATUS
+Crypt_TransformBatch(
+    __in PVOLUME_CONTEXT VolCtx,
+    __in_ecount(Count) PAES_CTR_JOB Jobs,
+    __in ULONG Count,
+    __in BOOLEAN Encrypt
+    ) ;
@@ -1,14 +1,130 @@
 #include "ctx.h"
+#include "rangelock.h"
 
 static NTSTATUS iCtx_CreateStreamContext(PFLT_RELATED_OBJECTS FltObjects, PSTREAM_CONTEXT *StreamContext) ;
 
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, Ctx_Init)
+#pragma alloc_text(PAGE, Ctx_Uninit)
+#endif
+
+//
+//  Name arena, one paged lookaside list per size class
+//
+
+static const USHORT g_CtxNameClassSize[CTX_NAME_CLASSES] = { CTX_NAME_CLASS_SMALL, CTX_NAME_CLASS_LARGE } ;
+
+static PAGED_LOOKASIDE_LIST g_CtxNameArena[CTX_NAME_CLASSES] ;
+
+static volatile LONG64 g_CtxStreamContexts = 0 ;
+
+static volatile LONG64 g_CtxNamesInline = 0 ;
+
+static volatile LONG64 g_CtxNamesArena = 0 ;
+
+static volatile LONG64 g_CtxNamesPool = 0 ;
+
+//
+//  Handled stream filter.  Each slot counts the streams hashing to it whose
+//  context has SC_FLAG_FILE_CRYPT set, with or without a key;
+//  streams are told apart by FsContext, which the file system shares by every file object
+//  of a stream.  A zero slot proves a stream is not ours without looking
+//  its context up.
+//
+
+static volatile LONG g_CtxStreamFilter[CTX_STREAM_FILTER_SIZE] ;
+
+//
+//  Pending stream filter, the same for the streams whose trailer is yet to
+//  be read.  Reads and writes of other streams do not look their context up
+//  to find out.
+//
+
+static volatile LONG g_CtxPendingFilter[CTX_STREAM_FILTER_SIZE] ;
+
+#define iCtx_FilterSlot(_fsContext) \
+	(((ULONG)((ULONG_PTR)(_fsContext) >> 4) * 0x9E3779B1) >> (32 - CTX_STREAM_FILTER_BITS))
+
+
+VOID
+Ctx_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine initializes the name arena.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG i ;
+
+	for (i = 0; i < CTX_NAME_CLASSES; i++)
+	{
+		ExInitializePagedLookasideList(&g_CtxNameArena[i], NULL, NULL, 0,
+			g_CtxNameClassSize[i], STRING_TAG, 0) ;
+	}
+}
+
+
+VOID
+Ctx_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine deletes the name arena.  Every stream context must have
+    been freed.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	for (i = 0; i < CTX_NAME_CLASSES; i++)
+		ExDeletePagedLookasideList(&g_CtxNameArena[i]) ;
+}
+
+
+VOID
+Ctx_QueryStats(
+    __out PCTX_STATS Stats
+    )
+{
+	Stats->StreamContexts = ReadNoFence64(&g_CtxStreamContexts) ;
+	Stats->NamesInline = ReadNoFence64(&g_CtxNamesInline) ;
+	Stats->NamesArena = ReadNoFence64(&g_CtxNamesArena) ;
+	Stats->NamesPool = ReadNoFence64(&g_CtxNamesPool) ;
+	Stats->Allocations = Stats->StreamContexts + Stats->NamesArena + Stats->NamesPool ;
+}
+
 
 VOID 
 SC_LOCK(PSTREAM_CONTEXT SC, PKIRQL OldIrql)
 {
 	if (KeGetCurrentIrql() <= APC_LEVEL)
 	{
-		SC_iLOCK(SC->Resource) ;
+		SC_iLOCK(&SC->Resource) ;
 	}
 	else 
 	{
@@ -21,7 +137,7 @@ SC_UNLOCK(PSTREAM_CONTEXT SC, KIRQL OldIrql)
 {
     if (KeGetCurrentIrql() <= APC_LEVEL)
     {
-    	SC_iUNLOCK(SC->Resource) ;
+    	SC_iUNLOCK(&SC->Resource) ;
     }
 	else
 	{
@@ -30,6 +146,103 @@ SC_UNLOCK(PSTREAM_CONTEXT SC, KIRQL OldIrql)
 }
 
 
+VOID
+SC_READ_SIZES(PSTREAM_CONTEXT SC, PLARGE_INTEGER FileValidLength, PLARGE_INTEGER FileSize)
+/*++
+
+Routine Description:
+
+    This routine reads FileValidLength and FileSize as one snapshot
+    without taking a lock or writing the context.  It retries while a
+    writer holds SC_SIZE_LOCK.  Callable at any irql <= DISPATCH_LEVEL.
+
+Arguments:
+
+    SC              - Stream context
+    FileValidLength - Receives FileValidLength, optional
+    FileSize        - Receives FileSize, optional
+
+Return Value:
+
+    None
+
+--*/
+{
+	LONG seq ;
+	LONG64 validLength ;
+	LONG64 fileSize ;
+
+	for (;;)
+	{
+		seq = ReadAcquire(&SC->SizeSequence) ;
+		if (seq & 1)
+		{
+			YieldProcessor() ;
+			continue ;
+		}
+
+		//acquire loads keep the sequence check below after them
+		validLength = ReadAcquire64(&SC->FileValidLength.QuadPart) ;
+		fileSize = ReadAcquire64(&SC->FileSize.QuadPart) ;
+
+		if (ReadNoFence(&SC->SizeSequence) == seq)
+			break ;
+	}
+
+	if (FileValidLength != NULL)
+		FileValidLength->QuadPart = validLength ;
+	if (FileSize != NULL)
+		FileSize->QuadPart = fileSize ;
+}
+
+
+VOID
+SC_SIZE_LOCK(PSTREAM_CONTEXT SC, PKIRQL OldIrql)
+/*++
+
+Routine Description:
+
+    This routine starts a change of FileValidLength or FileSize.  Writers
+    serialize on the sequence itself, at DISPATCH_LEVEL so that a reader
+    or writer never spins on a preempted writer.  Keep the section to the
+    stores.  May be taken with SC_LOCK held, not the other way round.
+
+Arguments:
+
+    SC       - Stream context
+    OldIrql  - Receives the irql to pass to SC_SIZE_UNLOCK
+
+Return Value:
+
+    None
+
+--*/
+{
+	LONG seq ;
+
+	KeRaiseIrql(DISPATCH_LEVEL, OldIrql) ;
+
+	for (;;)
+	{
+		seq = ReadNoFence(&SC->SizeSequence) ;
+		if (!(seq & 1) &&
+			InterlockedCompareExchange(&SC->SizeSequence, seq + 1, seq) == seq)
+			break ;
+
+		YieldProcessor() ;
+	}
+}
+
+
+VOID
+SC_SIZE_UNLOCK(PSTREAM_CONTEXT SC, KIRQL OldIrql)
+{
+	InterlockedIncrement(&SC->SizeSequence) ;
+
+	KeLowerIrql(OldIrql) ;
+}
+
+
 NTSTATUS
 Ctx_FindOrCreateStreamContext (
     __in PFLT_CALLBACK_DATA Data,
@@ -135,30 +348,57 @@ Note:
     The caller must synchronize access to the context. This routine does no
     synchronization
 
+    Names up to STREAM_CONTEXT_NAME_INLINE characters are stored in the
+    context, longer ones in the name arena or, past its largest class,
+    the pool.
+
 --*/
 {
     NTSTATUS status = STATUS_SUCCESS ;
+	USHORT length = DirectoryName->Length ;
+	ULONG i ;
 
     PAGED_CODE();
 
     //Free any existing name
-	if (StreamContext->FileName.Buffer != NULL) 
+	Ctx_FreeNameInStreamContext(StreamContext) ;
+
+	if (length <= sizeof(StreamContext->NameInline))
 	{
-		ExFreePoolWithTag( StreamContext->FileName.Buffer,STRING_TAG );
+		StreamContext->FileName.MaximumLength = sizeof(StreamContext->NameInline) ;
+		StreamContext->FileName.Buffer = StreamContext->NameInline ;
 
-		StreamContext->FileName.Length = StreamContext->FileName.MaximumLength = 0;
-		StreamContext->FileName.Buffer = NULL;
+		InterlockedIncrement64(&g_CtxNamesInline) ;
 	}
-
-    //Allocate and copy off the directory name
-    StreamContext->FileName.MaximumLength = DirectoryName->Length;
-    StreamContext->FileName.Buffer = ExAllocatePoolWithTag( PagedPool,
-                                            StreamContext->FileName.MaximumLength,
-                                            STRING_TAG );
-    if (StreamContext->FileName.Buffer == NULL) 
+	else
 	{
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+		for (i = 0; i < CTX_NAME_CLASSES; i++)
+		{
+			if (length <= g_CtxNameClassSize[i])
+				break ;
+		}
+
+		if (i < CTX_NAME_CLASSES)
+		{
+			StreamContext->FileName.MaximumLength = g_CtxNameClassSize[i] ;
+			StreamContext->FileName.Buffer = ExAllocateFromPagedLookasideList(&g_CtxNameArena[i]) ;
+
+			InterlockedIncrement64(&g_CtxNamesArena) ;
+		}
+		else
+		{
+			StreamContext->FileName.MaximumLength = length ;
+			StreamContext->FileName.Buffer = ExAllocatePoolWithTag( PagedPool, length, STRING_TAG ) ;
+
+			InterlockedIncrement64(&g_CtxNamesPool) ;
+		}
+
+		if (StreamContext->FileName.Buffer == NULL)
+		{
+			StreamContext->FileName.MaximumLength = 0 ;
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
 
     RtlCopyUnicodeString(&StreamContext->FileName, DirectoryName);
 
@@ -166,6 +406,49 @@ Note:
 }
 
 
+VOID
+Ctx_FreeNameInStreamContext (
+    __inout PSTREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the name of a stream context, wherever
+    Ctx_UpdateNameInStreamContext stored it.
+
+Arguments:
+
+    StreamContext - Stream context
+
+Return Value:
+
+    None
+
+--*/
+{
+	PWCHAR buffer = StreamContext->FileName.Buffer ;
+	ULONG i ;
+
+	if (buffer != NULL && buffer != StreamContext->NameInline)
+	{
+		for (i = 0; i < CTX_NAME_CLASSES; i++)
+		{
+			if (StreamContext->FileName.MaximumLength == g_CtxNameClassSize[i])
+				break ;
+		}
+
+		if (i < CTX_NAME_CLASSES)
+			ExFreeToPagedLookasideList(&g_CtxNameArena[i], buffer) ;
+		else
+			ExFreePoolWithTag(buffer, STRING_TAG) ;
+	}
+
+	StreamContext->FileName.Length = StreamContext->FileName.MaximumLength = 0 ;
+	StreamContext->FileName.Buffer = NULL ;
+}
+
+
 NTSTATUS
 iCtx_CreateStreamContext (
     __in PFLT_RELATED_OBJECTS FltObjects,
@@ -203,20 +486,203 @@ Return Value:
         return status;
     }
 
+	//FltMgr serves fixed size contexts from its own lookaside list
+	InterlockedIncrement64(&g_CtxStreamContexts) ;
+
     //  Initialize the newly created context
     RtlZeroMemory( streamContext, STREAM_CONTEXT_SIZE );
 
-    streamContext->Resource = ExAllocatePoolWithTag( NonPagedPool, sizeof( ERESOURCE ),RESOURCE_TAG );
-    if(streamContext->Resource == NULL)
-	{
-        FltReleaseContext( streamContext );
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-    ExInitializeResourceLite( streamContext->Resource );
+	//the lock lives in the context, no allocation can fail past here
+    ExInitializeResourceLite( &streamContext->Resource );
+    ExInitializeResourceLite( &streamContext->ProbeLock );
 
 	KeInitializeSpinLock(&streamContext->Resource1) ; 
 
+	RangeLock_Init(&streamContext->RangeLock) ;
+
     *StreamContext = streamContext;
 
     return STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+
+VOID
+Ctx_MarkStreamHandled (
+    __inout PSTREAM_CONTEXT StreamContext,
+    __in PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine counts a stream in the handled stream filter.  Call it
+    with the context locked, BEFORE setting SC_FLAG_FILE_CRYPT and the
+    flags that go with it: a pre-operation seeing them set must not have
+    been turned away by Ctx_MayBeHandled.
+
+Arguments:
+
+    StreamContext - Context of the stream, locked
+    FileObject    - Any file object of the stream
+
+Return Value:
+
+    None
+
+--*/
+{
+	if (SC_TEST_FLAG(StreamContext, SC_FLAG_FILTERED))
+		return ;
+
+	StreamContext->uFilterSlot = iCtx_FilterSlot(FileObject->FsContext) ;
+	SC_SET_FLAG(StreamContext, SC_FLAG_FILTERED) ;
+
+	InterlockedIncrement(&g_CtxStreamFilter[StreamContext->uFilterSlot]) ;
+}
+
+
+VOID
+Ctx_UnmarkStreamHandled (
+    __inout PSTREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine removes a stream from the handled stream filter.  Called
+    when its context is freed.
+
+Arguments:
+
+    StreamContext - Context of the stream
+
+Return Value:
+
+    None
+
+--*/
+{
+	if (!SC_TEST_FLAG(StreamContext, SC_FLAG_FILTERED))
+		return ;
+
+	SC_CLEAR_FLAG(StreamContext, SC_FLAG_FILTERED) ;
+
+	InterlockedDecrement(&g_CtxStreamFilter[StreamContext->uFilterSlot]) ;
+}
+
+
+BOOLEAN
+Ctx_MayBeHandled (
+    __in PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine tells, with one read and no lock, whether a stream may
+    have a context of an encrypted file.  FALSE is exact; TRUE may be
+    caused by another stream sharing the slot.
+
+Arguments:
+
+    FileObject - File object of the operation
+
+Return Value:
+
+    FALSE if the stream is certainly not handled
+
+--*/
+{
+	return (BOOLEAN)(ReadNoFence(&g_CtxStreamFilter[iCtx_FilterSlot(FileObject->FsContext)]) != 0) ;
+}
+
+
+VOID
+Ctx_MarkStreamPending (
+    __inout PSTREAM_CONTEXT StreamContext,
+    __in PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine counts a stream in the pending stream filter.  Call it
+    with the context locked, before the stream can be read or written
+    through FileObject.
+
+Arguments:
+
+    StreamContext - Context of the stream, locked
+    FileObject    - File object being opened
+
+Return Value:
+
+    None
+
+--*/
+{
+	if (SC_TEST_FLAG(StreamContext, SC_FLAG_PENDING))
+		return ;
+
+	//the same slot as the handled stream filter, FsContext does not change
+	StreamContext->uFilterSlot = iCtx_FilterSlot(FileObject->FsContext) ;
+	SC_SET_FLAG(StreamContext, SC_FLAG_PENDING) ;
+
+	InterlockedIncrement(&g_CtxPendingFilter[StreamContext->uFilterSlot]) ;
+}
+
+
+VOID
+Ctx_UnmarkStreamPending (
+    __inout PSTREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine removes a stream from the pending stream filter, once
+    its trailer was looked for or when its context is freed.  Call it
+    with the context locked, or from its cleanup.
+
+Arguments:
+
+    StreamContext - Context of the stream
+
+Return Value:
+
+    None
+
+--*/
+{
+	if (!SC_TEST_FLAG(StreamContext, SC_FLAG_PENDING))
+		return ;
+
+	SC_CLEAR_FLAG(StreamContext, SC_FLAG_PENDING) ;
+
+	InterlockedDecrement(&g_CtxPendingFilter[StreamContext->uFilterSlot]) ;
+}
+
+
+BOOLEAN
+Ctx_MayBePending (
+    __in PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine tells, with one read and no lock, whether a stream may
+    still have its trailer to read.  FALSE is exact.
+
+Arguments:
+
+    FileObject - File object of the operation
+
+Return Value:
+
+    FALSE if the trailer of the stream was certainly looked for
+
+--*/
+{
+	return (BOOLEAN)(ReadNoFence(&g_CtxPendingFilter[iCtx_FilterSlot(FileObject->FsContext)]) != 0) ;
+}
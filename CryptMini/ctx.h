@@ -5,9 +5,46 @@
 //
 
 #define STRING_TAG                        'tSxC'
-#define RESOURCE_TAG                      'cRxC'
 #define STREAM_CONTEXT_TAG                'cSxC'
 
+//
+//  Size classes of the name arena, in bytes.  Names longer than the
+//  stream context holds inline take the smallest class they fit, longer
+//  ones come from the pool.
+//
+
+#define CTX_NAME_CLASSES                  2
+#define CTX_NAME_CLASS_SMALL              512
+#define CTX_NAME_CLASS_LARGE              2048
+
+typedef struct _CTX_STATS {
+
+	//stream contexts created
+	LONG64 StreamContexts ;
+
+	//names stored in the stream context
+	LONG64 NamesInline ;
+
+	//names taken from the name arena
+	LONG64 NamesArena ;
+
+	//names allocated from the pool
+	LONG64 NamesPool ;
+
+	//allocations made for stream contexts: the contexts, arena and pool
+	//names
+	LONG64 Allocations ;
+
+} CTX_STATS, *PCTX_STATS ;
+
+//
+//  Slots of the handled and pending stream filters, see Ctx_MayBeHandled
+//  and Ctx_MayBePending
+//
+
+#define CTX_STREAM_FILTER_BITS            12
+#define CTX_STREAM_FILTER_SIZE            (1 << CTX_STREAM_FILTER_BITS)
+
 #define SC_iLOCK(SC)\
 	(ASSERT(KeGetCurrentIrql() <= APC_LEVEL), \
 	ASSERT(ExIsResourceAcquiredExclusiveLite(SC) || \
@@ -22,12 +59,36 @@
 	 ExReleaseResourceLite(SC),\
 	 KeLeaveCriticalRegion())
 
+VOID
+Ctx_Init(
+    VOID
+    ) ;
+
+VOID
+Ctx_Uninit(
+    VOID
+    ) ;
+
+VOID
+Ctx_QueryStats(
+    __out PCTX_STATS Stats
+    ) ;
+
 VOID 
 SC_LOCK(PSTREAM_CONTEXT SC, PKIRQL OldIrql) ;
 
 VOID 
 SC_UNLOCK(PSTREAM_CONTEXT SC, KIRQL OldIrql) ;
 
+VOID
+SC_READ_SIZES(PSTREAM_CONTEXT SC, PLARGE_INTEGER FileValidLength, PLARGE_INTEGER FileSize) ;
+
+VOID
+SC_SIZE_LOCK(PSTREAM_CONTEXT SC, PKIRQL OldIrql) ;
+
+VOID
+SC_SIZE_UNLOCK(PSTREAM_CONTEXT SC, KIRQL OldIrql) ;
+
 NTSTATUS
 Ctx_FindOrCreateStreamContext (
     __in PFLT_CALLBACK_DATA Cbd,
@@ -41,4 +102,41 @@ NTSTATUS
 Ctx_UpdateNameInStreamContext (
     __in PUNICODE_STRING DirectoryName,
     __inout PSTREAM_CONTEXT StreamContext
-    );
\ No newline at end of file
+    );
+
+VOID
+Ctx_FreeNameInStreamContext (
+    __inout PSTREAM_CONTEXT StreamContext
+    ) ;
+
+VOID
+Ctx_MarkStreamHandled (
+    __inout PSTREAM_CONTEXT StreamContext,
+    __in PFILE_OBJECT FileObject
+    ) ;
+
+VOID
+Ctx_UnmarkStreamHandled (
+    __inout PSTREAM_CONTEXT StreamContext
+    ) ;
+
+BOOLEAN
+Ctx_MayBeHandled (
+    __in PFILE_OBJECT FileObject
+    ) ;
+
+VOID
+Ctx_MarkStreamPending (
+    __inout PSTREAM_CONTEXT StreamContext,
+    __in PFILE_OBJECT FileObject
+    ) ;
+
+VOID
+Ctx_UnmarkStreamPending (
+    __inout PSTREAM_CONTEXT StreamContext
+    ) ;
+
+BOOLEAN
+Ctx_MayBePending (
+    __in PFILE_OBJECT FileObject
+    ) ;
\ No newline at end of file
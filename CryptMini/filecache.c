@@ -0,0 +1,512 @@
+/*++
+
+Module Name:
+
+    filecache.c
+
+Abstract:
+
+    Per-volume cache of file flags, keyed by file id.  Opening a file
+    costs a trailer read to find out whether it is encrypted; a file
+    reopened while unchanged gets the flag read the last time instead.
+    Plain text files, by far the most opened, are cached as well, with no
+    flag: reopening them reads nothing.
+
+    Each entry carries the stamp of the file (end of file, last write and
+    change times) taken before its trailer was read.  A lookup only hits
+    when the file still has that stamp; any write, truncation or rename
+    over it changes one of them, and the entry is replaced by the next
+    insert.  Stamps may lag behind writes still in the cache, so the entry
+    of a file opened for write is also removed when its stream context
+    goes, see SC_FLAG_WRITER.
+
+    The table is FILE_CACHE_SETS sets of FILE_CACHE_WAYS entries; the file
+    id selects the set.  Readers take no lock: an entry is copied under
+    its sequence count, odd while a writer changes it, and the copy is
+    retried if the count moved.  Writers of a set hold its spin lock, so
+    one file never has two entries.  A full set evicts by CLOCK.
+
+Environment:
+
+    Kernel mode.  Lookups and updates at IRQL <= DISPATCH_LEVEL, file
+    queries at PASSIVE_LEVEL.
+
+--*/
+#include "filecache.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FileCache_Create)
+#pragma alloc_text(PAGE, FileCache_Delete)
+#pragma alloc_text(PAGE, FileCache_QueryFile)
+#endif
+
+#define FILE_CACHE_SET_BITS               8
+
+C_ASSERT(FILE_CACHE_SETS == (1 << FILE_CACHE_SET_BITS)) ;
+
+typedef struct _FILE_CACHE_ENTRY {
+
+	//odd while the entry changes
+	volatile LONG Sequence ;
+
+	//CLOCK bit, set on every hit
+	volatile LONG Referenced ;
+
+	BOOLEAN bValid ;
+
+	//FALSE for a plain text file, Flag is then unused
+	BOOLEAN bEncrypted ;
+
+	FILE_CACHE_ID Id ;
+
+	FILE_CACHE_STAMP Stamp ;
+
+	FILE_FLAG Flag ;
+
+} FILE_CACHE_ENTRY, *PFILE_CACHE_ENTRY ;
+
+typedef struct _FILE_CACHE {
+
+	FILE_CACHE_ENTRY Entries[FILE_CACHE_SETS][FILE_CACHE_WAYS] ;
+
+	//writer lock of each set
+	KSPIN_LOCK SetLock[FILE_CACHE_SETS] ;
+
+	//CLOCK hand of each set, under its lock
+	ULONG Hand[FILE_CACHE_SETS] ;
+
+	volatile LONG64 Hits ;
+
+	volatile LONG64 PlaintextHits ;
+
+	volatile LONG64 Misses ;
+
+	volatile LONG64 Evictions ;
+
+	volatile LONG64 Invalidations ;
+
+} FILE_CACHE ;
+
+#define iFileCache_Set(_id) \
+	((ULONG)((((_id)->Low ^ (_id)->High) * 0x9E3779B97F4A7C15ULL) >> (64 - FILE_CACHE_SET_BITS)))
+
+#define iFileCache_SameId(_a, _b) \
+	((_a)->Low == (_b)->Low && (_a)->High == (_b)->High)
+
+
+PFILE_CACHE
+FileCache_Create(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates an empty cache for a volume.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The cache, NULL if out of memory
+
+--*/
+{
+	PFILE_CACHE cache ;
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	cache = ExAllocatePoolWithTag(NonPagedPool, sizeof(FILE_CACHE), FILE_CACHE_TAG) ;
+	if (cache == NULL)
+		return NULL ;
+
+	RtlZeroMemory(cache, sizeof(FILE_CACHE)) ;
+
+	for (i = 0; i < FILE_CACHE_SETS; i++)
+		KeInitializeSpinLock(&cache->SetLock[i]) ;
+
+	return cache ;
+}
+
+
+VOID
+FileCache_Delete(
+    __in PFILE_CACHE Cache
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the cache of a volume.  Called when its volume
+    context is freed.
+
+Arguments:
+
+    Cache - Cache to free
+
+Return Value:
+
+    None
+
+--*/
+{
+	PAGED_CODE() ;
+
+	ExFreePoolWithTag(Cache, FILE_CACHE_TAG) ;
+}
+
+
+NTSTATUS
+FileCache_QueryFile(
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __out PFILE_CACHE_ID Id,
+    __out PFILE_CACHE_STAMP Stamp
+    )
+/*++
+
+Routine Description:
+
+    This routine queries the id and the current stamp of an open file.
+    Query the stamp before reading the flag to cache: a change in between
+    then only costs a miss.
+
+Arguments:
+
+    Instance   - Our instance on the volume
+    FileObject - File object of the file
+    Id         - Receives the file id, 128-bit where the file system has
+                 one
+    Stamp      - Receives the stamp
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+	FILE_INTERNAL_INFORMATION internalInfo ;
+	FILE_NETWORK_OPEN_INFORMATION openInfo ;
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+	FILE_ID_INFORMATION idInfo ;
+#endif
+
+	PAGED_CODE() ;
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+	status = FltQueryInformationFile(Instance, FileObject, &idInfo, sizeof(idInfo), FileIdInformation, NULL) ;
+	if (NT_SUCCESS(status))
+	{
+		C_ASSERT(sizeof(idInfo.FileId) == sizeof(FILE_CACHE_ID)) ;
+		RtlCopyMemory(Id, &idInfo.FileId, sizeof(FILE_CACHE_ID)) ;
+	}
+	else
+#endif
+	{
+		status = FltQueryInformationFile(Instance, FileObject, &internalInfo, sizeof(internalInfo), FileInternalInformation, NULL) ;
+		if (!NT_SUCCESS(status))
+			return status ;
+
+		Id->Low = (ULONGLONG)internalInfo.IndexNumber.QuadPart ;
+		Id->High = 0 ;
+	}
+
+	status = FltQueryInformationFile(Instance, FileObject, &openInfo, sizeof(openInfo), FileNetworkOpenInformation, NULL) ;
+	if (!NT_SUCCESS(status))
+		return status ;
+
+	Stamp->EndOfFile = openInfo.EndOfFile ;
+	Stamp->LastWriteTime = openInfo.LastWriteTime ;
+	Stamp->ChangeTime = openInfo.ChangeTime ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+static VOID
+iFileCache_Read(
+    __in PFILE_CACHE_ENTRY Entry,
+    __out PFILE_CACHE_ENTRY Copy
+    )
+/*++
+
+Routine Description:
+
+    This routine copies an entry no writer was changing meanwhile.
+
+Arguments:
+
+    Entry - Entry in the table
+    Copy  - Receives the copy
+
+Return Value:
+
+    None
+
+--*/
+{
+	LONG seq ;
+
+	for (;;)
+	{
+		seq = ReadAcquire(&Entry->Sequence) ;
+		if (seq & 1)
+		{
+			YieldProcessor() ;
+			continue ;
+		}
+
+		RtlCopyMemory(Copy, (PVOID)Entry, sizeof(FILE_CACHE_ENTRY)) ;
+
+		//the copy must be complete before the count is checked again
+		KeMemoryBarrier() ;
+
+		if (ReadNoFence(&Entry->Sequence) == seq)
+			break ;
+	}
+}
+
+
+static VOID
+iFileCache_Write(
+    __inout PFILE_CACHE_ENTRY Entry,
+    __in_opt PFILE_CACHE_ID Id,
+    __in_opt PFILE_CACHE_STAMP Stamp,
+    __in_opt PFILE_FLAG Flag
+    )
+/*++
+
+Routine Description:
+
+    This routine fills an entry, or empties it when Id is NULL.  Called
+    with the lock of its set held.
+
+Arguments:
+
+    Entry - Entry in the table
+    Id    - File id, NULL to empty the entry
+    Stamp - Stamp of the file
+    Flag  - File flag of the file, NULL for a plain text file
+
+Return Value:
+
+    None
+
+--*/
+{
+	InterlockedIncrement(&Entry->Sequence) ;
+
+	Entry->bValid = (BOOLEAN)(Id != NULL) ;
+
+	if (Id != NULL)
+	{
+		Entry->Id = *Id ;
+		Entry->Stamp = *Stamp ;
+		Entry->bEncrypted = (BOOLEAN)(Flag != NULL) ;
+		if (Flag != NULL)
+			RtlCopyMemory(&Entry->Flag, Flag, sizeof(FILE_FLAG)) ;
+	}
+
+	InterlockedIncrement(&Entry->Sequence) ;
+}
+
+
+BOOLEAN
+FileCache_Lookup(
+    __in PFILE_CACHE Cache,
+    __in PFILE_CACHE_ID Id,
+    __in PFILE_CACHE_STAMP Stamp,
+    __out PBOOLEAN Encrypted,
+    __out PFILE_FLAG Flag
+    )
+/*++
+
+Routine Description:
+
+    This routine looks the flag of a file up.
+
+Arguments:
+
+    Cache     - Cache of the volume
+    Id        - File id, from FileCache_QueryFile
+    Stamp     - Current stamp of the file, from FileCache_QueryFile
+    Encrypted - Receives FALSE if the file is cached as plain text
+    Flag      - Receives the cached flag of an encrypted file
+
+Return Value:
+
+    TRUE if the file is cached with the same stamp
+
+--*/
+{
+	PFILE_CACHE_ENTRY entry ;
+	FILE_CACHE_ENTRY copy ;
+	ULONG way ;
+
+	entry = Cache->Entries[iFileCache_Set(Id)] ;
+
+	for (way = 0; way < FILE_CACHE_WAYS; way++, entry++)
+	{
+		//cheap look before copying the entry, it is checked again
+		if (*(volatile ULONGLONG *)&entry->Id.Low != Id->Low)
+			continue ;
+
+		iFileCache_Read(entry, &copy) ;
+
+		if (!copy.bValid || !iFileCache_SameId(&copy.Id, Id))
+			continue ;
+
+		//a file has one entry; one for a file since changed is useless
+		if (!RtlEqualMemory(&copy.Stamp, Stamp, sizeof(FILE_CACHE_STAMP)))
+			break ;
+
+		*Encrypted = copy.bEncrypted ;
+		if (copy.bEncrypted)
+			RtlCopyMemory(Flag, &copy.Flag, sizeof(FILE_FLAG)) ;
+
+		if (!ReadNoFence(&entry->Referenced))
+			InterlockedExchange(&entry->Referenced, 1) ;
+
+		InterlockedIncrement64(copy.bEncrypted ? &Cache->Hits : &Cache->PlaintextHits) ;
+		return TRUE ;
+	}
+
+	InterlockedIncrement64(&Cache->Misses) ;
+	return FALSE ;
+}
+
+
+VOID
+FileCache_Insert(
+    __in PFILE_CACHE Cache,
+    __in PFILE_CACHE_ID Id,
+    __in PFILE_CACHE_STAMP Stamp,
+    __in_opt PFILE_FLAG Flag
+    )
+/*++
+
+Routine Description:
+
+    This routine caches the flag of a file, replacing its entry if it
+    has one.
+
+Arguments:
+
+    Cache - Cache of the volume
+    Id    - File id, from FileCache_QueryFile
+    Stamp - Stamp of the file queried before its flag was read
+    Flag  - File flag read, NULL if the file has no trailer
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG set = iFileCache_Set(Id) ;
+	PFILE_CACHE_ENTRY entries = Cache->Entries[set] ;
+	PFILE_CACHE_ENTRY victim = NULL ;
+	KIRQL oldIrql ;
+	ULONG way ;
+
+	KeAcquireSpinLock(&Cache->SetLock[set], &oldIrql) ;
+
+	for (way = 0; way < FILE_CACHE_WAYS; way++)
+	{
+		if (entries[way].bValid && iFileCache_SameId(&entries[way].Id, Id))
+		{
+			victim = &entries[way] ;
+			break ;
+		}
+	}
+
+	//CLOCK: clear referenced bits until an unreferenced entry comes up,
+	//at most one turn
+	while (victim == NULL)
+	{
+		way = Cache->Hand[set] ;
+		Cache->Hand[set] = (way + 1) % FILE_CACHE_WAYS ;
+
+		if (!entries[way].bValid)
+		{
+			victim = &entries[way] ;
+		}
+		else if (entries[way].Referenced)
+		{
+			InterlockedExchange(&entries[way].Referenced, 0) ;
+		}
+		else
+		{
+			victim = &entries[way] ;
+			InterlockedIncrement64(&Cache->Evictions) ;
+		}
+	}
+
+	iFileCache_Write(victim, Id, Stamp, Flag) ;
+
+	//a new entry survives one turn of the hand
+	InterlockedExchange(&victim->Referenced, 1) ;
+
+	KeReleaseSpinLock(&Cache->SetLock[set], oldIrql) ;
+}
+
+
+VOID
+FileCache_Remove(
+    __in PFILE_CACHE Cache,
+    __in PFILE_CACHE_ID Id
+    )
+/*++
+
+Routine Description:
+
+    This routine drops the entry of a file, if any.
+
+Arguments:
+
+    Cache - Cache of the volume
+    Id    - File id
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG set = iFileCache_Set(Id) ;
+	PFILE_CACHE_ENTRY entries = Cache->Entries[set] ;
+	KIRQL oldIrql ;
+	ULONG way ;
+
+	KeAcquireSpinLock(&Cache->SetLock[set], &oldIrql) ;
+
+	for (way = 0; way < FILE_CACHE_WAYS; way++)
+	{
+		if (entries[way].bValid && iFileCache_SameId(&entries[way].Id, Id))
+		{
+			iFileCache_Write(&entries[way], NULL, NULL, NULL) ;
+			InterlockedIncrement64(&Cache->Invalidations) ;
+			break ;
+		}
+	}
+
+	KeReleaseSpinLock(&Cache->SetLock[set], oldIrql) ;
+}
+
+
+VOID
+FileCache_QueryStats(
+    __in PFILE_CACHE Cache,
+    __out PFILE_CACHE_STATS Stats
+    )
+{
+	Stats->Hits = ReadNoFence64(&Cache->Hits) ;
+	Stats->PlaintextHits = ReadNoFence64(&Cache->PlaintextHits) ;
+	Stats->Misses = ReadNoFence64(&Cache->Misses) ;
+	Stats->Evictions = ReadNoFence64(&Cache->Evictions) ;
+	Stats->Invalidations = ReadNoFence64(&Cache->Invalidations) ;
+}
@@ -0,0 +1,96 @@
+#include "common.h"
+
+//
+//  Per-volume cache of the file flag of recently opened files, keyed by
+//  file id, so reopening a file skips the trailer read.  Files found
+//  without a trailer are cached as plain text.
+//
+//  Lookups are lock-free: each entry is read under its own sequence
+//  count.  Writers of a set serialize on a per-set bit lock.
+//
+
+#define FILE_CACHE_TAG                    'cFxC'
+
+#define FILE_CACHE_SETS                   256
+#define FILE_CACHE_WAYS                   8
+
+//
+//  What the file looked like when its flag was read.  A cached flag is
+//  only used while the file still matches it.
+//
+
+typedef struct _FILE_CACHE_STAMP {
+
+	LARGE_INTEGER EndOfFile ;
+	LARGE_INTEGER LastWriteTime ;
+	LARGE_INTEGER ChangeTime ;
+
+} FILE_CACHE_STAMP, *PFILE_CACHE_STAMP ;
+
+typedef struct _FILE_CACHE_STATS {
+
+	//hits on encrypted files
+	LONG64 Hits ;
+
+	//hits on plain text files
+	LONG64 PlaintextHits ;
+
+	//including entries whose file changed
+	LONG64 Misses ;
+
+	//valid entries dropped to make room for another file
+	LONG64 Evictions ;
+
+	//valid entries dropped by FileCache_Remove
+	LONG64 Invalidations ;
+
+} FILE_CACHE_STATS, *PFILE_CACHE_STATS ;
+
+typedef struct _FILE_CACHE *PFILE_CACHE ;
+
+PFILE_CACHE
+FileCache_Create(
+    VOID
+    ) ;
+
+VOID
+FileCache_Delete(
+    __in PFILE_CACHE Cache
+    ) ;
+
+NTSTATUS
+FileCache_QueryFile(
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __out PFILE_CACHE_ID Id,
+    __out PFILE_CACHE_STAMP Stamp
+    ) ;
+
+BOOLEAN
+FileCache_Lookup(
+    __in PFILE_CACHE Cache,
+    __in PFILE_CACHE_ID Id,
+    __in PFILE_CACHE_STAMP Stamp,
+    __out PBOOLEAN Encrypted,
+    __out PFILE_FLAG Flag
+    ) ;
+
+VOID
+FileCache_Insert(
+    __in PFILE_CACHE Cache,
+    __in PFILE_CACHE_ID Id,
+    __in PFILE_CACHE_STAMP Stamp,
+    __in_opt PFILE_FLAG Flag
+    ) ;
+
+VOID
+FileCache_Remove(
+    __in PFILE_CACHE Cache,
+    __in PFILE_CACHE_ID Id
+    ) ;
+
+VOID
+FileCache_QueryStats(
+    __in PFILE_CACHE Cache,
+    __out PFILE_CACHE_STATS Stats
+    ) ;
@@ -0,0 +1,314 @@
+/*++
+
+Module Name:
+
+    flagfmt.c
+
+Abstract:
+
+    Reading and writing the on-disk file flag, see flagfmt.h for the
+    formats, and CRC32C.
+
+    The scalar CRC32C kernel uses a 256 entry table built by FlagFmt_Init.
+    The SSE4.2 kernel uses the CRC32 instruction, 8 bytes at a time on
+    64-bit processors.
+
+Environment:
+
+    Kernel mode or user mode.
+
+--*/
+#include "flagfmt.h"
+
+#if FLAGFMT_HAVE_SSE42
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define FLAGFMT_SSE42_FN
+#else
+#include <cpuid.h>
+#define FLAGFMT_SSE42_FN __attribute__((target("sse4.2")))
+#endif
+#include <nmmintrin.h>
+#endif
+
+typedef unsigned int       flagfmt_u32 ;
+typedef unsigned long long flagfmt_u64 ;
+
+//CRC32C (Castagnoli) polynomial, reflected
+#define FLAGFMT_CRC32C_POLY               0x82F63B78
+
+//offsets of the version 1 and 2 fields
+#define FLAGFMT_V1_KEY_HASH               8
+#define FLAGFMT_V1_NONCE                  28
+#define FLAGFMT_V1_VALID_LENGTH           44
+
+#define FLAGFMT_V2_LENGTH                 8
+#define FLAGFMT_V2_CIPHER_ID              12
+#define FLAGFMT_V2_VALID_LENGTH           16
+#define FLAGFMT_V2_NONCE                  24
+#define FLAGFMT_V2_KEY_HASH               40
+#define FLAGFMT_V2_CRC                    (FLAGFMT_V2_SIZE - 4)
+
+static FLAGFMT_IMPL g_FlagFmtImpl = FlagFmtImplScalar ;
+
+static flagfmt_u32 g_FlagFmtCrcTable[256] ;
+
+
+/*************************************************************************
+    Byte order helpers
+*************************************************************************/
+
+static flagfmt_u32
+iFlagFmt_Load32(const unsigned char *p)
+{
+	return (flagfmt_u32)p[0] | ((flagfmt_u32)p[1] << 8) | ((flagfmt_u32)p[2] << 16) | ((flagfmt_u32)p[3] << 24) ;
+}
+
+static void
+iFlagFmt_Store32(unsigned char *p, flagfmt_u32 v)
+{
+	p[0] = (unsigned char)v ;
+	p[1] = (unsigned char)(v >> 8) ;
+	p[2] = (unsigned char)(v >> 16) ;
+	p[3] = (unsigned char)(v >> 24) ;
+}
+
+static flagfmt_u64
+iFlagFmt_Load64(const unsigned char *p)
+{
+	return (flagfmt_u64)iFlagFmt_Load32(p) | ((flagfmt_u64)iFlagFmt_Load32(p + 4) << 32) ;
+}
+
+static void
+iFlagFmt_Store64(unsigned char *p, flagfmt_u64 v)
+{
+	iFlagFmt_Store32(p, (flagfmt_u32)v) ;
+	iFlagFmt_Store32(p + 4, (flagfmt_u32)(v >> 32)) ;
+}
+
+static void
+iFlagFmt_Copy(unsigned char *Dst, const unsigned char *Src, size_t Length)
+{
+	size_t i ;
+
+	for (i = 0; i < Length; i++)
+		Dst[i] = Src[i] ;
+}
+
+
+/*************************************************************************
+    CRC32C kernels
+*************************************************************************/
+
+static flagfmt_u32
+iFlagFmt_Crc32cScalar(flagfmt_u32 Crc, const unsigned char *p, size_t Length)
+{
+	while (Length--)
+		Crc = g_FlagFmtCrcTable[(Crc ^ *p++) & 0xff] ^ (Crc >> 8) ;
+
+	return Crc ;
+}
+
+#if FLAGFMT_HAVE_SSE42
+
+static int
+iFlagFmt_CpuHasSse42(void)
+{
+	unsigned int ecx ;
+
+#if defined(_MSC_VER)
+	int regs[4] ;
+
+	__cpuid(regs, 1) ;
+	ecx = (unsigned int)regs[2] ;
+#else
+	unsigned int eax, ebx, edx ;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0 ;
+#endif
+
+	//CPUID.01H:ECX.SSE4_2[bit 20]
+	return (ecx & (1u << 20)) != 0 ;
+}
+
+FLAGFMT_SSE42_FN static flagfmt_u32
+iFlagFmt_Crc32cSse42(flagfmt_u32 Crc, const unsigned char *p, size_t Length)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	flagfmt_u64 crc64 = Crc ;
+
+	for (; Length >= 8; Length -= 8, p += 8)
+		crc64 = _mm_crc32_u64(crc64, iFlagFmt_Load64(p)) ;
+
+	Crc = (flagfmt_u32)crc64 ;
+#endif
+
+	for (; Length >= 4; Length -= 4, p += 4)
+		Crc = _mm_crc32_u32(Crc, iFlagFmt_Load32(p)) ;
+
+	while (Length--)
+		Crc = _mm_crc32_u8(Crc, *p++) ;
+
+	return Crc ;
+}
+
+#endif
+
+
+/*************************************************************************
+    Interface
+*************************************************************************/
+
+void
+FlagFmt_Init(FLAGFMT_IMPL MaxImpl)
+/*++
+
+Routine Description:
+
+    Builds the CRC32C table and selects the fastest kernel supported by
+    the processor, but not faster than MaxImpl.  Must be called before
+    any other routine of this module.
+
+--*/
+{
+	flagfmt_u32 crc ;
+	int i, bit ;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = (flagfmt_u32)i ;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 1) ? FLAGFMT_CRC32C_POLY : 0) ;
+		g_FlagFmtCrcTable[i] = crc ;
+	}
+
+	g_FlagFmtImpl = FlagFmtImplScalar ;
+
+#if FLAGFMT_HAVE_SSE42
+	if (MaxImpl >= FlagFmtImplSse42 && iFlagFmt_CpuHasSse42())
+		g_FlagFmtImpl = FlagFmtImplSse42 ;
+#else
+	(void)MaxImpl ;
+#endif
+}
+
+FLAGFMT_IMPL
+FlagFmt_GetImpl(void)
+{
+	return g_FlagFmtImpl ;
+}
+
+unsigned int
+FlagFmt_Crc32c(unsigned int Crc, const void *Data, size_t Length)
+/*++
+
+Routine Description:
+
+    Continues the CRC32C of a byte string.  Pass 0 as Crc to start one;
+    the result of "123456789" is 0xE3069283.
+
+--*/
+{
+	Crc = ~Crc ;
+
+#if FLAGFMT_HAVE_SSE42
+	if (g_FlagFmtImpl == FlagFmtImplSse42)
+		return ~iFlagFmt_Crc32cSse42(Crc, (const unsigned char *)Data, Length) ;
+#endif
+
+	return ~iFlagFmt_Crc32cScalar(Crc, (const unsigned char *)Data, Length) ;
+}
+
+void
+FlagFmt_Write(const FLAGFMT_INFO *Info, unsigned char *Out)
+/*++
+
+Routine Description:
+
+    Encodes a file flag into FLAGFMT_V2_SIZE bytes: a version 3 header if
+    Info->Version is FLAGFMT_VERSION_3, otherwise a version 2 trailer.
+
+--*/
+{
+	int header = Info->Version == FLAGFMT_VERSION_3 ;
+	size_t i ;
+
+	for (i = 0; i < FLAGFMT_V2_SIZE; i++)
+		Out[i] = 0 ;
+
+	iFlagFmt_Copy(Out, (const unsigned char *)FLAGFMT_MAGIC, FLAGFMT_MAGIC_SIZE) ;
+	iFlagFmt_Store32(Out + FLAGFMT_MAGIC_SIZE, header ? FLAGFMT_VERSION_3 : FLAGFMT_VERSION_2) ;
+	iFlagFmt_Store32(Out + FLAGFMT_V2_LENGTH, FLAGFMT_V2_SIZE) ;
+	iFlagFmt_Store32(Out + FLAGFMT_V2_CIPHER_ID, Info->CipherId) ;
+	iFlagFmt_Store64(Out + FLAGFMT_V2_VALID_LENGTH, header ? 0 : (flagfmt_u64)Info->ValidLength) ;
+	iFlagFmt_Copy(Out + FLAGFMT_V2_NONCE, Info->Nonce, FLAGFMT_NONCE_SIZE) ;
+	iFlagFmt_Copy(Out + FLAGFMT_V2_KEY_HASH, Info->KeyHash, FLAGFMT_KEY_HASH_SIZE) ;
+
+	iFlagFmt_Store32(Out + FLAGFMT_V2_CRC, FlagFmt_Crc32c(0, Out, FLAGFMT_V2_CRC)) ;
+}
+
+FLAGFMT_RESULT
+FlagFmt_Read(const unsigned char *In, size_t Length, FLAGFMT_INFO *Info)
+/*++
+
+Routine Description:
+
+    Decodes the file flag at the start of In, of any version.  Length is
+    the bytes available; fewer than the size of the version found is not
+    a flag.  The valid length is not checked against the file size.
+
+--*/
+{
+	flagfmt_u32 version ;
+	size_t i ;
+
+	if (Length < FLAGFMT_MAGIC_SIZE + 4)
+		return FlagFmtNotFlag ;
+
+	for (i = 0; i < FLAGFMT_MAGIC_SIZE; i++)
+	{
+		if (In[i] != (unsigned char)FLAGFMT_MAGIC[i])
+			return FlagFmtNotFlag ;
+	}
+
+	version = iFlagFmt_Load32(In + FLAGFMT_MAGIC_SIZE) ;
+
+	switch (version)
+	{
+	case FLAGFMT_VERSION_1:
+
+		if (Length < FLAGFMT_V1_SIZE)
+			return FlagFmtNotFlag ;
+
+		Info->Version = FLAGFMT_VERSION_1 ;
+		Info->CipherId = 0 ;
+		Info->ValidLength = (long long)iFlagFmt_Load64(In + FLAGFMT_V1_VALID_LENGTH) ;
+		iFlagFmt_Copy(Info->Nonce, In + FLAGFMT_V1_NONCE, FLAGFMT_NONCE_SIZE) ;
+		iFlagFmt_Copy(Info->KeyHash, In + FLAGFMT_V1_KEY_HASH, FLAGFMT_KEY_HASH_SIZE) ;
+		break ;
+
+	case FLAGFMT_VERSION_2:
+	case FLAGFMT_VERSION_3:
+
+		if (Length < FLAGFMT_V2_SIZE)
+			return FlagFmtNotFlag ;
+
+		if (iFlagFmt_Load32(In + FLAGFMT_V2_LENGTH) != FLAGFMT_V2_SIZE ||
+			iFlagFmt_Load32(In + FLAGFMT_V2_CRC) != FlagFmt_Crc32c(0, In, FLAGFMT_V2_CRC))
+			return FlagFmtCorrupt ;
+
+		Info->Version = version ;
+		Info->CipherId = iFlagFmt_Load32(In + FLAGFMT_V2_CIPHER_ID) ;
+		Info->ValidLength = (long long)iFlagFmt_Load64(In + FLAGFMT_V2_VALID_LENGTH) ;
+		iFlagFmt_Copy(Info->Nonce, In + FLAGFMT_V2_NONCE, FLAGFMT_NONCE_SIZE) ;
+		iFlagFmt_Copy(Info->KeyHash, In + FLAGFMT_V2_KEY_HASH, FLAGFMT_KEY_HASH_SIZE) ;
+		break ;
+
+	default:
+
+		return FlagFmtUnknownVersion ;
+	}
+
+	return FlagFmtOk ;
+}
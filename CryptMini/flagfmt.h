@@ -0,0 +1,117 @@
+#ifndef _FLAGFMT_H_
+#define _FLAGFMT_H_
+
+//
+//  On-disk format of the file flag, the trailer of an encrypted file.
+//
+//  This module is freestanding like aes.h: it includes no system header
+//  besides <stddef.h>, so the driver, the user mode tools writing
+//  encrypted files and test programs share one reader and one writer.
+//
+//  Version 2 is FLAGFMT_V2_SIZE bytes at the start of the last sector of
+//  the file, all integers little endian:
+//
+//      offset  size
+//           0     4  Magic          FLAGFMT_MAGIC
+//           4     4  Version        FLAGFMT_VERSION_2
+//           8     4  Length         FLAGFMT_V2_SIZE, bytes covered by Crc
+//          12     4  CipherId       CRYPT_CIPHER_XXX
+//          16     8  ValidLength    length of the plain text
+//          24    16  Nonce          counter block of file offset 0
+//          40    20  KeyHash        digest of the key
+//          60    64  Reserved       zero
+//         124     4  Crc            CRC32C of bytes [0, 124)
+//
+//  Recognizing a trailer is one sector aligned read and one CRC32C of
+//  124 bytes, with the SSE4.2 instruction where the processor has it.
+//
+//  Version 3 is version 2 at the start of the file, a header, for volumes
+//  using the header layout (see layout.h).  Its ValidLength is 0: the
+//  plain text is the rest of the file.
+//
+//  Version 1, still read, is the packed FILE_FLAG of the first releases:
+//  Magic, Version 1, KeyHash, Nonce and ValidLength, no cipher id and no
+//  check beyond the magic.
+//
+
+#include <stddef.h>
+
+#define FLAGFMT_MAGIC                     "CMFF"
+#define FLAGFMT_MAGIC_SIZE                4
+
+#define FLAGFMT_VERSION_1                 1
+#define FLAGFMT_VERSION_2                 2
+#define FLAGFMT_VERSION_3                 3
+
+#define FLAGFMT_NONCE_SIZE                16
+#define FLAGFMT_KEY_HASH_SIZE             20
+
+#define FLAGFMT_V1_SIZE                   52
+#define FLAGFMT_V2_SIZE                   128
+
+//bytes a reader needs to tell any version
+#define FLAGFMT_MAX_SIZE                  FLAGFMT_V2_SIZE
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FLAGFMT_HAVE_SSE42 1
+#else
+#define FLAGFMT_HAVE_SSE42 0
+#endif
+
+//
+//  CRC32C kernels FlagFmt_Init can select.
+//
+
+typedef enum _FLAGFMT_IMPL {
+	FlagFmtImplScalar = 0,
+	FlagFmtImplSse42
+} FLAGFMT_IMPL;
+
+typedef enum _FLAGFMT_RESULT {
+	FlagFmtOk = 0,
+
+	//no magic: not a trailer
+	FlagFmtNotFlag,
+
+	//magic of a version this module does not know
+	FlagFmtUnknownVersion,
+
+	//a version 2 or 3 flag with a wrong length or CRC
+	FlagFmtCorrupt
+} FLAGFMT_RESULT;
+
+//
+//  A file flag, decoded.
+//
+
+typedef struct _FLAGFMT_INFO {
+
+	unsigned int Version ;
+
+	//0 for version 1, which does not record it
+	unsigned int CipherId ;
+
+	long long ValidLength ;
+
+	unsigned char Nonce[FLAGFMT_NONCE_SIZE] ;
+
+	unsigned char KeyHash[FLAGFMT_KEY_HASH_SIZE] ;
+
+} FLAGFMT_INFO, *PFLAGFMT_INFO ;
+
+void
+FlagFmt_Init(FLAGFMT_IMPL MaxImpl) ;
+
+FLAGFMT_IMPL
+FlagFmt_GetImpl(void) ;
+
+unsigned int
+FlagFmt_Crc32c(unsigned int Crc, const void *Data, size_t Length) ;
+
+void
+FlagFmt_Write(const FLAGFMT_INFO *Info, unsigned char *Out) ;
+
+FLAGFMT_RESULT
+FlagFmt_Read(const unsigned char *In, size_t Length, FLAGFMT_INFO *Info) ;
+
+#endif//_FLAGFMT_H_
@@ -0,0 +1,487 @@
+/*++
+
+Module Name:
+
+    keycache.c
+
+Abstract:
+
+    Bounded cache mapping a key digest (szKeyHash) to the expanded AES key
+    schedules of that key, so volumes and streams sharing a key - current
+    or historical - share one schedule instead of expanding it again.
+
+    The table is KEY_CACHE_SETS sets of KEY_CACHE_WAYS entries; the digest
+    selects the set.  Entry->RefCount is the only synchronization:
+
+        0   free
+        -1  owned by a thread filling (or evicting) it
+        n   valid, 1 reference held by the cache plus n - 1 holders
+
+    A reader takes a reference by compare-exchange on a valid entry and
+    then checks the digest; an entry cannot be refilled while referenced,
+    so a matching digest after the reference is taken is stable.  A miss
+    evicts an entry only the cache references, picked by CLOCK within the
+    set.  When every entry of the set is pinned the schedule is built in a
+    private pool allocation that is freed with its last reference.
+
+    Two threads missing on the same digest may both fill an entry; the
+    duplicate is harmless and ages out.
+
+Environment:
+
+    Kernel mode, IRQL <= DISPATCH_LEVEL
+
+--*/
+#include "keycache.h"
+#include "crypt.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, KeyCache_Init)
+#pragma alloc_text(PAGE, KeyCache_Uninit)
+#endif
+
+static PKEY_CACHE_ENTRY g_KeyCache = NULL ;
+
+static volatile LONG g_KeyCacheHand[KEY_CACHE_SETS] ;
+
+static KEY_CACHE_STATS g_KeyCacheStats ;
+
+//digests are SHA-1 output, any 4 bytes of them are uniformly distributed
+#define iKeyCache_Set(_hash) \
+	(&g_KeyCache[(*(UNALIGNED ULONG *)(_hash) % KEY_CACHE_SETS) * KEY_CACHE_WAYS])
+
+
+NTSTATUS
+KeyCache_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates the cache table.  Called from DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Status
+
+--*/
+{
+	SIZE_T size = KEY_CACHE_SETS * KEY_CACHE_WAYS * sizeof(KEY_CACHE_ENTRY) ;
+
+	//a multiple of PAGE_SIZE, so the table is page aligned
+	C_ASSERT((KEY_CACHE_SETS * KEY_CACHE_WAYS * sizeof(KEY_CACHE_ENTRY)) % PAGE_SIZE == 0) ;
+
+	g_KeyCache = ExAllocatePoolWithTag(NonPagedPool, size, KEY_CACHE_TAG) ;
+	if (g_KeyCache == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	RtlZeroMemory(g_KeyCache, size) ;
+	RtlZeroMemory((PVOID)g_KeyCacheHand, sizeof(g_KeyCacheHand)) ;
+	RtlZeroMemory(&g_KeyCacheStats, sizeof(g_KeyCacheStats)) ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+VOID
+KeyCache_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine wipes and frees the cache table.  Called on unload, after
+    every volume and stream context has released its entry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	if (g_KeyCache == NULL)
+		return ;
+
+	for (i = 0; i < KEY_CACHE_SETS * KEY_CACHE_WAYS; i++)
+	{
+		ASSERT(g_KeyCache[i].RefCount <= 1) ;
+	}
+
+	RtlSecureZeroMemory(g_KeyCache, KEY_CACHE_SETS * KEY_CACHE_WAYS * sizeof(KEY_CACHE_ENTRY)) ;
+	ExFreePoolWithTag(g_KeyCache, KEY_CACHE_TAG) ;
+	g_KeyCache = NULL ;
+}
+
+
+static PKEY_CACHE_ENTRY
+iKeyCache_TryReference(
+    __in PKEY_CACHE_ENTRY Entry,
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash
+    )
+/*++
+
+Routine Description:
+
+    This routine references Entry if it is valid and holds KeyHash.
+
+Arguments:
+
+    Entry   - Table entry
+    KeyHash - Key digest
+
+Return Value:
+
+    Entry, referenced, or NULL
+
+--*/
+{
+	LONG ref = Entry->RefCount ;
+	LONG old ;
+
+	//unlocked read of the digest, only to avoid dirtying the
+	//cache line of entries that cannot match
+	if (ref < 1 || *(UNALIGNED ULONG *)Entry->szKeyHash != *(UNALIGNED ULONG *)KeyHash)
+		return NULL ;
+
+	while (ref >= 1)
+	{
+		old = InterlockedCompareExchange(&Entry->RefCount, ref + 1, ref) ;
+		if (old == ref)
+		{
+			if (RtlEqualMemory(Entry->szKeyHash, KeyHash, HASH_SIZE))
+				return Entry ;
+
+			//refilled with another key before we got the reference
+			KeyCache_Release(Entry) ;
+			return NULL ;
+		}
+		ref = old ;
+	}
+
+	return NULL ;
+}
+
+
+static PKEY_CACHE_ENTRY
+iKeyCache_Claim(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash
+    )
+/*++
+
+Routine Description:
+
+    This routine takes ownership (RefCount -1) of a free entry, or of a
+    valid entry referenced only by the cache, in the set of KeyHash.
+    Valid entries are picked by CLOCK: an entry hit since the hand last
+    passed gets a second chance.
+
+Arguments:
+
+    KeyHash - Key digest
+
+Return Value:
+
+    The owned entry, or NULL if every entry of the set is pinned
+
+--*/
+{
+	PKEY_CACHE_ENTRY set = iKeyCache_Set(KeyHash) ;
+	LONG *hand = (LONG *)&g_KeyCacheHand[(set - g_KeyCache) / KEY_CACHE_WAYS] ;
+	PKEY_CACHE_ENTRY entry ;
+	LONG ref ;
+	ULONG i ;
+
+	for (i = 0; i < 2 * KEY_CACHE_WAYS; i++)
+	{
+		entry = &set[(ULONG)InterlockedIncrement(hand) % KEY_CACHE_WAYS] ;
+		ref = entry->RefCount ;
+
+		if (ref == 1 && entry->Referenced)
+		{
+			entry->Referenced = 0 ;
+			continue ;
+		}
+
+		if ((ref == 0 || ref == 1) &&
+			InterlockedCompareExchange(&entry->RefCount, -1, ref) == ref)
+		{
+			if (ref == 1)
+				InterlockedIncrement64(&g_KeyCacheStats.Evictions) ;
+			return entry ;
+		}
+	}
+
+	return NULL ;
+}
+
+
+static PKEY_CACHE_ENTRY
+iKeyCache_AllocateUncached(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates a zeroed entry outside the cache table.  Pool
+    blocks smaller than a page are only 16 byte aligned, so the block is
+    over-allocated and the entry placed on the next cache line boundary.
+
+Return Value:
+
+    The entry, or NULL
+
+--*/
+{
+	PUCHAR block ;
+	PKEY_CACHE_ENTRY entry ;
+
+	C_ASSERT(TYPE_ALIGNMENT(KEY_CACHE_ENTRY) == KEY_CACHE_ALIGNMENT) ;
+
+	block = ExAllocatePoolWithTag(NonPagedPool, sizeof(KEY_CACHE_ENTRY) + KEY_CACHE_ALIGNMENT - 1, KEY_CACHE_TAG) ;
+	if (block == NULL)
+		return NULL ;
+
+	entry = (PKEY_CACHE_ENTRY)(((ULONG_PTR)block + KEY_CACHE_ALIGNMENT - 1) & ~(ULONG_PTR)(KEY_CACHE_ALIGNMENT - 1)) ;
+
+	RtlZeroMemory(entry, sizeof(KEY_CACHE_ENTRY)) ;
+	entry->Allocation = block ;
+	entry->bUncached = TRUE ;
+
+	return entry ;
+}
+
+
+static VOID
+iKeyCache_FreeUncached(
+    __in PKEY_CACHE_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine wipes and frees an entry of iKeyCache_AllocateUncached.
+
+--*/
+{
+	PVOID block = Entry->Allocation ;
+
+	RtlSecureZeroMemory(Entry, sizeof(KEY_CACHE_ENTRY)) ;
+	ExFreePoolWithTag(block, KEY_CACHE_TAG) ;
+}
+
+
+PKEY_CACHE_ENTRY
+KeyCache_Lookup(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash
+    )
+/*++
+
+Routine Description:
+
+    This routine looks up the schedules of the key with digest KeyHash.
+    It never blocks and never allocates.
+
+Arguments:
+
+    KeyHash - Key digest
+
+Return Value:
+
+    Referenced entry, to be released with KeyCache_Release, or NULL if
+    the key is not cached
+
+--*/
+{
+	PKEY_CACHE_ENTRY set = iKeyCache_Set(KeyHash) ;
+	PKEY_CACHE_ENTRY entry ;
+	ULONG i ;
+
+	for (i = 0; i < KEY_CACHE_WAYS; i++)
+	{
+		entry = iKeyCache_TryReference(&set[i], KeyHash) ;
+		if (entry != NULL)
+		{
+			if (!entry->Referenced)
+				entry->Referenced = 1 ;
+
+			InterlockedIncrement64(&g_KeyCacheStats.Hits) ;
+			return entry ;
+		}
+	}
+
+	InterlockedIncrement64(&g_KeyCacheStats.Misses) ;
+
+	return NULL ;
+}
+
+
+NTSTATUS
+KeyCache_Reference(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash,
+    __in_bcount(MAX_KEY_LENGTH) const UCHAR *Key,
+    __deref_out PKEY_CACHE_ENTRY *Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the schedules of Key, expanding and caching them
+    if they are not cached yet.
+
+Arguments:
+
+    KeyHash - Digest of Key
+    Key     - Raw key
+    Entry   - Receives the referenced entry, to be released with
+              KeyCache_Release
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+	PKEY_CACHE_ENTRY entry ;
+
+	*Entry = KeyCache_Lookup(KeyHash) ;
+	if (*Entry != NULL)
+		return STATUS_SUCCESS ;
+
+	entry = iKeyCache_Claim(KeyHash) ;
+	if (entry == NULL)
+	{
+		entry = iKeyCache_AllocateUncached() ;
+		if (entry == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES ;
+
+		InterlockedIncrement64(&g_KeyCacheStats.Uncached) ;
+	}
+
+	status = Crypt_ExpandKey(Key, &entry->Key, &entry->TweakKey) ;
+	if (!NT_SUCCESS(status))
+	{
+		if (entry->bUncached)
+		{
+			iKeyCache_FreeUncached(entry) ;
+		}
+		else
+		{
+			RtlSecureZeroMemory(entry->szKeyHash, HASH_SIZE) ;
+			InterlockedExchange(&entry->RefCount, 0) ;
+		}
+		return status ;
+	}
+
+	RtlCopyMemory(entry->szKeyHash, KeyHash, HASH_SIZE) ;
+	entry->Referenced = 1 ;
+
+	//publish: the interlocked write orders the schedules before the count
+	InterlockedExchange(&entry->RefCount, entry->bUncached ? 1 : 2) ;
+
+	*Entry = entry ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+VOID
+KeyCache_AddRef(
+    __in PKEY_CACHE_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine takes another reference on an entry the caller already
+    holds a reference to.
+
+Arguments:
+
+    Entry - Referenced entry
+
+Return Value:
+
+    None
+
+--*/
+{
+	LONG ref = InterlockedIncrement(&Entry->RefCount) ;
+
+	ASSERT(ref > 1) ;
+	UNREFERENCED_PARAMETER(ref) ;
+}
+
+
+VOID
+KeyCache_Release(
+    __in PKEY_CACHE_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine drops a reference taken by KeyCache_Lookup or
+    KeyCache_Reference.
+
+Arguments:
+
+    Entry - Referenced entry
+
+Return Value:
+
+    None
+
+--*/
+{
+	LONG ref = InterlockedDecrement(&Entry->RefCount) ;
+
+	ASSERT(ref >= 0) ;
+
+	if (ref == 0 && Entry->bUncached)
+	{
+		iKeyCache_FreeUncached(Entry) ;
+	}
+}
+
+
+VOID
+KeyCache_QueryStats(
+    __out PKEY_CACHE_STATS Stats
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a snapshot of the cache counters.
+
+Arguments:
+
+    Stats - Receives the counters
+
+Return Value:
+
+    None
+
+--*/
+{
+	Stats->Hits = InterlockedCompareExchange64(&g_KeyCacheStats.Hits, 0, 0) ;
+	Stats->Misses = InterlockedCompareExchange64(&g_KeyCacheStats.Misses, 0, 0) ;
+	Stats->Evictions = InterlockedCompareExchange64(&g_KeyCacheStats.Evictions, 0, 0) ;
+	Stats->Uncached = InterlockedCompareExchange64(&g_KeyCacheStats.Uncached, 0, 0) ;
+}
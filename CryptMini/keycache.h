@@ -0,0 +1,67 @@
+#include "common.h"
+
+//
+//  Cache of expanded key schedules, indexed by key digest.
+//
+//  Lookups are lock-free: an entry is pinned by a reference count taken
+//  with a compare-exchange and can only be refilled once its count has
+//  dropped back to the cache's own reference.
+//
+
+#define KEY_CACHE_TAG                     'cKxC'
+
+#define KEY_CACHE_SETS                    16
+#define KEY_CACHE_WAYS                    4
+
+//alignment of every entry, one cache line
+#define KEY_CACHE_ALIGNMENT               64
+
+typedef struct _KEY_CACHE_STATS {
+
+	LONG64 Hits ;
+	LONG64 Misses ;
+
+	//valid entries dropped to make room for another key
+	LONG64 Evictions ;
+
+	//entries allocated outside the table because a set was pinned full
+	LONG64 Uncached ;
+
+} KEY_CACHE_STATS, *PKEY_CACHE_STATS ;
+
+NTSTATUS
+KeyCache_Init(
+    VOID
+    ) ;
+
+VOID
+KeyCache_Uninit(
+    VOID
+    ) ;
+
+PKEY_CACHE_ENTRY
+KeyCache_Lookup(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash
+    ) ;
+
+NTSTATUS
+KeyCache_Reference(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash,
+    __in_bcount(MAX_KEY_LENGTH) const UCHAR *Key,
+    __deref_out PKEY_CACHE_ENTRY *Entry
+    ) ;
+
+VOID
+KeyCache_AddRef(
+    __in PKEY_CACHE_ENTRY Entry
+    ) ;
+
+VOID
+KeyCache_Release(
+    __in PKEY_CACHE_ENTRY Entry
+    ) ;
+
+VOID
+KeyCache_QueryStats(
+    __out PKEY_CACHE_STATS Stats
+    ) ;
@@ -0,0 +1,303 @@
+/*++
+
+Module Name:
+
+    keylist.c
+
+Abstract:
+
+    History key list (IOCTL_SET_KEYLIST).  Files encrypted before a
+    password change carry the digest of an older key in their file flag;
+    resolving it used to mean a linear scan of every FILEKEY_INFO.
+
+    When a list is installed an open-addressing index is built over the
+    key digests: a power of two slot array at most half full, linear
+    probing, each slot holding 4 bytes of the digest and the key position.
+    Lookup cost does not depend on the length of the list.
+
+    Index and keys live in one immutable allocation, published to the
+    lookups through publish.c.  Installs are serialized by a fast mutex.
+
+Environment:
+
+    Kernel mode.  Lookups at IRQL <= DISPATCH_LEVEL, installs at
+    PASSIVE_LEVEL.
+
+--*/
+#include "keylist.h"
+#include "keycache.h"
+#include "publish.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, KeyList_Init)
+#pragma alloc_text(PAGE, KeyList_Uninit)
+#pragma alloc_text(PAGE, KeyList_Install)
+#endif
+
+typedef struct _KEYLIST_INDEX_SLOT {
+
+	// first 4 bytes of the digest
+	ULONG uTag ;
+
+	// position in Keys plus one, 0 for an empty slot
+	ULONG uIndex ;
+
+} KEYLIST_INDEX_SLOT, *PKEYLIST_INDEX_SLOT ;
+
+typedef struct _KEYLIST_TABLE {
+
+	ULONG uCount ;
+
+	// slot count - 1
+	ULONG uMask ;
+
+	PKEYLIST_INDEX_SLOT Slots ;
+
+	FILEKEY_INFO Keys[1] ;
+
+} KEYLIST_TABLE, *PKEYLIST_TABLE ;
+
+static PUBLISH g_KeyList ;
+
+static FAST_MUTEX g_KeyListMutex ;
+
+#define iKeyList_Tag(_hash) (*(UNALIGNED ULONG *)(_hash))
+
+
+static VOID
+iKeyList_FreeTable(
+    __in PVOID Context
+    )
+{
+	PKEYLIST_TABLE Table = Context ;
+
+	RtlSecureZeroMemory(Table->Keys, Table->uCount * sizeof(FILEKEY_INFO)) ;
+	ExFreePoolWithTag(Table, KEYLIST_TAG) ;
+}
+
+
+NTSTATUS
+KeyList_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up an empty list.  Called from DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+
+	status = Publish_Init(&g_KeyList, KEYLIST_TAG, iKeyList_FreeTable) ;
+	if (!NT_SUCCESS(status))
+		return status ;
+
+	ExInitializeFastMutex(&g_KeyListMutex) ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+VOID
+KeyList_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine waits for readers to leave and frees both tables.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PAGED_CODE() ;
+
+	Publish_Uninit(&g_KeyList) ;
+}
+
+
+NTSTATUS
+KeyList_Install(
+    __in_ecount(Count) const FILEKEY_INFO *Keys,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    This routine builds the digest index of a new key list and makes it
+    the one lookups see.  A digest listed twice resolves to its first
+    occurrence.
+
+Arguments:
+
+    Keys  - Key list, in system memory
+    Count - Number of keys, at most KEYLIST_MAX_KEYS
+
+Return Value:
+
+    Status
+
+--*/
+{
+	PKEYLIST_TABLE table ;
+	SIZE_T keysSize ;
+	ULONG slots = 2 ;
+	ULONG i, j ;
+
+	PAGED_CODE() ;
+
+	if (Count > KEYLIST_MAX_KEYS)
+		return STATUS_INVALID_PARAMETER ;
+
+	while (slots < Count * 2)
+		slots <<= 1 ;
+
+	keysSize = FIELD_OFFSET(KEYLIST_TABLE, Keys) + max(Count, 1) * sizeof(FILEKEY_INFO) ;
+	keysSize = ALIGN_UP_BY(keysSize, sizeof(KEYLIST_INDEX_SLOT)) ;
+
+	table = ExAllocatePoolWithTag(NonPagedPool, keysSize + slots * sizeof(KEYLIST_INDEX_SLOT), KEYLIST_TAG) ;
+	if (table == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	table->uCount = Count ;
+	table->uMask = slots - 1 ;
+	table->Slots = (PKEYLIST_INDEX_SLOT)((PUCHAR)table + keysSize) ;
+	RtlZeroMemory(table->Slots, slots * sizeof(KEYLIST_INDEX_SLOT)) ;
+	RtlCopyMemory(table->Keys, Keys, Count * sizeof(FILEKEY_INFO)) ;
+
+	for (i = 0; i < Count; i++)
+	{
+		ULONG tag = iKeyList_Tag(table->Keys[i].szCurKeyHash) ;
+
+		for (j = tag & table->uMask; table->Slots[j].uIndex != 0; j = (j + 1) & table->uMask)
+		{
+			if (table->Slots[j].uTag == tag &&
+				RtlEqualMemory(table->Keys[table->Slots[j].uIndex - 1].szCurKeyHash, table->Keys[i].szCurKeyHash, HASH_SIZE))
+				break ;
+		}
+
+		if (table->Slots[j].uIndex == 0)
+		{
+			table->Slots[j].uTag = tag ;
+			table->Slots[j].uIndex = i + 1 ;
+		}
+	}
+
+	ExAcquireFastMutex(&g_KeyListMutex) ;
+	Publish_Replace(&g_KeyList, table) ;
+	ExReleaseFastMutex(&g_KeyListMutex) ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+BOOLEAN
+KeyList_Lookup(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash,
+    __out_bcount(MAX_KEY_LENGTH) PUCHAR Key
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the key with digest KeyHash in the installed key
+    list.  It never blocks.
+
+Arguments:
+
+    KeyHash - Key digest, e.g. from a file flag
+    Key     - Receives the key
+
+Return Value:
+
+    TRUE if found
+
+--*/
+{
+	PPUBLISH_SLOT slot ;
+	PKEYLIST_TABLE table ;
+	PKEYLIST_INDEX_SLOT entry ;
+	ULONG tag = iKeyList_Tag(KeyHash) ;
+	ULONG j ;
+	BOOLEAN found = FALSE ;
+
+	table = Publish_Acquire(&g_KeyList, &slot) ;
+	if (table != NULL)
+	{
+		for (j = tag & table->uMask; table->Slots[j].uIndex != 0; j = (j + 1) & table->uMask)
+		{
+			entry = &table->Slots[j] ;
+
+			if (entry->uTag == tag &&
+				RtlEqualMemory(table->Keys[entry->uIndex - 1].szCurKeyHash, KeyHash, HASH_SIZE))
+			{
+				RtlCopyMemory(Key, table->Keys[entry->uIndex - 1].szCurKeyCipher, MAX_KEY_LENGTH) ;
+				found = TRUE ;
+				break ;
+			}
+		}
+	}
+
+	Publish_Release(slot) ;
+
+	return found ;
+}
+
+
+NTSTATUS
+KeyList_ReferenceKey(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash,
+    __deref_out PKEY_CACHE_ENTRY *Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the expanded schedules of the key with digest
+    KeyHash: from the key cache, or from the key list on a cache miss.
+
+Arguments:
+
+    KeyHash - Key digest
+    Entry   - Receives the referenced key cache entry
+
+Return Value:
+
+    STATUS_NOT_FOUND if no installed key has this digest
+
+--*/
+{
+	NTSTATUS status ;
+	UCHAR key[MAX_KEY_LENGTH] ;
+
+	*Entry = KeyCache_Lookup(KeyHash) ;
+	if (*Entry != NULL)
+		return STATUS_SUCCESS ;
+
+	if (!KeyList_Lookup(KeyHash, key))
+		return STATUS_NOT_FOUND ;
+
+	status = KeyCache_Reference(KeyHash, key, Entry) ;
+	RtlSecureZeroMemory(key, sizeof(key)) ;
+
+	return status ;
+}
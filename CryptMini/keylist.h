@@ -0,0 +1,38 @@
+#include "common.h"
+
+//
+//  History key list installed by IOCTL_SET_KEYLIST, indexed by key digest.
+//
+
+#define KEYLIST_TAG                       'lKxC'
+
+//upper bound of keys accepted in one list
+#define KEYLIST_MAX_KEYS                  0x10000
+
+NTSTATUS
+KeyList_Init(
+    VOID
+    ) ;
+
+VOID
+KeyList_Uninit(
+    VOID
+    ) ;
+
+NTSTATUS
+KeyList_Install(
+    __in_ecount(Count) const FILEKEY_INFO *Keys,
+    __in ULONG Count
+    ) ;
+
+BOOLEAN
+KeyList_Lookup(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash,
+    __out_bcount(MAX_KEY_LENGTH) PUCHAR Key
+    ) ;
+
+NTSTATUS
+KeyList_ReferenceKey(
+    __in_bcount(HASH_SIZE) const UCHAR *KeyHash,
+    __deref_out PKEY_CACHE_ENTRY *Entry
+    ) ;
@@ -0,0 +1,144 @@
+/*++
+
+Module Name:
+
+    layout.c
+
+Abstract:
+
+    Offset arithmetic of the on-disk layouts of encrypted files, see
+    layout.h.
+
+Environment:
+
+    Kernel mode or user mode.
+
+--*/
+#include "layout.h"
+
+
+int
+Layout_Init(LAYOUT *Layout, LAYOUT_KIND Kind, unsigned int SectorSize, unsigned int FlagSize)
+/*++
+
+Routine Description:
+
+    Describes a layout whose flag of FlagSize bytes is padded to whole
+    sectors.  Returns 0 if SectorSize is not a power of two or FlagSize
+    is 0.
+
+--*/
+{
+	unsigned int flagLength ;
+
+	if (SectorSize == 0 || (SectorSize & (SectorSize - 1)) != 0 || FlagSize == 0)
+		return 0 ;
+
+	if (Kind != LayoutTrailer && Kind != LayoutHeader)
+		return 0 ;
+
+	flagLength = (FlagSize + SectorSize - 1) & ~(SectorSize - 1) ;
+
+	Layout->Kind = Kind ;
+	Layout->SectorSize = SectorSize ;
+	Layout->HeadLength = Kind == LayoutHeader ? flagLength : 0 ;
+	Layout->TailLength = Kind == LayoutTrailer ? flagLength : 0 ;
+
+	return 1 ;
+}
+
+long long
+Layout_ToFile(const LAYOUT *Layout, long long Offset)
+/*++
+
+Routine Description:
+
+    Returns the file offset of plain text offset Offset.
+
+--*/
+{
+	return Offset + Layout->HeadLength ;
+}
+
+long long
+Layout_FlagOffset(const LAYOUT *Layout, long long FileSize)
+/*++
+
+Routine Description:
+
+    Returns the file offset of the flag of a file of FileSize bytes, or
+    -1 if no flag fits there.  A trailer starts on a sector boundary.
+
+--*/
+{
+	if (Layout->Kind == LayoutHeader)
+		return FileSize >= Layout->HeadLength ? 0 : -1 ;
+
+	if (FileSize < Layout->TailLength || (FileSize & (Layout->SectorSize - 1)) != 0)
+		return -1 ;
+
+	return FileSize - Layout->TailLength ;
+}
+
+long long
+Layout_FileSize(const LAYOUT *Layout, long long ValidLength)
+/*++
+
+Routine Description:
+
+    Returns the size of a file holding ValidLength bytes of plain text.
+
+--*/
+{
+	long long sector = Layout->SectorSize ;
+
+	if (Layout->Kind == LayoutHeader)
+		return Layout->HeadLength + ValidLength ;
+
+	return ((ValidLength + sector - 1) & ~(sector - 1)) + Layout->TailLength ;
+}
+
+long long
+Layout_ValidLength(const LAYOUT *Layout, long long FileSize)
+/*++
+
+Routine Description:
+
+    Returns the most plain text a file of FileSize bytes holds, which for
+    the header layout is its valid length, or -1 if no flag fits.
+
+--*/
+{
+	long long flagOffset = Layout_FlagOffset(Layout, FileSize) ;
+
+	if (flagOffset < 0)
+		return -1 ;
+
+	return Layout->Kind == LayoutHeader ? FileSize - Layout->HeadLength : flagOffset ;
+}
+
+void
+Layout_MapFileRange(const LAYOUT *Layout, long long FileOffset, size_t Length, LAYOUT_EXTENT *Extent)
+/*++
+
+Routine Description:
+
+    Splits Length bytes at FileOffset, FileOffset >= 0, into the header
+    bytes they start with, if any, and the plain text after them.  The
+    range is not clipped at the valid length.
+
+--*/
+{
+	size_t skip = 0 ;
+
+	if (FileOffset < (long long)Layout->HeadLength)
+	{
+		skip = (size_t)(Layout->HeadLength - FileOffset) ;
+		if (skip > Length)
+			skip = Length ;
+	}
+
+	Extent->Skip = skip ;
+	Extent->Offset = FileOffset + (long long)skip - Layout->HeadLength ;
+	Extent->Length = Length - skip ;
+}
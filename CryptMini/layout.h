@@ -0,0 +1,86 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+//
+//  On-disk layout of encrypted files: where the file flag sits and how
+//  offsets of the plain text map to offsets in the file.
+//
+//  Trailer layout, the default:
+//
+//      | cipher text | pad | file flag | pad |
+//      0             ValidLength        FileSize - TailLength
+//
+//  Plain text offset N is file offset N.  The valid length is recorded
+//  in the flag, so every write extending the file moves the trailer.
+//
+//  Header layout:
+//
+//      | file flag | pad | cipher text |
+//      0                 HeadLength    FileSize
+//
+//  Plain text offset N is file offset HeadLength + N and the valid
+//  length is FileSize - HeadLength, so appending writes no metadata.
+//  HeadLength is whole sectors, so sector aligned I/O stays aligned
+//  after the shift.
+//
+//  This module is freestanding like aes.h, for the driver and user mode
+//  tests alike.
+//
+
+#include <stddef.h>
+
+typedef enum _LAYOUT_KIND {
+	LayoutTrailer = 0,
+	LayoutHeader
+} LAYOUT_KIND;
+
+typedef struct _LAYOUT {
+
+	LAYOUT_KIND Kind ;
+
+	unsigned int SectorSize ;
+
+	//bytes before the plain text, 0 for the trailer layout
+	unsigned int HeadLength ;
+
+	//bytes after the padded plain text, 0 for the header layout
+	unsigned int TailLength ;
+
+} LAYOUT, *PLAYOUT ;
+
+//
+//  Part of a range of file offsets holding plain text
+//
+
+typedef struct _LAYOUT_EXTENT {
+
+	//bytes at the start of the range holding the header
+	size_t Skip ;
+
+	//plain text offset of the byte at Skip
+	long long Offset ;
+
+	//bytes from Skip to the end of the range
+	size_t Length ;
+
+} LAYOUT_EXTENT, *PLAYOUT_EXTENT ;
+
+int
+Layout_Init(LAYOUT *Layout, LAYOUT_KIND Kind, unsigned int SectorSize, unsigned int FlagSize) ;
+
+long long
+Layout_ToFile(const LAYOUT *Layout, long long Offset) ;
+
+long long
+Layout_FlagOffset(const LAYOUT *Layout, long long FileSize) ;
+
+long long
+Layout_FileSize(const LAYOUT *Layout, long long ValidLength) ;
+
+long long
+Layout_ValidLength(const LAYOUT *Layout, long long FileSize) ;
+
+void
+Layout_MapFileRange(const LAYOUT *Layout, long long FileOffset, size_t Length, LAYOUT_EXTENT *Extent) ;
+
+#endif//_LAYOUT_H_
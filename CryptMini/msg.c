@@ -0,0 +1,555 @@
+/*++
+
+Module Name:
+
+    msg.c
+
+Abstract:
+
+    Server side of SERVER_PORTNAME.  The user mode engine connects and
+    sends requests starting with a MSG_SEND_TYPE (see interface.h).
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL
+
+--*/
+#include "msg.h"
+#include "keylist.h"
+#include "proclist.h"
+#include "policylist.h"
+#include "crypt.h"
+
+static NTSTATUS iMsg_Connect(PFLT_PORT ClientPort, PVOID ServerPortCookie, PVOID ConnectionContext, ULONG SizeOfContext, PVOID *ConnectionPortCookie) ;
+static VOID iMsg_Disconnect(PVOID ConnectionCookie) ;
+static NTSTATUS iMsg_Notify(PVOID PortCookie, PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength, PULONG ReturnOutputBufferLength) ;
+static NTSTATUS iMsg_SetKeyList(PVOID InputBuffer, ULONG InputBufferLength) ;
+static NTSTATUS iMsg_SetPolicy(PVOID InputBuffer, ULONG InputBufferLength) ;
+static NTSTATUS iMsg_CaptureProcessInfo(PVOID InputBuffer, ULONG InputBufferLength, PPROCESS_INFO Info) ;
+static NTSTATUS iMsg_Reply(PVOID OutputBuffer, ULONG OutputBufferLength, const VOID *Reply, ULONG ReplyLength, PULONG ReturnOutputBufferLength) ;
+static NTSTATUS iMsg_GetAllProcessInfo(PVOID OutputBuffer, ULONG OutputBufferLength, PULONG ReturnOutputBufferLength) ;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, Msg_CreateCommunicationPort)
+#pragma alloc_text(PAGE, Msg_CloseCommunicationPort)
+#pragma alloc_text(PAGE, iMsg_Connect)
+#pragma alloc_text(PAGE, iMsg_Disconnect)
+#pragma alloc_text(PAGE, iMsg_Notify)
+#pragma alloc_text(PAGE, iMsg_SetKeyList)
+#pragma alloc_text(PAGE, iMsg_SetPolicy)
+#pragma alloc_text(PAGE, iMsg_CaptureProcessInfo)
+#pragma alloc_text(PAGE, iMsg_Reply)
+#pragma alloc_text(PAGE, iMsg_GetAllProcessInfo)
+#endif
+
+PFLT_PORT g_pServerPort = NULL ;
+
+static PFLT_FILTER g_pMsgFilter = NULL ;
+
+static PFLT_PORT g_pClientPort = NULL ;
+
+
+NTSTATUS
+Msg_CreateCommunicationPort(
+    __in PFLT_FILTER Filter
+    )
+/*++
+
+Routine Description:
+
+    This routine creates the server port.  Only administrators and the
+    system can connect, one client at a time.
+
+Arguments:
+
+    Filter - Filter handle
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+	PSECURITY_DESCRIPTOR sd ;
+	OBJECT_ATTRIBUTES oa ;
+	UNICODE_STRING uniName ;
+
+	g_pMsgFilter = Filter ;
+
+	status = FltBuildDefaultSecurityDescriptor(&sd, FLT_PORT_ALL_ACCESS) ;
+	if (!NT_SUCCESS(status))
+		return status ;
+
+	RtlInitUnicodeString(&uniName, SERVER_PORTNAME) ;
+	InitializeObjectAttributes(&oa, &uniName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, sd) ;
+
+	status = FltCreateCommunicationPort(Filter, &g_pServerPort, &oa, NULL,
+		iMsg_Connect, iMsg_Disconnect, iMsg_Notify, 1) ;
+
+	FltFreeSecurityDescriptor(sd) ;
+
+	return status ;
+}
+
+
+VOID
+Msg_CloseCommunicationPort(
+    __in PFLT_PORT ServerPort
+    )
+/*++
+
+Routine Description:
+
+    This routine closes the server port.  Must be called before the filter
+    is unregistered.
+
+Arguments:
+
+    ServerPort - Port created by Msg_CreateCommunicationPort
+
+Return Value:
+
+    None
+
+--*/
+{
+	PAGED_CODE() ;
+
+	if (ServerPort != NULL)
+		FltCloseCommunicationPort(ServerPort) ;
+}
+
+
+static NTSTATUS
+iMsg_Connect(
+    __in PFLT_PORT ClientPort,
+    __in PVOID ServerPortCookie,
+    __in_bcount(SizeOfContext) PVOID ConnectionContext,
+    __in ULONG SizeOfContext,
+    __deref_out_opt PVOID *ConnectionPortCookie
+    )
+{
+	UNREFERENCED_PARAMETER(ServerPortCookie) ;
+	UNREFERENCED_PARAMETER(ConnectionContext) ;
+	UNREFERENCED_PARAMETER(SizeOfContext) ;
+
+	PAGED_CODE() ;
+
+	g_pClientPort = ClientPort ;
+	*ConnectionPortCookie = NULL ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+static VOID
+iMsg_Disconnect(
+    __in_opt PVOID ConnectionCookie
+    )
+{
+	UNREFERENCED_PARAMETER(ConnectionCookie) ;
+
+	PAGED_CODE() ;
+
+	FltCloseClientPort(g_pMsgFilter, &g_pClientPort) ;
+}
+
+
+static NTSTATUS
+iMsg_Notify(
+    __in_opt PVOID PortCookie,
+    __in_bcount_opt(InputBufferLength) PVOID InputBuffer,
+    __in ULONG InputBufferLength,
+    __out_bcount_part_opt(OutputBufferLength, *ReturnOutputBufferLength) PVOID OutputBuffer,
+    __in ULONG OutputBufferLength,
+    __out PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This routine dispatches a request from the user mode engine.
+
+Arguments:
+
+    InputBuffer              - Request, user mode address
+    InputBufferLength        - Request length
+    OutputBuffer             - Reply, user mode address
+    OutputBufferLength       - Reply buffer length
+    ReturnOutputBufferLength - Receives the reply length
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+	ULONG uSendType ;
+	PROCESS_INFO info ;
+	MSG_GET_ADD_PROCESS_INFO result ;
+	MSG_GET_PROCESS_COUNT count ;
+	ULONG threshold ;
+	MSG_GET_STATS stats ;
+
+	UNREFERENCED_PARAMETER(PortCookie) ;
+
+	PAGED_CODE() ;
+
+	*ReturnOutputBufferLength = 0 ;
+
+	if (InputBuffer == NULL || InputBufferLength < sizeof(MSG_SEND_TYPE))
+		return STATUS_INVALID_PARAMETER ;
+
+	try {
+		ProbeForRead(InputBuffer, InputBufferLength, 1) ;
+		uSendType = ((PMSG_SEND_TYPE)InputBuffer)->uSendType ;
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		return GetExceptionCode() ;
+	}
+
+	switch (uSendType)
+	{
+	case IOCTL_SET_KEYLIST:
+		return iMsg_SetKeyList(InputBuffer, InputBufferLength) ;
+
+	case IOCTL_SET_POLICY:
+		return iMsg_SetPolicy(InputBuffer, InputBufferLength) ;
+
+	case IOCTL_SET_PARALLEL_THRESHOLD:
+		if (InputBufferLength < sizeof(MSG_SEND_SET_PARALLEL_THRESHOLD))
+			return STATUS_INVALID_PARAMETER ;
+
+		try {
+			threshold = ((PMSG_SEND_SET_PARALLEL_THRESHOLD)InputBuffer)->uThreshold ;
+		} except (EXCEPTION_EXECUTE_HANDLER) {
+			return GetExceptionCode() ;
+		}
+
+		Crypt_SetParallelThreshold(threshold) ;
+		return STATUS_SUCCESS ;
+
+	case IOCTL_ADD_PROCESS_INFO:
+	case IOCTL_DEL_PROCESS_INFO:
+		status = iMsg_CaptureProcessInfo(InputBuffer, InputBufferLength, &info) ;
+		if (!NT_SUCCESS(status))
+			return status ;
+
+		if (uSendType == IOCTL_ADD_PROCESS_INFO)
+			result.uResult = ProcList_Add(&info) ;
+		else
+			result.uResult = ProcList_Delete(info.szProcessName) ;
+
+		return iMsg_Reply(OutputBuffer, OutputBufferLength, &result, sizeof(result), ReturnOutputBufferLength) ;
+
+	case IOCTL_SET_PROCESS_MONITOR:
+		status = iMsg_CaptureProcessInfo(InputBuffer, InputBufferLength, &info) ;
+		if (!NT_SUCCESS(status))
+			return status ;
+
+		return ProcList_SetMonitor(&info) ;
+
+	case IOCTL_GET_PROCESS_COUNT:
+		count.uCount = ProcList_Query(NULL, 0) ;
+		return iMsg_Reply(OutputBuffer, OutputBufferLength, &count, sizeof(count), ReturnOutputBufferLength) ;
+
+	case IOCTL_GET_ALL_PROCESS_INFO:
+		return iMsg_GetAllProcessInfo(OutputBuffer, OutputBufferLength, ReturnOutputBufferLength) ;
+
+	case IOCTL_GET_STATS:
+		QueryDriverStats(&stats) ;
+		return iMsg_Reply(OutputBuffer, OutputBufferLength, &stats, sizeof(stats), ReturnOutputBufferLength) ;
+
+	default:
+		return STATUS_INVALID_DEVICE_REQUEST ;
+	}
+}
+
+
+static NTSTATUS
+iMsg_SetKeyList(
+    __in_bcount(InputBufferLength) PVOID InputBuffer,
+    __in ULONG InputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This routine installs the history key list of a MSG_SEND_SET_HISKEY_INFO
+    request.  The keys are captured into system memory before they are
+    validated and indexed.
+
+Arguments:
+
+    InputBuffer       - Request, user mode address, probed
+    InputBufferLength - Request length
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+	PMSG_SEND_SET_HISKEY_INFO msg = (PMSG_SEND_SET_HISKEY_INFO)InputBuffer ;
+	PFILEKEY_INFO keys = NULL ;
+	ULONG count = 0 ;
+	ULONG size = 0 ;
+
+	PAGED_CODE() ;
+
+	if (InputBufferLength < FIELD_OFFSET(MSG_SEND_SET_HISKEY_INFO, sKeyListInfo.sFileKeyInfo))
+		return STATUS_INVALID_PARAMETER ;
+
+	try {
+		count = msg->sKeyListInfo.uItemCount ;
+		if (count > KEYLIST_MAX_KEYS ||
+			InputBufferLength - FIELD_OFFSET(MSG_SEND_SET_HISKEY_INFO, sKeyListInfo.sFileKeyInfo) < count * sizeof(FILEKEY_INFO))
+		{
+			status = STATUS_INVALID_PARAMETER ;
+			leave ;
+		}
+
+		size = max(count, 1) * sizeof(FILEKEY_INFO) ;
+		keys = ExAllocatePoolWithTag(PagedPool, size, MSG_TAG) ;
+		if (keys == NULL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES ;
+			leave ;
+		}
+
+		RtlCopyMemory(keys, msg->sKeyListInfo.sFileKeyInfo, count * sizeof(FILEKEY_INFO)) ;
+		status = STATUS_SUCCESS ;
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		status = GetExceptionCode() ;
+	}
+
+	if (NT_SUCCESS(status))
+		status = KeyList_Install(keys, count) ;
+
+	if (keys != NULL)
+	{
+		RtlSecureZeroMemory(keys, size) ;
+		ExFreePoolWithTag(keys, MSG_TAG) ;
+	}
+
+	return status ;
+}
+
+
+static NTSTATUS
+iMsg_SetPolicy(
+    __in_bcount(InputBufferLength) PVOID InputBuffer,
+    __in ULONG InputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This routine installs the path policy of a MSG_SEND_SET_POLICY_INFO
+    request.  The rules are captured into system memory before they are
+    compiled.
+
+Arguments:
+
+    InputBuffer       - Request, user mode address, probed
+    InputBufferLength - Request length
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+	PMSG_SEND_SET_POLICY_INFO msg = (PMSG_SEND_SET_POLICY_INFO)InputBuffer ;
+	PPOLICY_RULE_INFO rules = NULL ;
+	ULONG count = 0 ;
+
+	PAGED_CODE() ;
+
+	if (InputBufferLength < FIELD_OFFSET(MSG_SEND_SET_POLICY_INFO, sRules))
+		return STATUS_INVALID_PARAMETER ;
+
+	try {
+		count = msg->uRuleCount ;
+		if (count > POLICYLIST_MAX_RULES ||
+			InputBufferLength - FIELD_OFFSET(MSG_SEND_SET_POLICY_INFO, sRules) < count * sizeof(POLICY_RULE_INFO))
+		{
+			status = STATUS_INVALID_PARAMETER ;
+			leave ;
+		}
+
+		rules = ExAllocatePoolWithTag(PagedPool, max(count, 1) * sizeof(POLICY_RULE_INFO), MSG_TAG) ;
+		if (rules == NULL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES ;
+			leave ;
+		}
+
+		RtlCopyMemory(rules, msg->sRules, count * sizeof(POLICY_RULE_INFO)) ;
+		status = STATUS_SUCCESS ;
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		status = GetExceptionCode() ;
+	}
+
+	if (NT_SUCCESS(status))
+		status = PolicyList_Install(rules, count) ;
+
+	if (rules != NULL)
+		ExFreePoolWithTag(rules, MSG_TAG) ;
+
+	return status ;
+}
+
+
+static NTSTATUS
+iMsg_CaptureProcessInfo(
+    __in_bcount(InputBufferLength) PVOID InputBuffer,
+    __in ULONG InputBufferLength,
+    __out PPROCESS_INFO Info
+    )
+/*++
+
+Routine Description:
+
+    This routine captures the PROCESS_INFO of a MSG_SEND_SET_PROCESS_INFO
+    request (also used to add and delete processes).
+
+Arguments:
+
+    InputBuffer       - Request, user mode address, probed
+    InputBufferLength - Request length
+    Info              - Receives the process info
+
+Return Value:
+
+    Status
+
+--*/
+{
+	PAGED_CODE() ;
+
+	if (InputBufferLength < sizeof(MSG_SEND_SET_PROCESS_INFO))
+		return STATUS_INVALID_PARAMETER ;
+
+	try {
+		*Info = ((PMSG_SEND_SET_PROCESS_INFO)InputBuffer)->sProcInfo ;
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		return GetExceptionCode() ;
+	}
+
+	return STATUS_SUCCESS ;
+}
+
+
+static NTSTATUS
+iMsg_Reply(
+    __out_bcount(OutputBufferLength) PVOID OutputBuffer,
+    __in ULONG OutputBufferLength,
+    __in_bcount(ReplyLength) const VOID *Reply,
+    __in ULONG ReplyLength,
+    __out PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This routine copies a fixed size reply to the engine's buffer.
+
+Arguments:
+
+    OutputBuffer             - Reply buffer, user mode address
+    OutputBufferLength       - Reply buffer length
+    Reply                    - Reply, in system memory
+    ReplyLength              - Reply length
+    ReturnOutputBufferLength - Receives ReplyLength on success
+
+Return Value:
+
+    Status
+
+--*/
+{
+	PAGED_CODE() ;
+
+	if (OutputBuffer == NULL || OutputBufferLength < ReplyLength)
+		return STATUS_BUFFER_TOO_SMALL ;
+
+	try {
+		ProbeForWrite(OutputBuffer, ReplyLength, 1) ;
+		RtlCopyMemory(OutputBuffer, Reply, ReplyLength) ;
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		return GetExceptionCode() ;
+	}
+
+	*ReturnOutputBufferLength = ReplyLength ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+static NTSTATUS
+iMsg_GetAllProcessInfo(
+    __out_bcount(OutputBufferLength) PVOID OutputBuffer,
+    __in ULONG OutputBufferLength,
+    __out PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This routine replies to IOCTL_GET_ALL_PROCESS_INFO with as many
+    entries of the process list as fit.  uCount is always the length of
+    the whole list.
+
+Arguments:
+
+    OutputBuffer             - Reply buffer, user mode address
+    OutputBufferLength       - Reply buffer length
+    ReturnOutputBufferLength - Receives the reply length
+
+Return Value:
+
+    STATUS_BUFFER_OVERFLOW if some entries did not fit
+
+--*/
+{
+	NTSTATUS status ;
+	PMSG_GET_ALL_PROCESS_INFO reply = (PMSG_GET_ALL_PROCESS_INFO)OutputBuffer ;
+	PPROCESS_INFO infos ;
+	ULONG capacity ;
+	ULONG count ;
+	ULONG copied ;
+
+	PAGED_CODE() ;
+
+	if (OutputBuffer == NULL || OutputBufferLength < FIELD_OFFSET(MSG_GET_ALL_PROCESS_INFO, sProcInfo))
+		return STATUS_BUFFER_TOO_SMALL ;
+
+	capacity = (OutputBufferLength - FIELD_OFFSET(MSG_GET_ALL_PROCESS_INFO, sProcInfo)) / sizeof(PROCESS_INFO) ;
+	capacity = min(capacity, PROCLIST_MAX_PROCESSES) ;
+
+	infos = ExAllocatePoolWithTag(PagedPool, max(capacity, 1) * sizeof(PROCESS_INFO), MSG_TAG) ;
+	if (infos == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	count = ProcList_Query(infos, capacity) ;
+	copied = min(count, capacity) ;
+
+	try {
+		ProbeForWrite(OutputBuffer, OutputBufferLength, 1) ;
+		reply->uCount = count ;
+		RtlCopyMemory(reply->sProcInfo, infos, copied * sizeof(PROCESS_INFO)) ;
+
+		*ReturnOutputBufferLength = FIELD_OFFSET(MSG_GET_ALL_PROCESS_INFO, sProcInfo) + copied * sizeof(PROCESS_INFO) ;
+		status = (copied < count) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS ;
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		status = GetExceptionCode() ;
+	}
+
+	ExFreePoolWithTag(infos, MSG_TAG) ;
+
+	return status ;
+}
@@ -0,0 +1,28 @@
+#include "common.h"
+
+//
+//  Communication port between the driver and the user mode engine
+//
+
+#define MSG_TAG                           'gMxC'
+
+extern PFLT_PORT g_pServerPort ;
+
+NTSTATUS
+Msg_CreateCommunicationPort(
+    __in PFLT_FILTER Filter
+    ) ;
+
+VOID
+Msg_CloseCommunicationPort(
+    __in PFLT_PORT ServerPort
+    ) ;
+
+//
+//  Implemented by CryptMini.c, which owns the counters
+//
+
+VOID
+QueryDriverStats(
+    __out PMSG_GET_STATS Stats
+    ) ;
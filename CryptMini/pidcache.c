@@ -0,0 +1,349 @@
+/*++
+
+Module Name:
+
+    pidcache.c
+
+Abstract:
+
+    Per-process decision cache.  Deciding whether the process behind a
+    create is monitored means fetching its image name and looking it up
+    in the process list (proclist.c); the answer only changes when the
+    list does, so it is cached by process id.
+
+    The cache is a direct mapped table of 64-bit words, each packing
+
+        | process id / 4 (30) | policy generation (26) | decision (8) |
+
+    A lookup is one aligned 64-bit read: there is no lock and no torn
+    entry to guard against.  Writers replace whole words with interlocked
+    operations.  A collision simply evicts.
+
+    Entries are invalidated two ways.  Every process list update bumps
+    the policy generation (ProcList_GetGeneration), which turns all
+    entries of older generations into misses without touching the table.
+    A process notify routine drops the entry of a process as it exits,
+    before its id can be reused.  The generation is stored in 26 bits; an
+    entry could only be mistaken for current after 2^26 list updates
+    without a create from its process.
+
+Environment:
+
+    Kernel mode.  Lookups at IRQL <= DISPATCH_LEVEL, resolution at
+    IRQL <= APC_LEVEL.
+
+--*/
+#include "pidcache.h"
+#include "proclist.h"
+
+NTKERNELAPI
+PCHAR
+PsGetProcessImageFileName(
+    __in PEPROCESS Process
+    ) ;
+
+static VOID iPidCache_ProcessNotify(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create) ;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, PidCache_Init)
+#pragma alloc_text(PAGE, PidCache_Uninit)
+#pragma alloc_text(PAGE, PidCache_Resolve)
+#endif
+
+#define PIDCACHE_PID_SHIFT                34
+#define PIDCACHE_GEN_SHIFT                8
+#define PIDCACHE_GEN_MASK                 0x3FFFFFFULL
+#define PIDCACHE_DECISION_MASK            0xFFULL
+
+#define iPidCache_Word(_pid, _gen, _decision) \
+	(((ULONG64)((ULONG_PTR)(_pid) >> 2) << PIDCACHE_PID_SHIFT) | \
+	 (((ULONG64)(_gen) & PIDCACHE_GEN_MASK) << PIDCACHE_GEN_SHIFT) | \
+	 (ULONG64)(_decision))
+
+//the id and generation part of a word
+#define iPidCache_Tag(_word)    ((_word) & ~PIDCACHE_DECISION_MASK)
+
+static volatile LONG64 g_PidCache[PIDCACHE_SIZE] ;
+
+static BOOLEAN g_PidCacheNotify = FALSE ;
+
+static volatile LONG64 g_PidCacheHits = 0 ;
+
+static volatile LONG64 g_PidCacheMisses = 0 ;
+
+static volatile LONG64 g_PidCacheExits = 0 ;
+
+
+static volatile LONG64 *
+iPidCache_Slot(
+    __in HANDLE ProcessId
+    )
+{
+	ULONG id = (ULONG)((ULONG_PTR)ProcessId >> 2) ;
+
+	//ids are allocated densely, spread neighbours over the table anyway
+	return &g_PidCache[(id * 0x9E3779B1) >> (32 - 12)] ;
+}
+
+C_ASSERT(PIDCACHE_SIZE == (1 << 12)) ;
+
+
+static VOID
+iPidCache_ProcessNotify(
+    __in HANDLE ParentId,
+    __in HANDLE ProcessId,
+    __in BOOLEAN Create
+    )
+{
+	UNREFERENCED_PARAMETER(ParentId) ;
+
+	//on exit the id is about to be freed; on create it may be a reused
+	//one, whose entry must be gone already, but be safe
+	PidCache_Remove(ProcessId) ;
+
+	if (!Create)
+		InterlockedIncrement64(&g_PidCacheExits) ;
+}
+
+
+NTSTATUS
+PidCache_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine empties the cache and registers the process notify
+    routine that drops the entries of exiting processes.  Called from
+    DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+
+	RtlZeroMemory((PVOID)g_PidCache, sizeof(g_PidCache)) ;
+
+	status = PsSetCreateProcessNotifyRoutine(iPidCache_ProcessNotify, FALSE) ;
+	g_PidCacheNotify = NT_SUCCESS(status) ;
+
+	return status ;
+}
+
+
+VOID
+PidCache_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine removes the process notify routine.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PAGED_CODE() ;
+
+	if (g_PidCacheNotify)
+	{
+		PsSetCreateProcessNotifyRoutine(iPidCache_ProcessNotify, TRUE) ;
+		g_PidCacheNotify = FALSE ;
+	}
+}
+
+
+PROCESS_DECISION
+PidCache_Lookup(
+    __in HANDLE ProcessId,
+    __in ULONG Generation
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the cached decision of a process.  It never
+    blocks and takes no lock.
+
+Arguments:
+
+    ProcessId  - Process id
+    Generation - Current policy generation
+
+Return Value:
+
+    ProcessDecisionUnknown on a miss
+
+--*/
+{
+	ULONG64 word = (ULONG64)ReadNoFence64(iPidCache_Slot(ProcessId)) ;
+
+	if (word != 0 && iPidCache_Tag(word) == iPidCache_Word(ProcessId, Generation, 0))
+	{
+		InterlockedIncrement64(&g_PidCacheHits) ;
+		return (PROCESS_DECISION)(word & PIDCACHE_DECISION_MASK) ;
+	}
+
+	InterlockedIncrement64(&g_PidCacheMisses) ;
+
+	return ProcessDecisionUnknown ;
+}
+
+
+VOID
+PidCache_Insert(
+    __in HANDLE ProcessId,
+    __in ULONG Generation,
+    __in PROCESS_DECISION Decision
+    )
+/*++
+
+Routine Description:
+
+    This routine caches the decision of a process, evicting whatever
+    shared its slot.
+
+Arguments:
+
+    ProcessId  - Process id
+    Generation - Policy generation read BEFORE the process list was
+                 consulted, so that a concurrent update invalidates it
+    Decision   - Decision to cache
+
+Return Value:
+
+    None
+
+--*/
+{
+	InterlockedExchange64(iPidCache_Slot(ProcessId), (LONG64)iPidCache_Word(ProcessId, Generation, Decision)) ;
+}
+
+
+VOID
+PidCache_Remove(
+    __in HANDLE ProcessId
+    )
+/*++
+
+Routine Description:
+
+    This routine drops the entry of a process, whatever its generation.
+    An entry of another process sharing the slot is left alone.
+
+Arguments:
+
+    ProcessId - Process id
+
+Return Value:
+
+    None
+
+--*/
+{
+	volatile LONG64 *slot = iPidCache_Slot(ProcessId) ;
+	LONG64 word = ReadNoFence64(slot) ;
+
+	while (word != 0 && ((ULONG64)word >> PIDCACHE_PID_SHIFT) == ((ULONG_PTR)ProcessId >> 2))
+	{
+		LONG64 old = InterlockedCompareExchange64(slot, 0, word) ;
+		if (old == word)
+			break ;
+		word = old ;
+	}
+}
+
+
+PROCESS_DECISION
+PidCache_Resolve(
+    __in PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the decision of the process requesting an
+    operation: from the cache, or from the process list on a miss, in
+    which case it is cached.
+
+    Callable at IRQL <= APC_LEVEL.
+
+Arguments:
+
+    Data - Operation
+
+Return Value:
+
+    Decision, ProcessDecisionIgnored if the requestor is unknown
+
+--*/
+{
+	HANDLE processId = (HANDLE)(ULONG_PTR)FltGetRequestorProcessId(Data) ;
+	ULONG generation = ProcList_GetGeneration() ;
+	PROCESS_DECISION decision ;
+	PEPROCESS process ;
+	BOOLEAN monitor = FALSE ;
+
+	PAGED_CODE() ;
+
+	decision = PidCache_Lookup(processId, generation) ;
+	if (decision != ProcessDecisionUnknown)
+		return decision ;
+
+	process = FltGetRequestorProcess(Data) ;
+	if (process == NULL)
+		return ProcessDecisionIgnored ;
+
+	if (!ProcList_Lookup(PsGetProcessImageFileName(process), &monitor))
+		decision = ProcessDecisionIgnored ;
+	else if (monitor)
+		decision = ProcessDecisionMonitored ;
+	else
+		decision = ProcessDecisionTrusted ;
+
+	PidCache_Insert(processId, generation, decision) ;
+
+	return decision ;
+}
+
+
+VOID
+PidCache_QueryStats(
+    __out PPIDCACHE_STATS Stats
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a snapshot of the cache counters.
+
+Arguments:
+
+    Stats - Receives the counters
+
+Return Value:
+
+    None
+
+--*/
+{
+	Stats->Hits = g_PidCacheHits ;
+	Stats->Misses = g_PidCacheMisses ;
+	Stats->Exits = g_PidCacheExits ;
+}
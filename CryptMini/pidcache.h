@@ -0,0 +1,76 @@
+#include "common.h"
+
+//
+//  Monitor decision of each process, cached by process id
+//
+
+#define PIDCACHE_TAG                      'cPxC'
+
+//direct mapped, one 64-bit word per slot
+#define PIDCACHE_SIZE                     4096
+
+typedef enum _PROCESS_DECISION {
+
+	//not cached
+	ProcessDecisionUnknown = 0,
+
+	//not in the process list
+	ProcessDecisionIgnored,
+
+	//in the process list, monitoring off
+	ProcessDecisionTrusted,
+
+	//in the process list, monitoring on
+	ProcessDecisionMonitored
+
+} PROCESS_DECISION ;
+
+typedef struct _PIDCACHE_STATS {
+
+	LONG64 Hits ;
+
+	//including entries of an older policy generation
+	LONG64 Misses ;
+
+	//entries dropped because their process exited
+	LONG64 Exits ;
+
+} PIDCACHE_STATS, *PPIDCACHE_STATS ;
+
+NTSTATUS
+PidCache_Init(
+    VOID
+    ) ;
+
+VOID
+PidCache_Uninit(
+    VOID
+    ) ;
+
+PROCESS_DECISION
+PidCache_Lookup(
+    __in HANDLE ProcessId,
+    __in ULONG Generation
+    ) ;
+
+VOID
+PidCache_Insert(
+    __in HANDLE ProcessId,
+    __in ULONG Generation,
+    __in PROCESS_DECISION Decision
+    ) ;
+
+VOID
+PidCache_Remove(
+    __in HANDLE ProcessId
+    ) ;
+
+PROCESS_DECISION
+PidCache_Resolve(
+    __in PFLT_CALLBACK_DATA Data
+    ) ;
+
+VOID
+PidCache_QueryStats(
+    __out PPIDCACHE_STATS Stats
+    ) ;
@@ -0,0 +1,453 @@
+/*++
+
+Module Name:
+
+    policy.c
+
+Abstract:
+
+    Path policy engine: compiles include/exclude rules and matches volume
+    relative paths against them.
+
+    Directory prefixes, each completed with a trailing separator so that
+    they match whole path components only, are folded to upper case and
+    inserted into a trie.  The node reached by a prefix's last separator
+    lists the extensions of the rules ending there.  Matching walks the
+    directory part of a path down the trie once, checking the extension
+    lists of the nodes it passes; any matching exclude rule wins.
+
+    Most opens match no include rule at all, and are rejected before the
+    walk by a Bloom filter over the first path components and extensions
+    of the include rules, costing two short hashes and a few bit tests.
+
+    Case folding covers ASCII, Latin-1, Greek and Cyrillic; other code
+    units compare exactly.
+
+Environment:
+
+    Kernel mode or user mode.
+
+--*/
+#include "policy.h"
+
+typedef unsigned int       pol_u32 ;
+typedef unsigned long long pol_u64 ;
+
+#define POLICY_MAGIC                0x594C4F50
+
+#define POLICY_BLOOM_BITS           1024
+#define POLICY_BLOOM_WORDS          (POLICY_BLOOM_BITS / 64)
+
+//the Bloom filter holds the first path component of every include rule
+#define POLICY_FLAG_BLOOM_DIRECTORY 0x00000001
+
+//the Bloom filter holds the extension of every include rule
+#define POLICY_FLAG_BLOOM_EXTENSION 0x00000002
+
+//no include rule, nothing matches
+#define POLICY_FLAG_EMPTY           0x00000004
+
+#define POLICY_SEED_DIRECTORY       0x811C9DC5
+#define POLICY_SEED_EXTENSION       0x050C5D1F
+
+typedef struct _POLICY_NODE {
+
+	//folded code unit of the edge leading to this node
+	unsigned short Char ;
+	unsigned short Reserved ;
+
+	//node indexes, 0 for none: the root is nobody's child or sibling
+	pol_u32 FirstChild ;
+	pol_u32 NextSibling ;
+
+	//extension index + 1 of the first rule ending here, 0 for none
+	pol_u32 FirstExtension ;
+
+} POLICY_NODE ;
+
+typedef struct _POLICY_EXTENSION {
+
+	//extension index + 1 of the next rule ending at the same node
+	pol_u32 Next ;
+
+	pol_u32 Hash ;
+
+	unsigned short Exclude ;
+
+	//0 for any extension
+	unsigned short Length ;
+
+	//folded
+	unsigned short Chars[POLICY_MAX_EXTENSION] ;
+
+} POLICY_EXTENSION ;
+
+typedef struct _POLICY_HEADER {
+
+	pol_u32 Magic ;
+
+	//POLICY_FLAG_XXX
+	pol_u32 Flags ;
+
+	pol_u32 NodeCount ;
+
+	//byte offset of the POLICY_EXTENSION array, which follows the nodes
+	pol_u32 ExtensionOffset ;
+
+	pol_u64 Bloom[POLICY_BLOOM_WORDS] ;
+
+	//POLICY_NODE Nodes[], root first
+
+} POLICY_HEADER ;
+
+#define iPolicy_Nodes(_hdr) \
+	((POLICY_NODE *)((unsigned char *)(_hdr) + sizeof(POLICY_HEADER)))
+
+#define iPolicy_Extensions(_hdr) \
+	((POLICY_EXTENSION *)((unsigned char *)(_hdr) + (_hdr)->ExtensionOffset))
+
+
+static unsigned short
+iPolicy_FoldWide(unsigned short c)
+{
+	//Latin-1, but for the division sign and y with diaeresis
+	if (c >= 0xE0 && c <= 0xFE && c != 0xF7)
+		return (unsigned short)(c - 0x20) ;
+
+	//Greek, but for the final sigma
+	if (c >= 0x3B1 && c <= 0x3CB && c != 0x3C2)
+		return (unsigned short)(c - 0x20) ;
+
+	//Cyrillic
+	if (c >= 0x430 && c <= 0x44F)
+		return (unsigned short)(c - 0x20) ;
+	if (c >= 0x450 && c <= 0x45F)
+		return (unsigned short)(c - 0x50) ;
+
+	return c ;
+}
+
+//ASCII inline, it is nearly every character of nearly every path
+#define iPolicy_Fold(_c) \
+	((_c) < 0x80 ? (unsigned short)((unsigned)((_c) - 'a') < 26 ? (_c) - 0x20 : (_c)) : iPolicy_FoldWide(_c))
+
+static pol_u32
+iPolicy_Hash(pol_u32 Seed, const unsigned short *Chars, size_t Length)
+{
+	pol_u32 h = Seed ;
+	size_t i ;
+
+	for (i = 0; i < Length; i++)
+		h = (h ^ iPolicy_Fold(Chars[i])) * 0x01000193 ;
+
+	//FNV leaves the high bits poorly mixed for short keys
+	h ^= h >> 15 ;
+	h *= 0x2C1B3C6D ;
+	h ^= h >> 12 ;
+
+	return h ;
+}
+
+static void
+iPolicy_BloomAdd(pol_u64 *Bloom, pol_u32 Hash)
+{
+	int i ;
+
+	for (i = 0; i < 3; i++, Hash >>= 10)
+		Bloom[(Hash & (POLICY_BLOOM_BITS - 1)) / 64] |= 1ULL << (Hash & 63) ;
+}
+
+static int
+iPolicy_BloomTest(const pol_u64 *Bloom, pol_u32 Hash)
+{
+	int i ;
+
+	for (i = 0; i < 3; i++, Hash >>= 10)
+	{
+		if (!(Bloom[(Hash & (POLICY_BLOOM_BITS - 1)) / 64] & (1ULL << (Hash & 63))))
+			return 0 ;
+	}
+
+	return 1 ;
+}
+
+static pol_u32
+iPolicy_Child(const POLICY_NODE *Nodes, pol_u32 Node, unsigned short Char)
+{
+	pol_u32 child ;
+
+	for (child = Nodes[Node].FirstChild; child != 0; child = Nodes[child].NextSibling)
+	{
+		if (Nodes[child].Char == Char)
+			break ;
+	}
+
+	return child ;
+}
+
+
+size_t
+Policy_Compile(
+	const POLICY_RULE *Rules,
+	size_t Count,
+	void *Policy,
+	size_t PolicySize
+	)
+/*++
+
+Routine Description:
+
+    Compiles rules into a policy for Policy_Match.  Call it once with
+    Policy NULL to learn the size to allocate, then again to compile.
+
+    A path matches the policy if it matches an include rule and no
+    exclude rule.
+
+Arguments:
+
+    Rules      - Array of rules.
+    Count      - Number of rules.
+    Policy     - Receives the compiled policy, aligned on POLICY_ALIGNMENT.
+    PolicySize - Size of the Policy buffer.
+
+Return Value:
+
+    Size of the compiled policy; nothing is compiled if it exceeds
+    PolicySize.  0 if a rule is malformed, or Policy is misaligned.
+
+--*/
+{
+	POLICY_HEADER *hdr = (POLICY_HEADER *)Policy ;
+	POLICY_NODE *nodes ;
+	POLICY_EXTENSION *exts ;
+	size_t maxNodes = 1 ;
+	size_t size, i, j ;
+	int includes = 0 ;
+
+	for (i = 0; i < Count; i++)
+	{
+		const POLICY_RULE *rule = &Rules[i] ;
+		size_t extLength = rule->ExtensionLength ;
+
+		if (rule->DirectoryLength > POLICY_MAX_DIRECTORY + 1 ||
+			(rule->DirectoryLength != 0 && rule->Directory[0] != L'\\'))
+			return 0 ;
+
+		if (extLength != 0 && rule->Extension[0] == L'.')
+			extLength-- ;
+		if (extLength > POLICY_MAX_EXTENSION)
+			return 0 ;
+
+		//the prefix, its separator, and the root separator of an empty one
+		maxNodes += rule->DirectoryLength + 2 ;
+	}
+
+	size = sizeof(POLICY_HEADER) + maxNodes * sizeof(POLICY_NODE) + Count * sizeof(POLICY_EXTENSION) ;
+
+	if (Policy == NULL || PolicySize < size)
+		return size ;
+
+	if (((size_t)Policy & (POLICY_ALIGNMENT - 1)) != 0)
+		return 0 ;
+
+	for (i = 0; i < size; i++)
+		((unsigned char *)Policy)[i] = 0 ;
+
+	hdr->Magic = POLICY_MAGIC ;
+	hdr->Flags = POLICY_FLAG_BLOOM_DIRECTORY | POLICY_FLAG_BLOOM_EXTENSION ;
+	hdr->NodeCount = 1 ;
+	hdr->ExtensionOffset = (pol_u32)(sizeof(POLICY_HEADER) + maxNodes * sizeof(POLICY_NODE)) ;
+
+	nodes = iPolicy_Nodes(hdr) ;
+	exts = iPolicy_Extensions(hdr) ;
+
+	for (i = 0; i < Count; i++)
+	{
+		const POLICY_RULE *rule = &Rules[i] ;
+		const unsigned short *ext = rule->Extension ;
+		size_t extLength = rule->ExtensionLength ;
+		size_t dirLength = rule->DirectoryLength ;
+		pol_u32 node = 0 ;
+		pol_u32 child ;
+		size_t first ;
+
+		if (extLength != 0 && ext[0] == L'.')
+		{
+			ext++ ;
+			extLength-- ;
+		}
+
+		//the prefix followed by a separator, an empty one is the root
+		for (j = 0; j <= dirLength; j++)
+		{
+			unsigned short c ;
+
+			if (j < dirLength)
+				c = iPolicy_Fold(rule->Directory[j]) ;
+			else if (dirLength == 0 || rule->Directory[dirLength - 1] != L'\\')
+				c = L'\\' ;
+			else
+				break ;
+
+			child = iPolicy_Child(nodes, node, c) ;
+			if (child == 0)
+			{
+				child = hdr->NodeCount++ ;
+				nodes[child].Char = c ;
+				nodes[child].NextSibling = nodes[node].FirstChild ;
+				nodes[node].FirstChild = child ;
+			}
+
+			node = child ;
+		}
+
+		exts[i].Exclude = (unsigned short)(rule->Exclude != 0) ;
+		exts[i].Length = (unsigned short)extLength ;
+		for (j = 0; j < extLength; j++)
+			exts[i].Chars[j] = iPolicy_Fold(ext[j]) ;
+		exts[i].Hash = iPolicy_Hash(POLICY_SEED_EXTENSION, ext, extLength) ;
+		exts[i].Next = nodes[node].FirstExtension ;
+		nodes[node].FirstExtension = (pol_u32)i + 1 ;
+
+		//exclude rules cannot make a path match, the filter ignores them
+		if (rule->Exclude)
+			continue ;
+
+		includes++ ;
+
+		for (first = 1; first < dirLength && rule->Directory[first] != L'\\'; first++)
+			;
+
+		if (first > 1)
+			iPolicy_BloomAdd(hdr->Bloom, iPolicy_Hash(POLICY_SEED_DIRECTORY, rule->Directory + 1, first - 1)) ;
+		else
+			hdr->Flags &= ~POLICY_FLAG_BLOOM_DIRECTORY ;
+
+		if (extLength != 0)
+			iPolicy_BloomAdd(hdr->Bloom, exts[i].Hash) ;
+		else
+			hdr->Flags &= ~POLICY_FLAG_BLOOM_EXTENSION ;
+	}
+
+	if (includes == 0)
+		hdr->Flags |= POLICY_FLAG_EMPTY ;
+
+	return size ;
+}
+
+
+int
+Policy_Match(
+	const void *Policy,
+	const unsigned short *Path,
+	size_t Length
+	)
+/*++
+
+Routine Description:
+
+    Matches a path against a compiled policy.  A stream name suffix
+    (":stream") is ignored.
+
+Arguments:
+
+    Policy - Compiled policy.
+    Path   - Volume relative path, starting with a backslash.  Need not be
+             NUL terminated.
+    Length - Length of Path in UTF-16 code units.
+
+Return Value:
+
+    Non-zero if the path matches an include rule and no exclude rule.
+    0 as well for a path not starting with a backslash.
+
+--*/
+{
+	const POLICY_HEADER *hdr = (const POLICY_HEADER *)Policy ;
+	const POLICY_NODE *nodes = iPolicy_Nodes(hdr) ;
+	const POLICY_EXTENSION *exts ;
+	size_t end = Length ;
+	size_t sep, dot, first, i ;
+	size_t extLength = 0 ;
+	pol_u32 extHash ;
+	pol_u32 node = 0 ;
+	pol_u32 e ;
+	int match = 0 ;
+
+	if ((hdr->Flags & POLICY_FLAG_EMPTY) || Length == 0 || Path[0] != L'\\')
+		return 0 ;
+
+	//the first component is short and tells most paths apart, try it first
+	if (hdr->Flags & POLICY_FLAG_BLOOM_DIRECTORY)
+	{
+		for (first = 1; first < Length && Path[first] != L'\\'; first++)
+			;
+
+		//a file in the root is under no first component
+		if (first == Length ||
+			!iPolicy_BloomTest(hdr->Bloom, iPolicy_Hash(POLICY_SEED_DIRECTORY, Path + 1, first - 1)))
+			return 0 ;
+	}
+
+	//only the last component is scanned for the stream name and extension
+	dot = 0 ;
+	for (sep = Length - 1; Path[sep] != L'\\'; sep--)
+	{
+		if (Path[sep] == L':')
+		{
+			end = sep ;
+			dot = 0 ;
+		}
+		else if (Path[sep] == L'.' && dot == 0)
+		{
+			dot = sep ;
+		}
+	}
+
+	if (dot != 0 && dot < end)
+		extLength = end - dot - 1 ;
+
+	extHash = iPolicy_Hash(POLICY_SEED_EXTENSION, Path + dot + 1, extLength) ;
+
+	if ((hdr->Flags & POLICY_FLAG_BLOOM_EXTENSION) &&
+		(extLength == 0 || !iPolicy_BloomTest(hdr->Bloom, extHash)))
+		return 0 ;
+
+	exts = iPolicy_Extensions(hdr) ;
+
+	for (i = 0; i <= sep; i++)
+	{
+		unsigned short c = iPolicy_Fold(Path[i]) ;
+
+		node = iPolicy_Child(nodes, node, c) ;
+		if (node == 0)
+			break ;
+
+		if (c != L'\\')
+			continue ;
+
+		for (e = nodes[node].FirstExtension; e != 0; e = exts[e - 1].Next)
+		{
+			const POLICY_EXTENSION *ext = &exts[e - 1] ;
+			size_t j ;
+
+			if (ext->Length != 0)
+			{
+				if (ext->Length != extLength || ext->Hash != extHash)
+					continue ;
+
+				for (j = 0; j < extLength && ext->Chars[j] == iPolicy_Fold(Path[dot + 1 + j]); j++)
+					;
+				if (j < extLength)
+					continue ;
+			}
+
+			if (ext->Exclude)
+				return 0 ;
+
+			match = 1 ;
+		}
+	}
+
+	return match ;
+}
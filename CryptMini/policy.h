@@ -0,0 +1,65 @@
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+//
+//  Path policy engine.
+//
+//  Include and exclude rules by directory prefix and extension are
+//  compiled into a single position independent block: a case-insensitive
+//  trie over the UTF-16 directory prefixes, with a Bloom filter over the
+//  first path components and extensions of the include rules in front of
+//  it.  Matching a path neither allocates nor takes a lock.
+//
+//  This module is freestanding like aes.c, so it can be linked into the
+//  driver as well as into a user mode test or benchmark program.
+//
+
+#include <stddef.h>
+
+//characters of a directory prefix, without the terminating separator
+#define POLICY_MAX_DIRECTORY   259
+
+//characters of an extension, without the dot
+#define POLICY_MAX_EXTENSION   15
+
+//alignment the compiled policy must be stored at
+#define POLICY_ALIGNMENT       8
+
+//
+//  One rule.  A path matches it if it lies under Directory (compared per
+//  path component, ignoring case) and, unless ExtensionLength is 0, its
+//  extension equals Extension.  Lengths are in UTF-16 code units.
+//
+
+typedef struct _POLICY_RULE {
+
+	//non-zero for an exclude rule
+	int Exclude ;
+
+	//volume relative, starting with a backslash, e.g. \Projects or \Projects\;
+	//empty for the whole volume
+	const unsigned short *Directory ;
+	size_t DirectoryLength ;
+
+	//e.g. docx or .docx; empty for any extension
+	const unsigned short *Extension ;
+	size_t ExtensionLength ;
+
+} POLICY_RULE, *PPOLICY_RULE ;
+
+size_t
+Policy_Compile(
+	const POLICY_RULE *Rules,
+	size_t Count,
+	void *Policy,
+	size_t PolicySize
+	) ;
+
+int
+Policy_Match(
+	const void *Policy,
+	const unsigned short *Path,
+	size_t Length
+	) ;
+
+#endif//_POLICY_H_
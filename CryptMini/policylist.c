@@ -0,0 +1,224 @@
+/*++
+
+Module Name:
+
+    policylist.c
+
+Abstract:
+
+    Path policy (IOCTL_SET_POLICY): which new files are encrypted, by
+    directory and extension.  Until a policy is installed every file is.
+    Files encrypted already are recognized wherever they are.
+
+    Rules are compiled by policy.c into one immutable allocation,
+    published like the key list through publish.c, so that PostCreate can
+    match the name of every file it creates without a lock or an
+    allocation.  No policy is published while none is installed.
+
+Environment:
+
+    Kernel mode.  Matching at IRQL <= DISPATCH_LEVEL, installs at
+    PASSIVE_LEVEL.
+
+--*/
+#include "policylist.h"
+#include "policy.h"
+#include "publish.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, PolicyList_Init)
+#pragma alloc_text(PAGE, PolicyList_Uninit)
+#pragma alloc_text(PAGE, PolicyList_Install)
+#endif
+
+static PUBLISH g_PolicyList ;
+
+static FAST_MUTEX g_PolicyListMutex ;
+
+
+static SIZE_T
+iPolicyList_Length(
+    __in_ecount(MaxLength) const WCHAR *String,
+    __in SIZE_T MaxLength
+    )
+{
+	SIZE_T i ;
+
+	for (i = 0; i < MaxLength && String[i] != L'\0'; i++)
+		;
+
+	return i ;
+}
+
+
+NTSTATUS
+PolicyList_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up an empty policy.  Called from DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+
+	status = Publish_Init(&g_PolicyList, POLICYLIST_TAG, NULL) ;
+	if (!NT_SUCCESS(status))
+		return status ;
+
+	ExInitializeFastMutex(&g_PolicyListMutex) ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+VOID
+PolicyList_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine waits for readers to leave and frees both policies.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PAGED_CODE() ;
+
+	Publish_Uninit(&g_PolicyList) ;
+}
+
+
+NTSTATUS
+PolicyList_Install(
+    __in_ecount(Count) const POLICY_RULE_INFO *Rules,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    This routine compiles a new policy and makes it the one PostCreate
+    matches against.
+
+Arguments:
+
+    Rules - Rules, in system memory
+    Count - Number of rules, at most POLICYLIST_MAX_RULES.  0 removes the
+            policy.
+
+Return Value:
+
+    Status
+
+--*/
+{
+	PPOLICY_RULE rules = NULL ;
+	PVOID policy = NULL ;
+	SIZE_T size ;
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	if (Count > POLICYLIST_MAX_RULES)
+		return STATUS_INVALID_PARAMETER ;
+
+	if (Count != 0)
+	{
+		rules = ExAllocatePoolWithTag(PagedPool, Count * sizeof(POLICY_RULE), POLICYLIST_TAG) ;
+		if (rules == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES ;
+
+		for (i = 0; i < Count; i++)
+		{
+			rules[i].Exclude = (Rules[i].uAction == POLICY_ACTION_EXCLUDE) ;
+			rules[i].Directory = (const unsigned short *)Rules[i].wszDirectory ;
+			rules[i].DirectoryLength = iPolicyList_Length(Rules[i].wszDirectory, MAX_PATH) ;
+			rules[i].Extension = (const unsigned short *)Rules[i].wszExtension ;
+			rules[i].ExtensionLength = iPolicyList_Length(Rules[i].wszExtension, MAX_POLICY_EXTENSION_LENGTH) ;
+		}
+
+		size = Policy_Compile(rules, Count, NULL, 0) ;
+		if (size == 0)
+		{
+			ExFreePoolWithTag(rules, POLICYLIST_TAG) ;
+			return STATUS_INVALID_PARAMETER ;
+		}
+
+		policy = ExAllocatePoolWithTag(NonPagedPool, size, POLICYLIST_TAG) ;
+		if (policy == NULL)
+		{
+			ExFreePoolWithTag(rules, POLICYLIST_TAG) ;
+			return STATUS_INSUFFICIENT_RESOURCES ;
+		}
+
+		Policy_Compile(rules, Count, policy, size) ;
+		ExFreePoolWithTag(rules, POLICYLIST_TAG) ;
+	}
+
+	ExAcquireFastMutex(&g_PolicyListMutex) ;
+	Publish_Replace(&g_PolicyList, policy) ;
+	ExReleaseFastMutex(&g_PolicyListMutex) ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+BOOLEAN
+PolicyList_Match(
+    __in PCUNICODE_STRING FileName
+    )
+/*++
+
+Routine Description:
+
+    This routine tells whether the installed policy covers a file.  It
+    never blocks and never allocates.
+
+Arguments:
+
+    FileName - Volume relative name, e.g. a normalized name past its
+               volume name.  A stream name is ignored.
+
+Return Value:
+
+    FALSE if a policy is installed and leaves the file alone.  TRUE for
+    a name that is not volume relative, which cannot be decided here.
+
+--*/
+{
+	PPUBLISH_SLOT slot ;
+	PVOID policy ;
+	BOOLEAN match = TRUE ;
+
+	if (FileName->Length < sizeof(WCHAR) || FileName->Buffer[0] != L'\\')
+		return TRUE ;
+
+	policy = Publish_Acquire(&g_PolicyList, &slot) ;
+	if (policy != NULL)
+		match = (BOOLEAN)Policy_Match(policy, (const unsigned short *)FileName->Buffer, FileName->Length / sizeof(WCHAR)) ;
+
+	Publish_Release(slot) ;
+
+	return match ;
+}
@@ -0,0 +1,31 @@
+#include "common.h"
+
+//
+//  Path policy installed by IOCTL_SET_POLICY, compiled by policy.c.
+//
+
+#define POLICYLIST_TAG                    'lYxC'
+
+//upper bound of rules accepted in one policy
+#define POLICYLIST_MAX_RULES              1024
+
+NTSTATUS
+PolicyList_Init(
+    VOID
+    ) ;
+
+VOID
+PolicyList_Uninit(
+    VOID
+    ) ;
+
+NTSTATUS
+PolicyList_Install(
+    __in_ecount(Count) const POLICY_RULE_INFO *Rules,
+    __in ULONG Count
+    ) ;
+
+BOOLEAN
+PolicyList_Match(
+    __in PCUNICODE_STRING FileName
+    ) ;
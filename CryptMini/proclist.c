@@ -0,0 +1,574 @@
+/*++
+
+Module Name:
+
+    proclist.c
+
+Abstract:
+
+    Process monitor list.  The user mode engine adds and removes
+    PROCESS_INFO entries and turns monitoring of each on or off; every
+    create asks whether the requesting process is monitored.
+
+    The list is compiled into an immutable open-addressing table on every
+    update.  A process name is at most 16 bytes, so it is zero padded and
+    case folded into a key of two 64-bit words: a lookup hashes the two
+    words and compares them, without a string compare, and its cost does
+    not depend on the length of the list.  The table is at most half
+    full; each slot carries the key and the monitor flag, so a hit reads
+    one slot.
+
+    Tables are published to the lookups through publish.c, so lookups
+    never block.  Updates are serialized by a fast mutex and copy the
+    active table's entries into the next one.  The entries of the active table are the list the engine sees.
+
+Environment:
+
+    Kernel mode.  Lookups at IRQL <= DISPATCH_LEVEL, updates at
+    PASSIVE_LEVEL.
+
+--*/
+#include "proclist.h"
+#include "publish.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, ProcList_Init)
+#pragma alloc_text(PAGE, ProcList_Uninit)
+#pragma alloc_text(PAGE, ProcList_Add)
+#pragma alloc_text(PAGE, ProcList_Delete)
+#pragma alloc_text(PAGE, ProcList_SetMonitor)
+#pragma alloc_text(PAGE, ProcList_Query)
+#endif
+
+#define PROCLIST_NAME_LENGTH              RTL_FIELD_SIZE(PROCESS_INFO, szProcessName)
+
+C_ASSERT(PROCLIST_NAME_LENGTH == 2 * sizeof(ULONG64)) ;
+
+typedef struct _PROCLIST_SLOT {
+
+	//folded name, all zero for an empty slot
+	ULONG64 Key[2] ;
+
+	//position in Infos
+	ULONG uIndex ;
+
+	ULONG bMonitor ;
+
+} PROCLIST_SLOT, *PPROCLIST_SLOT ;
+
+typedef struct _PROCLIST_TABLE {
+
+	ULONG uCount ;
+
+	// slot count - 1
+	ULONG uMask ;
+
+	PPROCLIST_SLOT Slots ;
+
+	PROCESS_INFO Infos[1] ;
+
+} PROCLIST_TABLE, *PPROCLIST_TABLE ;
+
+static PUBLISH g_ProcList ;
+
+static FAST_MUTEX g_ProcListMutex ;
+
+//bumped after every publish, see ProcList_GetGeneration
+static volatile LONG g_ProcListGeneration = 0 ;
+
+
+static VOID
+iProcList_Key(
+    __in_bcount(PROCLIST_NAME_LENGTH) const CHAR *ProcessName,
+    __out_ecount(2) ULONG64 *Key
+    )
+{
+	PCHAR key = (PCHAR)Key ;
+	ULONG64 x, upper ;
+	ULONG i ;
+
+	Key[0] = Key[1] = 0 ;
+
+	//image file names are kept truncated to 15 characters, so the 16th
+	//of a configured name can never match and is dropped
+	for (i = 0; i < PROCLIST_NAME_LENGTH - 1 && ProcessName[i] != '\0'; i++)
+		key[i] = ProcessName[i] ;
+
+	//fold 'A'..'Z' to lower case eight bytes at a time: the top bit of a
+	//byte of upper is set for bytes >= 'A', > 'Z' and non-ASCII, and
+	//only the first survives
+	for (i = 0; i < 2; i++)
+	{
+		x = Key[i] ;
+		upper = ((x & 0x7F7F7F7F7F7F7F7FULL) + 0x3F3F3F3F3F3F3F3FULL) &
+			~((x & 0x7F7F7F7F7F7F7F7FULL) + 0x2525252525252525ULL) &
+			~x & 0x8080808080808080ULL ;
+		Key[i] = x | (upper >> 2) ;
+	}
+}
+
+
+static ULONG
+iProcList_Hash(
+    __in_ecount(2) const ULONG64 *Key
+    )
+{
+	ULONG64 x = Key[0] ^ (Key[1] * 0x9E3779B97F4A7C15ULL) ;
+
+	//fold every byte into the low bits the table index uses
+	x ^= x >> 32 ;
+	x *= 0xBF58476D1CE4E5B9ULL ;
+	x ^= x >> 29 ;
+
+	return (ULONG)x ;
+}
+
+
+static PPROCLIST_SLOT
+iProcList_Find(
+    __in PPROCLIST_TABLE Table,
+    __in_ecount(2) const ULONG64 *Key
+    )
+{
+	PPROCLIST_SLOT slot ;
+	ULONG j ;
+
+	for (j = iProcList_Hash(Key) & Table->uMask; ; j = (j + 1) & Table->uMask)
+	{
+		slot = &Table->Slots[j] ;
+
+		if (slot->Key[0] == Key[0] && slot->Key[1] == Key[1])
+			return slot ;
+
+		if (slot->Key[0] == 0)
+			return NULL ;
+	}
+}
+
+
+static PPROCLIST_TABLE
+iProcList_Active(
+    VOID
+    )
+{
+	//only valid under g_ProcListMutex: tables are freed by updates only
+	return Publish_GetActive(&g_ProcList) ;
+}
+
+
+static NTSTATUS
+iProcList_Publish(
+    __in_ecount(Count) const PROCESS_INFO *Infos,
+    __in ULONG Count
+    )
+{
+	PPROCLIST_TABLE table ;
+	PPROCLIST_SLOT entry ;
+	ULONG64 key[2] ;
+	SIZE_T infosSize ;
+	ULONG slots = 2 ;
+	ULONG i, j ;
+
+	while (slots < Count * 2)
+		slots <<= 1 ;
+
+	infosSize = FIELD_OFFSET(PROCLIST_TABLE, Infos) + max(Count, 1) * sizeof(PROCESS_INFO) ;
+	infosSize = ALIGN_UP_BY(infosSize, sizeof(ULONG64)) ;
+
+	table = ExAllocatePoolWithTag(NonPagedPool, infosSize + slots * sizeof(PROCLIST_SLOT), PROCLIST_TAG) ;
+	if (table == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	table->uCount = Count ;
+	table->uMask = slots - 1 ;
+	table->Slots = (PPROCLIST_SLOT)((PUCHAR)table + infosSize) ;
+	RtlZeroMemory(table->Slots, slots * sizeof(PROCLIST_SLOT)) ;
+	RtlCopyMemory(table->Infos, Infos, Count * sizeof(PROCESS_INFO)) ;
+
+	//callers keep names unique, so every name gets a slot of its own
+	for (i = 0; i < Count; i++)
+	{
+		iProcList_Key(Infos[i].szProcessName, key) ;
+
+		for (j = iProcList_Hash(key) & table->uMask; table->Slots[j].Key[0] != 0; j = (j + 1) & table->uMask)
+			;
+
+		entry = &table->Slots[j] ;
+		entry->Key[0] = key[0] ;
+		entry->Key[1] = key[1] ;
+		entry->uIndex = i ;
+		entry->bMonitor = Infos[i].bMonitor ;
+	}
+
+	Publish_Replace(&g_ProcList, table) ;
+
+	//after the flip: a reader seeing the new generation sees the new table
+	InterlockedIncrement(&g_ProcListGeneration) ;
+
+	return STATUS_SUCCESS ;
+}
+
+
+NTSTATUS
+ProcList_Init(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine publishes an empty list.  Called from DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status ;
+
+	status = Publish_Init(&g_ProcList, PROCLIST_TAG, NULL) ;
+	if (!NT_SUCCESS(status))
+		return status ;
+
+	ExInitializeFastMutex(&g_ProcListMutex) ;
+
+	//so that the active table is never NULL for updates
+	status = iProcList_Publish(NULL, 0) ;
+	if (!NT_SUCCESS(status))
+		ProcList_Uninit() ;
+
+	return status ;
+}
+
+
+VOID
+ProcList_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine waits for readers to leave and frees both tables.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PAGED_CODE() ;
+
+	Publish_Uninit(&g_ProcList) ;
+}
+
+
+ULONG
+ProcList_Add(
+    __in const PROCESS_INFO *Info
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a process to the list.  Names are matched without
+    regard to case.
+
+Arguments:
+
+    Info - Process name and monitor flag, in system memory
+
+Return Value:
+
+    MGAPI_RESULT_SUCCESS
+    MGAPI_RESULT_ALREADY_EXIST - a process of this name is listed
+    MGAPI_RESULT_INTERNEL_ERROR - list full, or out of memory
+
+--*/
+{
+	PPROCLIST_TABLE active ;
+	PPROCESS_INFO infos ;
+	ULONG64 key[2] ;
+	ULONG result ;
+
+	PAGED_CODE() ;
+
+	iProcList_Key(Info->szProcessName, key) ;
+	if (key[0] == 0)
+		return MGAPI_RESULT_INTERNEL_ERROR ;
+
+	ExAcquireFastMutex(&g_ProcListMutex) ;
+
+	active = iProcList_Active() ;
+
+	if (iProcList_Find(active, key) != NULL)
+	{
+		result = MGAPI_RESULT_ALREADY_EXIST ;
+	}
+	else if (active->uCount >= PROCLIST_MAX_PROCESSES ||
+		(infos = ExAllocatePoolWithTag(PagedPool, (active->uCount + 1) * sizeof(PROCESS_INFO), PROCLIST_TAG)) == NULL)
+	{
+		result = MGAPI_RESULT_INTERNEL_ERROR ;
+	}
+	else
+	{
+		RtlCopyMemory(infos, active->Infos, active->uCount * sizeof(PROCESS_INFO)) ;
+		infos[active->uCount] = *Info ;
+
+		result = NT_SUCCESS(iProcList_Publish(infos, active->uCount + 1)) ?
+			MGAPI_RESULT_SUCCESS : MGAPI_RESULT_INTERNEL_ERROR ;
+
+		ExFreePoolWithTag(infos, PROCLIST_TAG) ;
+	}
+
+	ExReleaseFastMutex(&g_ProcListMutex) ;
+
+	return result ;
+}
+
+
+ULONG
+ProcList_Delete(
+    __in_bcount(16) const CHAR *ProcessName
+    )
+/*++
+
+Routine Description:
+
+    This routine removes a process from the list.
+
+Arguments:
+
+    ProcessName - Process name, in system memory
+
+Return Value:
+
+    MGDPI_RESULT_SUCCESS
+    MGDPI_RESULT_NOT_EXIST - no process of this name is listed
+    MGDPI_RESULT_INTERNEL_ERROR - out of memory
+
+--*/
+{
+	PPROCLIST_TABLE active ;
+	PPROCLIST_SLOT slot ;
+	PPROCESS_INFO infos ;
+	ULONG64 key[2] ;
+	ULONG result ;
+	ULONG index ;
+
+	PAGED_CODE() ;
+
+	iProcList_Key(ProcessName, key) ;
+
+	ExAcquireFastMutex(&g_ProcListMutex) ;
+
+	active = iProcList_Active() ;
+	slot = (key[0] != 0) ? iProcList_Find(active, key) : NULL ;
+
+	if (slot == NULL)
+	{
+		result = MGDPI_RESULT_NOT_EXIST ;
+	}
+	else if ((infos = ExAllocatePoolWithTag(PagedPool, max(active->uCount - 1, 1) * sizeof(PROCESS_INFO), PROCLIST_TAG)) == NULL)
+	{
+		result = MGDPI_RESULT_INTERNEL_ERROR ;
+	}
+	else
+	{
+		index = slot->uIndex ;
+		RtlCopyMemory(infos, active->Infos, index * sizeof(PROCESS_INFO)) ;
+		RtlCopyMemory(infos + index, active->Infos + index + 1, (active->uCount - index - 1) * sizeof(PROCESS_INFO)) ;
+
+		result = NT_SUCCESS(iProcList_Publish(infos, active->uCount - 1)) ?
+			MGDPI_RESULT_SUCCESS : MGDPI_RESULT_INTERNEL_ERROR ;
+
+		ExFreePoolWithTag(infos, PROCLIST_TAG) ;
+	}
+
+	ExReleaseFastMutex(&g_ProcListMutex) ;
+
+	return result ;
+}
+
+
+NTSTATUS
+ProcList_SetMonitor(
+    __in const PROCESS_INFO *Info
+    )
+/*++
+
+Routine Description:
+
+    This routine turns monitoring of a listed process on or off.
+
+Arguments:
+
+    Info - Process name and new monitor flag, in system memory
+
+Return Value:
+
+    STATUS_NOT_FOUND if no process of this name is listed
+
+--*/
+{
+	NTSTATUS status ;
+	PPROCLIST_TABLE active ;
+	PPROCLIST_SLOT slot ;
+	PPROCESS_INFO infos ;
+	ULONG64 key[2] ;
+
+	PAGED_CODE() ;
+
+	iProcList_Key(Info->szProcessName, key) ;
+
+	ExAcquireFastMutex(&g_ProcListMutex) ;
+
+	active = iProcList_Active() ;
+	slot = (key[0] != 0) ? iProcList_Find(active, key) : NULL ;
+
+	if (slot == NULL)
+	{
+		status = STATUS_NOT_FOUND ;
+	}
+	else if ((BOOLEAN)slot->bMonitor == Info->bMonitor)
+	{
+		status = STATUS_SUCCESS ;
+	}
+	else if ((infos = ExAllocatePoolWithTag(PagedPool, active->uCount * sizeof(PROCESS_INFO), PROCLIST_TAG)) == NULL)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES ;
+	}
+	else
+	{
+		RtlCopyMemory(infos, active->Infos, active->uCount * sizeof(PROCESS_INFO)) ;
+		infos[slot->uIndex].bMonitor = Info->bMonitor ;
+
+		status = iProcList_Publish(infos, active->uCount) ;
+
+		ExFreePoolWithTag(infos, PROCLIST_TAG) ;
+	}
+
+	ExReleaseFastMutex(&g_ProcListMutex) ;
+
+	return status ;
+}
+
+
+ULONG
+ProcList_Query(
+    __out_ecount(MaxCount) PPROCESS_INFO Infos,
+    __in ULONG MaxCount
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the list, in the order processes were added.
+
+Arguments:
+
+    Infos    - Receives up to MaxCount entries, in system memory
+    MaxCount - Capacity of Infos, 0 to only count
+
+Return Value:
+
+    Number of processes in the list
+
+--*/
+{
+	PPROCLIST_TABLE active ;
+	ULONG count ;
+
+	PAGED_CODE() ;
+
+	ExAcquireFastMutex(&g_ProcListMutex) ;
+
+	active = iProcList_Active() ;
+	count = active->uCount ;
+	RtlCopyMemory(Infos, active->Infos, min(count, MaxCount) * sizeof(PROCESS_INFO)) ;
+
+	ExReleaseFastMutex(&g_ProcListMutex) ;
+
+	return count ;
+}
+
+
+BOOLEAN
+ProcList_Lookup(
+    __in_bcount(16) const CHAR *ProcessName,
+    __out PBOOLEAN Monitor
+    )
+/*++
+
+Routine Description:
+
+    This routine looks a process up by image name, e.g. the name returned
+    by PsGetProcessImageFileName.  It never blocks.
+
+Arguments:
+
+    ProcessName - Image name, NUL terminated or 16 bytes long
+    Monitor     - Receives the monitor flag of a listed process
+
+Return Value:
+
+    TRUE if the process is listed
+
+--*/
+{
+	PPUBLISH_SLOT slot ;
+	PPROCLIST_TABLE table ;
+	PPROCLIST_SLOT entry = NULL ;
+	ULONG64 key[2] ;
+
+	iProcList_Key(ProcessName, key) ;
+	if (key[0] == 0)
+		return FALSE ;
+
+	table = Publish_Acquire(&g_ProcList, &slot) ;
+	if (table != NULL)
+	{
+		entry = iProcList_Find(table, key) ;
+		if (entry != NULL)
+			*Monitor = (BOOLEAN)entry->bMonitor ;
+	}
+
+	Publish_Release(slot) ;
+
+	return (BOOLEAN)(entry != NULL) ;
+}
+
+
+ULONG
+ProcList_GetGeneration(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the policy generation, which changes whenever
+    the list or a monitor flag does.  Decisions derived from lookups are
+    current as long as the generation read BEFORE the lookups is.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Generation
+
+--*/
+{
+	return (ULONG)ReadAcquire(&g_ProcListGeneration) ;
+}
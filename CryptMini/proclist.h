@@ -0,0 +1,53 @@
+#include "common.h"
+
+//
+//  Process monitor list (IOCTL_ADD_PROCESS_INFO and friends), indexed by
+//  image name.
+//
+
+#define PROCLIST_TAG                      'lPxC'
+
+//upper bound of processes in the list
+#define PROCLIST_MAX_PROCESSES            1024
+
+NTSTATUS
+ProcList_Init(
+    VOID
+    ) ;
+
+VOID
+ProcList_Uninit(
+    VOID
+    ) ;
+
+ULONG
+ProcList_Add(
+    __in const PROCESS_INFO *Info
+    ) ;
+
+ULONG
+ProcList_Delete(
+    __in_bcount(16) const CHAR *ProcessName
+    ) ;
+
+NTSTATUS
+ProcList_SetMonitor(
+    __in const PROCESS_INFO *Info
+    ) ;
+
+ULONG
+ProcList_Query(
+    __out_ecount(MaxCount) PPROCESS_INFO Infos,
+    __in ULONG MaxCount
+    ) ;
+
+BOOLEAN
+ProcList_Lookup(
+    __in_bcount(16) const CHAR *ProcessName,
+    __out PBOOLEAN Monitor
+    ) ;
+
+ULONG
+ProcList_GetGeneration(
+    VOID
+    ) ;
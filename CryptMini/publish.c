@@ -0,0 +1,267 @@
+/*++
+
+Module Name:
+
+    publish.c
+
+Abstract:
+
+    Publication of an immutable table to lock-free readers, shared by the
+    history key list, the process list and the path policy.
+
+    A table is published through one of two slots, each protected by
+    cache-aware run-down protection.  Readers take run-down protection
+    on the active slot, which never blocks and touches a per-processor
+    counter only.  A writer fills the inactive slot after waiting for the
+    readers that picked it before the last flip to leave, then flips the
+    active index; the table it replaces stays valid until the next
+    publish.  Writers are serialized by their caller.
+
+Environment:
+
+    Kernel mode.  Readers at IRQL <= DISPATCH_LEVEL, writers at
+    PASSIVE_LEVEL.
+
+--*/
+#include "publish.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Publish_Init)
+#pragma alloc_text(PAGE, Publish_Uninit)
+#pragma alloc_text(PAGE, Publish_Replace)
+#endif
+
+
+static VOID
+iPublish_Free(
+    __in PPUBLISH Publish,
+    __in PVOID Table
+    )
+{
+	if (Publish->Free != NULL)
+		Publish->Free(Table) ;
+	else
+		ExFreePoolWithTag(Table, Publish->Tag) ;
+}
+
+
+NTSTATUS
+Publish_Init(
+    __out PPUBLISH Publish,
+    __in ULONG Tag,
+    __in_opt PPUBLISH_FREE_ROUTINE Free
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up the two slots, both empty.
+
+Arguments:
+
+    Publish - Publication to set up
+    Tag     - Pool tag of the run-down protection and of the tables
+    Free    - Frees a table, NULL for ExFreePoolWithTag
+
+Return Value:
+
+    Status
+
+--*/
+{
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	RtlZeroMemory(Publish, sizeof(PUBLISH)) ;
+	Publish->Tag = Tag ;
+	Publish->Free = Free ;
+
+	for (i = 0; i < 2; i++)
+	{
+		Publish->Slots[i].Rundown = ExAllocateCacheAwareRundownProtection(NonPagedPool, Tag) ;
+		if (Publish->Slots[i].Rundown == NULL)
+		{
+			Publish_Uninit(Publish) ;
+			return STATUS_INSUFFICIENT_RESOURCES ;
+		}
+	}
+
+	return STATUS_SUCCESS ;
+}
+
+
+VOID
+Publish_Uninit(
+    __inout PPUBLISH Publish
+    )
+/*++
+
+Routine Description:
+
+    This routine waits for readers to leave and frees both tables.
+
+Arguments:
+
+    Publish - Publication from Publish_Init, even a failed one
+
+Return Value:
+
+    None
+
+--*/
+{
+	PPUBLISH_SLOT slot ;
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	for (i = 0; i < 2; i++)
+	{
+		slot = &Publish->Slots[i] ;
+
+		if (slot->Rundown == NULL)
+			continue ;
+
+		ExWaitForRundownProtectionReleaseCacheAware(slot->Rundown) ;
+		ExFreeCacheAwareRundownProtection(slot->Rundown) ;
+		slot->Rundown = NULL ;
+
+		if (slot->Table != NULL)
+		{
+			iPublish_Free(Publish, slot->Table) ;
+			slot->Table = NULL ;
+		}
+	}
+}
+
+
+VOID
+Publish_Replace(
+    __inout PPUBLISH Publish,
+    __in_opt PVOID Table
+    )
+/*++
+
+Routine Description:
+
+    This routine makes Table the one readers see.  It waits for the
+    readers still in the table before the current one, and frees it.
+    Calls must be serialized by the caller.
+
+Arguments:
+
+    Publish - Publication
+    Table   - New table, NULL for none.  Freed by the publication.
+
+Return Value:
+
+    None
+
+--*/
+{
+	PPUBLISH_SLOT slot ;
+	LONG inactive ;
+
+	PAGED_CODE() ;
+
+	inactive = !Publish->Active ;
+	slot = &Publish->Slots[inactive] ;
+
+	//readers that picked this slot before the last flip
+	ExWaitForRundownProtectionReleaseCacheAware(slot->Rundown) ;
+
+	if (slot->Table != NULL)
+		iPublish_Free(Publish, slot->Table) ;
+	slot->Table = Table ;
+
+	ExReInitializeRundownProtectionCacheAware(slot->Rundown) ;
+	InterlockedExchange(&Publish->Active, inactive) ;
+}
+
+
+PVOID
+Publish_GetActive(
+    __in PPUBLISH Publish
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the table readers see, for a writer: only valid
+    while the caller keeps other writers out.
+
+Arguments:
+
+    Publish - Publication
+
+Return Value:
+
+    Active table, or NULL
+
+--*/
+{
+	return Publish->Slots[Publish->Active].Table ;
+}
+
+
+PVOID
+Publish_Acquire(
+    __in PPUBLISH Publish,
+    __deref_out PPUBLISH_SLOT *Slot
+    )
+/*++
+
+Routine Description:
+
+    This routine enters the active table.  It never blocks.
+
+Arguments:
+
+    Publish - Publication
+    Slot    - Receives the slot to pass to Publish_Release
+
+Return Value:
+
+    Active table, or NULL if none is published.  Valid until
+    Publish_Release.
+
+--*/
+{
+	PPUBLISH_SLOT slot ;
+
+	//fails only on a slot a writer is draining, and then the other slot
+	//has just become active
+	do
+	{
+		slot = &Publish->Slots[Publish->Active] ;
+	} while (!ExAcquireRundownProtectionCacheAware(slot->Rundown)) ;
+
+	*Slot = slot ;
+
+	return slot->Table ;
+}
+
+
+VOID
+Publish_Release(
+    __in PPUBLISH_SLOT Slot
+    )
+/*++
+
+Routine Description:
+
+    This routine leaves a table entered with Publish_Acquire.
+
+Arguments:
+
+    Slot - Slot from Publish_Acquire
+
+Return Value:
+
+    None
+
+--*/
+{
+	ExReleaseRundownProtectionCacheAware(Slot->Rundown) ;
+}
@@ -0,0 +1,69 @@
+#include "common.h"
+
+//
+//  Immutable table published through two run-down protected slots, see
+//  publish.c.  The key list, process list and path policy use one each.
+//
+
+//frees a table the slots hold, at PASSIVE_LEVEL
+typedef VOID
+(*PPUBLISH_FREE_ROUTINE)(
+    __in PVOID Table
+    ) ;
+
+typedef struct _PUBLISH_SLOT {
+
+	PEX_RUNDOWN_REF_CACHE_AWARE Rundown ;
+
+	//NULL until a table is published through the slot
+	PVOID Table ;
+
+} PUBLISH_SLOT, *PPUBLISH_SLOT ;
+
+typedef struct _PUBLISH {
+
+	PUBLISH_SLOT Slots[2] ;
+
+	//index of the slot readers take
+	volatile LONG Active ;
+
+	ULONG Tag ;
+
+	//NULL to free tables with ExFreePoolWithTag(Table, Tag)
+	PPUBLISH_FREE_ROUTINE Free ;
+
+} PUBLISH, *PPUBLISH ;
+
+NTSTATUS
+Publish_Init(
+    __out PPUBLISH Publish,
+    __in ULONG Tag,
+    __in_opt PPUBLISH_FREE_ROUTINE Free
+    ) ;
+
+VOID
+Publish_Uninit(
+    __inout PPUBLISH Publish
+    ) ;
+
+VOID
+Publish_Replace(
+    __inout PPUBLISH Publish,
+    __in_opt PVOID Table
+    ) ;
+
+PVOID
+Publish_GetActive(
+    __in PPUBLISH Publish
+    ) ;
+
+PVOID
+Publish_Acquire(
+    __in PPUBLISH Publish,
+    __deref_out PPUBLISH_SLOT *Slot
+    ) ;
+
+VOID
+Publish_Release(
+    __in PPUBLISH_SLOT Slot
+    ) ;
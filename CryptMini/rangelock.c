@@ -0,0 +1,200 @@
+/*++
+
+Module Name:
+
+    rangelock.c
+
+Abstract:
+
+    Byte range locks of a stream.  Non-cached I/Os to disjoint ranges of
+    one file run concurrently; overlapping ranges are serialized when
+    either side is exclusive.  A size change locks from the old end of
+    the file to RANGE_LOCK_TO_END_OF_FILE, so every I/O touching the end
+    of the file waits for it.
+
+    Ranges are granted in arrival order among those that overlap: a range
+    is not granted past an earlier waiting range it conflicts with, so a
+    stream of shared ranges cannot starve an exclusive one.
+
+    The entry is provided by the caller, acquiring a range allocates
+    nothing.
+
+Environment:
+
+    Kernel mode.  Acquire at IRQL <= APC_LEVEL, release at
+    IRQL <= DISPATCH_LEVEL.
+
+--*/
+#include "rangelock.h"
+
+#define iRangeLock_Conflict(_a, _b) \
+	(((_a)->Exclusive || (_b)->Exclusive) && \
+	 (_a)->Start < (_b)->End && (_b)->Start < (_a)->End)
+
+
+static BOOLEAN
+iRangeLock_CanGrant(
+    __in PLIST_ENTRY Granted,
+    __in PLIST_ENTRY Waiting,
+    __in PLIST_ENTRY Until,
+    __in PRANGE_LOCK_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine tells whether a range conflicts with no granted range and
+    with no waiting range queued before Until.
+
+    Called with the range lock spin lock held.
+
+Arguments:
+
+    Granted - Granted list
+    Waiting - Waiting list
+    Until   - First waiting list link not to look at
+    Entry   - Range to grant
+
+Return Value:
+
+    TRUE if Entry can be granted
+
+--*/
+{
+	PLIST_ENTRY link ;
+
+	for (link = Granted->Flink; link != Granted; link = link->Flink)
+	{
+		if (iRangeLock_Conflict(CONTAINING_RECORD(link, RANGE_LOCK_ENTRY, Link), Entry))
+			return FALSE ;
+	}
+
+	for (link = Waiting->Flink; link != Until; link = link->Flink)
+	{
+		if (iRangeLock_Conflict(CONTAINING_RECORD(link, RANGE_LOCK_ENTRY, Link), Entry))
+			return FALSE ;
+	}
+
+	return TRUE ;
+}
+
+
+VOID
+RangeLock_Init(
+    __out PRANGE_LOCK RangeLock
+    )
+{
+	KeInitializeSpinLock(&RangeLock->Lock) ;
+	InitializeListHead(&RangeLock->Granted) ;
+	InitializeListHead(&RangeLock->Waiting) ;
+}
+
+
+VOID
+RangeLock_Acquire(
+    __inout PRANGE_LOCK RangeLock,
+    __out PRANGE_LOCK_ENTRY Entry,
+    __in LONGLONG Start,
+    __in LONGLONG End,
+    __in BOOLEAN Exclusive
+    )
+/*++
+
+Routine Description:
+
+    This routine acquires [Start, End) of a stream, waiting for the
+    conflicting ranges granted or queued before it to be released.
+
+Arguments:
+
+    RangeLock - Range lock of the stream
+    Entry     - Receives the range, kept until RangeLock_Release
+    Start     - First byte
+    End       - Byte after the last one, or RANGE_LOCK_TO_END_OF_FILE
+    Exclusive - TRUE to exclude every overlapping range, FALSE to only
+                exclude the overlapping exclusive ones
+
+Return Value:
+
+    None
+
+--*/
+{
+	KIRQL oldIrql ;
+	BOOLEAN granted ;
+
+	ASSERT(KeGetCurrentIrql() <= APC_LEVEL) ;
+	ASSERT(Start < End) ;
+
+	Entry->Start = Start ;
+	Entry->End = End ;
+	Entry->Exclusive = Exclusive ;
+
+	KeAcquireSpinLock(&RangeLock->Lock, &oldIrql) ;
+
+	granted = iRangeLock_CanGrant(&RangeLock->Granted, &RangeLock->Waiting, &RangeLock->Waiting, Entry) ;
+	if (granted)
+	{
+		InsertTailList(&RangeLock->Granted, &Entry->Link) ;
+	}
+	else
+	{
+		KeInitializeEvent(&Entry->Granted, NotificationEvent, FALSE) ;
+		InsertTailList(&RangeLock->Waiting, &Entry->Link) ;
+	}
+
+	KeReleaseSpinLock(&RangeLock->Lock, oldIrql) ;
+
+	if (!granted)
+		KeWaitForSingleObject(&Entry->Granted, Executive, KernelMode, FALSE, NULL) ;
+}
+
+
+VOID
+RangeLock_Release(
+    __inout PRANGE_LOCK RangeLock,
+    __inout PRANGE_LOCK_ENTRY Entry
+    )
+/*++
+
+Routine Description:
+
+    This routine releases a range and grants the waiting ranges it was
+    the last to block.
+
+Arguments:
+
+    RangeLock - Range lock of the stream
+    Entry     - Range from RangeLock_Acquire
+
+Return Value:
+
+    None
+
+--*/
+{
+	KIRQL oldIrql ;
+	PLIST_ENTRY link ;
+	PLIST_ENTRY next ;
+	PRANGE_LOCK_ENTRY waiter ;
+
+	KeAcquireSpinLock(&RangeLock->Lock, &oldIrql) ;
+
+	RemoveEntryList(&Entry->Link) ;
+
+	for (link = RangeLock->Waiting.Flink; link != &RangeLock->Waiting; link = next)
+	{
+		next = link->Flink ;
+		waiter = CONTAINING_RECORD(link, RANGE_LOCK_ENTRY, Link) ;
+
+		if (!iRangeLock_CanGrant(&RangeLock->Granted, &RangeLock->Waiting, link, waiter))
+			continue ;
+
+		RemoveEntryList(link) ;
+		InsertTailList(&RangeLock->Granted, link) ;
+
+		KeSetEvent(&waiter->Granted, IO_NO_INCREMENT, FALSE) ;
+	}
+
+	KeReleaseSpinLock(&RangeLock->Lock, oldIrql) ;
+}
@@ -0,0 +1,25 @@
+#include "common.h"
+
+//
+//  Byte range locks of a stream
+//
+
+VOID
+RangeLock_Init(
+    __out PRANGE_LOCK RangeLock
+    ) ;
+
+VOID
+RangeLock_Acquire(
+    __inout PRANGE_LOCK RangeLock,
+    __out PRANGE_LOCK_ENTRY Entry,
+    __in LONGLONG Start,
+    __in LONGLONG End,
+    __in BOOLEAN Exclusive
+    ) ;
+
+VOID
+RangeLock_Release(
+    __inout PRANGE_LOCK RangeLock,
+    __inout PRANGE_LOCK_ENTRY Entry
+    ) ;
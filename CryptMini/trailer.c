@@ -0,0 +1,193 @@
+/*++
+
+Module Name:
+
+    trailer.c
+
+Abstract:
+
+    Reading and writing the file flag trailer at the end of encrypted
+    files, or the header at their start on volumes using the header
+    layout.  All trailer I/O is non-cached and sector aligned, and is sent
+    below this filter so it is never transformed.  The flag itself is
+    decoded by flagfmt.c.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL
+
+--*/
+#include "trailer.h"
+#include "bufpool.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Trailer_Read)
+#pragma alloc_text(PAGE, Trailer_Write)
+#endif
+
+C_ASSERT(FLAGFMT_NONCE_SIZE == IV_LENGTH) ;
+C_ASSERT(FLAGFMT_KEY_HASH_SIZE == HASH_SIZE) ;
+
+
+NTSTATUS
+Trailer_Read(
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __in PVOLUME_CONTEXT VolCtx,
+    __out PFILE_FLAG Flag,
+    __out PLARGE_INTEGER FileSize
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the trailer of a file, or its header if the volume
+    uses the header layout, and checks whether it holds a valid file flag
+    of that layout.  The valid length of a header layout file is its size
+    less the header.
+
+Arguments:
+
+    Instance   - Our instance on the volume
+    FileObject - File object opened with read access
+    VolCtx     - Volume context, for the layout
+    Flag       - Receives the file flag
+    FileSize   - Receives the end of file, flag included
+
+Return Value:
+
+    STATUS_SUCCESS     - the file is encrypted, Flag is valid
+    STATUS_NOT_FOUND   - the file has no (valid) trailer
+    other              - the trailer could not be read
+
+--*/
+{
+	NTSTATUS status ;
+	FILE_STANDARD_INFORMATION stdInfo ;
+	LARGE_INTEGER offset ;
+	ULONG flagLen = max(VolCtx->Layout.HeadLength, VolCtx->Layout.TailLength) ;
+	BOOLEAN header = (BOOLEAN)(VolCtx->Layout.Kind == LayoutHeader) ;
+	LONGLONG maxValid ;
+	ULONG bytesRead = 0 ;
+	FLAGFMT_INFO info ;
+	PUCHAR buffer ;
+
+	PAGED_CODE() ;
+
+	status = FltQueryInformationFile(Instance, FileObject, &stdInfo, sizeof(stdInfo), FileStandardInformation, NULL) ;
+	if (!NT_SUCCESS(status))
+		return status ;
+
+	*FileSize = stdInfo.EndOfFile ;
+
+	//a trailer starts on the sector after the padded cipher text
+	offset.QuadPart = Layout_FlagOffset(&VolCtx->Layout, stdInfo.EndOfFile.QuadPart) ;
+	if (offset.QuadPart < 0)
+		return STATUS_NOT_FOUND ;
+
+	maxValid = Layout_ValidLength(&VolCtx->Layout, stdInfo.EndOfFile.QuadPart) ;
+
+	buffer = BufPool_Allocate(flagLen) ;
+	if (buffer == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	status = FltReadFile(Instance, FileObject, &offset, flagLen, buffer,
+		FLTFL_IO_OPERATION_NON_CACHED | FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET,
+		&bytesRead, NULL, NULL) ;
+
+	if (NT_SUCCESS(status))
+	{
+		if (FlagFmt_Read(buffer, bytesRead, &info) != FlagFmtOk ||
+			(info.Version == FLAGFMT_VERSION_3) != header ||
+			(!header && (info.ValidLength < 0 || info.ValidLength > maxValid)))
+		{
+			status = STATUS_NOT_FOUND ;
+		}
+		else
+		{
+			Flag->uVersion = info.Version ;
+			Flag->CipherId = info.CipherId ;
+			RtlCopyMemory(Flag->szKeyHash, info.KeyHash, HASH_SIZE) ;
+			RtlCopyMemory(Flag->szNonce, info.Nonce, IV_LENGTH) ;
+			Flag->FileValidLength.QuadPart = header ? maxValid : info.ValidLength ;
+		}
+	}
+	else if (status == STATUS_END_OF_FILE)
+	{
+		status = STATUS_NOT_FOUND ;
+	}
+
+	BufPool_Free(buffer, flagLen) ;
+
+	return status ;
+}
+
+NTSTATUS
+Trailer_Write(
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __in PVOLUME_CONTEXT VolCtx,
+    __in PFILE_FLAG Flag
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the file flag of a file holding Flag->FileValidLength
+    bytes of plain text where Trailer_Read looks for it: on the sector
+    after the padded plain text, or at the start of the file on volumes
+    using the header layout.  A trailer written past the end of file
+    extends the file to the end of the trailer; shrinking a file is up to
+    the caller.
+
+Arguments:
+
+    Instance   - Our instance on the volume
+    FileObject - File object opened with write access
+    VolCtx     - Volume context, for the layout and cipher
+    Flag       - File flag to write
+
+Return Value:
+
+    Status of the write
+
+--*/
+{
+	NTSTATUS status ;
+	LARGE_INTEGER offset ;
+	ULONG flagLen = max(VolCtx->Layout.HeadLength, VolCtx->Layout.TailLength) ;
+	BOOLEAN header = (BOOLEAN)(VolCtx->Layout.Kind == LayoutHeader) ;
+	ULONG bytesWritten = 0 ;
+	FLAGFMT_INFO info ;
+	PUCHAR buffer ;
+
+	PAGED_CODE() ;
+
+	offset.QuadPart = Layout_FlagOffset(&VolCtx->Layout,
+		Layout_FileSize(&VolCtx->Layout, Flag->FileValidLength.QuadPart)) ;
+
+	RtlZeroMemory(&info, sizeof(info)) ;
+	info.Version = header ? FLAGFMT_VERSION_3 : FLAGFMT_VERSION_2 ;
+	info.CipherId = VolCtx->CipherId ;
+	info.ValidLength = header ? 0 : Flag->FileValidLength.QuadPart ;
+	RtlCopyMemory(info.Nonce, Flag->szNonce, IV_LENGTH) ;
+	RtlCopyMemory(info.KeyHash, Flag->szKeyHash, HASH_SIZE) ;
+
+	buffer = BufPool_Allocate(flagLen) ;
+	if (buffer == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	RtlZeroMemory(buffer, flagLen) ;
+	FlagFmt_Write(&info, buffer) ;
+
+	status = FltWriteFile(Instance, FileObject, &offset, flagLen, buffer,
+		FLTFL_IO_OPERATION_NON_CACHED | FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET,
+		&bytesWritten, NULL, NULL) ;
+
+	if (NT_SUCCESS(status) && bytesWritten != flagLen)
+		status = STATUS_DISK_FULL ;
+
+	BufPool_Free(buffer, flagLen) ;
+
+	return status ;
+}
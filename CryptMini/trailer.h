@@ -0,0 +1,27 @@
+#include "common.h"
+#include "flagfmt.h"
+
+//
+//  File flag trailer of encrypted files, or header on volumes using the
+//  header layout.  See layout.h for where it is and flagfmt.h for what
+//  it holds.  It is one sector on every volume we attach to.
+//
+
+#define TRAILER_TAG                       'rTxC'
+
+NTSTATUS
+Trailer_Read(
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __in PVOLUME_CONTEXT VolCtx,
+    __out PFILE_FLAG Flag,
+    __out PLARGE_INTEGER FileSize
+    ) ;
+
+NTSTATUS
+Trailer_Write(
+    __in PFLT_INSTANCE Instance,
+    __in PFILE_OBJECT FileObject,
+    __in PVOLUME_CONTEXT VolCtx,
+    __in PFILE_FLAG Flag
+    ) ;
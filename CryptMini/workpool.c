@@ -0,0 +1,493 @@
+/*++
+
+Module Name:
+
+    workpool.c
+
+Abstract:
+
+    Work-stealing worker pool.  A caller splits a large job - encrypting
+    a multi-megabyte paging write - into chunks, WorkPool_Run spreads
+    them over the workers and returns once every chunk has run, so the
+    I/O is passed down only after the whole buffer is transformed.
+
+    Every worker owns a bounded ring of chunks.  It runs its own chunks
+    newest first and, when its ring is empty, steals the oldest chunk of
+    another worker's ring.  The caller does not sleep while chunks are
+    queued: it steals too, and only waits for the chunks already running.
+    A chunk that finds its ring full runs inline, so a burst of large
+    writes degrades to single threaded encryption instead of queueing
+    without bound.
+
+    Rings are short and touched a few times per chunk, so each is
+    protected by a queued spin lock of its own.
+
+    Chunk routines run at PASSIVE_LEVEL on a worker and at the caller's
+    IRQL otherwise, and must not fault: paging writes wait on them.
+
+Environment:
+
+    Kernel mode, IRQL <= APC_LEVEL
+
+--*/
+#include "workpool.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, WorkPool_Init)
+#pragma alloc_text(PAGE, WorkPool_Uninit)
+#endif
+
+typedef struct _WORKPOOL_JOB {
+
+	PWORKPOOL_ROUTINE Routine ;
+
+	PVOID Context ;
+
+	//chunks not run yet
+	volatile LONG Remaining ;
+
+	//set by whoever runs the last chunk
+	KEVENT Done ;
+
+} WORKPOOL_JOB, *PWORKPOOL_JOB ;
+
+typedef struct _WORKPOOL_TASK {
+
+	PWORKPOOL_JOB Job ;
+
+	ULONG Index ;
+
+} WORKPOOL_TASK, *PWORKPOOL_TASK ;
+
+typedef struct DECLSPEC_ALIGN(64) _WORKPOOL_WORKER {
+
+	KSPIN_LOCK Lock ;
+
+	//ring of queued chunks: the owner pops at Tail, thieves at Head
+	ULONG uHead ;
+	ULONG uTail ;
+
+	WORKPOOL_TASK Tasks[WORKPOOL_QUEUE_DEPTH] ;
+
+	//set when chunks are queued, or to stop the worker
+	KEVENT Wake ;
+
+	PKTHREAD Thread ;
+
+	ULONG uIndex ;
+
+	//only updated by the worker
+	LONG64 Executed ;
+
+} WORKPOOL_WORKER, *PWORKPOOL_WORKER ;
+
+static PWORKPOOL_WORKER g_WorkPoolWorkers = NULL ;
+
+static PVOID g_WorkPoolBlock = NULL ;
+
+static ULONG g_WorkPoolWorkerCount = 0 ;
+
+static volatile LONG g_WorkPoolNext = 0 ;
+
+static volatile LONG g_WorkPoolStop = FALSE ;
+
+static volatile LONG64 g_WorkPoolStolen = 0 ;
+
+static volatile LONG64 g_WorkPoolInline = 0 ;
+
+static KSTART_ROUTINE iWorkPool_Worker ;
+
+
+static BOOLEAN
+iWorkPool_Push(
+    __in PWORKPOOL_WORKER Worker,
+    __in PWORKPOOL_JOB Job,
+    __in ULONG Index
+    )
+{
+	KLOCK_QUEUE_HANDLE lockHandle ;
+	PWORKPOOL_TASK task ;
+	BOOLEAN pushed = FALSE ;
+
+	KeAcquireInStackQueuedSpinLock(&Worker->Lock, &lockHandle) ;
+
+	if (Worker->uTail - Worker->uHead < WORKPOOL_QUEUE_DEPTH)
+	{
+		task = &Worker->Tasks[Worker->uTail % WORKPOOL_QUEUE_DEPTH] ;
+		task->Job = Job ;
+		task->Index = Index ;
+		Worker->uTail++ ;
+		pushed = TRUE ;
+	}
+
+	KeReleaseInStackQueuedSpinLock(&lockHandle) ;
+
+	return pushed ;
+}
+
+
+static BOOLEAN
+iWorkPool_Pop(
+    __in PWORKPOOL_WORKER Worker,
+    __in BOOLEAN Steal,
+    __out PWORKPOOL_TASK Task
+    )
+{
+	KLOCK_QUEUE_HANDLE lockHandle ;
+	BOOLEAN popped = FALSE ;
+
+	//unlocked peek, a stale value only costs a retry or a missed steal
+	if (Worker->uTail == Worker->uHead)
+		return FALSE ;
+
+	KeAcquireInStackQueuedSpinLock(&Worker->Lock, &lockHandle) ;
+
+	if (Worker->uTail != Worker->uHead)
+	{
+		if (Steal)
+			*Task = Worker->Tasks[Worker->uHead++ % WORKPOOL_QUEUE_DEPTH] ;
+		else
+			*Task = Worker->Tasks[--Worker->uTail % WORKPOOL_QUEUE_DEPTH] ;
+		popped = TRUE ;
+	}
+
+	KeReleaseInStackQueuedSpinLock(&lockHandle) ;
+
+	return popped ;
+}
+
+
+static BOOLEAN
+iWorkPool_Steal(
+    __in ULONG Start,
+    __out PWORKPOOL_TASK Task
+    )
+{
+	ULONG i ;
+
+	for (i = 0; i < g_WorkPoolWorkerCount; i++)
+	{
+		if (iWorkPool_Pop(&g_WorkPoolWorkers[(Start + i) % g_WorkPoolWorkerCount], TRUE, Task))
+		{
+			InterlockedIncrement64(&g_WorkPoolStolen) ;
+			return TRUE ;
+		}
+	}
+
+	return FALSE ;
+}
+
+
+static VOID
+iWorkPool_Execute(
+    __in PWORKPOOL_JOB Job,
+    __in ULONG Index
+    )
+{
+	Job->Routine(Job->Context, Index) ;
+
+	if (InterlockedDecrement(&Job->Remaining) == 0)
+		KeSetEvent(&Job->Done, IO_NO_INCREMENT, FALSE) ;
+}
+
+
+static VOID
+iWorkPool_Worker(
+    __in PVOID StartContext
+    )
+{
+	PWORKPOOL_WORKER worker = StartContext ;
+	WORKPOOL_TASK task ;
+
+	for (;;)
+	{
+		KeWaitForSingleObject(&worker->Wake, Executive, KernelMode, FALSE, NULL) ;
+
+		if (g_WorkPoolStop)
+			break ;
+
+		for (;;)
+		{
+			if (iWorkPool_Pop(worker, FALSE, &task))
+				worker->Executed++ ;
+			else if (!iWorkPool_Steal(worker->uIndex + 1, &task))
+				break ;
+
+			iWorkPool_Execute(task.Job, task.Index) ;
+		}
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS) ;
+}
+
+
+NTSTATUS
+WorkPool_Init(
+    __in ULONG Workers
+    )
+/*++
+
+Routine Description:
+
+    This routine starts the worker threads.  Called from DriverEntry.
+    Pool blocks smaller than a page are only 16 byte aligned, so the
+    block is over-allocated and the workers placed on the next cache
+    line boundary.
+
+Arguments:
+
+    Workers - Number of workers, 0 for one per processor.  Capped at
+              WORKPOOL_MAX_WORKERS.
+
+Return Value:
+
+    Status
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS ;
+	PWORKPOOL_WORKER worker ;
+	HANDLE hThread ;
+	ULONG i ;
+
+	C_ASSERT(TYPE_ALIGNMENT(WORKPOOL_WORKER) == WORKPOOL_WORKER_ALIGNMENT) ;
+
+	if (Workers == 0)
+		Workers = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS) ;
+
+	Workers = min(Workers, WORKPOOL_MAX_WORKERS) ;
+
+	g_WorkPoolBlock = ExAllocatePoolWithTag(NonPagedPool,
+		Workers * sizeof(WORKPOOL_WORKER) + WORKPOOL_WORKER_ALIGNMENT - 1, WORKPOOL_TAG) ;
+	if (g_WorkPoolBlock == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	g_WorkPoolWorkers = (PWORKPOOL_WORKER)(((ULONG_PTR)g_WorkPoolBlock + WORKPOOL_WORKER_ALIGNMENT - 1) &
+		~(ULONG_PTR)(WORKPOOL_WORKER_ALIGNMENT - 1)) ;
+
+	RtlZeroMemory(g_WorkPoolWorkers, Workers * sizeof(WORKPOOL_WORKER)) ;
+
+	g_WorkPoolStop = FALSE ;
+	g_WorkPoolWorkerCount = 0 ;
+
+	for (i = 0; i < Workers; i++)
+	{
+		worker = &g_WorkPoolWorkers[i] ;
+
+		KeInitializeSpinLock(&worker->Lock) ;
+		KeInitializeEvent(&worker->Wake, SynchronizationEvent, FALSE) ;
+		worker->uIndex = i ;
+
+		status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, NULL, NULL, NULL, iWorkPool_Worker, worker) ;
+		if (!NT_SUCCESS(status))
+			break ;
+
+		status = ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, NULL, KernelMode, (PVOID *)&worker->Thread, NULL) ;
+		if (!NT_SUCCESS(status))
+		{
+			//the thread is running already and Uninit has no object to
+			//wait on: stop it here, before its worker is freed
+			worker->Thread = NULL ;
+			InterlockedExchange(&g_WorkPoolStop, TRUE) ;
+			KeSetEvent(&worker->Wake, IO_NO_INCREMENT, FALSE) ;
+			ZwWaitForSingleObject(hThread, FALSE, NULL) ;
+			ZwClose(hThread) ;
+			break ;
+		}
+
+		ZwClose(hThread) ;
+		g_WorkPoolWorkerCount++ ;
+	}
+
+	if (!NT_SUCCESS(status))
+		WorkPool_Uninit() ;
+
+	return status ;
+}
+
+
+VOID
+WorkPool_Uninit(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine stops the worker threads.  Called on unload, when no
+    WorkPool_Run call is in progress any more.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+	PWORKPOOL_WORKER worker ;
+	ULONG i ;
+
+	PAGED_CODE() ;
+
+	if (g_WorkPoolWorkers == NULL)
+		return ;
+
+	InterlockedExchange(&g_WorkPoolStop, TRUE) ;
+
+	for (i = 0; i < g_WorkPoolWorkerCount; i++)
+	{
+		worker = &g_WorkPoolWorkers[i] ;
+
+		KeSetEvent(&worker->Wake, IO_NO_INCREMENT, FALSE) ;
+
+		if (worker->Thread != NULL)
+		{
+			KeWaitForSingleObject(worker->Thread, Executive, KernelMode, FALSE, NULL) ;
+			ObDereferenceObject(worker->Thread) ;
+		}
+	}
+
+	ExFreePoolWithTag(g_WorkPoolBlock, WORKPOOL_TAG) ;
+	g_WorkPoolBlock = NULL ;
+	g_WorkPoolWorkers = NULL ;
+	g_WorkPoolWorkerCount = 0 ;
+}
+
+
+ULONG
+WorkPool_GetWorkerCount(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the number of running workers, 0 if the pool
+    failed to start or is stopped.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    Number of workers
+
+--*/
+{
+	return g_WorkPoolWorkerCount ;
+}
+
+
+VOID
+WorkPool_Run(
+    __in PWORKPOOL_ROUTINE Routine,
+    __in PVOID Context,
+    __in ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    This routine runs Routine(Context, i) for every i in [0, Count) on the
+    workers and the calling thread, and returns when all have run.
+
+    Chunks are dealt round robin over the worker rings, starting at a
+    different worker for each call so that concurrent callers spread.
+    The caller then steals chunks - its own or other callers' - until the
+    rings are empty, and waits for the chunks still running.
+
+    Callable at IRQL <= APC_LEVEL.
+
+Arguments:
+
+    Routine - Chunk routine
+    Context - Passed to Routine
+    Count   - Number of chunks
+
+Return Value:
+
+    None
+
+--*/
+{
+	WORKPOOL_JOB job ;
+	WORKPOOL_TASK task ;
+	PWORKPOOL_WORKER worker ;
+	ULONG start ;
+	ULONG i ;
+
+	if (Count == 0)
+		return ;
+
+	job.Routine = Routine ;
+	job.Context = Context ;
+	job.Remaining = Count ;
+	KeInitializeEvent(&job.Done, NotificationEvent, FALSE) ;
+
+	if (g_WorkPoolWorkerCount == 0)
+	{
+		for (i = 0; i < Count; i++)
+			iWorkPool_Execute(&job, i) ;
+		return ;
+	}
+
+	start = (ULONG)InterlockedIncrement(&g_WorkPoolNext) ;
+
+	for (i = 0; i < Count; i++)
+	{
+		worker = &g_WorkPoolWorkers[(start + i) % g_WorkPoolWorkerCount] ;
+
+		if (iWorkPool_Push(worker, &job, i))
+		{
+			KeSetEvent(&worker->Wake, IO_NO_INCREMENT, FALSE) ;
+		}
+		else
+		{
+			InterlockedIncrement64(&g_WorkPoolInline) ;
+			iWorkPool_Execute(&job, i) ;
+		}
+	}
+
+	while (job.Remaining > 0 && iWorkPool_Steal(start, &task))
+		iWorkPool_Execute(task.Job, task.Index) ;
+
+	//always wait: the last chunk's runner touches the job until the
+	//event is set, and the job lives on this stack
+	KeWaitForSingleObject(&job.Done, Executive, KernelMode, FALSE, NULL) ;
+}
+
+
+VOID
+WorkPool_QueryStats(
+    __out PWORKPOOL_STATS Stats
+    )
+/*++
+
+Routine Description:
+
+    This routine returns a snapshot of the pool counters.
+
+Arguments:
+
+    Stats - Receives the counters
+
+Return Value:
+
+    None
+
+--*/
+{
+	ULONG i ;
+
+	RtlZeroMemory(Stats, sizeof(WORKPOOL_STATS)) ;
+
+	for (i = 0; i < g_WorkPoolWorkerCount; i++)
+		Stats->Executed += g_WorkPoolWorkers[i].Executed ;
+
+	Stats->Stolen = g_WorkPoolStolen ;
+	Stats->Inline = g_WorkPoolInline ;
+}
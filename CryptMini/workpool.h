@@ -0,0 +1,66 @@
+#include "common.h"
+
+//
+//  Pool of worker threads running the chunks of a large transform
+//
+
+#define WORKPOOL_TAG                      'pWxC'
+
+//workers are capped; more would only add stealing traffic
+#define WORKPOOL_MAX_WORKERS              16
+
+//bounded per-worker queue; a chunk that does not fit runs inline
+#define WORKPOOL_QUEUE_DEPTH              64
+
+//alignment of the workers, a cache line
+#define WORKPOOL_WORKER_ALIGNMENT         64
+
+//
+//  Runs one chunk.  Index is in [0, Count) of the WorkPool_Run call.
+//
+
+typedef VOID
+(*PWORKPOOL_ROUTINE)(
+    __in PVOID Context,
+    __in ULONG Index
+    ) ;
+
+typedef struct _WORKPOOL_STATS {
+
+	//chunks run by a worker from its own queue
+	LONG64 Executed ;
+
+	//chunks taken from another worker's queue, by a worker or a caller
+	LONG64 Stolen ;
+
+	//chunks run by the caller because a queue was full
+	LONG64 Inline ;
+
+} WORKPOOL_STATS, *PWORKPOOL_STATS ;
+
+NTSTATUS
+WorkPool_Init(
+    __in ULONG Workers
+    ) ;
+
+VOID
+WorkPool_Uninit(
+    VOID
+    ) ;
+
+ULONG
+WorkPool_GetWorkerCount(
+    VOID
+    ) ;
+
+VOID
+WorkPool_Run(
+    __in PWORKPOOL_ROUTINE Routine,
+    __in PVOID Context,
+    __in ULONG Count
+    ) ;
+
+VOID
+WorkPool_QueryStats(
+    __out PWORKPOOL_STATS Stats
+    ) ;
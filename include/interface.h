@@ -16,6 +16,9 @@
 #define IOCTL_SET_MONITOR          0x00000007
 #define IOCTL_SET_KEYLIST          0x00000008
 #define IOCTL_GET_MONITOR          0x00000009
+#define IOCTL_SET_POLICY           0x0000000A
+#define IOCTL_SET_PARALLEL_THRESHOLD 0x0000000B
+#define IOCTL_GET_STATS            0x0000000C
 
 #define TAG_LENGTH     4 
 #define VERSION_LENGTH 4
@@ -117,6 +120,94 @@ typedef struct _MSG_SEND_SET_HISKEY_INFO{
 
 }MSG_SEND_SET_HISKEY_INFO,*PMSG_SEND_SET_HISKEY_INFO ;
 
+/**
+ * path policy rule. A file is encrypted if its volume relative path lies
+ * under the directory of an include rule and has its extension, and
+ * matches no exclude rule.
+ */
+#define POLICY_ACTION_INCLUDE  0x00000000
+#define POLICY_ACTION_EXCLUDE  0x00000001
+
+#define MAX_POLICY_EXTENSION_LENGTH 16
+
+typedef struct _POLICY_RULE_INFO{
+
+	ULONG uAction ;
+	//e.g. \Projects\ ; empty for the whole volume
+	WCHAR wszDirectory[MAX_PATH] ;
+	//e.g. docx ; empty for any extension
+	WCHAR wszExtension[MAX_POLICY_EXTENSION_LENGTH] ;
+
+}POLICY_RULE_INFO,*PPOLICY_RULE_INFO ;
+
+/**
+ * replace the path policy, no rule removes it (every path is encrypted)
+ */
+typedef struct _MSG_SEND_SET_POLICY_INFO{
+
+	MSG_SEND_TYPE sSendType ;
+	ULONG uRuleCount ;
+	POLICY_RULE_INFO sRules[1] ;
+
+}MSG_SEND_SET_POLICY_INFO,*PMSG_SEND_SET_POLICY_INFO ;
+
+/**
+ * length in bytes from which a non-cached read or write is encrypted or
+ * decrypted on the worker pool, never below one chunk
+ */
+typedef struct _MSG_SEND_SET_PARALLEL_THRESHOLD{
+
+	MSG_SEND_TYPE sSendType ;
+	ULONG uThreshold ;
+
+}MSG_SEND_SET_PARALLEL_THRESHOLD,*PMSG_SEND_SET_PARALLEL_THRESHOLD ;
+
+/**
+ * counters since the driver was loaded, times in 100ns units
+ */
+#define STATS_OPERATION_CREATE 0
+#define STATS_OPERATION_READ   1
+#define STATS_OPERATION_WRITE  2
+#define STATS_OPERATIONS       3
+
+typedef struct _MSG_GET_STATS{
+
+	//pre-operation callbacks, and those that asked for no post-operation
+	//callback, by STATS_OPERATION_XXX
+	LONGLONG llCalls[STATS_OPERATIONS] ;
+	LONGLONG llNoCallback[STATS_OPERATIONS] ;
+
+	//creates, and the trailer probes their streams' first accesses ran
+	LONGLONG llCreates ;
+	LONGLONG llCreateTime ;
+	LONGLONG llCreateMaxTime ;
+	LONGLONG llProbes ;
+	LONGLONG llProbeTime ;
+	LONGLONG llProbeMaxTime ;
+	LONGLONG llProbeCoalesced ;
+	LONGLONG llProbeFailures ;
+
+	//swap buffer pool
+	LONGLONG llBufMagazineHits ;
+	LONGLONG llBufDepotHits ;
+	LONGLONG llBufMisses ;
+	LONGLONG llBufFailures ;
+	LONGLONG llBufBytes ;
+
+	//file flag cache, summed over the volumes
+	LONGLONG llFileCacheHits ;
+	LONGLONG llFileCachePlaintextHits ;
+	LONGLONG llFileCacheMisses ;
+	LONGLONG llFileCacheEvictions ;
+	LONGLONG llFileCacheInvalidations ;
+
+	//process decision cache
+	LONGLONG llPidCacheHits ;
+	LONGLONG llPidCacheMisses ;
+	LONGLONG llPidCacheExits ;
+
+}MSG_GET_STATS,*PMSG_GET_STATS ;
+
 typedef struct _CFG_SECTION1{
 
 	UCHAR szCheckSum[HASH_SIZE] ;
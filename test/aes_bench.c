@@ -0,0 +1,168 @@
+/*++
+
+Module Name:
+
+    aes_bench.c
+
+Abstract:
+
+    Single core throughput of the AES kernels, in GB/s:
+
+        aes_bench [buffer bytes [XTS unit bytes]]
+
+    Counter mode and XTS over one buffer, repeated for about half a second
+    per kernel.  A drive reading 7 GB/s needs the driver to keep up on a
+    couple of cores at most.  Then both over buffers of 4 KiB up to that
+    one, XTS with 512 byte units and with the unit given, 4096 by default
+    as on 4Kn volumes.  XTS runs with a tweak key of its own, as the one
+    Crypt_ExpandKey derives: its schedule is as costly as a random one.
+
+    Last, a scatter list of up to 64 KiB in jobs of 64 bytes to 16 KiB,
+    each of another file with a nonce of its own: counter mode over all
+    of them in one Aes_CtrXorBatch call, as Crypt_TransformBatch makes it,
+    and one Aes_CtrXorAt call per job.
+
+--*/
+#include "aes.h"
+#include "testutil.h"
+
+#include <stdlib.h>
+
+static AES_KEY g_DataKey, g_TweakKey ;
+
+#define BATCH_BYTES     (64 * 1024)
+#define BATCH_JOBS      (BATCH_BYTES / 64)
+
+static AES_CTR_JOB g_Jobs[BATCH_JOBS] ;
+static unsigned char g_Nonces[BATCH_JOBS][16] ;
+
+//counter mode with Unit 0, XTS with units of Unit bytes; for Seconds
+static double
+Measure(size_t Unit, const unsigned char *Nonce, unsigned char *Buffer, size_t Length, double Seconds)
+{
+	unsigned long long offset = 0 ;
+	double start = Now(), elapsed ;
+	size_t bytes = 0 ;
+
+	do
+	{
+		if (Unit != 0)
+			Aes_XtsCrypt(&g_DataKey, &g_TweakKey, Nonce, offset / Unit, Unit, Buffer, Buffer, Length, 0) ;
+		else
+			Aes_CtrXorAt(&g_DataKey, Nonce, offset, Buffer, Buffer, Length) ;
+
+		offset += Length ;
+		bytes += Length ;
+		elapsed = Now() - start ;
+
+	} while (elapsed < Seconds) ;
+
+	return bytes / elapsed / 1e9 ;
+}
+
+//Count jobs of g_Jobs in one batch or one by one, for Seconds
+static double
+MeasureBatch(int Batch, size_t Count, double Seconds)
+{
+	double start = Now(), elapsed ;
+	size_t bytes = 0, i ;
+
+	do
+	{
+		if (Batch)
+		{
+			Aes_CtrXorBatch(g_Jobs, Count) ;
+		}
+		else
+		{
+			for (i = 0; i < Count; i++)
+				Aes_CtrXorAt(g_Jobs[i].Key, g_Jobs[i].Nonce, g_Jobs[i].ByteOffset, g_Jobs[i].In, g_Jobs[i].Out, g_Jobs[i].Length) ;
+		}
+
+		for (i = 0; i < Count; i++)
+			bytes += g_Jobs[i].Length ;
+		elapsed = Now() - start ;
+
+	} while (elapsed < Seconds) ;
+
+	return bytes / elapsed / 1e9 ;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t length = argc > 1 ? (size_t)atol(argv[1]) : 1 << 20 ;
+	size_t unit = argc > 2 ? (size_t)atol(argv[2]) : 4096 ;
+	unsigned char key[AES_KEY_SIZE], tweakKey[AES_KEY_SIZE], nonce[16] ;
+	unsigned char *buffer ;
+	size_t bytes, total, jobLength, count, i ;
+	int impl ;
+
+	//a power of two sector size
+	if (unit < 512 || unit > 65536 || (unit & (unit - 1)) != 0)
+		unit = 4096 ;
+
+	length &= ~(size_t)(unit - 1) ;
+	if (length == 0)
+		length = unit ;
+
+	buffer = malloc(length) ;
+	RandFill(buffer, length) ;
+	RandFill(key, sizeof(key)) ;
+	RandFill(tweakKey, sizeof(tweakKey)) ;
+	RandFill(nonce, sizeof(nonce)) ;
+	RandFill(g_Nonces, sizeof(g_Nonces)) ;
+	total = length < BATCH_BYTES ? length : BATCH_BYTES ;
+
+	for (impl = AesImplScalar; impl <= AesImplNi; impl++)
+	{
+		Aes_Init((AES_IMPL)impl) ;
+		if (Aes_GetImpl() != (AES_IMPL)impl)
+			continue ;
+
+		Aes_SetKey(&g_DataKey, key) ;
+		Aes_SetKey(&g_TweakKey, tweakKey) ;
+
+		printf("%-7s %zu byte buffers: ctr %6.2f GB/s, xts %6.2f GB/s\n",
+			impl == AesImplNi ? "aes-ni" : "scalar",
+			length,
+			Measure(0, nonce, buffer, length, 0.5),
+			Measure(512, nonce, buffer, length, 0.5)) ;
+
+		printf("%10s %8s %8s     xts-%zu\n", "bytes", "ctr", "xts-512", unit) ;
+
+		for (bytes = unit > 4096 ? unit : 4096; bytes <= length; bytes *= 2)
+		{
+			printf("%10zu %8.2f %8.2f %8.2f\n", bytes,
+				Measure(0, nonce, buffer, bytes, 0.1),
+				Measure(512, nonce, buffer, bytes, 0.1),
+				Measure(unit, nonce, buffer, bytes, 0.1)) ;
+		}
+
+		printf("%10s %8s %8s %8s\n", "job bytes", "jobs", "batch", "per job") ;
+
+		for (jobLength = 64; jobLength <= 16384 && jobLength <= total; jobLength *= 4)
+		{
+			count = total / jobLength ;
+
+			//files far apart, the jobs of one I/O at their sector offsets
+			for (i = 0; i < count; i++)
+			{
+				g_Jobs[i].Key = &g_DataKey ;
+				g_Jobs[i].Nonce = g_Nonces[i] ;
+				g_Jobs[i].ByteOffset = (unsigned long long)i * 1048576 + 4096 ;
+				g_Jobs[i].In = buffer + i * jobLength ;
+				g_Jobs[i].Out = buffer + i * jobLength ;
+				g_Jobs[i].Length = jobLength ;
+			}
+
+			printf("%10zu %8zu %8.2f %8.2f\n", jobLength, count,
+				MeasureBatch(1, count, 0.1), MeasureBatch(0, count, 0.1)) ;
+		}
+
+		printf("\n") ;
+	}
+
+	free(buffer) ;
+	return 0 ;
+}
@@ -0,0 +1,339 @@
+/*++
+
+Module Name:
+
+    aes_kat.c
+
+Abstract:
+
+    Known-answer tests of the AES engine, for every kernel the processor
+    supports: FIPS-197 single block, SP 800-38A counter mode, IEEE 1619
+    XTS, and agreement of the byte addressed and batch entry points with
+    plain counter mode.  A range cut into pieces of random offsets and
+    lengths, transformed in shuffled order, must match one pass over it,
+    as the I/Os of a file do the stream of its nonce.
+
+--*/
+#include "aes.h"
+#include "testutil.h"
+
+#include <stdlib.h>
+
+//FIPS-197 appendix C.3
+static const char *g_EcbKey = "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f" ;
+static const char *g_EcbPlain = "00112233445566778899aabbccddeeff" ;
+static const char *g_EcbCipher = "8ea2b7ca516745bfeafc49904b496089" ;
+
+//SP 800-38A F.5.5, CTR-AES256.Encrypt
+static const char *g_CtrKey = "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4" ;
+static const char *g_CtrIv = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff" ;
+static const char *g_CtrPlain =
+	"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710" ;
+static const char *g_CtrCipher =
+	"601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+	"2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6" ;
+
+//IEEE 1619-2007 vector 10, XTS-AES-256, data unit 0xff, plain text 00..ff twice
+static const char *g_XtsKey1 = "2718281828459045235360287471352662497757247093699959574966967627" ;
+static const char *g_XtsKey2 = "3141592653589793238462643383279502884197169399375105820974944592" ;
+static const char *g_XtsCipher =
+	"1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b"
+	"5d31e276f8fe4a8d66b317f9ac683f44680a86ac35adfc3345befecb4bb188fd"
+	"5776926c49a3095eb108fd1098baec70aaa66999a72a82f27d848b21d4a741b0"
+	"c5cd4d5fff9dac89aeba122961d03a757123e9870f8acf1000020887891429ca"
+	"2a3e7a7d7df7b10355165c8b9a6d0a7de8b062c4500dc4cd120c0f7418dae3d0"
+	"b5781c34803fa75421c790dfe1de1834f280d7667b327f6c8cd7557e12ac3a0f"
+	"93ec05c52e0493ef31a12d3d9260f79a289d6a379bc70c50841473d1a8cc81ec"
+	"583e9645e07b8d9670655ba5bbcfecc6dc3966380ad8fecb17b6ba02469a020a"
+	"84e18e8f84252070c13e9f1f289be54fbc481457778f616015e1327a02b140f1"
+	"505eb309326d68378f8374595c849d84f4c333ec4423885143cb47bd71c5edae"
+	"9be69a2ffeceb1bec9de244fbe15992b11b77c040f12bd8f6a975a44a0f90c29"
+	"a9abc3d4d893927284c58754cce294529f8614dcd2aba991925fedc4ae74ffac"
+	"6e333b93eb4aff0479da9a410e4450e0dd7ae4c6e2910900575da401fc07059f"
+	"645e8b7e9bfdef33943054ff84011493c27b3429eaedb4ed5376441a77ed4385"
+	"1ad77f16f541dfd269d50d6a5f14fb0aab1cbb4c1550be97f7ab4066193c4caa"
+	"773dad38014bd2092fa755c824bb5e54c4f36ffda9fcea70b9c6e693e148c151" ;
+
+#define BULK_LENGTH  (64 * 1024 + 7)
+
+static void
+TestBlock(void)
+{
+	AES_KEY key ;
+	unsigned char k[AES_KEY_SIZE], pt[16], ct[16], exp[16], out[16] ;
+
+	Hex(g_EcbKey, k) ;
+	Hex(g_EcbPlain, pt) ;
+	Hex(g_EcbCipher, exp) ;
+
+	Aes_SetKey(&key, k) ;
+	Aes_EncryptBlocks(&key, pt, ct, 1) ;
+	CHECK(memcmp(ct, exp, 16) == 0) ;
+
+	Aes_DecryptBlocks(&key, ct, out, 1) ;
+	CHECK(memcmp(out, pt, 16) == 0) ;
+}
+
+static void
+TestCtr(void)
+{
+	AES_KEY key ;
+	unsigned char k[AES_KEY_SIZE], iv[16], pt[64], exp[64], out[64] ;
+	size_t off, len ;
+
+	Hex(g_CtrKey, k) ;
+	Hex(g_CtrIv, iv) ;
+	Hex(g_CtrPlain, pt) ;
+	Hex(g_CtrCipher, exp) ;
+	Aes_SetKey(&key, k) ;
+
+	Aes_CtrXor(&key, iv, 0, pt, out, 64) ;
+	CHECK(memcmp(out, exp, 64) == 0) ;
+
+	Aes_CtrXor(&key, iv, 1, pt + 16, out, 37) ;
+	CHECK(memcmp(out, exp + 16, 37) == 0) ;
+
+	//any byte range of the stream, the nonce being the counter block of offset 0
+	for (off = 0; off < 64; off++)
+	{
+		for (len = 0; off + len <= 64; len++)
+		{
+			memset(out, 0, sizeof(out)) ;
+			Aes_CtrXorAt(&key, iv, off, pt + off, out, len) ;
+			CHECK(memcmp(out, exp + off, len) == 0) ;
+		}
+	}
+
+	//in place
+	memcpy(out, pt, 64) ;
+	Aes_CtrXorAt(&key, iv, 0, out, out, 64) ;
+	CHECK(memcmp(out, exp, 64) == 0) ;
+}
+
+static void
+TestXts(void)
+{
+	AES_KEY k1, k2 ;
+	unsigned char key[AES_KEY_SIZE], nonce[16] = { 0 }, pt[512], exp[512], out[512] ;
+	size_t i ;
+
+	Hex(g_XtsKey1, key) ;
+	Aes_SetKey(&k1, key) ;
+	Hex(g_XtsKey2, key) ;
+	Aes_SetKey(&k2, key) ;
+	Hex(g_XtsCipher, exp) ;
+
+	for (i = 0; i < sizeof(pt); i++)
+		pt[i] = (unsigned char)i ;
+
+	Aes_XtsCrypt(&k1, &k2, nonce, 0xff, 512, pt, out, 512, 0) ;
+	CHECK(memcmp(out, exp, 512) == 0) ;
+
+	Aes_XtsCrypt(&k1, &k2, nonce, 0xff, 512, exp, out, 512, 1) ;
+	CHECK(memcmp(out, pt, 512) == 0) ;
+
+	//the nonce is added to the unit index
+	nonce[0] = 0x7f ;
+	Aes_XtsCrypt(&k1, &k2, nonce, 0x80, 512, pt, out, 512, 0) ;
+	CHECK(memcmp(out, exp, 512) == 0) ;
+}
+
+static void
+TestBatch(void)
+{
+	AES_KEY keys[3] ;
+	unsigned char k[AES_KEY_SIZE], nonces[3][16] ;
+	unsigned char *in = malloc(BULK_LENGTH), *out = malloc(BULK_LENGTH), *exp = malloc(BULK_LENGTH) ;
+	AES_CTR_JOB jobs[40] ;
+	int round, i ;
+
+	for (i = 0; i < 3; i++)
+	{
+		RandFill(k, sizeof(k)) ;
+		Aes_SetKey(&keys[i], k) ;
+		RandFill(nonces[i], 16) ;
+	}
+
+	//counter carries across the low bytes
+	memset(nonces[2], 0xff, 16) ;
+
+	RandFill(in, BULK_LENGTH) ;
+
+	for (round = 0; round < 200; round++)
+	{
+		size_t pos = 0, count = 1 + Rand() % 40 ;
+
+		//short, unaligned and long jobs over several keys, back to back in one buffer
+		for (i = 0; i < (int)count; i++)
+		{
+			size_t length = Rand() % 4 == 0 ? Rand() % 1500 : Rand() % 40 ;
+
+			if (pos + length > BULK_LENGTH)
+				length = BULK_LENGTH - pos ;
+
+			jobs[i].Key = &keys[Rand() % 3] ;
+			jobs[i].Nonce = nonces[jobs[i].Key - keys] ;
+			jobs[i].ByteOffset = Rand() % (1ULL << 40) ;
+			jobs[i].In = in + pos ;
+			jobs[i].Out = out + pos ;
+			jobs[i].Length = length ;
+
+			Aes_CtrXorAt(jobs[i].Key, jobs[i].Nonce, jobs[i].ByteOffset, in + pos, exp + pos, length) ;
+			pos += length ;
+		}
+
+		Aes_CtrXorBatch(jobs, count) ;
+		CHECK(memcmp(out, exp, pos) == 0) ;
+	}
+
+	free(in) ;
+	free(out) ;
+	free(exp) ;
+}
+
+#define PIECES_LENGTH   (64 * 1024)
+#define MAX_PIECES      256
+
+static void
+TestCtrPieces(void)
+{
+	AES_KEY key ;
+	unsigned char k[AES_KEY_SIZE], nonce[16] ;
+	unsigned char *in = malloc(PIECES_LENGTH), *whole = malloc(PIECES_LENGTH), *pieces = malloc(PIECES_LENGTH) ;
+	size_t cuts[MAX_PIECES + 1], order[MAX_PIECES], count, i, j, t ;
+	unsigned long long base ;
+	int round ;
+
+	for (round = 0; round < 50; round++)
+	{
+		RandFill(in, PIECES_LENGTH) ;
+		RandFill(k, sizeof(k)) ;
+		RandFill(nonce, sizeof(nonce)) ;
+		Aes_SetKey(&key, k) ;
+
+		base = Rand() >> 1 ;
+		if (round % 4 == 1)
+			base = 0 ;
+
+		//now and then a counter carrying out of its low 64 bits within
+		//the range, the nonce being big endian
+		if (round % 4 == 0)
+		{
+			unsigned long long low = 0 - base / 16 - 1 - Rand() % (PIECES_LENGTH / 16) ;
+
+			for (i = 0; i < 8; i++)
+				nonce[15 - i] = (unsigned char)(low >> (i * 8)) ;
+		}
+
+		Aes_CtrXorAt(&key, nonce, base, in, whole, PIECES_LENGTH) ;
+
+		//mostly short pieces, within a block or across one, some long
+		cuts[0] = 0 ;
+		for (count = 0; cuts[count] < PIECES_LENGTH; count++)
+		{
+			size_t length = Rand() % 4 == 0 ? Rand() % 8192 : Rand() % 64 ;
+
+			if (count == MAX_PIECES - 1 || cuts[count] + length > PIECES_LENGTH)
+				length = PIECES_LENGTH - cuts[count] ;
+			cuts[count + 1] = cuts[count] + length ;
+		}
+
+		for (i = 0; i < count; i++)
+			order[i] = i ;
+		for (i = count; i > 1; i--)
+		{
+			j = Rand() % i ;
+			t = order[i - 1] ;
+			order[i - 1] = order[j] ;
+			order[j] = t ;
+		}
+
+		//in place and out of place
+		memcpy(pieces, in, PIECES_LENGTH) ;
+		for (i = 0; i < count; i++)
+		{
+			j = order[i] ;
+			Aes_CtrXorAt(&key, nonce, base + cuts[j], (j & 1) ? in + cuts[j] : pieces + cuts[j],
+				pieces + cuts[j], cuts[j + 1] - cuts[j]) ;
+		}
+
+		CHECK(memcmp(pieces, whole, PIECES_LENGTH) == 0) ;
+	}
+
+	free(in) ;
+	free(whole) ;
+	free(pieces) ;
+}
+
+static void
+TestKernelsAgree(void)
+{
+	AES_KEY key ;
+	unsigned char k[AES_KEY_SIZE], nonce[16] ;
+	unsigned char *in = malloc(BULK_LENGTH), *a = malloc(BULK_LENGTH), *b = malloc(BULK_LENGTH) ;
+	int round ;
+
+	if (Aes_GetImpl() != AesImplNi)
+	{
+		free(in) ;
+		free(a) ;
+		free(b) ;
+		return ;
+	}
+
+	RandFill(in, BULK_LENGTH) ;
+
+	for (round = 0; round < 200; round++)
+	{
+		size_t skip = Rand() % 16, length = Rand() % (BULK_LENGTH - 16) ;
+		unsigned long long offset = Rand() ;
+
+		RandFill(k, sizeof(k)) ;
+		RandFill(nonce, sizeof(nonce)) ;
+		Aes_SetKey(&key, k) ;
+
+		Aes_Init(AesImplScalar) ;
+		Aes_CtrXorAt(&key, nonce, offset, in + skip, a, length) ;
+		Aes_Init(AesImplNi) ;
+		Aes_CtrXorAt(&key, nonce, offset, in + skip, b, length) ;
+		CHECK(memcmp(a, b, length) == 0) ;
+
+		length &= ~(size_t)511 ;
+		Aes_Init(AesImplScalar) ;
+		Aes_XtsCrypt(&key, &key, nonce, offset, 512, in, a, length, round & 1) ;
+		Aes_Init(AesImplNi) ;
+		Aes_XtsCrypt(&key, &key, nonce, offset, 512, in, b, length, round & 1) ;
+		CHECK(memcmp(a, b, length) == 0) ;
+	}
+
+	free(in) ;
+	free(a) ;
+	free(b) ;
+}
+
+int
+main(void)
+{
+	int impl ;
+
+	for (impl = AesImplScalar; impl <= AesImplNi; impl++)
+	{
+		Aes_Init((AES_IMPL)impl) ;
+		if (Aes_GetImpl() != (AES_IMPL)impl)
+		{
+			printf("kernel %d not supported here, skipped\n", impl) ;
+			continue ;
+		}
+
+		TestBlock() ;
+		TestCtr() ;
+		TestXts() ;
+		TestBatch() ;
+		TestCtrPieces() ;
+		TestKernelsAgree() ;
+		printf("kernel %s done\n", impl == AesImplNi ? "aes-ni" : "scalar") ;
+	}
+
+	return Report("aes_kat") ;
+}
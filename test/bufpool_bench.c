@@ -0,0 +1,118 @@
+/*++
+
+Module Name:
+
+    bufpool_bench.c
+
+Abstract:
+
+    Swap buffer pool against the C heap, in million allocate/free pairs
+    per second:
+
+        bufpool_bench [pairs per thread]
+
+    Each thread takes a few page aligned buffers of one size, writes their
+    first byte and gives them back, as the write and paging read paths do
+    with their swap buffers; BufPool_Allocate/BufPool_Free on one side,
+    aligned_alloc/free on the other, from 1 to 64 threads on the virtual
+    processors of wdk/ (WDK_CPUS, by default the online ones).  Threads
+    beyond the real processors only show the contention, not a speedup.
+
+--*/
+#include <stdlib.h>
+
+#include "bufpool.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define HELD            4
+
+static ULONG g_Pairs = 100000 ;
+static ULONG g_Length ;
+static BOOLEAN g_Heap ;
+
+static void
+Loop(PVOID Context, ULONG Index)
+{
+	PUCHAR held[HELD] ;
+	ULONG n, i ;
+
+	(void)Context ; (void)Index ;
+
+	for (n = 0; n < g_Pairs; n += HELD)
+	{
+		for (i = 0; i < HELD; i++)
+		{
+			held[i] = g_Heap ? aligned_alloc(PAGE_SIZE, g_Length) : BufPool_Allocate(g_Length) ;
+			if (held[i] != NULL)
+				held[i][0] = (UCHAR)n ;
+		}
+
+		for (i = 0; i < HELD; i++)
+		{
+			if (held[i] == NULL)
+				continue ;
+
+			if (g_Heap)
+				free(held[i]) ;
+			else
+				BufPool_Free(held[i], g_Length) ;
+		}
+	}
+}
+
+static double
+Measure(BOOLEAN Heap, ULONG Threads)
+{
+	double start ;
+
+	g_Heap = Heap ;
+
+	//once untimed, so both start with warm caches
+	Wdk_RunThreads(Threads, Loop, NULL) ;
+
+	start = Now() ;
+	Wdk_RunThreads(Threads, Loop, NULL) ;
+
+	return (double)g_Pairs * Threads / (Now() - start) / 1e6 ;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const ULONG lengths[] = { 4 * 1024, 64 * 1024 } ;
+	BUFPOOL_STATS stats ;
+	ULONG threads ;
+	int i ;
+
+	if (argc > 1)
+		g_Pairs = (ULONG)atol(argv[1]) ;
+	g_Pairs = (ULONG)ROUND_TO_SIZE(g_Pairs ? g_Pairs : 1, HELD) ;
+
+	if (!NT_SUCCESS(BufPool_Init((SIZE_T)1 << 30)))
+		return 1 ;
+
+	printf("%u virtual processors, %u pairs per thread\n", Wdk_CpuCount(), g_Pairs) ;
+	printf("%8s %8s %12s %12s %8s\n", "bytes", "threads", "bufpool", "malloc", "ratio") ;
+
+	for (i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++)
+	{
+		g_Length = lengths[i] ;
+
+		for (threads = 1; threads <= 64; threads *= 2)
+		{
+			double pool = Measure(FALSE, threads) ;
+			double heap = Measure(TRUE, threads) ;
+
+			printf("%8u %8u %12.2f %12.2f %8.2f\n", g_Length, threads, pool, heap, pool / heap) ;
+		}
+	}
+
+	BufPool_QueryStats(&stats) ;
+	printf("magazine hits %lld, depot hits %lld, misses %lld, failures %lld\n",
+		(long long)stats.MagazineHits, (long long)stats.DepotHits, (long long)stats.Misses, (long long)stats.Failures) ;
+
+	BufPool_Uninit() ;
+
+	return 0 ;
+}
@@ -0,0 +1,237 @@
+/*++
+
+Module Name:
+
+    bufpool_test.c
+
+Abstract:
+
+    Swap buffer pool under 64 threads.
+
+    Builds bufpool.c against the threaded kernel stand-ins of wdk/, with
+    16 virtual processors unless WDK_CPUS says otherwise, so magazines
+    fill, spill into the depots and refill from them across processors.
+    Each thread holds a few buffers at a time and stamps them; a buffer
+    handed out twice, or freed into the wrong class, shows as a stamp
+    overwritten while held.
+
+    The ceiling is checked under contention on a small pool, and the
+    pool's byte count against what it really holds in system pool.
+
+--*/
+#include <stdlib.h>
+
+#include "bufpool.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define THREADS         64
+#define ITERATIONS      4000
+#define HELD            4
+
+typedef struct _HELD_BUFFER {
+
+	PULONG64 Buffer ;
+	ULONG Length ;
+	ULONG64 Stamp ;
+
+} HELD_BUFFER ;
+
+#define SQUEEZE_ROUNDS  8
+
+static volatile LONG g_Failed ;
+static volatile LONG g_Arrived ;
+static LONG64 g_Ceiling ;
+
+//rarely past the largest class, mostly the small ones
+static ULONG
+RandomLength(unsigned long long *State)
+{
+	ULONG r ;
+
+	*State ^= *State << 13 ;
+	*State ^= *State >> 7 ;
+	*State ^= *State << 17 ;
+	r = (ULONG)(*State % 1000) ;
+
+	if (r < 5)
+		return BUFPOOL_MAX_CACHED_SIZE + PAGE_SIZE + r ;
+	if (r < 40)
+		return BUFPOOL_MAX_CACHED_SIZE - r ;
+	if (r < 300)
+		return 64 * 1024 - r ;
+
+	return 1 + r * 4 ;
+}
+
+static void
+Stamp(HELD_BUFFER *Held)
+{
+	ULONG last = Held->Length / sizeof(ULONG64) - 1 ;
+
+	Held->Buffer[0] = Held->Stamp ;
+	Held->Buffer[last / 2] = Held->Stamp ;
+	Held->Buffer[last] = Held->Stamp ;
+}
+
+static BOOLEAN
+StampIntact(HELD_BUFFER *Held)
+{
+	ULONG last = Held->Length / sizeof(ULONG64) - 1 ;
+
+	return Held->Buffer[0] == Held->Stamp && Held->Buffer[last / 2] == Held->Stamp && Held->Buffer[last] == Held->Stamp ;
+}
+
+//random lengths, a few buffers held at a time
+static void
+Churn(PVOID Context, ULONG Index)
+{
+	HELD_BUFFER held[HELD] ;
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	ULONG i ;
+	int n ;
+
+	(void)Context ;
+
+	memset(held, 0, sizeof(held)) ;
+
+	for (n = 0; n < ITERATIONS; n++)
+	{
+		HELD_BUFFER *h = &held[n % HELD] ;
+
+		//interleave the threads even on one processor
+		if (n % 16 == 0)
+			sched_yield() ;
+
+		if (h->Buffer != NULL)
+		{
+			CHECK(StampIntact(h)) ;
+			BufPool_Free(h->Buffer, h->Length) ;
+			h->Buffer = NULL ;
+			continue ;
+		}
+
+		h->Length = (ULONG)ROUND_TO_SIZE(RandomLength(&state), sizeof(ULONG64)) ;
+		h->Buffer = BufPool_Allocate(h->Length) ;
+		CHECK(h->Buffer != NULL) ;
+		if (h->Buffer == NULL)
+			continue ;
+
+		CHECK(((ULONG_PTR)h->Buffer & (PAGE_SIZE - 1)) == 0) ;
+
+		h->Stamp = ((ULONG64)Index << 32) | (ULONG)n ;
+		Stamp(h) ;
+	}
+
+	for (i = 0; i < HELD; i++)
+	{
+		if (held[i].Buffer != NULL)
+		{
+			CHECK(StampIntact(&held[i])) ;
+			BufPool_Free(held[i].Buffer, held[i].Length) ;
+		}
+	}
+}
+
+//every thread holds HELD 64 KiB buffers at once, more than the ceiling
+static void
+Squeeze(PVOID Context, ULONG Index)
+{
+	HELD_BUFFER held[HELD] ;
+	BUFPOOL_STATS stats ;
+	ULONG i ;
+	LONG round ;
+
+	(void)Context ;
+
+	for (round = 1; round <= SQUEEZE_ROUNDS; round++)
+	{
+		for (i = 0; i < HELD; i++)
+		{
+			held[i].Length = 64 * 1024 ;
+			held[i].Buffer = BufPool_Allocate(held[i].Length) ;
+
+			BufPool_QueryStats(&stats) ;
+			CHECK(stats.Bytes <= g_Ceiling) ;
+
+			if (held[i].Buffer == NULL)
+			{
+				InterlockedIncrement(&g_Failed) ;
+				continue ;
+			}
+
+			held[i].Stamp = ((ULONG64)Index << 32) | (ULONG)(round * HELD + i) ;
+			Stamp(&held[i]) ;
+		}
+
+		InterlockedIncrement(&g_Arrived) ;
+		while (g_Arrived < round * THREADS)
+			sched_yield() ;
+
+		for (i = 0; i < HELD; i++)
+		{
+			if (held[i].Buffer != NULL)
+			{
+				CHECK(StampIntact(&held[i])) ;
+				BufPool_Free(held[i].Buffer, held[i].Length) ;
+			}
+		}
+	}
+}
+
+//what the pool counts is what it holds in system pool, less the magazines
+static void
+CheckBytes(void)
+{
+	BUFPOOL_STATS stats ;
+	SIZE_T magazines = g_BufPoolCpuCount * sizeof(BUFPOOL_CPU) + BUFPOOL_CPU_ALIGNMENT - 1 ;
+
+	BufPool_QueryStats(&stats) ;
+	CHECK(Wdk_PoolBytes(BUFFER_SWAP_TAG) == stats.Bytes + (LONG64)magazines) ;
+}
+
+int
+main(void)
+{
+	BUFPOOL_STATS stats ;
+
+	setenv("WDK_CPUS", "16", 0) ;
+
+	//plenty of room: nothing may fail
+	g_Ceiling = 1024 * 1024 * 1024 ;
+	CHECK(NT_SUCCESS(BufPool_Init((SIZE_T)g_Ceiling))) ;
+	CHECK(((ULONG_PTR)g_BufPoolCpu & (BUFPOOL_CPU_ALIGNMENT - 1)) == 0) ;
+
+	Wdk_RunThreads(THREADS, Churn, NULL) ;
+
+	BufPool_QueryStats(&stats) ;
+	CHECK(stats.Failures == 0) ;
+	CHECK(stats.MagazineHits > 0 && stats.DepotHits > 0 && stats.Misses > 0) ;
+	CheckBytes() ;
+
+	BufPool_Trim() ;
+	CheckBytes() ;
+
+	BufPool_Uninit() ;
+	CHECK(Wdk_PoolBytes(BUFFER_SWAP_TAG) == 0) ;
+
+	//threads want 16 MiB at once from an 8 MiB pool
+	g_Ceiling = 8 * 1024 * 1024 ;
+	CHECK(NT_SUCCESS(BufPool_Init((SIZE_T)g_Ceiling))) ;
+
+	Wdk_RunThreads(THREADS, Squeeze, NULL) ;
+
+	BufPool_QueryStats(&stats) ;
+	CHECK(g_Failed > 0 && stats.Failures == g_Failed) ;
+	CHECK(stats.Bytes <= g_Ceiling) ;
+	CheckBytes() ;
+
+	//lowering the ceiling returns what is over it
+	BufPool_SetLimit(1024 * 1024) ;
+	CheckBytes() ;
+
+	BufPool_Uninit() ;
+	CHECK(Wdk_PoolBytes(BUFFER_SWAP_TAG) == 0) ;
+
+	return Report("bufpool_test") ;
+}
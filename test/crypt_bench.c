@@ -0,0 +1,142 @@
+/*++
+
+Module Name:
+
+    crypt_bench.c
+
+Abstract:
+
+    Crypt_Transform on one volume from 1 to 16 threads:
+
+        crypt_bench [transforms per thread]
+
+    Every thread encrypts and decrypts 64 KiB of its own at its own file
+    offset, with the volume context and the key cache entry of the file
+    shared by all, in counter mode and in XTS.  Next to that the same
+    calls serialized by one spin lock of the volume, as FsCryptSpinLock
+    and FsCtxTableMutex did, in GB/s and as speedup over one thread.
+    Threads run on the virtual processors of wdk/; beyond the real
+    processors they only show the contention, not a speedup.
+
+--*/
+#include <stdlib.h>
+
+#include "crypt.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define THREAD_BYTES    (64 * 1024)
+#define MAX_THREADS     16
+
+static ULONG g_Transforms = 2000 ;
+static VOLUME_CONTEXT g_VolCtx ;
+static KEY_CACHE_ENTRY g_KeyEntry ;
+static UCHAR g_Nonce[IV_LENGTH] ;
+static KSPIN_LOCK g_VolumeLock ;
+static PUCHAR g_Buffers[MAX_THREADS] ;
+static PUCHAR g_Plain[MAX_THREADS] ;
+
+static VOID
+Transform(PVOID Context, ULONG Index)
+{
+	BOOLEAN locked = Context != NULL ;
+	LONGLONG offset = (LONGLONG)Index * THREAD_BYTES ;
+	KIRQL oldIrql ;
+	ULONG n ;
+
+	for (n = 0; n < g_Transforms; n++)
+	{
+		if (locked)
+			KeAcquireSpinLock(&g_VolumeLock, &oldIrql) ;
+
+		CHECK(NT_SUCCESS(Crypt_Transform(&g_VolCtx, &g_KeyEntry, g_Nonce, offset,
+			g_Buffers[Index], g_Buffers[Index], THREAD_BYTES, n % 2 == 0))) ;
+
+		if (locked)
+			KeReleaseSpinLock(&g_VolumeLock, oldIrql) ;
+	}
+}
+
+//GB/s over all threads
+static double
+Throughput(ULONG Threads, BOOLEAN Locked)
+{
+	double start ;
+	ULONG i ;
+
+	start = Now() ;
+	Wdk_RunThreads(Threads, Transform, Locked ? (PVOID)1 : NULL) ;
+
+	//an even count of transforms: each buffer is back to plain text
+	for (i = 0; i < Threads; i++)
+		CHECK(memcmp(g_Buffers[i], g_Plain[i], THREAD_BYTES) == 0) ;
+
+	return (double)THREAD_BYTES * g_Transforms * Threads / (Now() - start) / 1e9 ;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const ULONG ciphers[] = { CRYPT_CIPHER_AES256_CTR, CRYPT_CIPHER_AES256_XTS } ;
+	UCHAR key[AES_KEY_SIZE] ;
+	double alone, locked, alone1, locked1 ;
+	ULONG threads, i ;
+
+	if (argc > 1)
+		g_Transforms = (ULONG)atol(argv[1]) ;
+	g_Transforms += g_Transforms % 2 ;
+	if (g_Transforms == 0)
+		g_Transforms = 2 ;
+
+	Aes_Init(AesImplNi) ;
+	RandFill(key, sizeof(key)) ;
+	Aes_SetKey(&g_KeyEntry.Key, key) ;
+	RandFill(key, sizeof(key)) ;
+	Aes_SetKey(&g_KeyEntry.TweakKey, key) ;
+	RandFill(g_Nonce, sizeof(g_Nonce)) ;
+	KeInitializeSpinLock(&g_VolumeLock) ;
+	g_VolCtx.SectorSize = 512 ;
+
+	for (i = 0; i < MAX_THREADS; i++)
+	{
+		g_Buffers[i] = malloc(THREAD_BYTES) ;
+		g_Plain[i] = malloc(THREAD_BYTES) ;
+		RandFill(g_Plain[i], THREAD_BYTES) ;
+		memcpy(g_Buffers[i], g_Plain[i], THREAD_BYTES) ;
+	}
+
+	printf("%u virtual processors, %u transforms of %u KiB per thread\n",
+		Wdk_CpuCount(), g_Transforms, THREAD_BYTES / 1024) ;
+
+	for (i = 0; i < sizeof(ciphers) / sizeof(ciphers[0]); i++)
+	{
+		g_VolCtx.CipherId = ciphers[i] ;
+
+		printf("\n%s\n%8s %10s %8s %10s %8s\n", ciphers[i] == CRYPT_CIPHER_AES256_XTS ? "XTS" : "CTR",
+			"threads", "GB/s", "speedup", "locked", "speedup") ;
+
+		alone1 = locked1 = 0 ;
+
+		for (threads = 1; threads <= MAX_THREADS; threads *= 2)
+		{
+			alone = Throughput(threads, FALSE) ;
+			locked = Throughput(threads, TRUE) ;
+
+			if (threads == 1)
+			{
+				alone1 = alone ;
+				locked1 = locked ;
+			}
+
+			printf("%8u %10.2f %8.2f %10.2f %8.2f\n", threads, alone, alone / alone1, locked, locked / locked1) ;
+		}
+	}
+
+	for (i = 0; i < MAX_THREADS; i++)
+	{
+		free(g_Buffers[i]) ;
+		free(g_Plain[i]) ;
+	}
+
+	return Report("crypt_bench") ;
+}
@@ -0,0 +1,223 @@
+/*++
+
+Module Name:
+
+    ctxlayout_bench.c
+
+Abstract:
+
+    Hot field reads of a stream context against writes of its cold
+    fields, for the layout before the hot/cold split and the one now:
+
+        ctxlayout_bench [checks per reader]
+
+    Readers on 1 to 8 threads do what every read and write does first:
+    test a flag and read FileValidLength and FileSize.  They run alone,
+    then next to one thread doing what creates, cleanups and raised irql
+    callers do: take and release the context spin lock and count the
+    stream's creates in RefCount.  In the old layout those share a cache
+    line with the sizes and the flags; now the hot fields have the first
+    line to themselves.  The old layout is copied here from before the
+    split, its readers use plain loads; the new one is read with
+    SC_TEST_FLAG and SC_READ_SIZES as the driver does.  Both contexts are
+    cache line aligned.  In million checks per second, on the virtual
+    processors of wdk/: the writer only slows readers down by sharing
+    their line on a machine with more than one real processor.
+
+--*/
+#include <stdlib.h>
+
+#include "ctx.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define CACHE_LINE      64
+#define MAX_READERS     8
+
+//STREAM_CONTEXT before the hot/cold split
+typedef struct _OLD_STREAM_CONTEXT {
+
+	UNICODE_STRING FileName ;
+	WCHAR wszVolumeName[64] ;
+	UCHAR szKeyHash[HASH_SIZE] ;
+	LONG RefCount ;
+	LARGE_INTEGER FileValidLength ;
+	LARGE_INTEGER FileSize ;
+	ULONG uTrailLength ;
+	ULONG uAccess ;
+	BOOLEAN bIsFileCrypt ;
+	BOOLEAN bEncryptOnWrite ;
+	BOOLEAN bDecryptOnRead ;
+	BOOLEAN bHasWriteData ;
+	BOOLEAN bFirstWriteNotFromBeg ;
+	BOOLEAN bHasPPTWriteData ;
+	PERESOURCE Resource ;
+	KSPIN_LOCK Resource1 ;
+
+} OLD_STREAM_CONTEXT, *POLD_STREAM_CONTEXT ;
+
+static ULONG g_Checks = 2000000 ;
+static POLD_STREAM_CONTEXT g_Old ;
+static PSTREAM_CONTEXT g_New ;
+static volatile LONG g_Running ;
+static volatile LONG g_Sink ;
+
+static void
+Line(const char *Name, size_t Offset, size_t Size)
+{
+	printf("    %-16s %4zu  line %zu%s\n", Name, Offset, Offset / CACHE_LINE,
+		Offset / CACHE_LINE != (Offset + Size - 1) / CACHE_LINE ? " and next" : "") ;
+}
+
+static ULONG
+ReadOld(void)
+{
+	volatile OLD_STREAM_CONTEXT *sc = g_Old ;
+	ULONG found = 0 ;
+	ULONG n ;
+
+	for (n = 0; n < g_Checks; n++)
+	{
+		if (sc->bDecryptOnRead)
+			found += (ULONG)(sc->FileSize.QuadPart - sc->FileValidLength.QuadPart) ;
+	}
+
+	return found ;
+}
+
+static ULONG
+ReadNew(void)
+{
+	LARGE_INTEGER validLength, fileSize ;
+	ULONG found = 0 ;
+	ULONG n ;
+
+	for (n = 0; n < g_Checks; n++)
+	{
+		if (SC_TEST_FLAG(g_New, SC_FLAG_DECRYPT_ON_READ))
+		{
+			SC_READ_SIZES(g_New, &validLength, &fileSize) ;
+			found += (ULONG)(fileSize.QuadPart - validLength.QuadPart) ;
+		}
+	}
+
+	return found ;
+}
+
+static void
+Write(BOOLEAN Old)
+{
+	KIRQL oldIrql ;
+
+	while (g_Running != 0)
+	{
+		if (Old)
+		{
+			KeAcquireSpinLock(&g_Old->Resource1, &oldIrql) ;
+			InterlockedIncrement(&g_Old->RefCount) ;
+			KeReleaseSpinLock(&g_Old->Resource1, oldIrql) ;
+			InterlockedDecrement(&g_Old->RefCount) ;
+		}
+		else
+		{
+			SC_LOCK(g_New, &oldIrql) ;
+			InterlockedIncrement(&g_New->RefCount) ;
+			SC_UNLOCK(g_New, oldIrql) ;
+			InterlockedDecrement(&g_New->RefCount) ;
+		}
+	}
+}
+
+//Context: bit 0 the old layout, bit 1 a writer on thread 0
+static void
+Run(PVOID Context, ULONG Index)
+{
+	BOOLEAN old = ((ULONG_PTR)Context & 1) != 0 ;
+	BOOLEAN writing = ((ULONG_PTR)Context & 2) != 0 ;
+	ULONG found ;
+
+	if (writing && Index == 0)
+	{
+		Write(old) ;
+		return ;
+	}
+
+	found = old ? ReadOld() : ReadNew() ;
+
+	InterlockedExchangeAdd(&g_Sink, found != 0) ;
+	InterlockedDecrement(&g_Running) ;
+}
+
+static double
+Throughput(ULONG Readers, BOOLEAN Old, BOOLEAN Writing)
+{
+	double start ;
+
+	g_Running = Readers ;
+	g_Sink = 0 ;
+
+	start = Now() ;
+	Wdk_RunThreads(Readers + Writing, Run, (PVOID)(ULONG_PTR)(Old | Writing << 1)) ;
+
+	CHECK(g_Sink == (LONG)Readers) ;
+
+	return (double)g_Checks * Readers / (Now() - start) / 1e6 ;
+}
+
+int
+main(int argc, char **argv)
+{
+	ULONG readers ;
+
+	if (argc > 1)
+		g_Checks = (ULONG)atol(argv[1]) ;
+	if (g_Checks == 0)
+		g_Checks = 1 ;
+
+	g_Old = aligned_alloc(CACHE_LINE, ROUND_TO_SIZE(sizeof(OLD_STREAM_CONTEXT), CACHE_LINE)) ;
+	g_New = aligned_alloc(CACHE_LINE, ROUND_TO_SIZE(sizeof(STREAM_CONTEXT), CACHE_LINE)) ;
+	memset(g_Old, 0, sizeof(OLD_STREAM_CONTEXT)) ;
+	memset(g_New, 0, sizeof(STREAM_CONTEXT)) ;
+
+	KeInitializeSpinLock(&g_Old->Resource1) ;
+	g_Old->bDecryptOnRead = TRUE ;
+	g_Old->FileValidLength.QuadPart = 4096 ;
+	g_Old->FileSize.QuadPart = 4096 + 512 ;
+
+	KeInitializeSpinLock(&g_New->Resource1) ;
+	g_New->Flags = SC_FLAG_DECRYPT_ON_READ ;
+	g_New->FileValidLength.QuadPart = 4096 ;
+	g_New->FileSize.QuadPart = 4096 + 512 ;
+
+	printf("old layout, %zu bytes\n", sizeof(OLD_STREAM_CONTEXT)) ;
+	Line("bDecryptOnRead", FIELD_OFFSET(OLD_STREAM_CONTEXT, bDecryptOnRead), sizeof(BOOLEAN)) ;
+	Line("FileValidLength", FIELD_OFFSET(OLD_STREAM_CONTEXT, FileValidLength), sizeof(LARGE_INTEGER)) ;
+	Line("FileSize", FIELD_OFFSET(OLD_STREAM_CONTEXT, FileSize), sizeof(LARGE_INTEGER)) ;
+	Line("RefCount", FIELD_OFFSET(OLD_STREAM_CONTEXT, RefCount), sizeof(LONG)) ;
+	Line("Resource1", FIELD_OFFSET(OLD_STREAM_CONTEXT, Resource1), sizeof(KSPIN_LOCK)) ;
+
+	printf("new layout, %zu bytes\n", sizeof(STREAM_CONTEXT)) ;
+	Line("Flags", FIELD_OFFSET(STREAM_CONTEXT, Flags), sizeof(LONG)) ;
+	Line("FileValidLength", FIELD_OFFSET(STREAM_CONTEXT, FileValidLength), sizeof(LARGE_INTEGER)) ;
+	Line("FileSize", FIELD_OFFSET(STREAM_CONTEXT, FileSize), sizeof(LARGE_INTEGER)) ;
+	Line("RefCount", FIELD_OFFSET(STREAM_CONTEXT, RefCount), sizeof(LONG)) ;
+	Line("Resource1", FIELD_OFFSET(STREAM_CONTEXT, Resource1), sizeof(KSPIN_LOCK)) ;
+
+	printf("\n%u virtual processors, %u checks per reader, million checks per second\n", Wdk_CpuCount(), g_Checks) ;
+	printf("%8s %10s %10s %10s %10s\n", "readers", "old", "writing", "new", "writing") ;
+
+	for (readers = 1; readers <= MAX_READERS; readers *= 2)
+	{
+		double oldAlone = Throughput(readers, TRUE, FALSE) ;
+		double oldWriting = Throughput(readers, TRUE, TRUE) ;
+		double newAlone = Throughput(readers, FALSE, FALSE) ;
+		double newWriting = Throughput(readers, FALSE, TRUE) ;
+
+		printf("%8u %10.1f %10.1f %10.1f %10.1f\n", readers, oldAlone, oldWriting, newAlone, newWriting) ;
+	}
+
+	free(g_Old) ;
+	free(g_New) ;
+
+	return Report("ctxlayout_bench") ;
+}
@@ -0,0 +1,1114 @@
+/*++
+
+Module Name:
+
+    fastpath_test.c
+
+Abstract:
+
+    Which operations the driver asks post callbacks for.
+
+    Builds CryptMini.c against the mock WDK in wdk/ and drives PreCreate,
+    PreRead, PreWrite, PreSetInformation and PreQueryInformation with
+    hand made callback data.  The filter manager routines on those paths
+    are defined below; one stream context, found by FsContext, and one
+    volume context stand in for its context tracking.
+
+    Then reads and writes of an encrypted file go through PreRead and
+    PostRead, PreWrite and PostWrite with a file system in between, over
+    a stand-in cipher: the swapped buffers, the valid length clamp, the
+    trailer moved by extending writes and the zeros filled in behind it,
+    paging writes cut short before the trailer, reads deferred from
+    DISPATCH_LEVEL, user buffers and files with a header.
+
+    Also how overwriting creates carry the file flag of the file they
+    truncate to SetupTruncatedStream, with the trailer I/O mocked, and
+    that it drops the file cache entry of the old contents.
+
+--*/
+#include <stdlib.h>
+
+#include "CryptMini.c"
+#include "testutil.h"
+
+#undef DbgPrint
+
+//
+//  Kernel routines on the tested paths
+//
+
+ULONG DbgPrint(const char *Format, ...) { (void)Format ; return 0 ; }
+KIRQL KeGetCurrentIrql(void) ;
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER Number) { (void)Number ; return 0 ; }
+VOID KeRaiseIrql(KIRQL New, PKIRQL Old) { (void)New ; *Old = PASSIVE_LEVEL ; }
+VOID KeLowerIrql(KIRQL Old) { (void)Old ; }
+VOID KeEnterCriticalRegion(void) { }
+VOID KeLeaveCriticalRegion(void) { }
+VOID YieldProcessor(void) { }
+VOID KeMemoryBarrier(void) { }
+
+LONG InterlockedIncrement(volatile LONG *p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+LONG InterlockedDecrement(volatile LONG *p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+LONG InterlockedExchange(volatile LONG *p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST) ; }
+LONG InterlockedOr(volatile LONG *p, LONG v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST) ; }
+LONG InterlockedAnd(volatile LONG *p, LONG v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST) ; }
+LONG InterlockedCompareExchange(volatile LONG *p, LONG x, LONG c) { __atomic_compare_exchange_n(p, &c, x, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ; return c ; }
+LONG64 InterlockedIncrement64(volatile LONG64 *p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+LONG64 InterlockedExchange64(volatile LONG64 *p, LONG64 v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST) ; }
+LONG64 InterlockedCompareExchange64(volatile LONG64 *p, LONG64 x, LONG64 c) { __atomic_compare_exchange_n(p, &c, x, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ; return c ; }
+LONG ReadNoFence(const volatile LONG *p) { return *p ; }
+LONG ReadAcquire(const volatile LONG *p) { return *p ; }
+LONG64 ReadNoFence64(const volatile LONG64 *p) { return *p ; }
+LONG64 ReadAcquire64(const volatile LONG64 *p) { return *p ; }
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK Lock) { (void)Lock ; }
+VOID KeAcquireSpinLock(PKSPIN_LOCK Lock, PKIRQL Irql) { (void)Lock ; *Irql = PASSIVE_LEVEL ; }
+VOID KeReleaseSpinLock(PKSPIN_LOCK Lock, KIRQL Irql) { (void)Lock ; (void)Irql ; }
+VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State) { (void)Event ; (void)Type ; (void)State ; }
+LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait) { (void)Event ; (void)Increment ; (void)Wait ; return 0 ; }
+
+//single threaded, nothing may wait
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON Reason, ULONG Mode, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	(void)Object ; (void)Reason ; (void)Mode ; (void)Alertable ; (void)Timeout ;
+	abort() ;
+}
+
+BOOLEAN ExAcquireResourceExclusiveLite(PERESOURCE Resource, BOOLEAN Wait) { (void)Resource ; (void)Wait ; return TRUE ; }
+VOID ExReleaseResourceLite(PERESOURCE Resource) { (void)Resource ; }
+VOID ExInitializeFastMutex(PFAST_MUTEX Mutex) { (void)Mutex ; }
+VOID ExAcquireFastMutex(PFAST_MUTEX Mutex) { (void)Mutex ; }
+VOID ExReleaseFastMutex(PFAST_MUTEX Mutex) { (void)Mutex ; }
+
+static int g_Rundown ;
+
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE Type, ULONG Tag) { (void)Type ; (void)Tag ; return (PEX_RUNDOWN_REF_CACHE_AWARE)&g_Rundown ; }
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { (void)Ref ; return TRUE ; }
+VOID ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { (void)Ref ; }
+VOID ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { (void)Ref ; }
+VOID ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { (void)Ref ; }
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Length, ULONG Tag) { (void)Type ; (void)Tag ; return calloc(1, Length) ; }
+VOID ExFreePoolWithTag(PVOID p, ULONG Tag) { (void)Tag ; free(p) ; }
+PVOID ExAllocateFromNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List) { (void)List ; return calloc(1, sizeof(PRE_2_POST_CONTEXT)) ; }
+VOID ExFreeToNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID p) { (void)List ; free(p) ; }
+
+VOID RtlZeroMemory(PVOID Destination, SIZE_T Length) { memset(Destination, 0, Length) ; }
+VOID RtlCopyMemory(PVOID Destination, const VOID *Source, SIZE_T Length) { memcpy(Destination, Source, Length) ; }
+BOOLEAN RtlEqualMemory(const VOID *Source1, const VOID *Source2, SIZE_T Length) { return memcmp(Source1, Source2, Length) == 0 ; }
+
+VOID InitializeListHead(PLIST_ENTRY Head) { Head->Flink = Head->Blink = Head ; }
+VOID InsertTailList(PLIST_ENTRY Head, PLIST_ENTRY Entry) { Entry->Flink = Head ; Entry->Blink = Head->Blink ; Head->Blink->Flink = Entry ; Head->Blink = Entry ; }
+BOOLEAN RemoveEntryList(PLIST_ENTRY Entry) { Entry->Blink->Flink = Entry->Flink ; Entry->Flink->Blink = Entry->Blink ; return Entry->Flink == Entry->Blink ; }
+
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE Routine, BOOLEAN Remove) { (void)Routine ; (void)Remove ; return STATUS_SUCCESS ; }
+PCHAR PsGetProcessImageFileName(PEPROCESS Process) { (void)Process ; return "winword.exe" ; }
+
+//
+//  Filter manager
+//
+
+static STREAM_CONTEXT g_StreamCtx ;
+static PVOID g_StreamFsContext ;
+static VOLUME_CONTEXT g_VolCtx ;
+static int g_StreamLookups ;
+
+ULONG FltGetRequestorProcessId(PFLT_CALLBACK_DATA Data) { (void)Data ; return 1234 ; }
+PEPROCESS FltGetRequestorProcess(PFLT_CALLBACK_DATA Data) { (void)Data ; return (PEPROCESS)1 ; }
+VOID FltSetCallbackDataDirty(PFLT_CALLBACK_DATA Data) { (void)Data ; }
+VOID FltReleaseContext(PFLT_CONTEXT Context) { (void)Context ; }
+
+NTSTATUS
+FltGetStreamContext(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PVOID Context)
+{
+	(void)Instance ;
+
+	g_StreamLookups++ ;
+
+	if (g_StreamFsContext == NULL || FileObject->FsContext != g_StreamFsContext)
+		return STATUS_NOT_FOUND ;
+
+	*(PFLT_CONTEXT *)Context = &g_StreamCtx ;
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS
+FltGetVolumeContext(PFLT_FILTER Filter, PFLT_VOLUME Volume, PVOID Context)
+{
+	(void)Filter ; (void)Volume ;
+
+	*(PFLT_CONTEXT *)Context = &g_VolCtx ;
+	return STATUS_SUCCESS ;
+}
+
+//
+//  The file an overwriting create truncates, and the flag written to it
+//
+
+static NTSTATUS g_OpenStatus ;
+static NTSTATUS g_TrailerStatus ;
+static int g_Opens ;
+static FILE_FLAG g_WrittenFlag ;
+static int g_FlagWrites ;
+static LONG g_KeyRefs ;
+
+//the stamp does not move when the flag is written, as within one tick
+static FILE_CACHE_ID g_FileId = { 0x1234, 0x5678 } ;
+static FILE_NETWORK_OPEN_INFORMATION g_FileInfo ;
+
+NTSTATUS
+FltGetFileNameInformation(PFLT_CALLBACK_DATA Data, FLT_FILE_NAME_OPTIONS Options, PFLT_FILE_NAME_INFORMATION *Info)
+{
+	static FLT_FILE_NAME_INFORMATION info ;
+
+	(void)Data ; (void)Options ;
+
+	*Info = &info ;
+	return STATUS_SUCCESS ;
+}
+
+VOID FltReleaseFileNameInformation(PFLT_FILE_NAME_INFORMATION Info) { (void)Info ; }
+
+NTSTATUS
+FltCreateFileEx(PFLT_FILTER Filter, PFLT_INSTANCE Instance, PHANDLE Handle, PFILE_OBJECT *FileObject,
+	ACCESS_MASK Access, POBJECT_ATTRIBUTES Attributes, PIO_STATUS_BLOCK IoStatus, PLARGE_INTEGER AllocationSize,
+	ULONG FileAttributes, ULONG ShareAccess, ULONG Disposition, ULONG Options, PVOID Ea, ULONG EaLength, ULONG Flags)
+{
+	static FILE_OBJECT fileObject ;
+
+	(void)Filter ; (void)Instance ; (void)Access ; (void)Attributes ; (void)IoStatus ; (void)AllocationSize ;
+	(void)FileAttributes ; (void)ShareAccess ; (void)Options ; (void)Ea ; (void)EaLength ;
+
+	g_Opens++ ;
+	CHECK(Disposition == FILE_OPEN) ;
+	CHECK(Flags & IO_IGNORE_SHARE_ACCESS_CHECK) ;
+
+	if (!NT_SUCCESS(g_OpenStatus))
+		return g_OpenStatus ;
+
+	*Handle = (HANDLE)1 ;
+	*FileObject = &fileObject ;
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS
+FltQueryInformationFile(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PVOID Information, ULONG Length,
+	FILE_INFORMATION_CLASS Class, PULONG Returned)
+{
+	FILE_ID_INFORMATION *idInfo = Information ;
+
+	(void)Instance ; (void)FileObject ; (void)Returned ;
+
+	if (Class == FileIdInformation && Length == sizeof(FILE_ID_INFORMATION))
+	{
+		memcpy(&idInfo->FileId, &g_FileId, sizeof(g_FileId)) ;
+		return STATUS_SUCCESS ;
+	}
+
+	CHECK(Class == FileNetworkOpenInformation && Length == sizeof(g_FileInfo)) ;
+	memcpy(Information, &g_FileInfo, sizeof(g_FileInfo)) ;
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS FltClose(HANDLE Handle) { (void)Handle ; return STATUS_SUCCESS ; }
+VOID ObDereferenceObject(PVOID Object) { (void)Object ; }
+
+NTSTATUS
+Trailer_Read(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PVOLUME_CONTEXT VolCtx, PFILE_FLAG Flag, PLARGE_INTEGER FileSize)
+{
+	(void)Instance ; (void)FileObject ; (void)VolCtx ; (void)Flag ; (void)FileSize ;
+	return g_TrailerStatus ;
+}
+
+NTSTATUS
+Trailer_Write(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PVOLUME_CONTEXT VolCtx, PFILE_FLAG Flag)
+{
+	(void)Instance ; (void)FileObject ; (void)VolCtx ;
+
+	g_FlagWrites++ ;
+	g_WrittenFlag = *Flag ;
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS Crypt_GenerateNonce(PUCHAR Nonce) { memset(Nonce, 0x5A, IV_LENGTH) ; return STATUS_SUCCESS ; }
+VOID KeyCache_AddRef(PKEY_CACHE_ENTRY Entry) { (void)Entry ; g_KeyRefs++ ; }
+VOID KeyCache_Release(PKEY_CACHE_ENTRY Entry) { (void)Entry ; g_KeyRefs-- ; }
+
+//
+//  Below the read and write paths: a file system keeping the file in
+//  g_Disk, a cipher whose key stream is a function of the plain text
+//  offset, and completions at the IRQL of g_Irql
+//
+
+#define DISK_SIZE       (512 * 1024)
+
+static UCHAR g_Disk[DISK_SIZE] ;
+static KIRQL g_Irql = PASSIVE_LEVEL ;
+static LONG g_PoolBuffers ;
+static PMDL g_LockedMdl ;
+static int g_Locks ;
+static int g_Batches ;
+static PFLT_DEFERRED_IO_WORKITEM_ROUTINE g_DeferredRoutine ;
+static PVOID g_DeferredContext ;
+static int g_Completions ;
+
+KIRQL KeGetCurrentIrql(void) { return g_Irql ; }
+
+static UCHAR
+KeyStream(ULONGLONG Offset, const UCHAR *Nonce)
+{
+	return (UCHAR)(Offset * 0x9D ^ Offset >> 9 ^ Nonce[0]) ;
+}
+
+static void
+Cipher(ULONGLONG Offset, const UCHAR *Nonce, const UCHAR *In, PUCHAR Out, SIZE_T Length)
+{
+	SIZE_T i ;
+
+	for (i = 0; i < Length; i++)
+		Out[i] = In[i] ^ KeyStream(Offset + i, Nonce) ;
+}
+
+//the read and write paths only hand whole sectors to the cipher
+NTSTATUS
+Crypt_TransformBatch(PVOLUME_CONTEXT VolCtx, PAES_CTR_JOB Jobs, ULONG Count, BOOLEAN Encrypt)
+{
+	ULONG i ;
+
+	(void)Encrypt ;
+
+	g_Batches++ ;
+
+	for (i = 0; i < Count; i++)
+	{
+		CHECK(Jobs[i].ByteOffset % VolCtx->SectorSize == 0 && Jobs[i].Length % VolCtx->SectorSize == 0) ;
+		Cipher(Jobs[i].ByteOffset, Jobs[i].Nonce, Jobs[i].In, Jobs[i].Out, Jobs[i].Length) ;
+	}
+
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS
+Crypt_Transform(PVOLUME_CONTEXT VolCtx, PKEY_CACHE_ENTRY KeyEntry, const UCHAR *Nonce, LONGLONG ByteOffset,
+	const UCHAR *In, PUCHAR Out, ULONG Length, BOOLEAN Encrypt)
+{
+	(void)VolCtx ; (void)KeyEntry ; (void)Encrypt ;
+
+	Cipher(ByteOffset, Nonce, In, Out, Length) ;
+	return STATUS_SUCCESS ;
+}
+
+BOOLEAN Crypt_IsParallel(ULONG Length) { (void)Length ; return FALSE ; }
+
+PVOID
+BufPool_Allocate(ULONG Length)
+{
+	g_PoolBuffers++ ;
+	return memset(malloc(Length), 0xCC, Length) ;
+}
+
+VOID BufPool_Free(PVOID Buffer, ULONG Length) { (void)Length ; g_PoolBuffers-- ; free(Buffer) ; }
+
+PMDL
+IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN Secondary, BOOLEAN ChargeQuota, PVOID Irp)
+{
+	PMDL mdl = calloc(1, sizeof(MDL)) ;
+
+	(void)Secondary ; (void)ChargeQuota ; (void)Irp ;
+
+	mdl->StartVa = VirtualAddress ;
+	mdl->ByteCount = Length ;
+	return mdl ;
+}
+
+VOID IoFreeMdl(PMDL Mdl) { free(Mdl) ; }
+VOID MmBuildMdlForNonPagedPool(PMDL Mdl) { (void)Mdl ; }
+PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority) { (void)Priority ; return Mdl->StartVa ; }
+
+NTSTATUS
+FltLockUserBuffer(PFLT_CALLBACK_DATA Data)
+{
+	PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb ;
+
+	g_Locks++ ;
+
+	if (iopb->MajorFunction == IRP_MJ_READ)
+		g_LockedMdl = iopb->Parameters.Read.MdlAddress = IoAllocateMdl(iopb->Parameters.Read.ReadBuffer, iopb->Parameters.Read.Length, FALSE, FALSE, NULL) ;
+	else
+		g_LockedMdl = iopb->Parameters.Write.MdlAddress = IoAllocateMdl(iopb->Parameters.Write.WriteBuffer, iopb->Parameters.Write.Length, FALSE, FALSE, NULL) ;
+
+	return STATUS_SUCCESS ;
+}
+
+//already at a safe IRQL
+BOOLEAN
+FltDoCompletionProcessingWhenSafe(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS Objects, PVOID Context,
+	FLT_POST_OPERATION_FLAGS Flags, PFLT_POST_OPERATION_CALLBACK Routine, FLT_POSTOP_CALLBACK_STATUS *Status)
+{
+	CHECK(g_Irql == PASSIVE_LEVEL) ;
+
+	*Status = Routine(Data, Objects, Context, Flags) ;
+	return TRUE ;
+}
+
+//one work item, run by the test
+PFLT_DEFERRED_IO_WORKITEM FltAllocateDeferredIoWorkItem(void) { return (PFLT_DEFERRED_IO_WORKITEM)&g_DeferredRoutine ; }
+VOID FltFreeDeferredIoWorkItem(PFLT_DEFERRED_IO_WORKITEM WorkItem) { (void)WorkItem ; g_DeferredRoutine = NULL ; }
+VOID FltCompletePendedPostOperation(PFLT_CALLBACK_DATA Data) { (void)Data ; g_Completions++ ; }
+
+NTSTATUS
+FltQueueDeferredIoWorkItem(PFLT_DEFERRED_IO_WORKITEM WorkItem, PFLT_CALLBACK_DATA Data,
+	PFLT_DEFERRED_IO_WORKITEM_ROUTINE Routine, WORK_QUEUE_TYPE Queue, PVOID Context)
+{
+	(void)WorkItem ; (void)Data ; (void)Queue ;
+
+	CHECK(g_DeferredRoutine == NULL) ;
+	g_DeferredRoutine = Routine ;
+	g_DeferredContext = Context ;
+	return STATUS_SUCCESS ;
+}
+
+//what UpdateFileFlag fills in behind the old trailer
+NTSTATUS
+FltWriteFile(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PLARGE_INTEGER Offset, ULONG Length, PVOID Buffer,
+	ULONG Flags, PULONG Written, PVOID Callback, PVOID Context)
+{
+	(void)Instance ; (void)FileObject ; (void)Callback ; (void)Context ;
+
+	CHECK(FlagOn(Flags, FLTFL_IO_OPERATION_NON_CACHED)) ;
+	CHECK(Offset->QuadPart + Length <= DISK_SIZE) ;
+	memcpy(g_Disk + Offset->QuadPart, Buffer, Length) ;
+	*Written = Length ;
+	return STATUS_SUCCESS ;
+}
+
+//
+//  Callback data
+//
+
+static FILE_OBJECT g_FileObject ;
+static FLT_IO_PARAMETER_BLOCK g_Iopb ;
+static FLT_CALLBACK_DATA g_Data ;
+static FLT_RELATED_OBJECTS g_Objects ;
+static BOOLEAN g_MovesTrailer ;
+
+static void
+Reset(UCHAR MajorFunction, const WCHAR *Name, PVOID FsContext)
+{
+	memset(&g_FileObject, 0, sizeof(g_FileObject)) ;
+	memset(&g_Iopb, 0, sizeof(g_Iopb)) ;
+	memset(&g_Data, 0, sizeof(g_Data)) ;
+	memset(&g_Objects, 0, sizeof(g_Objects)) ;
+
+	g_Iopb.MajorFunction = MajorFunction ;
+	g_Data.Iopb = &g_Iopb ;
+	g_Data.Flags = FLTFL_CALLBACK_DATA_IRP_OPERATION ;
+	g_Objects.FileObject = &g_FileObject ;
+	g_FileObject.FsContext = FsContext ;
+
+	if (Name != NULL)
+	{
+		USHORT length = 0 ;
+
+		while (Name[length / sizeof(WCHAR)])
+			length += sizeof(WCHAR) ;
+
+		g_FileObject.FileName.Buffer = (PWCH)Name ;
+		g_FileObject.FileName.Length = g_FileObject.FileName.MaximumLength = length ;
+	}
+}
+
+static PVOID g_CreateContext ;
+
+static FLT_PREOP_CALLBACK_STATUS
+Create(const WCHAR *Name, ULONG Options, UCHAR OperationFlags, BOOLEAN Relative)
+{
+	FILE_OBJECT related ;
+	PVOID context = NULL ;
+	FLT_PREOP_CALLBACK_STATUS status ;
+
+	Reset(IRP_MJ_CREATE, Name, NULL) ;
+	g_Iopb.Parameters.Create.Options = Options ;
+	g_Iopb.OperationFlags = OperationFlags ;
+	if (Relative)
+		g_FileObject.RelatedFileObject = &related ;
+
+	status = PreCreate(&g_Data, &g_Objects, &context) ;
+	g_CreateContext = context ;
+
+	return status ;
+}
+
+//records the MovesTrailer of the pre to post context and frees it
+static FLT_PREOP_CALLBACK_STATUS
+Finish(FLT_PREOP_CALLBACK_STATUS Status, PVOID Context)
+{
+	g_MovesTrailer = FALSE ;
+
+	if (Context != NULL)
+	{
+		g_MovesTrailer = ((PPRE_2_POST_CONTEXT)Context)->MovesTrailer ;
+		FreePre2PostContext(Context) ;
+	}
+
+	return Status ;
+}
+
+static FLT_PREOP_CALLBACK_STATUS
+ReadWrite(BOOLEAN Write, PVOID FsContext, ULONG IrpFlags, ULONG Length)
+{
+	FLT_PREOP_CALLBACK_STATUS status ;
+	PVOID context = NULL ;
+
+	Reset(Write ? IRP_MJ_WRITE : IRP_MJ_READ, NULL, FsContext) ;
+	g_Iopb.IrpFlags = IrpFlags ;
+
+	if (Write)
+	{
+		g_Iopb.Parameters.Write.Length = Length ;
+		status = PreWrite(&g_Data, &g_Objects, &context) ;
+	}
+	else
+	{
+		g_Iopb.Parameters.Read.Length = Length ;
+		status = PreRead(&g_Data, &g_Objects, &context) ;
+	}
+
+	return Finish(status, context) ;
+}
+
+//sets the end of file, returns the size passed on to the file system in Size
+static FLT_PREOP_CALLBACK_STATUS
+SetEndOfFile(PVOID FsContext, BOOLEAN AdvanceOnly, LONGLONG *Size)
+{
+	FILE_END_OF_FILE_INFORMATION info ;
+	FLT_PREOP_CALLBACK_STATUS status ;
+	PVOID context = NULL ;
+
+	Reset(IRP_MJ_SET_INFORMATION, NULL, FsContext) ;
+	info.EndOfFile.QuadPart = *Size ;
+	g_Iopb.Parameters.SetFileInformation.FileInformationClass = FileEndOfFileInformation ;
+	g_Iopb.Parameters.SetFileInformation.AdvanceOnly = AdvanceOnly ;
+	g_Iopb.Parameters.SetFileInformation.InfoBuffer = &info ;
+
+	status = PreSetInformation(&g_Data, &g_Objects, &context) ;
+	*Size = info.EndOfFile.QuadPart ;
+
+	return Finish(status, context) ;
+}
+
+static FLT_PREOP_CALLBACK_STATUS
+Query(PVOID FsContext, FILE_INFORMATION_CLASS InfoClass)
+{
+	PVOID context = NULL ;
+
+	Reset(IRP_MJ_QUERY_INFORMATION, NULL, FsContext) ;
+	g_Iopb.Parameters.QueryFileInformation.FileInformationClass = InfoClass ;
+
+	return PreQueryInformation(&g_Data, &g_Objects, &context) ;
+}
+
+static void
+TestCreate(void)
+{
+	POLICY_RULE_INFO rules[2] ;
+
+	CHECK(Create(L"", 0, 0, FALSE) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(Create(L"\\pagefile.sys", 0, SL_OPEN_PAGING_FILE, FALSE) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(Create(L"\\Projects", FILE_DIRECTORY_FILE, 0, FALSE) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(Create(L"\\Windows\\notepad.exe", 0, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+
+	//the policy decides what new files are encrypted in PostCreate,
+	//existing encrypted files are recognized wherever they are
+	memset(rules, 0, sizeof(rules)) ;
+	rules[0].uAction = POLICY_ACTION_INCLUDE ;
+	memcpy(rules[0].wszDirectory, L"\\Projects\\", sizeof(L"\\Projects\\")) ;
+	memcpy(rules[0].wszExtension, L"docx", sizeof(L"docx")) ;
+	rules[1].uAction = POLICY_ACTION_EXCLUDE ;
+	memcpy(rules[1].wszDirectory, L"\\Projects\\Public", sizeof(L"\\Projects\\Public")) ;
+	CHECK(NT_SUCCESS(PolicyList_Install(rules, 2))) ;
+
+	CHECK(Create(L"\\Windows\\notepad.exe", 0, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(Create(L"\\projects\\q3\\PLAN.docx", 0, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(Create(L"\\Projects\\Public\\plan.docx", 0, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(Create(L"plan.docx", 0, 0, TRUE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(Create(L"\x01\x02\x03\x04", FILE_OPEN_BY_FILE_ID, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+}
+
+//PreCreate of an overwrite by a trusted process, returns its WAS_CRYPT bit
+static BOOLEAN
+Overwrite(ULONG Disposition, NTSTATUS OpenStatus, NTSTATUS TrailerStatus)
+{
+	g_OpenStatus = OpenStatus ;
+	g_TrailerStatus = TrailerStatus ;
+
+	CHECK(Create(L"\\Projects\\plan.docx", Disposition << 24, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(((ULONG_PTR)g_CreateContext & CREATE_CONTEXT_DECISION) == ProcessDecisionTrusted) ;
+
+	return BooleanFlagOn((ULONG_PTR)g_CreateContext, CREATE_CONTEXT_WAS_CRYPT) ;
+}
+
+static void
+TestOverwrite(void)
+{
+	PROCESS_INFO info ;
+	STREAM_CONTEXT streamCtx ;
+	KEY_CACHE_ENTRY *volKey = (KEY_CACHE_ENTRY *)0x1000 ;
+	KEY_CACHE_ENTRY *oldKey = (KEY_CACHE_ENTRY *)0x2000 ;
+	FILE_CACHE_STAMP stamp ;
+	BOOLEAN encrypted ;
+	FILE_FLAG flag ;
+
+	//ignored processes leave what they truncate plain, nothing to look at
+	g_Opens = 0 ;
+	CHECK(Create(L"\\Projects\\plan.docx", FILE_OVERWRITE_IF << 24, 0, FALSE) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK((ULONG_PTR)g_CreateContext == ProcessDecisionIgnored) ;
+	CHECK(g_Opens == 0) ;
+
+	memset(&info, 0, sizeof(info)) ;
+	memcpy(info.szProcessName, "winword.exe", sizeof("winword.exe")) ;
+	CHECK(ProcList_Add(&info) == MGAPI_RESULT_SUCCESS) ;
+
+	//the flag of the file is read before the create truncates it
+	g_Opens = 0 ;
+	CHECK(!Overwrite(FILE_OPEN, STATUS_SUCCESS, STATUS_SUCCESS)) ;
+	CHECK(!Overwrite(FILE_CREATE, STATUS_SUCCESS, STATUS_SUCCESS)) ;
+	CHECK(g_Opens == 0) ;
+	CHECK(Overwrite(FILE_SUPERSEDE, STATUS_SUCCESS, STATUS_SUCCESS)) ;
+	CHECK(Overwrite(FILE_OVERWRITE, STATUS_SUCCESS, STATUS_SUCCESS)) ;
+	CHECK(Overwrite(FILE_OVERWRITE_IF, STATUS_SUCCESS, STATUS_SUCCESS)) ;
+	CHECK(!Overwrite(FILE_OVERWRITE_IF, STATUS_SUCCESS, STATUS_NOT_FOUND)) ;
+	CHECK(!Overwrite(FILE_OVERWRITE_IF, STATUS_OBJECT_NAME_NOT_FOUND, STATUS_SUCCESS)) ;
+	CHECK(!Overwrite(FILE_SUPERSEDE, STATUS_OBJECT_PATH_NOT_FOUND, STATUS_SUCCESS)) ;
+	CHECK(g_Opens == 6) ;
+
+	//unreadable files are taken as encrypted
+	CHECK(Overwrite(FILE_OVERWRITE_IF, STATUS_ACCESS_DENIED, STATUS_SUCCESS)) ;
+	CHECK(Overwrite(FILE_OVERWRITE_IF, STATUS_SUCCESS, STATUS_DATA_ERROR)) ;
+
+	//the context of a stream opened for the first time knows nothing of
+	//the flag: a trusted process keeps an encrypted file encrypted...
+	g_VolCtx.KeyEntry = volKey ;
+	memset(g_VolCtx.szKeyHash, 0xA5, HASH_SIZE) ;
+	memset(&streamCtx, 0, sizeof(streamCtx)) ;
+	Reset(IRP_MJ_CREATE, NULL, (PVOID)0x30000) ;
+	g_FileObject.WriteAccess = TRUE ;
+	g_FlagWrites = 0 ;
+	g_KeyRefs = 0 ;
+	CHECK(NT_SUCCESS(SetupTruncatedStream(&g_Objects, &g_VolCtx, &streamCtx, ProcessDecisionTrusted, TRUE))) ;
+	CHECK(g_FlagWrites == 1) ;
+	CHECK(SC_TEST_FLAG(&streamCtx, SC_FLAG_ENCRYPT_ON_WRITE)) ;
+	CHECK(SC_TEST_FLAG(&streamCtx, SC_FLAG_TRAILER_CHECKED)) ;
+	CHECK(memcmp(g_WrittenFlag.szKeyHash, g_VolCtx.szKeyHash, HASH_SIZE) == 0) ;
+	CHECK(streamCtx.KeyEntry == volKey && streamCtx.RetiredKeyEntry == NULL && g_KeyRefs == 1) ;
+	CHECK(streamCtx.FileSize.QuadPart == Layout_FileSize(&g_VolCtx.Layout, 0)) ;
+	Ctx_UnmarkStreamHandled(&streamCtx) ;
+
+	//...but leaves a plain one alone
+	memset(&streamCtx, 0, sizeof(streamCtx)) ;
+	CHECK(NT_SUCCESS(SetupTruncatedStream(&g_Objects, &g_VolCtx, &streamCtx, ProcessDecisionTrusted, FALSE))) ;
+	CHECK(g_FlagWrites == 1) ;
+	CHECK(!SC_TEST_FLAG(&streamCtx, SC_FLAG_FILE_CRYPT)) ;
+	CHECK(SC_TEST_FLAG(&streamCtx, SC_FLAG_TRAILER_CHECKED)) ;
+
+	//a stream under another key is stamped with the volume key, the old
+	//one is kept for the I/O in flight on the old contents
+	memset(&streamCtx, 0, sizeof(streamCtx)) ;
+	streamCtx.KeyEntry = oldKey ;
+	memset(streamCtx.szKeyHash, 0x3C, HASH_SIZE) ;
+	streamCtx.Flags = SC_FLAG_FILE_CRYPT | SC_FLAG_DECRYPT_ON_READ | SC_FLAG_ENCRYPT_ON_WRITE ;
+	CHECK(NT_SUCCESS(SetupTruncatedStream(&g_Objects, &g_VolCtx, &streamCtx, ProcessDecisionTrusted, FALSE))) ;
+	CHECK(g_FlagWrites == 2) ;
+	CHECK(memcmp(g_WrittenFlag.szKeyHash, g_VolCtx.szKeyHash, HASH_SIZE) == 0) ;
+	CHECK(memcmp(streamCtx.szKeyHash, g_VolCtx.szKeyHash, HASH_SIZE) == 0) ;
+	CHECK(streamCtx.KeyEntry == volKey && streamCtx.RetiredKeyEntry == oldKey && g_KeyRefs == 2) ;
+	Ctx_UnmarkStreamHandled(&streamCtx) ;
+
+	//ignored processes truncate encrypted files to plain ones
+	memset(&streamCtx, 0, sizeof(streamCtx)) ;
+	CHECK(NT_SUCCESS(SetupTruncatedStream(&g_Objects, &g_VolCtx, &streamCtx, ProcessDecisionIgnored, TRUE))) ;
+	CHECK(g_FlagWrites == 2) ;
+	CHECK(!SC_TEST_FLAG(&streamCtx, SC_FLAG_FILE_CRYPT)) ;
+
+	//a plain file cached with the stamp it still has once encrypted is
+	//not served as plain; the id is kept for the writer to drop the entry
+	g_VolCtx.FileCache = FileCache_Create() ;
+	g_FileInfo.EndOfFile.QuadPart = Layout_FileSize(&g_VolCtx.Layout, 0) ;
+	g_FileInfo.LastWriteTime.QuadPart = g_FileInfo.ChangeTime.QuadPart = 132000000000000000LL ;
+	stamp.EndOfFile = g_FileInfo.EndOfFile ;
+	stamp.LastWriteTime = g_FileInfo.LastWriteTime ;
+	stamp.ChangeTime = g_FileInfo.ChangeTime ;
+	FileCache_Insert(g_VolCtx.FileCache, &g_FileId, &stamp, NULL) ;
+	memset(&streamCtx, 0, sizeof(streamCtx)) ;
+	streamCtx.Flags = SC_FLAG_UNNAMED_STREAM ;
+	CHECK(NT_SUCCESS(SetupTruncatedStream(&g_Objects, &g_VolCtx, &streamCtx, ProcessDecisionMonitored, FALSE))) ;
+	CHECK(g_FlagWrites == 3) ;
+	CHECK(SC_TEST_FLAG(&streamCtx, SC_FLAG_ENCRYPT_ON_WRITE)) ;
+	CHECK(SC_TEST_FLAG(&streamCtx, SC_FLAG_FILE_ID)) ;
+	CHECK(memcmp(&streamCtx.FileId, &g_FileId, sizeof(g_FileId)) == 0) ;
+	CHECK(!FileCache_Lookup(g_VolCtx.FileCache, &g_FileId, &stamp, &encrypted, &flag)) ;
+	Ctx_UnmarkStreamHandled(&streamCtx) ;
+
+	//named streams share the id of their file and leave it alone
+	FileCache_Insert(g_VolCtx.FileCache, &g_FileId, &stamp, NULL) ;
+	memset(&streamCtx, 0, sizeof(streamCtx)) ;
+	CHECK(NT_SUCCESS(SetupTruncatedStream(&g_Objects, &g_VolCtx, &streamCtx, ProcessDecisionMonitored, FALSE))) ;
+	CHECK(!SC_TEST_FLAG(&streamCtx, SC_FLAG_FILE_ID)) ;
+	CHECK(FileCache_Lookup(g_VolCtx.FileCache, &g_FileId, &stamp, &encrypted, &flag) && !encrypted) ;
+	Ctx_UnmarkStreamHandled(&streamCtx) ;
+
+	FileCache_Delete(g_VolCtx.FileCache) ;
+	g_VolCtx.FileCache = NULL ;
+
+	g_VolCtx.KeyEntry = NULL ;
+	CHECK(ProcList_Delete(info.szProcessName) == MGAPI_RESULT_SUCCESS) ;
+}
+
+static void
+TestUnhandled(PVOID FsContext)
+{
+	LONGLONG size = 4096 ;
+
+	//no stream context lookup at all
+	g_StreamLookups = 0 ;
+	CHECK(ReadWrite(FALSE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(ReadWrite(FALSE, FsContext, IRP_NOCACHE, 4096) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 0) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(SetEndOfFile(FsContext, FALSE, &size) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(size == 4096) ;
+	CHECK(Query(FsContext, FileStandardInformation) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(g_StreamLookups == 0) ;
+}
+
+static void
+TestHandled(PVOID FsContext)
+{
+	FILE_OBJECT fileObject ;
+	LONGLONG size ;
+
+	memset(&g_StreamCtx, 0, sizeof(g_StreamCtx)) ;
+	memset(&fileObject, 0, sizeof(fileObject)) ;
+	fileObject.FsContext = FsContext ;
+	g_StreamFsContext = FsContext ;
+	RangeLock_Init(&g_StreamCtx.RangeLock) ;
+	Ctx_MarkStreamHandled(&g_StreamCtx, &fileObject) ;
+	g_StreamCtx.Flags |= SC_FLAG_FILE_CRYPT | SC_FLAG_ENCRYPT_ON_WRITE | SC_FLAG_DECRYPT_ON_READ ;
+
+	g_StreamLookups = 0 ;
+	CHECK(ReadWrite(FALSE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(g_StreamLookups == 1) ;
+
+	//writes past the valid length move the trailer of trailer files only
+	CHECK(g_MovesTrailer) ;
+	g_StreamCtx.FileValidLength.QuadPart = 8192 ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(!g_MovesTrailer) ;
+	g_StreamCtx.Flags |= SC_FLAG_HEADER ;
+	g_StreamCtx.FileValidLength.QuadPart = 0 ;
+	CHECK(Layout_Init(&g_VolCtx.Layout, LayoutHeader, 512, FLAGFMT_MAX_SIZE)) ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(!g_MovesTrailer) ;
+
+	//sizes are plain text offsets to the caller
+	size = 100 ;
+	CHECK(SetEndOfFile(FsContext, FALSE, &size) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(size == 100 + g_VolCtx.Layout.HeadLength) ;
+	CHECK(!g_MovesTrailer) ;
+	g_StreamCtx.Flags &= ~SC_FLAG_HEADER ;
+	CHECK(Layout_Init(&g_VolCtx.Layout, LayoutTrailer, 512, FLAGFMT_MAX_SIZE)) ;
+	g_StreamCtx.FileValidLength.QuadPart = 8192 ;
+	size = 100 ;
+	CHECK(SetEndOfFile(FsContext, FALSE, &size) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(size == Layout_FileSize(&g_VolCtx.Layout, 100)) ;
+	CHECK(g_MovesTrailer) ;
+	size = 100 ;
+	CHECK(SetEndOfFile(FsContext, TRUE, &size) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(size == 100) ;
+
+	CHECK(Query(FsContext, FileStandardInformation) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(Query(FsContext, FileNetworkOpenInformation) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(Query(FsContext, FileBasicInformation) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+
+	//an encrypted file under an unknown key is neither written nor resized
+	g_StreamCtx.Flags &= ~(SC_FLAG_ENCRYPT_ON_WRITE | SC_FLAG_DECRYPT_ON_READ) ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_COMPLETE) ;
+	CHECK(g_Data.IoStatus.Status == STATUS_ACCESS_DENIED) ;
+	CHECK(ReadWrite(TRUE, FsContext, IRP_PAGING_IO | IRP_NOCACHE, 4096) == FLT_PREOP_COMPLETE) ;
+	size = 100 ;
+	CHECK(SetEndOfFile(FsContext, FALSE, &size) == FLT_PREOP_COMPLETE) ;
+	CHECK(g_Data.IoStatus.Status == STATUS_ACCESS_DENIED && size == 100) ;
+	CHECK(Query(FsContext, FileStandardInformation) == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+
+	//plain files, whatever the stream shares a slot with, are not
+	g_StreamCtx.Flags &= ~SC_FLAG_FILE_CRYPT ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	size = 100 ;
+	CHECK(SetEndOfFile(FsContext, FALSE, &size) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+
+	Ctx_UnmarkStreamHandled(&g_StreamCtx) ;
+	g_StreamLookups = 0 ;
+	CHECK(ReadWrite(TRUE, FsContext, 0, 4096) == FLT_PREOP_SUCCESS_NO_CALLBACK) ;
+	CHECK(g_StreamLookups == 0) ;
+}
+
+//
+//  Reads and writes through both callbacks, the file system in between
+//
+
+static FLT_PREOP_CALLBACK_STATUS g_PreStatus ;
+
+//the swapped buffer as sent, whole sectors
+static UCHAR g_Sent[256 * 1024] ;
+
+static UCHAR
+Plain(LONGLONG Offset, UCHAR Seed)
+{
+	return (UCHAR)((Offset * 7 + Seed) ^ Offset >> 8) ;
+}
+
+static void
+Fill(PUCHAR Buffer, LONGLONG Offset, ULONG Length, UCHAR Seed)
+{
+	ULONG i ;
+
+	for (i = 0; i < Length; i++)
+		Buffer[i] = Plain(Offset + i, Seed) ;
+}
+
+static BOOLEAN
+IsPlain(const UCHAR *Buffer, LONGLONG Offset, ULONG Length, UCHAR Seed)
+{
+	ULONG i ;
+
+	for (i = 0; i < Length; i++)
+	{
+		if (Buffer[i] != Plain(Offset + i, Seed))
+			return FALSE ;
+	}
+
+	return TRUE ;
+}
+
+static BOOLEAN
+IsZero(const UCHAR *Buffer, ULONG Length)
+{
+	ULONG i ;
+
+	for (i = 0; i < Length; i++)
+	{
+		if (Buffer[i] != 0)
+			return FALSE ;
+	}
+
+	return TRUE ;
+}
+
+//the disk at FileOffset holds the plain text at Offset, encrypted
+static BOOLEAN
+OnDisk(LONGLONG FileOffset, LONGLONG Offset, ULONG Length, UCHAR Seed)
+{
+	ULONG i ;
+
+	for (i = 0; i < Length; i++)
+	{
+		if (g_Disk[FileOffset + i] != (Plain(Offset + i, Seed) ^ KeyStream(Offset + i, g_StreamCtx.szNonce)))
+			return FALSE ;
+	}
+
+	return TRUE ;
+}
+
+//a read or write of Length bytes at Offset through Buffer, a system
+//buffer or, without FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, a user buffer;
+//completed at Irql.  Returns what the post-operation does, and the
+//pre-operation status in g_PreStatus
+static FLT_POSTOP_CALLBACK_STATUS
+Transfer(BOOLEAN Write, ULONG IrpFlags, ULONG DataFlags, LONGLONG Offset, ULONG Length, PUCHAR Buffer, KIRQL Irql)
+{
+	FLT_POSTOP_CALLBACK_STATUS status ;
+	PVOID context = NULL ;
+	LONGLONG sentOffset ;
+	ULONG sentLength ;
+	PMDL sentMdl ;
+	PUCHAR sent ;
+
+	Reset(Write ? IRP_MJ_WRITE : IRP_MJ_READ, NULL, g_StreamFsContext) ;
+	g_Data.Flags |= DataFlags ;
+	g_Iopb.IrpFlags = IrpFlags ;
+	g_Iopb.TargetFileObject = &g_FileObject ;
+	g_FileObject.Flags = FO_SYNCHRONOUS_IO ;
+	g_LockedMdl = NULL ;
+
+	if (Write)
+	{
+		g_Iopb.Parameters.Write.Length = Length ;
+		g_Iopb.Parameters.Write.ByteOffset.QuadPart = Offset ;
+		g_Iopb.Parameters.Write.WriteBuffer = Buffer ;
+		g_PreStatus = PreWrite(&g_Data, &g_Objects, &context) ;
+
+		sentOffset = g_Iopb.Parameters.Write.ByteOffset.QuadPart ;
+		sentLength = g_Iopb.Parameters.Write.Length ;
+		sentMdl = g_Iopb.Parameters.Write.MdlAddress ;
+		sent = sentMdl != NULL ? sentMdl->StartVa : g_Iopb.Parameters.Write.WriteBuffer ;
+	}
+	else
+	{
+		g_Iopb.Parameters.Read.Length = Length ;
+		g_Iopb.Parameters.Read.ByteOffset.QuadPart = Offset ;
+		g_Iopb.Parameters.Read.ReadBuffer = Buffer ;
+		g_PreStatus = PreRead(&g_Data, &g_Objects, &context) ;
+
+		sentOffset = g_Iopb.Parameters.Read.ByteOffset.QuadPart ;
+		sentLength = g_Iopb.Parameters.Read.Length ;
+		sentMdl = g_Iopb.Parameters.Read.MdlAddress ;
+		sent = sentMdl != NULL ? sentMdl->StartVa : g_Iopb.Parameters.Read.ReadBuffer ;
+	}
+
+	if (g_PreStatus != FLT_PREOP_SUCCESS_WITH_CALLBACK)
+	{
+		CHECK(context == NULL) ;
+		free(g_LockedMdl) ;
+		return FLT_POSTOP_FINISHED_PROCESSING ;
+	}
+
+	//non-cached I/O of whole sectors, never in the caller's buffer
+	if (FlagOn(IrpFlags, IRP_NOCACHE))
+	{
+		ULONG sectors = (ULONG)ROUND_TO_SIZE(sentLength, g_VolCtx.SectorSize) ;
+
+		CHECK(sent != Buffer) ;
+		CHECK(sentOffset >= 0 && sentOffset + sectors <= DISK_SIZE && sectors <= sizeof(g_Sent)) ;
+
+		if (Write)
+		{
+			memcpy(g_Disk + sentOffset, sent, sectors) ;
+			memcpy(g_Sent, sent, sectors) ;
+		}
+		else
+		{
+			memcpy(sent, g_Disk + sentOffset, sectors) ;
+		}
+	}
+
+	g_Data.IoStatus.Status = STATUS_SUCCESS ;
+	g_Data.IoStatus.Information = sentLength ;
+	if (!FlagOn(IrpFlags, IRP_PAGING_IO))
+		g_FileObject.CurrentByteOffset.QuadPart = sentOffset + sentLength ;
+
+	//FltMgr frees the MDL of the swapped buffer and hands the original
+	//parameters to the post-operation
+	if (sentMdl != NULL && sentMdl != g_LockedMdl)
+		IoFreeMdl(sentMdl) ;
+
+	if (Write)
+	{
+		g_Iopb.Parameters.Write.Length = Length ;
+		g_Iopb.Parameters.Write.ByteOffset.QuadPart = Offset ;
+		g_Iopb.Parameters.Write.WriteBuffer = Buffer ;
+		g_Iopb.Parameters.Write.MdlAddress = g_LockedMdl ;
+	}
+	else
+	{
+		g_Iopb.Parameters.Read.Length = Length ;
+		g_Iopb.Parameters.Read.ByteOffset.QuadPart = Offset ;
+		g_Iopb.Parameters.Read.ReadBuffer = Buffer ;
+		g_Iopb.Parameters.Read.MdlAddress = g_LockedMdl ;
+	}
+
+	g_Irql = Irql ;
+	status = Write ? PostWrite(&g_Data, &g_Objects, context, 0) : PostRead(&g_Data, &g_Objects, context, 0) ;
+	g_Irql = PASSIVE_LEVEL ;
+
+	free(g_LockedMdl) ;
+	g_LockedMdl = NULL ;
+
+	return status ;
+}
+
+static void
+TestTransform(PVOID FsContext)
+{
+	static UCHAR buffer[256 * 1024], copy[256 * 1024] ;
+	READ_COMPLETION_STATS before ;
+	FILE_OBJECT fileObject ;
+	LONGLONG flagOffset ;
+	ULONG head, batches ;
+
+	//an empty encrypted file with a trailer
+	memset(&g_StreamCtx, 0, sizeof(g_StreamCtx)) ;
+	memset(&fileObject, 0, sizeof(fileObject)) ;
+	fileObject.FsContext = FsContext ;
+	g_StreamFsContext = FsContext ;
+	RangeLock_Init(&g_StreamCtx.RangeLock) ;
+	Ctx_MarkStreamHandled(&g_StreamCtx, &fileObject) ;
+	g_StreamCtx.Flags |= SC_FLAG_FILE_CRYPT | SC_FLAG_ENCRYPT_ON_WRITE | SC_FLAG_DECRYPT_ON_READ ;
+	g_StreamCtx.KeyEntry = (PKEY_CACHE_ENTRY)0x1000 ;
+	memset(g_StreamCtx.szNonce, 0x5A, IV_LENGTH) ;
+	g_StreamCtx.FileSize.QuadPart = Layout_FileSize(&g_VolCtx.Layout, 0) ;
+	g_FlagWrites = 0 ;
+
+	//a non-cached write is encrypted into the swapped buffer, the caller's
+	//is left alone; past the valid length it moves the trailer
+	Fill(buffer, 0, 8192, 1) ;
+	memcpy(copy, buffer, 8192) ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 0, 8192, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_PreStatus == FLT_PREOP_SUCCESS_WITH_CALLBACK) ;
+	CHECK(memcmp(buffer, copy, 8192) == 0) ;
+	CHECK(OnDisk(0, 0, 8192, 1)) ;
+	CHECK(g_Data.IoStatus.Status == STATUS_SUCCESS && g_Data.IoStatus.Information == 8192) ;
+	CHECK(g_StreamCtx.FileValidLength.QuadPart == 8192) ;
+	CHECK(g_StreamCtx.FileSize.QuadPart == Layout_FileSize(&g_VolCtx.Layout, 8192)) ;
+	CHECK(g_FlagWrites == 1 && g_WrittenFlag.FileValidLength.QuadPart == 8192) ;
+	CHECK(SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_HAS_WRITE_DATA)) ;
+
+	//and read back, one batch for the whole read
+	memset(buffer, 0xEE, 8192) ;
+	batches = g_Batches ;
+	before = gReadStats ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 0, 8192, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(IsPlain(buffer, 0, 8192, 1) && g_Data.IoStatus.Information == 8192) ;
+	CHECK(g_Batches == batches + 1) ;
+	CHECK(gReadStats.Inline == before.Inline + 1) ;
+
+	//user buffers: a write locks it in PreWrite, a read decrypts into it
+	//at a safe IRQL
+	g_Locks = 0 ;
+	Fill(buffer, 4096, 4096, 2) ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE, 0, 4096, 4096, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(OnDisk(0, 0, 4096, 1) && OnDisk(4096, 4096, 4096, 2)) ;
+	memset(buffer, 0xEE, 8192) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, 0, 0, 8192, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(IsPlain(buffer, 0, 4096, 1) && IsPlain(buffer + 4096, 4096, 4096, 2)) ;
+	CHECK(g_Locks == 2) ;
+	CHECK(g_FlagWrites == 1) ;
+
+	//a write ending amid a sector is padded to it with encrypted zeros,
+	//in a batch of two jobs
+	Fill(buffer, 8192, 700, 3) ;
+	batches = g_Batches ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 8192, 700, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_Batches == batches + 1) ;
+	CHECK(OnDisk(8192, 8192, 700, 3)) ;
+	for (head = 700; head < 1024; head++)
+		CHECK(g_Sent[head] == KeyStream(8192 + head, g_StreamCtx.szNonce)) ;
+	CHECK(g_StreamCtx.FileValidLength.QuadPart == 8892 && g_WrittenFlag.FileValidLength.QuadPart == 8892) ;
+
+	//nothing past the valid length reads as data: a read is cut short
+	//there and so is the file position; a paging read gets zeros
+	memset(buffer, 0xEE, 4096) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 8192, 4096, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_Data.IoStatus.Information == 700 && IsPlain(buffer, 8192, 700, 3)) ;
+	CHECK(IsZero(buffer + 700, 4096 - 700)) ;
+	CHECK(g_FileObject.CurrentByteOffset.QuadPart == 8892) ;
+
+	memset(buffer, 0xEE, 4096) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE | IRP_PAGING_IO, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 8192, 4096, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_Data.IoStatus.Information == 4096 && IsPlain(buffer, 8192, 700, 3)) ;
+	CHECK(IsZero(buffer + 700, 4096 - 700)) ;
+
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 12288, 512, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_Data.IoStatus.Information == 0) ;
+
+	//a write past the old trailer zero fills up to its sector; the gap
+	//and the padding read back as zeros
+	Fill(buffer, 16384, 128 * 1024, 4) ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 16384, 128 * 1024, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_StreamCtx.FileValidLength.QuadPart == 16384 + 128 * 1024) ;
+	memset(buffer, 0xEE, 8192) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 8192, 8192, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_Data.IoStatus.Information == 8192 && IsPlain(buffer, 8192, 700, 3) && IsZero(buffer + 700, 8192 - 700)) ;
+
+	//a long read completing at DISPATCH_LEVEL is decrypted by a worker,
+	//which completes it
+	before = gReadStats ;
+	memset(buffer, 0xEE, 128 * 1024) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 16384, 128 * 1024, buffer, DISPATCH_LEVEL) == FLT_POSTOP_MORE_PROCESSING_REQUIRED) ;
+	CHECK(g_DeferredRoutine != NULL && gReadStats.Depth == 1 && gReadStats.Deferred == before.Deferred + 1) ;
+	CHECK(buffer[0] == 0xEE && g_PoolBuffers == 1) ;
+	g_DeferredRoutine((PFLT_DEFERRED_IO_WORKITEM)&g_DeferredRoutine, &g_Data, g_DeferredContext) ;
+	CHECK(IsPlain(buffer, 16384, 128 * 1024, 4) && g_Data.IoStatus.Information == 128 * 1024) ;
+	CHECK(g_Completions == 1 && g_DeferredRoutine == NULL && gReadStats.Depth == 0 && g_PoolBuffers == 0) ;
+
+	//inline when the queue is full, or the read short
+	gReadDeferMaxDepth = 0 ;
+	memset(buffer, 0xEE, 128 * 1024) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 16384, 128 * 1024, buffer, DISPATCH_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(IsPlain(buffer, 16384, 128 * 1024, 4) && gReadStats.Overflow == before.Overflow + 1) ;
+	gReadDeferMaxDepth = READ_DEFER_MAX_DEPTH ;
+
+	memset(buffer, 0xEE, 4096) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 16384, 4096, buffer, DISPATCH_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(IsPlain(buffer, 16384, 4096, 4) && gReadStats.Inline == before.Inline + 1) ;
+	CHECK(g_Completions == 1 && gReadStats.Deferred == before.Deferred + 1) ;
+
+	//paging writes stop before the trailer and report all they had
+	flagOffset = Layout_FlagOffset(&g_VolCtx.Layout, g_StreamCtx.FileSize.QuadPart) ;
+	CHECK(flagOffset % 4096 == 0 && flagOffset + 4096 <= DISK_SIZE) ;
+	memset(g_Disk + flagOffset, 0x77, 4096) ;
+	Fill(buffer, flagOffset - 2048, 4096, 5) ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE | IRP_PAGING_IO, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, flagOffset - 2048, 4096, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_Data.IoStatus.Information == 4096 && OnDisk(flagOffset - 2048, flagOffset - 2048, 2048, 5)) ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE | IRP_PAGING_IO, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, flagOffset, 4096, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(g_PreStatus == FLT_PREOP_COMPLETE && g_Data.IoStatus.Information == 4096) ;
+	CHECK(g_Disk[flagOffset] == 0x77 && g_Disk[flagOffset + 4095] == 0x77) ;
+	CHECK(g_StreamCtx.FileValidLength.QuadPart == 16384 + 128 * 1024) ;
+
+	//a file with a header: non-paging I/O moves past it and the file
+	//position back, a paging read of the first page returns it as it is
+	CHECK(Layout_Init(&g_VolCtx.Layout, LayoutHeader, 512, FLAGFMT_MAX_SIZE)) ;
+	head = (ULONG)g_VolCtx.Layout.HeadLength ;
+	g_StreamCtx.Flags |= SC_FLAG_HEADER ;
+	g_StreamCtx.FileValidLength.QuadPart = 0 ;
+	g_StreamCtx.FileSize.QuadPart = Layout_FileSize(&g_VolCtx.Layout, 0) ;
+	memset(g_Disk, 0xAB, head) ;
+
+	Fill(buffer, 0, 8192, 6) ;
+	CHECK(Transfer(TRUE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 0, 8192, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(OnDisk(head, 0, 8192, 6) && g_Disk[head - 1] == 0xAB) ;
+	CHECK(g_FileObject.CurrentByteOffset.QuadPart == 8192 && g_StreamCtx.FileValidLength.QuadPart == 8192) ;
+
+	memset(buffer, 0xEE, 8192) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 0, 8192, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(IsPlain(buffer, 0, 8192, 6) && g_FileObject.CurrentByteOffset.QuadPart == 8192) ;
+
+	memset(buffer, 0xEE, 4096) ;
+	CHECK(Transfer(FALSE, IRP_NOCACHE | IRP_PAGING_IO, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER, 0, 4096, buffer, PASSIVE_LEVEL) == FLT_POSTOP_FINISHED_PROCESSING) ;
+	CHECK(buffer[0] == 0xAB && buffer[head - 1] == 0xAB && IsPlain(buffer + head, 0, 4096 - head, 6)) ;
+
+	g_StreamCtx.Flags &= ~SC_FLAG_HEADER ;
+	CHECK(Layout_Init(&g_VolCtx.Layout, LayoutTrailer, 512, FLAGFMT_MAX_SIZE)) ;
+
+	CHECK(g_PoolBuffers == 0) ;
+	Ctx_UnmarkStreamHandled(&g_StreamCtx) ;
+	g_StreamFsContext = NULL ;
+}
+
+int
+main(void)
+{
+	FAST_PATH_STATS stats ;
+
+	ProcList_Init() ;
+	PidCache_Init() ;
+	PolicyList_Init() ;
+
+	g_VolCtx.SectorSize = 512 ;
+	CHECK(Layout_Init(&g_VolCtx.Layout, LayoutTrailer, 512, FLAGFMT_MAX_SIZE)) ;
+
+	TestCreate() ;
+	TestOverwrite() ;
+	TestUnhandled((PVOID)0x10000) ;
+	TestHandled((PVOID)0x20000) ;
+
+	QueryFastPathStats(&stats) ;
+	CHECK(stats.Calls[FastPathCreate] == 20) ;
+	CHECK(stats.NoCallback[FastPathCreate] == 3) ;
+	CHECK(stats.Calls[FastPathWrite] == stats.NoCallback[FastPathWrite] + 5) ;
+	CHECK(stats.Calls[FastPathRead] == stats.NoCallback[FastPathRead]) ;
+
+	TestTransform((PVOID)0x30000) ;
+
+	return Report("fastpath_test") ;
+}
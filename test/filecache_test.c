@@ -0,0 +1,316 @@
+/*++
+
+Module Name:
+
+    filecache_test.c
+
+Abstract:
+
+    File flag cache lookups, alone and against concurrent updates.
+
+    Builds filecache.c against the threaded kernel stand-ins of wdk/.
+    Copies of a whole entry, the copy of a lookup, and of a flag, the one
+    of an insert, yield half way, so that writers land in the middle of
+    readers and the other way round.
+
+    A scripted run checks hits on the stamp a file was cached with and
+    misses on each field of it changed, plain text hits, that an insert
+    replaces the entry of its file, removal, CLOCK eviction in a full
+    set, and that a plain text entry is not served once the file is
+    encrypted.  Then 8 readers look up 12 files of one set while two
+    threads cache version after version of them, every other version
+    encrypted, and remove them now and then.  The stamp and the flag of
+    a version are derived from its number: a hit must return the flag of
+    the version its stamp names, and not the plain text of an encrypted
+    one.
+
+--*/
+#include <sched.h>
+#include <stdlib.h>
+
+#include "filecache.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define FILES           12
+
+#define READERS         8
+#define WRITERS         2
+#define VERSIONS        4000
+
+static PFILE_CACHE g_Cache ;
+static FILE_CACHE_ID g_Ids[FILES] ;
+
+//version of each file being cached, or cached last
+static volatile LONG g_Version[FILES] ;
+static volatile LONG g_Writing ;
+
+static volatile LONG64 g_Lookups ;
+static volatile LONG64 g_Hits ;
+
+//the copies of an entry and of a flag, slow enough to be landed in
+VOID
+RtlCopyMemory(PVOID Destination, const VOID *Source, SIZE_T Length)
+{
+	if (Length != sizeof(FILE_CACHE_ENTRY) && Length != sizeof(FILE_FLAG))
+	{
+		memcpy(Destination, Source, Length) ;
+		return ;
+	}
+
+	memcpy(Destination, Source, Length / 2) ;
+	sched_yield() ;
+	memcpy((PUCHAR)Destination + Length / 2, (const UCHAR *)Source + Length / 2, Length - Length / 2) ;
+}
+
+static void
+FileStamp(ULONG File, LONG Version, PFILE_CACHE_STAMP Stamp)
+{
+	Stamp->EndOfFile.QuadPart = (LONGLONG)File << 32 | (ULONG)Version ;
+	Stamp->LastWriteTime.QuadPart = Version * 3LL ;
+	Stamp->ChangeTime.QuadPart = Version * 7LL ;
+}
+
+//odd versions are encrypted
+static void
+FileFlag(ULONG File, LONG Version, PFILE_FLAG Flag)
+{
+	memset(Flag, (UCHAR)(File * 16 + Version * 31), sizeof(FILE_FLAG)) ;
+}
+
+static BOOLEAN
+SameFlag(ULONG File, LONG Version, const FILE_FLAG *Flag)
+{
+	FILE_FLAG expected ;
+
+	FileFlag(File, Version, &expected) ;
+	return memcmp(Flag, &expected, sizeof(FILE_FLAG)) == 0 ;
+}
+
+//
+//  Scripted
+//
+
+static void
+Scripted(void)
+{
+	PFILE_CACHE cache = FileCache_Create() ;
+	FILE_CACHE_ID ids[FILE_CACHE_WAYS + 2], another ;
+	FILE_CACHE_STAMP stamp, other ;
+	FILE_CACHE_STATS stats ;
+	FILE_FLAG flag, found ;
+	BOOLEAN encrypted ;
+	ULONGLONG low ;
+	ULONG i, n, set ;
+
+	CHECK(cache != NULL) ;
+
+	//ids of one set, High not 0 as with 128-bit ids
+	set = ~0u ;
+	for (low = 1, n = 0; n < ARRAYSIZE(ids); low++)
+	{
+		FILE_CACHE_ID id = { low, 7 } ;
+
+		if (set == ~0u)
+			set = iFileCache_Set(&id) ;
+		if (iFileCache_Set(&id) == set)
+			ids[n++] = id ;
+	}
+
+	FileStamp(0, 1, &stamp) ;
+	CHECK(!FileCache_Lookup(cache, &ids[0], &stamp, &encrypted, &found)) ;
+
+	//plain text
+	FileCache_Insert(cache, &ids[0], &stamp, NULL) ;
+	encrypted = TRUE ;
+	CHECK(FileCache_Lookup(cache, &ids[0], &stamp, &encrypted, &found) && !encrypted) ;
+
+	//any field of the stamp changed
+	for (i = 0; i < 3; i++)
+	{
+		other = stamp ;
+		(&other.EndOfFile)[i].QuadPart++ ;
+		CHECK(!FileCache_Lookup(cache, &ids[0], &other, &encrypted, &found)) ;
+	}
+
+	//an id differing in High only is another file
+	another = ids[0] ;
+	another.High++ ;
+	CHECK(!FileCache_Lookup(cache, &another, &stamp, &encrypted, &found)) ;
+
+	//encrypted since, under the same stamp or another: the entry is
+	//replaced, the file keeps one
+	FileFlag(0, 2, &flag) ;
+	FileCache_Insert(cache, &ids[0], &stamp, &flag) ;
+	CHECK(FileCache_Lookup(cache, &ids[0], &stamp, &encrypted, &found) && encrypted && SameFlag(0, 2, &found)) ;
+
+	FileStamp(0, 3, &other) ;
+	FileCache_Insert(cache, &ids[0], &other, &flag) ;
+	CHECK(!FileCache_Lookup(cache, &ids[0], &stamp, &encrypted, &found)) ;
+	CHECK(FileCache_Lookup(cache, &ids[0], &other, &encrypted, &found) && encrypted) ;
+
+	for (i = n = 0; i < FILE_CACHE_WAYS; i++)
+		n += cache->Entries[set][i].bValid ;
+	CHECK(n == 1) ;
+
+	FileCache_QueryStats(cache, &stats) ;
+	CHECK(stats.Hits == 2 && stats.PlaintextHits == 1 && stats.Misses == 6) ;
+	CHECK(stats.Evictions == 0 && stats.Invalidations == 0) ;
+
+	//removed once
+	FileCache_Remove(cache, &ids[0]) ;
+	FileCache_Remove(cache, &ids[0]) ;
+	CHECK(!FileCache_Lookup(cache, &ids[0], &other, &encrypted, &found)) ;
+	FileCache_QueryStats(cache, &stats) ;
+	CHECK(stats.Invalidations == 1) ;
+
+	//a full set: the hand clears every referenced bit and takes the
+	//first entry; a hit saves an entry from the next turn
+	for (i = 0; i < FILE_CACHE_WAYS; i++)
+	{
+		FileStamp(i, 1, &stamp) ;
+		FileCache_Insert(cache, &ids[i], &stamp, NULL) ;
+	}
+	FileCache_QueryStats(cache, &stats) ;
+	CHECK(stats.Evictions == 0) ;
+
+	FileStamp(FILE_CACHE_WAYS, 1, &stamp) ;
+	FileCache_Insert(cache, &ids[FILE_CACHE_WAYS], &stamp, NULL) ;
+	FileStamp(1, 1, &stamp) ;
+	CHECK(FileCache_Lookup(cache, &ids[1], &stamp, &encrypted, &found)) ;
+	FileStamp(FILE_CACHE_WAYS + 1, 1, &stamp) ;
+	FileCache_Insert(cache, &ids[FILE_CACHE_WAYS + 1], &stamp, NULL) ;
+
+	for (i = 0; i < FILE_CACHE_WAYS + 2; i++)
+	{
+		FileStamp(i, 1, &stamp) ;
+		CHECK(FileCache_Lookup(cache, &ids[i], &stamp, &encrypted, &found) == (i != 0 && i != 2)) ;
+	}
+	FileCache_QueryStats(cache, &stats) ;
+	CHECK(stats.Evictions == 2) ;
+
+	FileCache_Delete(cache) ;
+	CHECK(Wdk_PoolBytes(FILE_CACHE_TAG) == 0) ;
+}
+
+//
+//  Stress
+//
+
+static void
+Reader(ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	FILE_CACHE_STAMP stamp ;
+	FILE_FLAG flag ;
+	BOOLEAN encrypted ;
+	LONG version ;
+	ULONG file ;
+	LONG n ;
+
+	for (n = 0; g_Writing != 0; n++)
+	{
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+		file = (ULONG)(state % FILES) ;
+
+		//the version cached last, or one on its way
+		version = g_Version[file] + (LONG)((state >> 32) & 1) ;
+		FileStamp(file, version, &stamp) ;
+
+		InterlockedIncrement64(&g_Lookups) ;
+
+		if (!FileCache_Lookup(g_Cache, &g_Ids[file], &stamp, &encrypted, &flag))
+			continue ;
+
+		InterlockedIncrement64(&g_Hits) ;
+
+		CHECK(encrypted == (version & 1)) ;
+		CHECK(!encrypted || SameFlag(file, version, &flag)) ;
+	}
+}
+
+static void
+Writer(ULONG Index)
+{
+	FILE_CACHE_STAMP stamp ;
+	FILE_FLAG flag ;
+	LONG version ;
+	ULONG file ;
+	LONG n ;
+
+	for (n = 0; n < VERSIONS; n++)
+	{
+		file = (ULONG)(n * WRITERS + Index) % FILES ;
+		version = g_Version[file] + 1 ;
+
+		FileStamp(file, version, &stamp) ;
+		FileFlag(file, version, &flag) ;
+		InterlockedExchange(&g_Version[file], version) ;
+
+		if (n % 16 == 15)
+			FileCache_Remove(g_Cache, &g_Ids[file]) ;
+		else
+			FileCache_Insert(g_Cache, &g_Ids[file], &stamp, (version & 1) ? &flag : NULL) ;
+
+		sched_yield() ;
+	}
+
+	InterlockedDecrement(&g_Writing) ;
+}
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	(void)Context ;
+
+	if (Index < READERS)
+		Reader(Index) ;
+	else
+		Writer(Index - READERS) ;
+}
+
+int
+main(void)
+{
+	FILE_CACHE_STATS stats ;
+	ULONGLONG low ;
+	ULONG n, set ;
+
+	setenv("WDK_CPUS", "8", 0) ;
+
+	Scripted() ;
+
+	//all files in one set, more of them than it has ways
+	g_Cache = FileCache_Create() ;
+	CHECK(g_Cache != NULL) ;
+
+	set = ~0u ;
+	for (low = 1, n = 0; n < FILES; low++)
+	{
+		FILE_CACHE_ID id = { low, 0 } ;
+
+		if (set == ~0u)
+			set = iFileCache_Set(&id) ;
+		if (iFileCache_Set(&id) == set)
+			g_Ids[n++] = id ;
+	}
+
+	g_Writing = WRITERS ;
+	Wdk_RunThreads(READERS + WRITERS, Stress, NULL) ;
+
+	//each lookup counted once, some of them hits
+	FileCache_QueryStats(g_Cache, &stats) ;
+	CHECK(stats.Hits + stats.PlaintextHits == g_Hits) ;
+	CHECK(stats.Hits + stats.PlaintextHits + stats.Misses == g_Lookups) ;
+	CHECK(stats.Hits != 0 && stats.PlaintextHits != 0 && stats.Evictions != 0 && stats.Invalidations != 0) ;
+
+	printf("%lld lookups, %lld hits, %lld plain text hits, %lld evictions\n",
+		(long long)g_Lookups, (long long)stats.Hits, (long long)stats.PlaintextHits, (long long)stats.Evictions) ;
+
+	FileCache_Delete(g_Cache) ;
+	CHECK(Wdk_PoolBytes(FILE_CACHE_TAG) == 0) ;
+
+	return Report("filecache_test") ;
+}
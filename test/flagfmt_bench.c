@@ -0,0 +1,150 @@
+/*++
+
+Module Name:
+
+    flagfmt_bench.c
+
+Abstract:
+
+    Trailer recognition throughput:
+
+        flagfmt_bench [directory]
+
+    Reads the last sector of every regular file under the directory and
+    decodes it, the way the driver recognizes an encrypted file, and
+    times the decode alone.  Without a directory a temporary one is filled
+    with a mix of version 2, version 1 and plain files.
+
+--*/
+#define _GNU_SOURCE
+#include "flagfmt.h"
+#include "testutil.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+#define MAX_FILES   100000
+
+static char *g_Paths[MAX_FILES] ;
+static int g_Count ;
+
+static int
+Collect(const char *Path, const struct stat *St, int Type, struct FTW *Ftw)
+{
+	(void)Ftw ;
+
+	if (Type == FTW_F && S_ISREG(St->st_mode) && St->st_size >= SECTOR_SIZE && g_Count < MAX_FILES)
+		g_Paths[g_Count++] = strdup(Path) ;
+
+	return 0 ;
+}
+
+static void
+MakeFiles(const char *Directory, int Count)
+{
+	unsigned char *data = malloc(128 * SECTOR_SIZE) ;
+	FLAGFMT_INFO info = { 0 } ;
+	char path[4096] ;
+	int i ;
+
+	info.Version = FLAGFMT_VERSION_2 ;
+	info.CipherId = 1 ;
+
+	for (i = 0; i < Count; i++)
+	{
+		size_t size = SECTOR_SIZE * (1 + Rand() % 128) ;
+		int fd ;
+
+		RandFill(data, size) ;
+
+		if (i % 3 == 0)
+		{
+			info.ValidLength = size - SECTOR_SIZE ;
+			FlagFmt_Write(&info, data + size - SECTOR_SIZE) ;
+		}
+		else if (i % 3 == 1)
+		{
+			memcpy(data + size - SECTOR_SIZE, "CMFF\1\0\0\0", 8) ;
+		}
+
+		snprintf(path, sizeof(path), "%s/%d", Directory, i) ;
+		fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644) ;
+		if (fd < 0 || write(fd, data, size) != (ssize_t)size)
+			perror(path) ;
+		if (fd >= 0)
+			close(fd) ;
+	}
+
+	free(data) ;
+}
+
+int
+main(int argc, char **argv)
+{
+	char scratch[] = "/tmp/flagfmt_benchXXXXXX" ;
+	const char *directory = argc > 1 ? argv[1] : NULL ;
+	unsigned char sector[SECTOR_SIZE] ;
+	FLAGFMT_INFO info = { 0 } ;
+	int impl, i ;
+
+	if (directory == NULL)
+	{
+		directory = mkdtemp(scratch) ;
+		MakeFiles(directory, 3000) ;
+	}
+
+	nftw(directory, Collect, 32, FTW_PHYS) ;
+
+	for (impl = FlagFmtImplScalar; impl <= FlagFmtImplSse42; impl++)
+	{
+		int results[FlagFmtCorrupt + 1] = { 0 } ;
+		unsigned int sum = 0 ;
+		double start, files, decode ;
+		long rounds = 10000000, r ;
+
+		FlagFmt_Init((FLAGFMT_IMPL)impl) ;
+		if (FlagFmt_GetImpl() != (FLAGFMT_IMPL)impl)
+			continue ;
+
+		start = Now() ;
+		for (i = 0; i < g_Count; i++)
+		{
+			int fd = open(g_Paths[i], O_RDONLY) ;
+			struct stat st ;
+
+			if (fd < 0)
+				continue ;
+
+			if (fstat(fd, &st) == 0 && pread(fd, sector, SECTOR_SIZE, (st.st_size & ~(off_t)(SECTOR_SIZE - 1)) - SECTOR_SIZE) == SECTOR_SIZE)
+				results[FlagFmt_Read(sector, SECTOR_SIZE, &info)]++ ;
+
+			close(fd) ;
+		}
+		files = Now() - start ;
+
+		FlagFmt_Write(&info, sector) ;
+		start = Now() ;
+		for (r = 0; r < rounds; r++)
+			sum += FlagFmt_Read(sector, SECTOR_SIZE, &info) ;
+		decode = Now() - start ;
+
+		printf("%-6s %d files at %.0f files/s (flag %d, not a flag %d, unknown %d, corrupt %d), decode %.1f ns/trailer (%u)\n",
+			impl == FlagFmtImplSse42 ? "sse4.2" : "scalar",
+			g_Count, g_Count / files,
+			results[FlagFmtOk], results[FlagFmtNotFlag], results[FlagFmtUnknownVersion], results[FlagFmtCorrupt],
+			decode / rounds * 1e9, sum) ;
+	}
+
+	if (directory == scratch)
+	{
+		for (i = 0; i < g_Count; i++)
+			unlink(g_Paths[i]) ;
+		rmdir(scratch) ;
+	}
+
+	return 0 ;
+}
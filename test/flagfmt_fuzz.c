@@ -0,0 +1,126 @@
+/*++
+
+Module Name:
+
+    flagfmt_fuzz.c
+
+Abstract:
+
+    Round trip and fuzz test of the file flag reader and writer:
+
+        flagfmt_fuzz [iterations]
+
+    Random flags must survive FlagFmt_Write/FlagFmt_Read unchanged, while
+    truncated flags, flags with up to three flipped bits and random bytes,
+    with or without a valid magic in front, must never decode.
+
+--*/
+#include "flagfmt.h"
+#include "testutil.h"
+
+#include <stdlib.h>
+
+static void
+TestCrc(void)
+{
+	int impl ;
+
+	for (impl = FlagFmtImplScalar; impl <= FlagFmtImplSse42; impl++)
+	{
+		FlagFmt_Init((FLAGFMT_IMPL)impl) ;
+
+		//RFC 3720 check value
+		CHECK(FlagFmt_Crc32c(0, "123456789", 9) == 0xE3069283) ;
+		CHECK(FlagFmt_Crc32c(FlagFmt_Crc32c(0, "1234", 4), "56789", 5) == 0xE3069283) ;
+	}
+}
+
+static void
+TestVersion1(void)
+{
+	unsigned char v1[FLAGFMT_V1_SIZE] ;
+	FLAGFMT_INFO out ;
+
+	RandFill(v1, sizeof(v1)) ;
+	memcpy(v1, "CMFF\1\0\0\0", 8) ;
+
+	CHECK(FlagFmt_Read(v1, sizeof(v1), &out) == FlagFmtOk) ;
+	CHECK(out.Version == FLAGFMT_VERSION_1 && out.CipherId == 0) ;
+	CHECK(memcmp(out.KeyHash, v1 + 8, FLAGFMT_KEY_HASH_SIZE) == 0) ;
+	CHECK(memcmp(out.Nonce, v1 + 28, FLAGFMT_NONCE_SIZE) == 0) ;
+
+	memcpy(v1 + 4, "\4\0\0\0", 4) ;
+	CHECK(FlagFmt_Read(v1, sizeof(v1), &out) == FlagFmtUnknownVersion) ;
+}
+
+static void
+Fuzz(long Iterations)
+{
+	unsigned char flag[FLAGFMT_MAX_SIZE], bad[FLAGFMT_MAX_SIZE], garbage[4096] ;
+	FLAGFMT_INFO in, out ;
+	long i ;
+
+	for (i = 0; i < Iterations; i++)
+	{
+		int flips = 1 + (int)(Rand() % 3), k ;
+
+		RandFill(&in, sizeof(in)) ;
+		in.Version = Rand() & 1 ? FLAGFMT_VERSION_3 : FLAGFMT_VERSION_2 ;
+		if (in.Version == FLAGFMT_VERSION_3)
+			in.ValidLength = 0 ;
+
+		FlagFmt_Write(&in, flag) ;
+
+		CHECK(FlagFmt_Read(flag, sizeof(flag), &out) == FlagFmtOk) ;
+		CHECK(out.Version == in.Version && out.CipherId == in.CipherId && out.ValidLength == in.ValidLength) ;
+		CHECK(memcmp(out.Nonce, in.Nonce, FLAGFMT_NONCE_SIZE) == 0) ;
+		CHECK(memcmp(out.KeyHash, in.KeyHash, FLAGFMT_KEY_HASH_SIZE) == 0) ;
+
+		//a flag cut short is never a flag
+		CHECK(FlagFmt_Read(flag, Rand() % FLAGFMT_V2_SIZE, &out) != FlagFmtOk) ;
+
+		//CRC32C catches every error of up to three bits in 128 bytes
+		memcpy(bad, flag, sizeof(bad)) ;
+		for (k = 0; k < flips; k++)
+		{
+			size_t bit = Rand() % (FLAGFMT_V2_SIZE * 8) ;
+			bad[bit / 8] ^= (unsigned char)(1 << (bit % 8)) ;
+		}
+		if (memcmp(bad, flag, sizeof(bad)) != 0)
+			CHECK(FlagFmt_Read(bad, sizeof(bad), &out) != FlagFmtOk || out.Version == FLAGFMT_VERSION_1) ;
+
+		RandFill(garbage, sizeof(garbage)) ;
+		CHECK(FlagFmt_Read(garbage, sizeof(garbage), &out) != FlagFmtOk) ;
+
+		memcpy(garbage, "CMFF\2\0\0\0\x80\0\0\0", 12) ;
+		CHECK(FlagFmt_Read(garbage, sizeof(garbage), &out) == FlagFmtCorrupt) ;
+
+		//both kernels agree on any length and alignment
+		if ((i & 255) == 0)
+		{
+			size_t skip = Rand() % 16, length = Rand() % 2000 ;
+			unsigned int a, b ;
+
+			FlagFmt_Init(FlagFmtImplScalar) ;
+			a = FlagFmt_Crc32c(0, garbage + skip, length) ;
+			FlagFmt_Init(FlagFmtImplSse42) ;
+			b = FlagFmt_Crc32c(0, garbage + skip, length) ;
+			CHECK(a == b) ;
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 200000 ;
+
+	TestCrc() ;
+	TestVersion1() ;
+
+	FlagFmt_Init(FlagFmtImplSse42) ;
+	printf("crc32c kernel: %s\n", FlagFmt_GetImpl() == FlagFmtImplSse42 ? "sse4.2" : "scalar") ;
+	Fuzz(iterations) ;
+
+	return Report("flagfmt_fuzz") ;
+}
@@ -0,0 +1,350 @@
+/*++
+
+Module Name:
+
+    keycache_test.c
+
+Abstract:
+
+    Key schedule cache: the reference count protocol, entries outside
+    the table, and eviction under contention.
+
+    Builds keycache.c against the threaded kernel stand-ins of wdk/, with
+    the key expansion mocked: the schedules of key k are filled with k,
+    so a holder sees whether its entry was refilled under it.
+
+    Scripted runs check each count: 0 free and -1 owned entries are never
+    handed out, a hit adds a reference and a release drops it, a failed
+    expansion frees what it took, a set pinned full makes entries outside
+    the table that go with their last reference, and CLOCK gives entries
+    hit since its last pass a second chance.  Then 32 threads reference
+    and hold keys crowding a few sets, so entries are evicted and made
+    outside the table all the time; every held entry must keep its key.
+
+--*/
+#include <sched.h>
+#include <stdlib.h>
+
+#include "keycache.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define THREADS         32
+#define ITERATIONS      3000
+#define HELD            3
+
+//keys of the stress run, spread over this many sets only
+#define KEYS            40
+#define HOT_SETS        3
+
+#define FAILING_KEY     0xEE
+
+static volatile LONG g_Expansions ;
+
+NTSTATUS
+Crypt_ExpandKey(const UCHAR *Key, PAES_KEY DataKey, PAES_KEY TweakKey)
+{
+	if (Key[0] == FAILING_KEY)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	memset(DataKey, Key[0], sizeof(AES_KEY)) ;
+
+	//a refill is slow enough for holders of the entry to notice
+	if (InterlockedIncrement(&g_Expansions) % 4 == 0)
+		sched_yield() ;
+
+	memset(TweakKey, Key[0], sizeof(AES_KEY)) ;
+
+	return STATUS_SUCCESS ;
+}
+
+//the digest of key Id, in set Id % KEY_CACHE_SETS
+static void
+Digest(ULONG Id, UCHAR *Hash, UCHAR *Key)
+{
+	memset(Hash, 0, HASH_SIZE) ;
+	*(ULONG *)Hash = Id ;
+	Hash[HASH_SIZE - 1] = 0x5A ;
+
+	memset(Key, 0, MAX_KEY_LENGTH) ;
+	Key[0] = (UCHAR)Id ;
+}
+
+static PKEY_CACHE_ENTRY
+Reference(ULONG Id)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+	PKEY_CACHE_ENTRY entry = NULL ;
+
+	Digest(Id, hash, key) ;
+	CHECK(NT_SUCCESS(KeyCache_Reference(hash, key, &entry))) ;
+
+	return entry ;
+}
+
+static PKEY_CACHE_ENTRY
+Lookup(ULONG Id)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+
+	Digest(Id, hash, key) ;
+	return KeyCache_Lookup(hash) ;
+}
+
+static BOOLEAN
+Holds(PKEY_CACHE_ENTRY Entry, ULONG Id)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+	const UCHAR *schedule = (const UCHAR *)&Entry->Key ;
+	const UCHAR *tweak = (const UCHAR *)&Entry->TweakKey ;
+
+	Digest(Id, hash, key) ;
+
+	return Entry->RefCount >= 1 && memcmp(Entry->szKeyHash, hash, HASH_SIZE) == 0 &&
+		schedule[0] == key[0] && schedule[sizeof(AES_KEY) - 1] == key[0] &&
+		tweak[0] == key[0] && tweak[sizeof(AES_KEY) - 1] == key[0] ;
+}
+
+static LONG64
+TableBytes(void)
+{
+	return KEY_CACHE_SETS * KEY_CACHE_WAYS * sizeof(KEY_CACHE_ENTRY) ;
+}
+
+//
+//  Scripted
+//
+
+static void
+Protocol(void)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+	KEY_CACHE_STATS before ;
+	KEY_CACHE_STATS after ;
+	PKEY_CACHE_ENTRY entry ;
+	PKEY_CACHE_ENTRY again ;
+
+	KeyCache_QueryStats(&before) ;
+
+	//n: the cache's reference plus one per holder
+	entry = Reference(1) ;
+	CHECK(entry != NULL && Holds(entry, 1) && entry->RefCount == 2 && !entry->bUncached) ;
+	CHECK(((ULONG_PTR)entry & (KEY_CACHE_ALIGNMENT - 1)) == 0) ;
+
+	again = Lookup(1) ;
+	CHECK(again == entry && entry->RefCount == 3) ;
+	KeyCache_AddRef(entry) ;
+	CHECK(entry->RefCount == 4) ;
+
+	KeyCache_Release(entry) ;
+	KeyCache_Release(entry) ;
+	KeyCache_Release(again) ;
+	CHECK(entry->RefCount == 1) ;
+
+	KeyCache_QueryStats(&after) ;
+	CHECK(after.Hits - before.Hits == 1 && after.Misses - before.Misses == 1) ;
+
+	//-1: owned by a filler, not handed out even though the digest matches
+	entry->RefCount = -1 ;
+	CHECK(Lookup(1) == NULL) ;
+
+	//0: free, a stale digest is not a hit either
+	entry->RefCount = 0 ;
+	CHECK(Lookup(1) == NULL) ;
+
+	//a free entry is taken again
+	again = Reference(1) ;
+	CHECK(Holds(again, 1) && again->RefCount == 2) ;
+	KeyCache_Release(again) ;
+
+	//a failed expansion gives back the entry it claimed
+	Digest(FAILING_KEY, hash, key) ;
+	key[0] = FAILING_KEY ;
+	CHECK(KeyCache_Reference(hash, key, &entry) == STATUS_INSUFFICIENT_RESOURCES) ;
+	CHECK(Lookup(FAILING_KEY) == NULL) ;
+	CHECK(Wdk_PoolBytes(KEY_CACHE_TAG) == TableBytes()) ;
+}
+
+//a set whose entries are all held makes entries outside the table
+static void
+Overflow(void)
+{
+	PKEY_CACHE_ENTRY held[KEY_CACHE_WAYS] ;
+	PKEY_CACHE_ENTRY extra ;
+	PKEY_CACHE_ENTRY extra2 ;
+	KEY_CACHE_STATS before ;
+	KEY_CACHE_STATS after ;
+	ULONG i ;
+
+	KeyCache_QueryStats(&before) ;
+
+	for (i = 0; i < KEY_CACHE_WAYS; i++)
+	{
+		held[i] = Reference(5 + i * KEY_CACHE_SETS) ;
+		CHECK(!held[i]->bUncached) ;
+	}
+
+	extra = Reference(5 + KEY_CACHE_WAYS * KEY_CACHE_SETS) ;
+	CHECK(extra != NULL && extra->bUncached && extra->RefCount == 1) ;
+	CHECK(Holds(extra, 5 + KEY_CACHE_WAYS * KEY_CACHE_SETS)) ;
+	CHECK(((ULONG_PTR)extra & (KEY_CACHE_ALIGNMENT - 1)) == 0) ;
+	CHECK(Wdk_PoolBytes(KEY_CACHE_TAG) > TableBytes()) ;
+
+	//not findable, a second reference makes a second entry
+	extra2 = Reference(5 + KEY_CACHE_WAYS * KEY_CACHE_SETS) ;
+	CHECK(extra2 != extra && extra2->bUncached) ;
+
+	KeyCache_AddRef(extra) ;
+	KeyCache_Release(extra) ;
+	CHECK(extra->RefCount == 1) ;
+
+	//the last reference frees it
+	KeyCache_Release(extra) ;
+	KeyCache_Release(extra2) ;
+	CHECK(Wdk_PoolBytes(KEY_CACHE_TAG) == TableBytes()) ;
+
+	KeyCache_QueryStats(&after) ;
+	CHECK(after.Uncached - before.Uncached == 2) ;
+
+	for (i = 0; i < KEY_CACHE_WAYS; i++)
+	{
+		CHECK(Holds(held[i], 5 + i * KEY_CACHE_SETS)) ;
+		KeyCache_Release(held[i]) ;
+	}
+}
+
+//CLOCK: a fifth key evicts an entry only the cache holds, and the one
+//hit since the hand passed survives the next eviction
+static void
+Clock(void)
+{
+	KEY_CACHE_STATS before ;
+	KEY_CACHE_STATS after ;
+	PKEY_CACHE_ENTRY entry ;
+	ULONG i, cached ;
+
+	KeyCache_QueryStats(&before) ;
+
+	for (i = 0; i < KEY_CACHE_WAYS + 1; i++)
+		KeyCache_Release(Reference(9 + i * KEY_CACHE_SETS)) ;
+
+	KeyCache_QueryStats(&after) ;
+	CHECK(after.Evictions - before.Evictions == 1 && after.Uncached == before.Uncached) ;
+
+	//keep the newest hot, then bring in two more keys
+	for (i = 0; i < 2; i++)
+	{
+		entry = Lookup(9 + KEY_CACHE_WAYS * KEY_CACHE_SETS) ;
+		CHECK(entry != NULL) ;
+		if (entry != NULL)
+			KeyCache_Release(entry) ;
+
+		KeyCache_Release(Reference(9 + (KEY_CACHE_WAYS + 1 + i) * KEY_CACHE_SETS)) ;
+	}
+
+	entry = Lookup(9 + KEY_CACHE_WAYS * KEY_CACHE_SETS) ;
+	CHECK(entry != NULL) ;
+	if (entry != NULL)
+		KeyCache_Release(entry) ;
+
+	for (i = 0, cached = 0; i < KEY_CACHE_WAYS + 3; i++)
+	{
+		entry = Lookup(9 + i * KEY_CACHE_SETS) ;
+		if (entry != NULL)
+		{
+			cached++ ;
+			KeyCache_Release(entry) ;
+		}
+	}
+
+	CHECK(cached == KEY_CACHE_WAYS) ;
+}
+
+//
+//  Stress
+//
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	PKEY_CACHE_ENTRY held[HELD] ;
+	ULONG ids[HELD] ;
+	ULONG i ;
+	int n ;
+
+	(void)Context ;
+
+	memset(held, 0, sizeof(held)) ;
+
+	for (n = 0; n < ITERATIONS; n++)
+	{
+		i = n % HELD ;
+
+		if (held[i] != NULL)
+		{
+			CHECK(Holds(held[i], ids[i])) ;
+			KeyCache_Release(held[i]) ;
+			held[i] = NULL ;
+		}
+
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+
+		//KEYS keys over HOT_SETS sets, more than their ways
+		ids[i] = (ULONG)(state % HOT_SETS) + KEY_CACHE_SETS * (ULONG)((state >> 16) % (KEYS / HOT_SETS)) ;
+
+		held[i] = (state >> 40) % 2 ? Lookup(ids[i]) : NULL ;
+		if (held[i] == NULL)
+			held[i] = Reference(ids[i]) ;
+
+		if (held[i] != NULL)
+			CHECK(Holds(held[i], ids[i])) ;
+
+		if (n % 8 == 0)
+			sched_yield() ;
+	}
+
+	for (i = 0; i < HELD; i++)
+	{
+		if (held[i] != NULL)
+		{
+			CHECK(Holds(held[i], ids[i])) ;
+			KeyCache_Release(held[i]) ;
+		}
+	}
+}
+
+int
+main(void)
+{
+	KEY_CACHE_STATS stats ;
+	ULONG i ;
+
+	setenv("WDK_CPUS", "8", 0) ;
+
+	CHECK(NT_SUCCESS(KeyCache_Init())) ;
+	CHECK(((ULONG_PTR)g_KeyCache & (PAGE_SIZE - 1)) == 0) ;
+
+	Protocol() ;
+	Overflow() ;
+	Clock() ;
+
+	Wdk_RunThreads(THREADS, Stress, NULL) ;
+
+	KeyCache_QueryStats(&stats) ;
+	CHECK(stats.Evictions > 0 && stats.Uncached > 0) ;
+	printf("%lld hits, %lld misses, %lld evictions, %lld uncached\n",
+		(long long)stats.Hits, (long long)stats.Misses, (long long)stats.Evictions, (long long)stats.Uncached) ;
+
+	//only the cache's own references are left, and no entry outside it
+	for (i = 0; i < KEY_CACHE_SETS * KEY_CACHE_WAYS; i++)
+		CHECK(g_KeyCache[i].RefCount == 0 || g_KeyCache[i].RefCount == 1) ;
+	CHECK(Wdk_PoolBytes(KEY_CACHE_TAG) == TableBytes()) ;
+
+	KeyCache_Uninit() ;
+	CHECK(Wdk_PoolBytes(KEY_CACHE_TAG) == 0) ;
+
+	return Report("keycache_test") ;
+}
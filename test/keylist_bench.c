@@ -0,0 +1,186 @@
+/*++
+
+Module Name:
+
+    keylist_bench.c
+
+Abstract:
+
+    History key list lookup time against the length of the list:
+
+        keylist_bench [lookups per point]
+
+    Times KeyList_Lookup for digests in the list and not in it, next to
+    a linear scan of the same FILEKEY_INFO array, which is what resolving
+    an old key cost before the index.  Then readers on 1 to 16 threads of
+    the virtual processors of wdk/, alone and with one thread installing
+    lists all the time, in million lookups per second.  Threads beyond
+    the real processors only show the contention, not a speedup.
+
+--*/
+#include <stdlib.h>
+
+#include "keylist.c"
+#include "wdk.h"
+#include "testutil.h"
+
+static ULONG g_Lookups = 1000000 ;
+static PFILEKEY_INFO g_Keys ;
+static ULONG g_Count ;
+static volatile LONG g_Running ;
+static volatile LONG g_Sink ;
+
+//digests of listed keys are even, of the others odd
+static void
+Digest(ULONG Id, UCHAR *Hash)
+{
+	memset(Hash, 0x5A, HASH_SIZE) ;
+	*(ULONG *)Hash = Id * 0x9E3779B1 ;
+	*(ULONG *)(Hash + HASH_SIZE - 4) = Id ;
+}
+
+static void
+Build(ULONG Count)
+{
+	ULONG i ;
+
+	free(g_Keys) ;
+	g_Keys = malloc(Count * sizeof(FILEKEY_INFO)) ;
+	g_Count = Count ;
+
+	for (i = 0; i < Count; i++)
+	{
+		Digest(i * 2, g_Keys[i].szCurKeyHash) ;
+		memset(g_Keys[i].szCurKeyCipher, (UCHAR)i, MAX_KEY_LENGTH) ;
+	}
+}
+
+//the lookup before the index
+static BOOLEAN
+Scan(const UCHAR *KeyHash, PUCHAR Key)
+{
+	ULONG i ;
+
+	for (i = 0; i < g_Count; i++)
+	{
+		if (RtlEqualMemory(g_Keys[i].szCurKeyHash, KeyHash, HASH_SIZE))
+		{
+			RtlCopyMemory(Key, g_Keys[i].szCurKeyCipher, MAX_KEY_LENGTH) ;
+			return TRUE ;
+		}
+	}
+
+	return FALSE ;
+}
+
+//ns per lookup of Lookups digests, all listed or, with Miss, none
+static double
+Time(BOOLEAN Linear, BOOLEAN Miss, ULONG Lookups)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+	double start ;
+	ULONG n, found = 0 ;
+
+	start = Now() ;
+
+	for (n = 0; n < Lookups; n++)
+	{
+		Digest((n * 2654435761u % g_Count) * 2 + Miss, hash) ;
+		found += Linear ? Scan(hash, key) : KeyList_Lookup(hash, key) ;
+	}
+
+	CHECK(found == (Miss ? 0 : Lookups)) ;
+
+	return (Now() - start) * 1e9 / Lookups ;
+}
+
+static void
+Reader(PVOID Context, ULONG Index)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+	ULONG n, found = 0 ;
+
+	//thread 0 installs until the readers are done, if asked to
+	if (Context != NULL && Index == 0)
+	{
+		while (g_Running != 0)
+			KeyList_Install(g_Keys, g_Count) ;
+		return ;
+	}
+
+	for (n = 0; n < g_Lookups; n++)
+	{
+		Digest((n * 2654435761u % g_Count) * 2, hash) ;
+		found += KeyList_Lookup(hash, key) ;
+	}
+
+	InterlockedExchangeAdd(&g_Sink, found) ;
+	InterlockedDecrement(&g_Running) ;
+}
+
+static double
+Throughput(ULONG Threads, BOOLEAN Installing)
+{
+	double start ;
+
+	g_Running = Threads ;
+	g_Sink = 0 ;
+
+	start = Now() ;
+	Wdk_RunThreads(Threads + Installing, Reader, Installing ? (PVOID)1 : NULL) ;
+
+	CHECK(g_Sink == (LONG)(g_Lookups * Threads)) ;
+
+	return (double)g_Lookups * Threads / (Now() - start) / 1e6 ;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const ULONG counts[] = { 4, 64, 1024, 16384 } ;
+	ULONG threads ;
+	int i ;
+
+	if (argc > 1)
+		g_Lookups = (ULONG)atol(argv[1]) ;
+	if (g_Lookups == 0)
+		g_Lookups = 1 ;
+
+	if (!NT_SUCCESS(KeyList_Init()))
+		return 1 ;
+
+	printf("ns per lookup, %u lookups per point\n", g_Lookups) ;
+	printf("%8s %10s %10s %10s %10s\n", "keys", "index hit", "miss", "scan hit", "miss") ;
+
+	for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++)
+	{
+		//a scan costs the length of the list, keep its points short
+		ULONG scans = max(g_Lookups / counts[i], 1) ;
+
+		Build(counts[i]) ;
+		KeyList_Install(g_Keys, g_Count) ;
+
+		printf("%8u %10.1f %10.1f %10.1f %10.1f\n", counts[i],
+			Time(FALSE, FALSE, g_Lookups), Time(FALSE, TRUE, g_Lookups),
+			Time(TRUE, FALSE, scans), Time(TRUE, TRUE, scans)) ;
+	}
+
+	printf("\n%u virtual processors, 1024 keys, million lookups per second\n", Wdk_CpuCount()) ;
+	printf("%8s %12s %12s\n", "threads", "alone", "installing") ;
+
+	Build(1024) ;
+	KeyList_Install(g_Keys, g_Count) ;
+
+	for (threads = 1; threads <= 16; threads *= 2)
+	{
+		double alone = Throughput(threads, FALSE) ;
+		double installing = Throughput(threads, TRUE) ;
+
+		printf("%8u %12.2f %12.2f\n", threads, alone, installing) ;
+	}
+
+	KeyList_Uninit() ;
+	free(g_Keys) ;
+
+	return Report("keylist_bench") ;
+}
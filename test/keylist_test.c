@@ -0,0 +1,280 @@
+/*++
+
+Module Name:
+
+    keylist_test.c
+
+Abstract:
+
+    History key list lookups, alone and against concurrent installs.
+
+    Builds keylist.c and publish.c against the threaded kernel stand-ins
+    of wdk/, whose freed pool is overwritten.  The key of digest id is
+    stamped with the id and the list it was installed with, and the copy
+    of a key out of the table yields half way, so that a lookup still in
+    a table that is freed under it copies a torn key.
+
+    A scripted run installs lists of several lengths, with digests that
+    share the 4 bytes the index keeps, a digest listed twice and a list
+    too long.  Then 16 readers look keys up while one thread installs
+    list after list, each holding another part of the ids; every lookup
+    must answer for a list installed during the call, with an untorn key.
+
+--*/
+#include <sched.h>
+#include <stdlib.h>
+
+#include "keylist.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define IDS             600
+
+#define READERS         16
+#define LOOKUPS         20000
+#define INSTALLS        400
+
+static volatile LONG g_Installed ;
+static volatile LONG g_Done ;
+
+//the key copy of a lookup, slow enough for an install to land in it
+VOID
+RtlCopyMemory(PVOID Destination, const VOID *Source, SIZE_T Length)
+{
+	if (Length != MAX_KEY_LENGTH)
+	{
+		memcpy(Destination, Source, Length) ;
+		return ;
+	}
+
+	memcpy(Destination, Source, Length / 2) ;
+	sched_yield() ;
+	memcpy((PUCHAR)Destination + Length / 2, (const UCHAR *)Source + Length / 2, Length - Length / 2) ;
+}
+
+//ids 2k and 2k+1 share the 4 bytes the index keeps
+static void
+Digest(ULONG Id, UCHAR *Hash)
+{
+	memset(Hash, 0x5A, HASH_SIZE) ;
+	*(ULONG *)Hash = Id / 2 ;
+	*(ULONG *)(Hash + 4) = Id ;
+}
+
+//id, list and a check word, repeated
+static void
+Stamp(ULONG Id, ULONG List, UCHAR *Key)
+{
+	ULONG *words = (ULONG *)Key ;
+	ULONG i ;
+
+	for (i = 0; i < MAX_KEY_LENGTH / sizeof(ULONG); i += 2)
+	{
+		words[i] = Id << 16 | List ;
+		words[i + 1] = ~(Id << 16 | List) ;
+	}
+}
+
+//returns the list the key was stamped with, or -1 for another id or a
+//torn key
+static LONG
+Unstamp(ULONG Id, const UCHAR *Key)
+{
+	const ULONG *words = (const ULONG *)Key ;
+	ULONG i ;
+
+	for (i = 0; i < MAX_KEY_LENGTH / sizeof(ULONG); i += 2)
+	{
+		if (words[i] != words[0] || words[i + 1] != ~words[0])
+			return -1 ;
+	}
+
+	return words[0] >> 16 == Id ? (LONG)(words[0] & 0xFFFF) : -1 ;
+}
+
+//list List holds the ids not divisible by List % 3 + 2, installed in a
+//list specific order (Count is not a multiple of 7)
+static BOOLEAN
+Listed(ULONG List, ULONG Id)
+{
+	return Id % (List % 3 + 2) != 0 ;
+}
+
+static NTSTATUS
+Install(ULONG List, ULONG Count)
+{
+	PFILEKEY_INFO keys = malloc(max(Count, 1) * sizeof(FILEKEY_INFO)) ;
+	NTSTATUS status ;
+	ULONG i, n = 0 ;
+
+	for (i = 0; i < Count; i++)
+	{
+		ULONG id = (i * 7 + List) % Count ;
+
+		if (!Listed(List, id))
+			continue ;
+
+		Digest(id, keys[n].szCurKeyHash) ;
+		Stamp(id, List, keys[n].szCurKeyCipher) ;
+		n++ ;
+	}
+
+	status = KeyList_Install(keys, n) ;
+	free(keys) ;
+
+	return status ;
+}
+
+static BOOLEAN
+Lookup(ULONG Id, LONG *List)
+{
+	UCHAR hash[HASH_SIZE], key[MAX_KEY_LENGTH] ;
+
+	Digest(Id, hash) ;
+	if (!KeyList_Lookup(hash, key))
+		return FALSE ;
+
+	*List = Unstamp(Id, key) ;
+	return TRUE ;
+}
+
+//
+//  Scripted
+//
+
+static void
+Scripted(void)
+{
+	static const ULONG counts[] = { 1, 2, 3, 17, 1000, 5000 } ;
+	FILEKEY_INFO keys[3] ;
+	ULONG i, c, id ;
+	LONG list ;
+
+	//nothing installed yet
+	CHECK(!Lookup(1, &list)) ;
+
+	CHECK(KeyList_Install(keys, 0) == STATUS_SUCCESS) ;
+	CHECK(!Lookup(1, &list)) ;
+
+	for (c = 0; c < ARRAYSIZE(counts); c++)
+	{
+		CHECK(NT_SUCCESS(Install(c, counts[c]))) ;
+
+		//and the ids past the list, some sharing an index tag with a listed one
+		for (id = 0; id < counts[c] + 50; id++)
+		{
+			BOOLEAN listed = id < counts[c] && Listed(c, id) ;
+
+			list = -2 ;
+			CHECK(Lookup(id, &list) == listed) ;
+			CHECK(!listed || list == (LONG)c) ;
+		}
+	}
+
+	//a digest listed twice resolves to its first occurrence
+	for (i = 0; i < 3; i++)
+	{
+		id = i == 1 ? 2 : 1 ;
+		Digest(id, keys[i].szCurKeyHash) ;
+		Stamp(id, 98 + (i != 0), keys[i].szCurKeyCipher) ;
+	}
+	CHECK(KeyList_Install(keys, 3) == STATUS_SUCCESS) ;
+	CHECK(Lookup(1, &list) && list == 98) ;
+	CHECK(Lookup(2, &list) && list == 99) ;
+	CHECK(!Lookup(3, &list)) ;
+
+	//refused, the installed list stays
+	CHECK(KeyList_Install(keys, KEYLIST_MAX_KEYS + 1) == STATUS_INVALID_PARAMETER) ;
+	CHECK(Lookup(1, &list) && list == 98) ;
+}
+
+//
+//  Stress
+//
+
+static void
+Reader(ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	ULONG id, first, last, l ;
+	BOOLEAN found ;
+	LONG list ;
+	int n ;
+
+	for (n = 0; n < LOOKUPS || !g_Done; n++)
+	{
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+		id = (ULONG)(state % (IDS + 20)) ;
+
+		first = (ULONG)g_Installed ;
+		found = Lookup(id, &list) ;
+		last = (ULONG)g_Installed ;
+
+		//a list is published before g_Installed moves on to it
+		if (found)
+			CHECK(list >= (LONG)first && list <= (LONG)last + 1 && id < IDS && Listed(list, id)) ;
+		else
+		{
+			for (l = first; l <= last + 1; l++)
+			{
+				if (id >= IDS || !Listed(l, id))
+					break ;
+			}
+
+			CHECK(l <= last + 1) ;
+		}
+
+		if (n % 64 == 0)
+			sched_yield() ;
+	}
+}
+
+static void
+Installer(void)
+{
+	ULONG list = g_Installed ;
+	int n ;
+
+	for (n = 0; n < INSTALLS; n++)
+	{
+		CHECK(NT_SUCCESS(Install(++list, IDS))) ;
+		InterlockedExchange(&g_Installed, list) ;
+		sched_yield() ;
+	}
+
+	InterlockedExchange(&g_Done, TRUE) ;
+}
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	(void)Context ;
+
+	if (Index < READERS)
+		Reader(Index) ;
+	else
+		Installer() ;
+}
+
+int
+main(void)
+{
+	setenv("WDK_CPUS", "8", 0) ;
+
+	CHECK(NT_SUCCESS(KeyList_Init())) ;
+
+	Scripted() ;
+
+	//list numbers go on from the scripted ones
+	CHECK(NT_SUCCESS(Install(100, IDS))) ;
+	g_Installed = 100 ;
+
+	Wdk_RunThreads(READERS + 1, Stress, NULL) ;
+
+	KeyList_Uninit() ;
+	CHECK(Wdk_PoolBytes(KEYLIST_TAG) == 0) ;
+
+	return Report("keylist_test") ;
+}
@@ -0,0 +1,392 @@
+/*++
+
+Module Name:
+
+    layout_test.c
+
+Abstract:
+
+    Tests of the layout offset arithmetic:
+
+        layout_test [operations]
+
+    Besides unit checks of every routine, a model of the header layout
+    I/O path runs random cached and non-cached reads and writes, half of
+    them starting within three sectors of the header boundary.  Cached
+    I/O is remapped to file offsets like MapIoOffset does, pages move
+    between a cache and a real file through the paging read and write
+    transforms of DecryptReadBuffer and EncryptWriteBuffer, and every read
+    is checked against a plain copy of the data.
+
+--*/
+#define _GNU_SOURCE
+#include "layout.h"
+#include "flagfmt.h"
+#include "testutil.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PAGE_SIZE     4096
+#define MAX_FILE      (1 << 20)
+
+static LAYOUT g_Layout ;
+static int g_File ;
+
+//end of file as the file system sees it
+static long long g_FileSize ;
+
+static unsigned char g_Plain[MAX_FILE] ;
+static long long g_PlainLength ;
+
+static unsigned char g_Cache[MAX_FILE + PAGE_SIZE] ;
+static char g_Present[MAX_FILE / PAGE_SIZE + 2] ;
+static char g_Dirty[MAX_FILE / PAGE_SIZE + 2] ;
+
+//stands in for the cipher: a key stream addressed by plain text offset
+static unsigned char
+KeyStream(long long Offset)
+{
+	return (unsigned char)(((unsigned long long)Offset * 0x9E3779B97F4A7C15ULL) >> 56) ^ 0xA5 ;
+}
+
+static void
+PageIn(long long Page)
+{
+	unsigned char swap[PAGE_SIZE] = { 0 } ;
+	long long fileOffset = Page * PAGE_SIZE ;
+	long long valid = g_FileSize - g_Layout.HeadLength ;
+	LAYOUT_EXTENT extent ;
+	size_t i ;
+
+	if (pread(g_File, swap, PAGE_SIZE, fileOffset) < 0)
+		CHECK(0) ;
+
+	//the header goes to the cache as it is, the plain text past the valid length is zero
+	Layout_MapFileRange(&g_Layout, fileOffset, PAGE_SIZE, &extent) ;
+	memcpy(g_Cache + fileOffset, swap, extent.Skip) ;
+	for (i = 0; i < extent.Length; i++)
+	{
+		long long offset = extent.Offset + (long long)i ;
+
+		g_Cache[fileOffset + extent.Skip + i] = offset < valid ? swap[extent.Skip + i] ^ KeyStream(offset) : 0 ;
+	}
+
+	g_Present[Page] = 1 ;
+	g_Dirty[Page] = 0 ;
+}
+
+static void
+PageOut(long long Page)
+{
+	unsigned char swap[PAGE_SIZE] ;
+	long long fileOffset = Page * PAGE_SIZE, length ;
+	LAYOUT_EXTENT extent ;
+	size_t i ;
+
+	Layout_MapFileRange(&g_Layout, fileOffset, PAGE_SIZE, &extent) ;
+	memcpy(swap, g_Cache + fileOffset, extent.Skip) ;
+	for (i = 0; i < extent.Length; i++)
+		swap[extent.Skip + i] = g_Cache[fileOffset + extent.Skip + i] ^ KeyStream(extent.Offset + (long long)i) ;
+
+	//paging writes do not extend the file, and end on a sector boundary
+	length = g_FileSize - fileOffset ;
+	if (length > PAGE_SIZE)
+		length = PAGE_SIZE ;
+	if (length > 0)
+	{
+		length = (length + g_Layout.SectorSize - 1) & ~(long long)(g_Layout.SectorSize - 1) ;
+		if (pwrite(g_File, swap, length, fileOffset) != length)
+			CHECK(0) ;
+	}
+
+	g_Dirty[Page] = 0 ;
+}
+
+static void
+Flush(int Purge)
+{
+	long long page ;
+
+	for (page = 0; page <= MAX_FILE / PAGE_SIZE; page++)
+	{
+		if (g_Present[page] && g_Dirty[page])
+			PageOut(page) ;
+		if (Purge)
+			g_Present[page] = 0 ;
+	}
+
+	if (Purge && ftruncate(g_File, g_FileSize) != 0)
+		CHECK(0) ;
+}
+
+static long long
+CachedRead(long long Offset, unsigned char *Buffer, long long Length)
+{
+	long long fileOffset = Layout_ToFile(&g_Layout, Offset), i ;
+
+	if (fileOffset >= g_FileSize)
+		return 0 ;
+	if (fileOffset + Length > g_FileSize)
+		Length = g_FileSize - fileOffset ;
+
+	for (i = 0; i < Length; i++)
+	{
+		long long page = (fileOffset + i) / PAGE_SIZE ;
+
+		if (!g_Present[page])
+			PageIn(page) ;
+		Buffer[i] = g_Cache[fileOffset + i] ;
+	}
+
+	return Length ;
+}
+
+static void
+CachedWrite(long long Offset, const unsigned char *Buffer, long long Length)
+{
+	long long fileOffset = Layout_ToFile(&g_Layout, Offset), i ;
+
+	//the cache manager zeroes a gap past the end of file, in plain text
+	for (i = g_FileSize; i < fileOffset; i++)
+	{
+		long long page = i / PAGE_SIZE ;
+
+		if (!g_Present[page])
+			PageIn(page) ;
+		g_Cache[i] = 0 ;
+		g_Dirty[page] = 1 ;
+	}
+
+	for (i = 0; i < Length; i++)
+	{
+		long long page = (fileOffset + i) / PAGE_SIZE ;
+
+		if (!g_Present[page])
+			PageIn(page) ;
+		g_Cache[fileOffset + i] = Buffer[i] ;
+		g_Dirty[page] = 1 ;
+	}
+
+	if (fileOffset + Length > g_FileSize)
+		g_FileSize = fileOffset + Length ;
+}
+
+static void
+NonCachedWrite(long long Offset, const unsigned char *Buffer, long long Length)
+{
+	long long fileOffset, i ;
+	unsigned char *swap = malloc(Length) ;
+	LAYOUT_EXTENT extent ;
+
+	Flush(1) ;
+
+	//sector aligned plain text stays sector aligned and never touches the header
+	fileOffset = Layout_ToFile(&g_Layout, Offset) ;
+	Layout_MapFileRange(&g_Layout, fileOffset, Length, &extent) ;
+	CHECK(extent.Skip == 0 && extent.Offset == Offset) ;
+
+	for (i = 0; i < Length; i++)
+		swap[i] = Buffer[i] ^ KeyStream(Offset + i) ;
+
+	if (pwrite(g_File, swap, Length, fileOffset) != Length)
+		CHECK(0) ;
+
+	if (fileOffset + Length > g_FileSize)
+		g_FileSize = fileOffset + Length ;
+
+	free(swap) ;
+}
+
+static void
+PlainWrite(long long Offset, const unsigned char *Buffer, long long Length)
+{
+	if (Offset > g_PlainLength)
+		memset(g_Plain + g_PlainLength, 0, Offset - g_PlainLength) ;
+
+	memcpy(g_Plain + Offset, Buffer, Length) ;
+
+	if (Offset + Length > g_PlainLength)
+		g_PlainLength = Offset + Length ;
+}
+
+static void
+TestRoutines(void)
+{
+	LAYOUT t, h ;
+	LAYOUT_EXTENT e ;
+	long long v ;
+	int i ;
+
+	CHECK(!Layout_Init(&t, LayoutTrailer, 0, 128)) ;
+	CHECK(!Layout_Init(&t, LayoutTrailer, 768, 128)) ;
+	CHECK(!Layout_Init(&t, LayoutTrailer, 512, 0)) ;
+	CHECK(!Layout_Init(&t, (LAYOUT_KIND)7, 512, 128)) ;
+
+	CHECK(Layout_Init(&t, LayoutTrailer, 512, 128) && t.HeadLength == 0 && t.TailLength == 512) ;
+	CHECK(Layout_Init(&h, LayoutHeader, 4096, 128) && h.HeadLength == 4096 && h.TailLength == 0) ;
+
+	CHECK(Layout_ToFile(&t, 5) == 5 && Layout_ToFile(&h, 5) == 4101) ;
+
+	CHECK(Layout_FileSize(&t, 0) == 512 && Layout_FileSize(&t, 1) == 1024 && Layout_FileSize(&t, 512) == 1024) ;
+	CHECK(Layout_FileSize(&h, 0) == 4096 && Layout_FileSize(&h, 1) == 4097) ;
+
+	CHECK(Layout_FlagOffset(&t, 1024) == 512 && Layout_FlagOffset(&t, 1000) == -1 && Layout_FlagOffset(&t, 0) == -1) ;
+	CHECK(Layout_FlagOffset(&h, 4096) == 0 && Layout_FlagOffset(&h, 5000) == 0 && Layout_FlagOffset(&h, 4095) == -1) ;
+
+	CHECK(Layout_ValidLength(&t, 1024) == 512 && Layout_ValidLength(&h, 5000) == 904 && Layout_ValidLength(&h, 100) == -1) ;
+
+	for (v = 0; v < 20000; v += 37)
+	{
+		CHECK(Layout_ValidLength(&h, Layout_FileSize(&h, v)) == v) ;
+		CHECK(Layout_ValidLength(&t, Layout_FileSize(&t, v)) >= v) ;
+	}
+
+	//unaligned ranges around the header boundary
+	Layout_MapFileRange(&h, 0, 100, &e) ;
+	CHECK(e.Skip == 100 && e.Length == 0) ;
+	Layout_MapFileRange(&h, 4000, 200, &e) ;
+	CHECK(e.Skip == 96 && e.Offset == 0 && e.Length == 104) ;
+	Layout_MapFileRange(&h, 0, 8192, &e) ;
+	CHECK(e.Skip == 4096 && e.Offset == 0 && e.Length == 4096) ;
+	Layout_MapFileRange(&h, 4096, 10, &e) ;
+	CHECK(e.Skip == 0 && e.Offset == 0 && e.Length == 10) ;
+	Layout_MapFileRange(&h, 9000, 10, &e) ;
+	CHECK(e.Skip == 0 && e.Offset == 4904 && e.Length == 10) ;
+	Layout_MapFileRange(&t, 0, 10, &e) ;
+	CHECK(e.Skip == 0 && e.Offset == 0 && e.Length == 10) ;
+
+	for (i = 0; i < 100000; i++)
+	{
+		long long fileOffset = Rand() % 20000 ;
+		size_t length = Rand() % 9000 ;
+
+		Layout_MapFileRange(&h, fileOffset, length, &e) ;
+		CHECK(e.Skip + e.Length == length) ;
+		if (e.Length)
+			CHECK(e.Offset >= 0 && Layout_ToFile(&h, e.Offset) == fileOffset + (long long)e.Skip) ;
+		if (e.Skip)
+			CHECK(fileOffset + (long long)e.Skip <= 4096) ;
+	}
+}
+
+static void
+RunModel(unsigned int SectorSize, long Operations)
+{
+	static unsigned char buffer[3 * PAGE_SIZE], out[3 * PAGE_SIZE], raw[MAX_FILE] ;
+	char path[] = "/tmp/layout_testXXXXXX" ;
+	unsigned char header[PAGE_SIZE] = { 0 } ;
+	FLAGFMT_INFO info = { 0 } ;
+	long boundary = 0, op ;
+	long long i, bad = 0 ;
+
+	CHECK(Layout_Init(&g_Layout, LayoutHeader, SectorSize, FLAGFMT_MAX_SIZE)) ;
+
+	g_File = mkstemp(path) ;
+	unlink(path) ;
+
+	info.Version = FLAGFMT_VERSION_3 ;
+	info.CipherId = 1 ;
+	FlagFmt_Write(&info, header) ;
+	if (pwrite(g_File, header, g_Layout.HeadLength, 0) != g_Layout.HeadLength)
+		CHECK(0) ;
+
+	g_FileSize = g_Layout.HeadLength ;
+	g_PlainLength = 0 ;
+	memset(g_Present, 0, sizeof(g_Present)) ;
+	memset(g_Dirty, 0, sizeof(g_Dirty)) ;
+
+	for (op = 0; op < Operations; op++)
+	{
+		int kind = (int)(Rand() % 10) ;
+		long long offset, length = 1 + Rand() % (2 * PAGE_SIZE) ;
+
+		if (Rand() & 1)
+		{
+			offset = Rand() % (3 * SectorSize) ;
+			boundary++ ;
+		}
+		else
+		{
+			offset = Rand() % (MAX_FILE / 2) ;
+		}
+
+		RandFill(buffer, length) ;
+
+		if (kind < 4)
+		{
+			CachedWrite(offset, buffer, length) ;
+			PlainWrite(offset, buffer, length) ;
+		}
+		else if (kind < 5)
+		{
+			//non-cached I/O is sector aligned, and cannot leave a partial sector before the end of file
+			offset &= ~(long long)(SectorSize - 1) ;
+			length = (length + SectorSize - 1) & ~(long long)(SectorSize - 1) ;
+			if (offset > g_PlainLength)
+				offset = g_PlainLength & ~(long long)(SectorSize - 1) ;
+
+			if ((g_PlainLength & (SectorSize - 1)) != 0 && offset + length > g_PlainLength)
+				CachedWrite(offset, buffer, length) ;
+			else
+				NonCachedWrite(offset, buffer, length) ;
+			PlainWrite(offset, buffer, length) ;
+		}
+		else if (kind < 6)
+		{
+			if (g_PlainLength + length < MAX_FILE - 3 * PAGE_SIZE)
+			{
+				CachedWrite(g_PlainLength, buffer, length) ;
+				PlainWrite(g_PlainLength, buffer, length) ;
+			}
+		}
+		else if (kind < 9)
+		{
+			long long got = CachedRead(offset, out, length) ;
+			long long expected = offset >= g_PlainLength ? 0 : (offset + length > g_PlainLength ? g_PlainLength - offset : length) ;
+
+			CHECK(got == expected) ;
+			if (got == expected && got > 0)
+				CHECK(memcmp(out, g_Plain + offset, got) == 0) ;
+		}
+		else
+		{
+			Flush((int)(Rand() & 1)) ;
+		}
+
+		CHECK(g_FileSize == g_Layout.HeadLength + g_PlainLength) ;
+	}
+
+	Flush(1) ;
+
+	//on disk: the header untouched, the cipher text right behind it
+	CHECK(pread(g_File, raw, g_Layout.HeadLength, 0) == g_Layout.HeadLength) ;
+	CHECK(memcmp(raw, header, g_Layout.HeadLength) == 0) ;
+	CHECK(FlagFmt_Read(raw, g_Layout.HeadLength, &info) == FlagFmtOk && info.Version == FLAGFMT_VERSION_3) ;
+	CHECK(Layout_ValidLength(&g_Layout, lseek(g_File, 0, SEEK_END)) == g_PlainLength) ;
+
+	CHECK(pread(g_File, raw, g_PlainLength, g_Layout.HeadLength) == g_PlainLength) ;
+	for (i = 0; i < g_PlainLength; i++)
+		bad += (raw[i] ^ KeyStream(i)) != g_Plain[i] ;
+	CHECK(bad == 0) ;
+
+	printf("sector %4u: %ld operations, %ld at the header boundary, %lld bytes of plain text\n",
+		SectorSize, Operations, boundary, g_PlainLength) ;
+
+	close(g_File) ;
+}
+
+int
+main(int argc, char **argv)
+{
+	long operations = argc > 1 ? atol(argv[1]) : 50000 ;
+
+	FlagFmt_Init(FlagFmtImplSse42) ;
+
+	TestRoutines() ;
+	RunModel(512, operations) ;
+	RunModel(4096, operations) ;
+
+	return Report("layout_test") ;
+}
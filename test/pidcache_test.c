@@ -0,0 +1,343 @@
+/*++
+
+Module Name:
+
+    pidcache_test.c
+
+Abstract:
+
+    Process decision cache against process exits, id reuse and list
+    updates.
+
+    Builds pidcache.c and proclist.c against the threaded kernel
+    stand-ins of wdk/.  A process is a name behind a process id; the
+    requestor routines below return the calling thread's.  Process exits
+    and creates go through the notify routine PidCache_Init registers,
+    via Wdk_NotifyProcess.
+
+    First a scripted run: an id reused by a process of another name after
+    an exit, and entries of older list generations.  Then resolvers on 24
+    threads race 4 threads that end processes and reuse their ids under
+    another name, and one that updates the process list.  A process is not
+    torn down while one of its threads is in a create, so an id is only
+    reused while no resolver is using it; every decision must be the one
+    of the id's current name, under a list generation current during the
+    call.
+
+--*/
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "pidcache.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define IMAGES          4
+#define PROCESSES       64
+
+#define RESOLVERS       24
+#define EXITERS         4
+#define RESOLVES        20000
+#define EXITS           4000
+#define UPDATES         1500
+
+typedef struct _PROCESS {
+
+	HANDLE ProcessId ;
+
+	//index into g_Images
+	volatile LONG Image ;
+
+	//held shared by the resolvers, exclusive to end the process
+	pthread_rwlock_t Alive ;
+
+} PROCESS ;
+
+//a.exe monitored, b.exe trusted, c.exe monitored, d.exe toggled in and
+//out of the list
+static const CHAR *g_Images[IMAGES] = { "a.exe", "b.exe", "c.exe", "d.exe" } ;
+
+static PROCESS g_Processes[PROCESSES] ;
+static __thread PROCESS *t_Process ;
+
+//decisions of the images under each generation, set before the update
+//that makes it current
+#define STATE(_image, _decision)    ((ULONG)(_decision) << ((_image) * 2))
+#define DECISION(_state, _image)    ((PROCESS_DECISION)(((_state) >> ((_image) * 2)) & 3))
+
+static volatile ULONG g_History[UPDATES + 16] ;
+static ULONG g_Generation0 ;
+
+//
+//  Requestor of the operation being resolved
+//
+
+ULONG FltGetRequestorProcessId(PFLT_CALLBACK_DATA Data) { (void)Data ; return (ULONG)(ULONG_PTR)t_Process->ProcessId ; }
+PEPROCESS FltGetRequestorProcess(PFLT_CALLBACK_DATA Data) { (void)Data ; return (PEPROCESS)t_Process ; }
+
+//slow now and then, so list updates land between a resolution's
+//generation read and its insert
+PCHAR
+PsGetProcessImageFileName(PEPROCESS Process)
+{
+	static volatile LONG calls ;
+
+	if (InterlockedIncrement(&calls) % 4 == 0)
+		sched_yield() ;
+
+	return (PCHAR)g_Images[((PROCESS *)Process)->Image] ;
+}
+
+static PROCESS_DECISION
+Resolve(PROCESS *Process)
+{
+	FLT_CALLBACK_DATA data ;
+
+	t_Process = Process ;
+	return PidCache_Resolve(&data) ;
+}
+
+static void
+SetMonitor(ULONG Image, BOOLEAN Monitor)
+{
+	PROCESS_INFO info ;
+
+	memset(&info, 0, sizeof(info)) ;
+	strcpy(info.szProcessName, g_Images[Image]) ;
+	info.bMonitor = Monitor ;
+
+	CHECK(NT_SUCCESS(ProcList_SetMonitor(&info))) ;
+}
+
+static void
+SetListed(ULONG Image, BOOLEAN Listed)
+{
+	PROCESS_INFO info ;
+
+	memset(&info, 0, sizeof(info)) ;
+	strcpy(info.szProcessName, g_Images[Image]) ;
+	info.bMonitor = TRUE ;
+
+	if (Listed)
+		CHECK(ProcList_Add(&info) == MGAPI_RESULT_SUCCESS) ;
+	else
+		CHECK(ProcList_Delete(info.szProcessName) == MGDPI_RESULT_SUCCESS) ;
+}
+
+//the process ends and a new one of another name gets its id
+static void
+Reuse(PROCESS *Process, LONG Image)
+{
+	Wdk_NotifyProcess((HANDLE)4, Process->ProcessId, FALSE) ;
+	InterlockedExchange(&Process->Image, Image) ;
+	Wdk_NotifyProcess((HANDLE)4, Process->ProcessId, TRUE) ;
+}
+
+//
+//  Scripted
+//
+
+static void
+Scripted(void)
+{
+	PROCESS *process = &g_Processes[0] ;
+	PIDCACHE_STATS before ;
+	PIDCACHE_STATS after ;
+	ULONG generation ;
+
+	PidCache_QueryStats(&before) ;
+
+	process->Image = 0 ;
+	CHECK(Resolve(process) == ProcessDecisionMonitored) ;
+	CHECK(Resolve(process) == ProcessDecisionMonitored) ;
+
+	PidCache_QueryStats(&after) ;
+	CHECK(after.Misses - before.Misses == 1 && after.Hits - before.Hits == 1) ;
+
+	//same id, same generation, another name: the exit dropped the entry
+	Reuse(process, 1) ;
+	CHECK(Resolve(process) == ProcessDecisionTrusted) ;
+
+	PidCache_QueryStats(&after) ;
+	CHECK(after.Exits - before.Exits == 1 && after.Misses - before.Misses == 2) ;
+
+	//a list update turns the cached entry into a miss
+	generation = ProcList_GetGeneration() ;
+	SetMonitor(1, TRUE) ;
+	CHECK(ProcList_GetGeneration() == generation + 1) ;
+	CHECK(PidCache_Lookup(process->ProcessId, generation + 1) == ProcessDecisionUnknown) ;
+	CHECK(Resolve(process) == ProcessDecisionMonitored) ;
+
+	SetMonitor(1, FALSE) ;
+	CHECK(Resolve(process) == ProcessDecisionTrusted) ;
+
+	//unlisted, then listed again
+	Reuse(process, 3) ;
+	CHECK(Resolve(process) == ProcessDecisionIgnored) ;
+	SetListed(3, TRUE) ;
+	CHECK(Resolve(process) == ProcessDecisionMonitored) ;
+	SetListed(3, FALSE) ;
+	CHECK(Resolve(process) == ProcessDecisionIgnored) ;
+
+	//an entry of another id sharing the slot is not dropped
+	PidCache_Insert(process->ProcessId, ProcList_GetGeneration(), ProcessDecisionTrusted) ;
+	PidCache_Remove((HANDLE)((ULONG_PTR)process->ProcessId + 4 * PIDCACHE_SIZE)) ;
+	CHECK(PidCache_Lookup(process->ProcessId, ProcList_GetGeneration()) == ProcessDecisionTrusted) ;
+	PidCache_Remove(process->ProcessId) ;
+	CHECK(PidCache_Lookup(process->ProcessId, ProcList_GetGeneration()) == ProcessDecisionUnknown) ;
+
+	Reuse(process, 0) ;
+}
+
+//
+//  Stress
+//
+
+static void
+Resolver(ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	PROCESS_DECISION decision ;
+	PROCESS *process ;
+	ULONG first, last, g ;
+	int n ;
+
+	for (n = 0; n < RESOLVES; n++)
+	{
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+		process = &g_Processes[state % PROCESSES] ;
+
+		pthread_rwlock_rdlock(&process->Alive) ;
+
+		first = ProcList_GetGeneration() ;
+		decision = Resolve(process) ;
+		last = ProcList_GetGeneration() ;
+
+		//a table is published before the generation is bumped, so the
+		//next generation's decisions may show already
+		for (g = first; g <= last + 1; g++)
+		{
+			if (g - g_Generation0 < UPDATES + 1 && DECISION(g_History[g - g_Generation0], process->Image) == decision)
+				break ;
+		}
+
+		CHECK(g <= last + 1) ;
+
+		pthread_rwlock_unlock(&process->Alive) ;
+
+		if (n % 64 == 0)
+			sched_yield() ;
+	}
+}
+
+static void
+Exiter(ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 100) ;
+	PROCESS *process ;
+	int n ;
+
+	for (n = 0; n < EXITS; n++)
+	{
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+		process = &g_Processes[state % PROCESSES] ;
+
+		pthread_rwlock_wrlock(&process->Alive) ;
+		Reuse(process, (LONG)((process->Image + 1 + (ULONG)(state >> 32) % (IMAGES - 1)) % IMAGES)) ;
+		pthread_rwlock_unlock(&process->Alive) ;
+
+		sched_yield() ;
+	}
+}
+
+//turns monitoring of a.exe, b.exe and c.exe on and off, d.exe in and
+//out of the list
+static void
+Updater(void)
+{
+	PROCESS_DECISION current, next ;
+	ULONG state = g_History[0] ;
+	ULONG image ;
+	int n ;
+
+	for (n = 1; n <= UPDATES; n++)
+	{
+		image = n % IMAGES ;
+		current = DECISION(state, image) ;
+
+		if (image == 3)
+			next = current == ProcessDecisionIgnored ? ProcessDecisionMonitored : ProcessDecisionIgnored ;
+		else
+			next = current == ProcessDecisionMonitored ? ProcessDecisionTrusted : ProcessDecisionMonitored ;
+
+		state = (state & ~STATE(image, 3)) | STATE(image, next) ;
+		g_History[n] = state ;
+
+		if (image == 3)
+			SetListed(3, next != ProcessDecisionIgnored) ;
+		else
+			SetMonitor(image, next == ProcessDecisionMonitored) ;
+
+		CHECK(ProcList_GetGeneration() == g_Generation0 + n) ;
+		sched_yield() ;
+	}
+}
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	(void)Context ;
+
+	if (Index < RESOLVERS)
+		Resolver(Index) ;
+	else if (Index < RESOLVERS + EXITERS)
+		Exiter(Index) ;
+	else
+		Updater() ;
+}
+
+int
+main(void)
+{
+	PIDCACHE_STATS stats ;
+	ULONG i ;
+
+	setenv("WDK_CPUS", "8", 0) ;
+
+	CHECK(NT_SUCCESS(ProcList_Init())) ;
+	CHECK(NT_SUCCESS(PidCache_Init())) ;
+
+	SetListed(0, TRUE) ;
+	SetListed(1, TRUE) ;
+	SetMonitor(1, FALSE) ;
+	SetListed(2, TRUE) ;
+
+	for (i = 0; i < PROCESSES; i++)
+	{
+		g_Processes[i].ProcessId = (HANDLE)(ULONG_PTR)(1000 + 4 * i) ;
+		g_Processes[i].Image = i % IMAGES ;
+		pthread_rwlock_init(&g_Processes[i].Alive, NULL) ;
+	}
+
+	Scripted() ;
+
+	g_Generation0 = ProcList_GetGeneration() ;
+	g_History[0] = STATE(0, ProcessDecisionMonitored) | STATE(1, ProcessDecisionTrusted) |
+		STATE(2, ProcessDecisionMonitored) | STATE(3, ProcessDecisionIgnored) ;
+
+	Wdk_RunThreads(RESOLVERS + EXITERS + 1, Stress, NULL) ;
+
+	PidCache_QueryStats(&stats) ;
+	CHECK(stats.Hits > 0 && stats.Misses > 0 && stats.Exits >= EXITERS * EXITS) ;
+	printf("%lld hits, %lld misses, %lld exits\n", (long long)stats.Hits, (long long)stats.Misses, (long long)stats.Exits) ;
+
+	PidCache_Uninit() ;
+	ProcList_Uninit() ;
+
+	return Report("pidcache_test") ;
+}
@@ -0,0 +1,275 @@
+/*++
+
+Module Name:
+
+    policy_test.c
+
+Abstract:
+
+    Tests of the path policy engine: fixed cases for component matching,
+    case folding, extensions, stream names and exclude precedence,
+    malformed rules, and random rule sets and paths checked against a
+    naive matcher.
+
+--*/
+#include "policy.h"
+#include "testutil.h"
+
+#include <stdlib.h>
+
+#define MAX_PATH_CHARS 512
+
+typedef struct _TEST_RULE {
+	int Exclude ;
+	const char *Directory ;
+	const char *Extension ;
+} TEST_RULE ;
+
+static size_t
+Widen(const char *String, unsigned short *Out)
+{
+	size_t i ;
+
+	for (i = 0; String[i]; i++)
+		Out[i] = (unsigned char)String[i] ;
+
+	return i ;
+}
+
+static unsigned short
+Fold(unsigned short c)
+{
+	return c >= 'a' && c <= 'z' ? (unsigned short)(c - 'a' + 'A') : c ;
+}
+
+//
+//  Compiles Rules into a freshly allocated policy, NULL if malformed.
+//
+
+static void *
+Compile(const TEST_RULE *Rules, size_t Count)
+{
+	static unsigned short chars[64][2][MAX_PATH_CHARS] ;
+	POLICY_RULE rules[64] ;
+	size_t size, i ;
+	void *policy ;
+
+	for (i = 0; i < Count; i++)
+	{
+		rules[i].Exclude = Rules[i].Exclude ;
+		rules[i].Directory = chars[i][0] ;
+		rules[i].DirectoryLength = Widen(Rules[i].Directory, chars[i][0]) ;
+		rules[i].Extension = chars[i][1] ;
+		rules[i].ExtensionLength = Widen(Rules[i].Extension, chars[i][1]) ;
+	}
+
+	size = Policy_Compile(rules, Count, NULL, 0) ;
+	if (size == 0)
+		return NULL ;
+
+	policy = aligned_alloc(POLICY_ALIGNMENT, (size + POLICY_ALIGNMENT - 1) & ~(size_t)(POLICY_ALIGNMENT - 1)) ;
+	CHECK(Policy_Compile(rules, Count, policy, size) == size) ;
+
+	return policy ;
+}
+
+static int
+Match(const void *Policy, const char *Path)
+{
+	unsigned short wide[MAX_PATH_CHARS] ;
+
+	return Policy_Match(Policy, wide, Widen(Path, wide)) != 0 ;
+}
+
+//
+//  Reference matcher: every rule compared against the path on its own.
+//
+
+static int
+NaiveMatch(const TEST_RULE *Rules, size_t Count, const char *Path)
+{
+	size_t length = strlen(Path), end, sep, dot = 0, extLength, i, k ;
+	int included = 0 ;
+
+	if (length == 0 || Path[0] != '\\')
+		return 0 ;
+
+	for (sep = length - 1; Path[sep] != '\\'; sep--)
+		;
+
+	end = length ;
+	for (i = sep + 1; i < length; i++)
+	{
+		if (Path[i] == ':')
+		{
+			end = i ;
+			break ;
+		}
+	}
+
+	for (i = sep + 1; i < end; i++)
+		if (Path[i] == '.')
+			dot = i ;
+
+	extLength = dot ? end - dot - 1 : 0 ;
+
+	for (k = 0; k < Count; k++)
+	{
+		const char *ext = Rules[k].Extension ;
+		char dir[MAX_PATH_CHARS] ;
+		size_t dirLength = strlen(Rules[k].Directory) ;
+
+		//the directory, completed with a separator, is a prefix of the directory part
+		memcpy(dir, Rules[k].Directory, dirLength) ;
+		if (dirLength == 0 || dir[dirLength - 1] != '\\')
+			dir[dirLength++] = '\\' ;
+
+		if (dirLength > sep + 1)
+			continue ;
+
+		for (i = 0; i < dirLength && Fold((unsigned char)dir[i]) == Fold((unsigned char)Path[i]); i++)
+			;
+		if (i < dirLength)
+			continue ;
+
+		if (ext[0] == '.')
+			ext++ ;
+
+		if (ext[0])
+		{
+			if (strlen(ext) != extLength)
+				continue ;
+
+			for (i = 0; i < extLength && Fold((unsigned char)ext[i]) == Fold((unsigned char)Path[dot + 1 + i]); i++)
+				;
+			if (i < extLength)
+				continue ;
+		}
+
+		if (Rules[k].Exclude)
+			return 0 ;
+
+		included = 1 ;
+	}
+
+	return included ;
+}
+
+static void
+TestCases(void)
+{
+	static const TEST_RULE rules[] = {
+		{ 0, "\\Projects", "docx" },
+		{ 0, "\\Projects\\", ".xlsx" },
+		{ 1, "\\Projects\\Secret", "" },
+		{ 1, "\\Windows", "" },
+		{ 0, "", "txt" },
+	} ;
+	static const struct { const char *Path ; int Expected ; } cases[] = {
+		{ "\\Projects\\a.docx", 1 },
+		{ "\\projects\\SUB\\A.DOCX", 1 },
+		{ "\\Projects\\b.xlsx", 1 },
+		{ "\\Projects\\a.docx:Zone.Identifier", 1 },
+		{ "\\Projects\\a.docx:Zone.Identifier:$DATA", 1 },
+		{ "\\ProjectsX\\a.docx", 0 },
+		{ "\\Projects.docx", 0 },
+		{ "\\Projects\\a.docxx", 0 },
+		{ "\\Projects\\a.doc", 0 },
+		{ "\\Projects\\docx", 0 },
+		{ "\\Projects\\a", 0 },
+		{ "\\Projects\\Secret\\a.docx", 0 },
+		{ "\\Projects\\Secret.docx", 1 },
+		{ "\\Windows\\a.txt", 0 },
+		{ "\\WINDOWS\\System32\\b.txt", 0 },
+		{ "\\a.txt", 1 },
+		{ "\\Users\\x\\notes.TXT", 1 },
+		{ "\\Users\\x\\notes.txt.bak", 0 },
+		{ "Projects\\a.docx", 0 },
+		{ "", 0 },
+	} ;
+	static const TEST_RULE relative = { 0, "Projects", "" } ;
+	static const TEST_RULE longExtension = { 0, "\\", "abcdefghijklmnop" } ;
+	void *policy = Compile(rules, sizeof(rules) / sizeof(rules[0])) ;
+	size_t i ;
+
+	CHECK(policy != NULL) ;
+	if (policy == NULL)
+		return ;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		int got = Match(policy, cases[i].Path) ;
+
+		CHECK(got == cases[i].Expected) ;
+		CHECK(NaiveMatch(rules, sizeof(rules) / sizeof(rules[0]), cases[i].Path) == cases[i].Expected) ;
+		if (got != cases[i].Expected)
+			printf("    path %s\n", cases[i].Path) ;
+	}
+
+	free(policy) ;
+
+	//no include rule: nothing matches
+	policy = Compile(&rules[3], 1) ;
+	CHECK(policy != NULL && !Match(policy, "\\a.txt")) ;
+	free(policy) ;
+
+	CHECK(Compile(&relative, 1) == NULL) ;
+	CHECK(Compile(&longExtension, 1) == NULL) ;
+}
+
+static void
+TestRandom(void)
+{
+	static const char *dirs[] = { "\\Projects", "\\Projects\\Sub", "\\Windows", "\\Users\\a", "\\Users", "\\Pro", "" } ;
+	static const char *exts[] = { "docx", ".txt", "h", "", "", "c" } ;
+	static const char *parts[] = { "Projects", "projects", "Sub", "Windows", "Users", "a", "Pro", "ProjectsX", "b" } ;
+	static const char *names[] = { "x.docx", "y.TXT", "z.h", "w.c", "noext", "v.txt.docx", "u.c:stream", ".h", "t.DocX:Zone.Identifier" } ;
+	TEST_RULE rules[12] ;
+	char path[MAX_PATH_CHARS] ;
+	int round, i ;
+
+	for (round = 0; round < 2000; round++)
+	{
+		size_t count = 1 + Rand() % 12 ;
+		void *policy ;
+
+		for (i = 0; i < (int)count; i++)
+		{
+			rules[i].Exclude = Rand() % 4 == 0 ;
+			rules[i].Directory = dirs[Rand() % (sizeof(dirs) / sizeof(dirs[0]))] ;
+			rules[i].Extension = exts[Rand() % (sizeof(exts) / sizeof(exts[0]))] ;
+		}
+
+		policy = Compile(rules, count) ;
+		CHECK(policy != NULL) ;
+		if (policy == NULL)
+			continue ;
+
+		for (i = 0; i < 200; i++)
+		{
+			int depth = (int)(Rand() % 4), d ;
+			size_t n = 0, k ;
+
+			for (d = 0; d < depth; d++)
+				n += sprintf(path + n, "\\%s", parts[Rand() % (sizeof(parts) / sizeof(parts[0]))]) ;
+			n += sprintf(path + n, "\\%s", names[Rand() % (sizeof(names) / sizeof(names[0]))]) ;
+
+			for (k = 0; k < n; k++)
+				if (Rand() % 4 == 0 && path[k] >= 'a' && path[k] <= 'z')
+					path[k] = (char)(path[k] - 'a' + 'A') ;
+
+			CHECK(Match(policy, path) == NaiveMatch(rules, count, path)) ;
+		}
+
+		free(policy) ;
+	}
+}
+
+int
+main(void)
+{
+	TestCases() ;
+	TestRandom() ;
+
+	return Report("policy_test") ;
+}
@@ -0,0 +1,202 @@
+/*++
+
+Module Name:
+
+    probe_race_test.c
+
+Abstract:
+
+    First touches of a pending stream racing each other.
+
+    Builds CryptMini.c against the threaded kernel stand-ins of wdk/ and
+    has many threads do what every pre-operation does on a stream whose
+    trailer is yet to be read, ResolveStream, at once.  The trailer read
+    is mocked and slow, so the threads pile up on the probe lock.  It
+    must run once per stream, and no thread may come out of
+    ResolveStream seeing the stream half set up: flags without a key,
+    old sizes, or a stream that is neither pending nor handled.
+
+    A stream under an unknown key is raced too: it must end up in the
+    handled stream filter so its writes are denied.
+
+--*/
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CryptMini.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define THREADS         64
+#define ROUNDS          40
+
+#define FILE_SIZE       (1024 * 1024 + 4096)
+#define VALID_LENGTH    (1024 * 1024 + 100)
+
+static STREAM_CONTEXT g_StreamCtx ;
+static VOLUME_CONTEXT g_VolCtx ;
+static KEY_CACHE_ENTRY *g_VolKey = (KEY_CACHE_ENTRY *)0x1000 ;
+static volatile LONG g_TrailerReads ;
+static volatile LONG g_KeyRefs ;
+static BOOLEAN g_UnknownKey ;
+
+//
+//  Filter manager and the modules off the probe path
+//
+
+NTSTATUS
+FltGetStreamContext(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PVOID Context)
+{
+	(void)Instance ; (void)FileObject ;
+
+	*(PFLT_CONTEXT *)Context = &g_StreamCtx ;
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS
+FltGetVolumeContext(PFLT_FILTER Filter, PFLT_VOLUME Volume, PVOID Context)
+{
+	(void)Filter ; (void)Volume ;
+
+	*(PFLT_CONTEXT *)Context = &g_VolCtx ;
+	return STATUS_SUCCESS ;
+}
+
+VOID FltReleaseContext(PFLT_CONTEXT Context) { (void)Context ; }
+
+//slow, so the first accessors wait for the one probing
+NTSTATUS
+Trailer_Read(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PVOLUME_CONTEXT VolCtx, PFILE_FLAG Flag, PLARGE_INTEGER FileSize)
+{
+	(void)Instance ; (void)FileObject ;
+
+	InterlockedIncrement(&g_TrailerReads) ;
+	usleep(2000) ;
+
+	memset(Flag, 0, sizeof(*Flag)) ;
+	Flag->uVersion = FLAGFMT_VERSION_2 ;
+	Flag->CipherId = VolCtx->CipherId ;
+	Flag->FileValidLength.QuadPart = VALID_LENGTH ;
+	memset(Flag->szKeyHash, g_UnknownKey ? 0x3C : 0xA5, HASH_SIZE) ;
+	memset(Flag->szNonce, 0x5A, IV_LENGTH) ;
+	FileSize->QuadPart = FILE_SIZE ;
+
+	return STATUS_SUCCESS ;
+}
+
+NTSTATUS KeyList_ReferenceKey(const UCHAR *KeyHash, PKEY_CACHE_ENTRY *Entry) { (void)KeyHash ; (void)Entry ; return STATUS_NOT_FOUND ; }
+VOID KeyCache_AddRef(PKEY_CACHE_ENTRY Entry) { (void)Entry ; InterlockedIncrement(&g_KeyRefs) ; }
+VOID KeyCache_Release(PKEY_CACHE_ENTRY Entry) { (void)Entry ; InterlockedDecrement(&g_KeyRefs) ; }
+
+//
+//  The race
+//
+
+static void
+NewPendingStream(PFILE_OBJECT FileObject)
+{
+	KIRQL oldIrql ;
+
+	if (SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_FILTERED))
+		Ctx_UnmarkStreamHandled(&g_StreamCtx) ;
+
+	memset(&g_StreamCtx, 0, sizeof(g_StreamCtx)) ;
+	ExInitializeResourceLite(&g_StreamCtx.Resource) ;
+	ExInitializeResourceLite(&g_StreamCtx.ProbeLock) ;
+	KeInitializeSpinLock(&g_StreamCtx.Resource1) ;
+	RangeLock_Init(&g_StreamCtx.RangeLock) ;
+
+	//as PostCreate leaves it
+	SC_LOCK(&g_StreamCtx, &oldIrql) ;
+	Ctx_MarkStreamPending(&g_StreamCtx, FileObject) ;
+	SC_UNLOCK(&g_StreamCtx, oldIrql) ;
+
+	g_KeyRefs = 0 ;
+}
+
+static void
+FirstTouch(PVOID Context, ULONG Index)
+{
+	FILE_OBJECT fileObject ;
+	FLT_RELATED_OBJECTS objects ;
+	LARGE_INTEGER validLength ;
+	LARGE_INTEGER fileSize ;
+	UCHAR nonce[IV_LENGTH] ;
+
+	(void)Index ;
+
+	memset(&fileObject, 0, sizeof(fileObject)) ;
+	memset(&objects, 0, sizeof(objects)) ;
+	fileObject.FsContext = Context ;
+	objects.FileObject = &fileObject ;
+
+	//what PreRead, PreWrite and the others do first
+	if (Ctx_MayBePending(&fileObject))
+		ResolveStream(&objects) ;
+
+	CHECK(!Ctx_MayBePending(&fileObject)) ;
+	CHECK(Ctx_MayBeHandled(&fileObject)) ;
+	CHECK(SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_TRAILER_CHECKED)) ;
+	CHECK(SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_FILE_CRYPT)) ;
+
+	SC_READ_SIZES(&g_StreamCtx, &validLength, &fileSize) ;
+	CHECK(validLength.QuadPart == VALID_LENGTH && fileSize.QuadPart == FILE_SIZE) ;
+
+	memset(nonce, 0x5A, IV_LENGTH) ;
+	CHECK(memcmp(g_StreamCtx.szNonce, nonce, IV_LENGTH) == 0) ;
+
+	if (g_UnknownKey)
+	{
+		CHECK(!SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_ENCRYPT_ON_WRITE | SC_FLAG_DECRYPT_ON_READ)) ;
+		CHECK(g_StreamCtx.KeyEntry == NULL) ;
+	}
+	else
+	{
+		CHECK(SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_ENCRYPT_ON_WRITE)) ;
+		CHECK(SC_TEST_FLAG(&g_StreamCtx, SC_FLAG_DECRYPT_ON_READ)) ;
+		CHECK(g_StreamCtx.KeyEntry == g_VolKey) ;
+	}
+}
+
+static void
+Race(BOOLEAN UnknownKey)
+{
+	FILE_OBJECT fileObject ;
+	CREATE_STATS before ;
+	CREATE_STATS after ;
+	int round ;
+
+	g_UnknownKey = UnknownKey ;
+
+	for (round = 0; round < ROUNDS; round++)
+	{
+		memset(&fileObject, 0, sizeof(fileObject)) ;
+		fileObject.FsContext = (PVOID)(ULONG_PTR)(0x10000 + round * 0x100) ;
+		NewPendingStream(&fileObject) ;
+
+		QueryCreateStats(&before) ;
+		g_TrailerReads = 0 ;
+
+		Wdk_RunThreads(THREADS, FirstTouch, fileObject.FsContext) ;
+
+		QueryCreateStats(&after) ;
+		CHECK(g_TrailerReads == 1) ;
+		CHECK(after.Probes - before.Probes == 1) ;
+		CHECK(after.ProbeFailures == before.ProbeFailures) ;
+		CHECK(g_KeyRefs == (UnknownKey ? 0 : 1)) ;
+	}
+}
+
+int
+main(void)
+{
+	g_VolCtx.SectorSize = 512 ;
+	g_VolCtx.KeyEntry = g_VolKey ;
+	memset(g_VolCtx.szKeyHash, 0xA5, HASH_SIZE) ;
+	CHECK(Layout_Init(&g_VolCtx.Layout, LayoutTrailer, 512, FLAGFMT_MAX_SIZE)) ;
+
+	Race(FALSE) ;
+	Race(TRUE) ;
+
+	return Report("probe_race_test") ;
+}
@@ -0,0 +1,200 @@
+/*++
+
+Module Name:
+
+    proclist_bench.c
+
+Abstract:
+
+    Process monitor list lookup time against the length of the list:
+
+        proclist_bench [lookups per point]
+
+    Times ProcList_Lookup for listed and unlisted image names in mixed
+    case, next to a case-insensitive linear scan of the same PROCESS_INFO
+    array, the obvious lookup without the table.  Then readers on 1 to
+    16 threads of the virtual processors of wdk/, alone and with one
+    thread turning monitoring on and off all the time, in million lookups
+    per second.  Threads beyond the real processors only show the
+    contention, not a speedup.
+
+--*/
+#include <ctype.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "proclist.c"
+#include "wdk.h"
+#include "testutil.h"
+
+static ULONG g_Lookups = 1000000 ;
+static PROCESS_INFO g_Infos[PROCLIST_MAX_PROCESSES] ;
+static ULONG g_Count ;
+
+//names looked up, built ahead so the timing leaves out the formatting
+static CHAR g_Names[PROCLIST_MAX_PROCESSES * 2][PROCLIST_NAME_LENGTH] ;
+static volatile LONG g_Running ;
+static volatile LONG g_Sink ;
+
+//listed names are even, the others odd; every other one in upper case
+static void
+Name(ULONG Id, CHAR *Name)
+{
+	ULONG i ;
+
+	memset(Name, 0, PROCLIST_NAME_LENGTH) ;
+	sprintf(Name, "app%05u.exe", Id) ;
+
+	for (i = 0; Id % 4 >= 2 && Name[i] != '\0'; i++)
+		Name[i] = (CHAR)toupper(Name[i]) ;
+}
+
+static void
+Build(ULONG Count)
+{
+	ULONG i ;
+
+	while (ProcList_Query(g_Infos, PROCLIST_MAX_PROCESSES) != 0)
+		ProcList_Delete(g_Infos[0].szProcessName) ;
+
+	g_Count = Count ;
+
+	for (i = 0; i < Count; i++)
+	{
+		memset(&g_Infos[i], 0, sizeof(PROCESS_INFO)) ;
+		sprintf(g_Infos[i].szProcessName, "app%05u.exe", i * 2) ;
+		g_Infos[i].bMonitor = i % 2 ;
+		ProcList_Add(&g_Infos[i]) ;
+	}
+}
+
+//the lookup without the table
+static BOOLEAN
+Scan(const CHAR *ProcessName, PBOOLEAN Monitor)
+{
+	ULONG i ;
+
+	for (i = 0; i < g_Count; i++)
+	{
+		if (strncasecmp(g_Infos[i].szProcessName, ProcessName, PROCLIST_NAME_LENGTH - 1) == 0)
+		{
+			*Monitor = g_Infos[i].bMonitor ;
+			return TRUE ;
+		}
+	}
+
+	return FALSE ;
+}
+
+//ns per lookup of Lookups names, all listed or, with Miss, none
+static double
+Time(BOOLEAN Linear, BOOLEAN Miss, ULONG Lookups)
+{
+	BOOLEAN monitor ;
+	double start ;
+	ULONG n, found = 0 ;
+
+	start = Now() ;
+
+	for (n = 0; n < Lookups; n++)
+	{
+		const CHAR *name = g_Names[(n * 2654435761u % g_Count) * 2 + Miss] ;
+
+		found += Linear ? Scan(name, &monitor) : ProcList_Lookup(name, &monitor) ;
+	}
+
+	CHECK(found == (Miss ? 0 : Lookups)) ;
+
+	return (Now() - start) * 1e9 / Lookups ;
+}
+
+static void
+Reader(PVOID Context, ULONG Index)
+{
+	BOOLEAN monitor ;
+	ULONG n, found = 0 ;
+
+	//thread 0 updates until the readers are done, if asked to
+	if (Context != NULL && Index == 0)
+	{
+		for (n = 0; g_Running != 0; n++)
+		{
+			g_Infos[0].bMonitor = n % 2 ;
+			ProcList_SetMonitor(&g_Infos[0]) ;
+		}
+		return ;
+	}
+
+	for (n = 0; n < g_Lookups; n++)
+		found += ProcList_Lookup(g_Names[(n * 2654435761u % g_Count) * 2], &monitor) ;
+
+	InterlockedExchangeAdd(&g_Sink, found) ;
+	InterlockedDecrement(&g_Running) ;
+}
+
+static double
+Throughput(ULONG Threads, BOOLEAN Updating)
+{
+	double start ;
+
+	g_Running = Threads ;
+	g_Sink = 0 ;
+
+	start = Now() ;
+	Wdk_RunThreads(Threads + Updating, Reader, Updating ? (PVOID)1 : NULL) ;
+
+	CHECK(g_Sink == (LONG)(g_Lookups * Threads)) ;
+
+	return (double)g_Lookups * Threads / (Now() - start) / 1e6 ;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const ULONG counts[] = { 4, 32, 300, PROCLIST_MAX_PROCESSES } ;
+	ULONG threads ;
+	int i ;
+
+	if (argc > 1)
+		g_Lookups = (ULONG)atol(argv[1]) ;
+	if (g_Lookups == 0)
+		g_Lookups = 1 ;
+
+	if (!NT_SUCCESS(ProcList_Init()))
+		return 1 ;
+
+	for (i = 0; i < PROCLIST_MAX_PROCESSES * 2; i++)
+		Name(i, g_Names[i]) ;
+
+	printf("ns per lookup, %u lookups per point\n", g_Lookups) ;
+	printf("%8s %10s %10s %10s %10s\n", "names", "table hit", "miss", "scan hit", "miss") ;
+
+	for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++)
+	{
+		//a scan costs the length of the list, keep its points short
+		ULONG scans = max(g_Lookups / counts[i], 1) ;
+
+		Build(counts[i]) ;
+
+		printf("%8u %10.1f %10.1f %10.1f %10.1f\n", counts[i],
+			Time(FALSE, FALSE, g_Lookups), Time(FALSE, TRUE, g_Lookups),
+			Time(TRUE, FALSE, scans), Time(TRUE, TRUE, scans)) ;
+	}
+
+	printf("\n%u virtual processors, 300 names, million lookups per second\n", Wdk_CpuCount()) ;
+	printf("%8s %12s %12s\n", "threads", "alone", "updating") ;
+
+	Build(300) ;
+
+	for (threads = 1; threads <= 16; threads *= 2)
+	{
+		double alone = Throughput(threads, FALSE) ;
+		double updating = Throughput(threads, TRUE) ;
+
+		printf("%8u %12.2f %12.2f\n", threads, alone, updating) ;
+	}
+
+	ProcList_Uninit() ;
+
+	return Report("proclist_bench") ;
+}
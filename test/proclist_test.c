@@ -0,0 +1,307 @@
+/*++
+
+Module Name:
+
+    proclist_test.c
+
+Abstract:
+
+    Process monitor list lookups, alone and against concurrent updates.
+
+    Builds proclist.c and publish.c against the threaded kernel stand-ins
+    of wdk/, whose freed pool is overwritten.  A lookup yields now and
+    then while it holds its table.
+
+    A scripted run checks the results of every update routine, lookups
+    without regard to case, that only 'A'..'Z' are folded, that the 16th
+    character of a configured name is dropped, and a full list.  Then 16
+    readers look names up, in mixed case, while one thread adds, deletes
+    and turns monitoring on and off; every answer must be the one of a
+    list generation current during the call.
+
+--*/
+#include <ctype.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "proclist.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define NAMES           24
+
+#define READERS         16
+#define LOOKUPS         20000
+#define UPDATES         3000
+
+//two bits per name: listed, and monitored
+#define LISTED(_state, _name)       (((_state) >> ((_name) * 2)) & 1)
+#define MONITORED(_state, _name)    (((_state) >> ((_name) * 2 + 1)) & 1)
+#define STATE(_name, _listed, _monitored) \
+	(((ULONG64)(_listed) | (ULONG64)(_monitored) << 1) << ((_name) * 2))
+
+//state of the list under each generation, set before the update that
+//makes it current
+static ULONG64 g_History[UPDATES + 1] ;
+static ULONG g_Generation0 ;
+
+//as in wdk/, but a lookup now and then holds its table across a yield,
+//so that updates land in it
+BOOLEAN
+ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref)
+{
+	static volatile LONG calls ;
+	volatile LONG64 *count = (volatile LONG64 *)Ref ;
+	LONG64 cur = __atomic_load_n(count, __ATOMIC_RELAXED) ;
+
+	do {
+		if (cur & 1)
+			return FALSE ;
+	} while (!__atomic_compare_exchange_n(count, &cur, cur + 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) ;
+
+	//long enough for two updates, the second of which reuses its slot
+	if (InterlockedIncrement(&calls) % 8 == 0)
+	{
+		sched_yield() ;
+		sched_yield() ;
+		sched_yield() ;
+	}
+
+	return TRUE ;
+}
+
+static void
+Name(ULONG Index, BOOLEAN Upper, CHAR *Name)
+{
+	ULONG i ;
+
+	memset(Name, 0, PROCLIST_NAME_LENGTH) ;
+	sprintf(Name, "proc%02u.exe", Index) ;
+
+	for (i = 0; Upper && Name[i] != '\0'; i++)
+		Name[i] = (CHAR)toupper(Name[i]) ;
+}
+
+static ULONG
+Add(const CHAR *Name, BOOLEAN Monitor)
+{
+	PROCESS_INFO info ;
+
+	memset(&info, 0, sizeof(info)) ;
+	memcpy(info.szProcessName, Name, strnlen(Name, PROCLIST_NAME_LENGTH)) ;
+	info.bMonitor = Monitor ;
+
+	return ProcList_Add(&info) ;
+}
+
+static NTSTATUS
+SetMonitor(const CHAR *Name, BOOLEAN Monitor)
+{
+	PROCESS_INFO info ;
+
+	memset(&info, 0, sizeof(info)) ;
+	memcpy(info.szProcessName, Name, strnlen(Name, PROCLIST_NAME_LENGTH)) ;
+	info.bMonitor = Monitor ;
+
+	return ProcList_SetMonitor(&info) ;
+}
+
+//
+//  Scripted
+//
+
+static void
+Scripted(void)
+{
+	PROCESS_INFO infos[4] ;
+	CHAR name[PROCLIST_NAME_LENGTH] ;
+	BOOLEAN monitor ;
+	ULONG generation ;
+	ULONG i ;
+
+	CHECK(!ProcList_Lookup("a.exe", &monitor)) ;
+	CHECK(ProcList_Query(NULL, 0) == 0) ;
+
+	CHECK(Add("a.exe", TRUE) == MGAPI_RESULT_SUCCESS) ;
+	CHECK(Add("B.exe", FALSE) == MGAPI_RESULT_SUCCESS) ;
+	CHECK(Add("c.exe", TRUE) == MGAPI_RESULT_SUCCESS) ;
+	CHECK(Add("A.EXE", FALSE) == MGAPI_RESULT_ALREADY_EXIST) ;
+	CHECK(Add("", TRUE) == MGAPI_RESULT_INTERNEL_ERROR) ;
+
+	monitor = FALSE ;
+	CHECK(ProcList_Lookup("A.Exe", &monitor) && monitor) ;
+	CHECK(ProcList_Lookup("b.EXE", &monitor) && !monitor) ;
+	CHECK(!ProcList_Lookup("d.exe", &monitor)) ;
+	CHECK(!ProcList_Lookup("", &monitor)) ;
+
+	//turning on what is on does not publish
+	generation = ProcList_GetGeneration() ;
+	CHECK(SetMonitor("a.exe", TRUE) == STATUS_SUCCESS) ;
+	CHECK(ProcList_GetGeneration() == generation) ;
+	CHECK(SetMonitor("b.exe", TRUE) == STATUS_SUCCESS) ;
+	CHECK(ProcList_GetGeneration() == generation + 1) ;
+	CHECK(ProcList_Lookup("B.EXE", &monitor) && monitor) ;
+	CHECK(SetMonitor("d.exe", TRUE) == STATUS_NOT_FOUND) ;
+
+	//deleting the middle one keeps the order of the others
+	CHECK(ProcList_Delete("B.EXE") == MGDPI_RESULT_SUCCESS) ;
+	CHECK(ProcList_Delete("b.exe") == MGDPI_RESULT_NOT_EXIST) ;
+	CHECK(ProcList_Query(infos, ARRAYSIZE(infos)) == 2) ;
+	CHECK(strcmp(infos[0].szProcessName, "a.exe") == 0 && strcmp(infos[1].szProcessName, "c.exe") == 0) ;
+	CHECK(!ProcList_Lookup("b.exe", &monitor)) ;
+
+	//only 'A'..'Z' fold: not '@' and '[' around them, nor non-ASCII
+	CHECK(Add("@[\xC4.exe", TRUE) == MGAPI_RESULT_SUCCESS) ;
+	CHECK(ProcList_Lookup("@[\xC4.EXE", &monitor)) ;
+	CHECK(!ProcList_Lookup("`{\xC4.exe", &monitor)) ;
+	CHECK(!ProcList_Lookup("@[\xE4.exe", &monitor)) ;
+
+	//image names are truncated to 15 characters
+	memcpy(name, "sixteen_chars_ab", PROCLIST_NAME_LENGTH) ;
+	CHECK(Add(name, TRUE) == MGAPI_RESULT_SUCCESS) ;
+	CHECK(ProcList_Lookup("SIXTEEN_CHARS_A", &monitor) && monitor) ;
+	CHECK(Add("sixteen_chars_a", TRUE) == MGAPI_RESULT_ALREADY_EXIST) ;
+
+	for (i = 0; i < 4; i++)
+		CHECK(ProcList_Delete(i == 0 ? "a.exe" : i == 1 ? "c.exe" : i == 2 ? "@[\xC4.exe" : "sixteen_chars_a") == MGDPI_RESULT_SUCCESS) ;
+	CHECK(ProcList_Query(NULL, 0) == 0) ;
+
+	//a full list
+	for (i = 0; i < PROCLIST_MAX_PROCESSES; i++)
+	{
+		sprintf(name, "full%04u", i) ;
+		CHECK(Add(name, i % 2) == MGAPI_RESULT_SUCCESS) ;
+	}
+	CHECK(Add("one.more", TRUE) == MGAPI_RESULT_INTERNEL_ERROR) ;
+
+	for (i = 0; i < PROCLIST_MAX_PROCESSES; i++)
+	{
+		sprintf(name, "FULL%04u", i) ;
+		CHECK(ProcList_Lookup(name, &monitor) && monitor == i % 2) ;
+	}
+
+	for (i = 0; i < PROCLIST_MAX_PROCESSES; i++)
+	{
+		sprintf(name, "full%04u", i) ;
+		CHECK(ProcList_Delete(name) == MGDPI_RESULT_SUCCESS) ;
+	}
+	CHECK(ProcList_Query(NULL, 0) == 0) ;
+}
+
+//
+//  Stress
+//
+
+static void
+Reader(ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	CHAR name[PROCLIST_NAME_LENGTH] ;
+	ULONG first, last, g, n ;
+	BOOLEAN found, monitor ;
+	ULONG i ;
+
+	for (n = 0; n < LOOKUPS; n++)
+	{
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+		i = (ULONG)(state % NAMES) ;
+		Name(i, (state >> 32) & 1, name) ;
+
+		monitor = 2 ;
+		first = ProcList_GetGeneration() ;
+		found = ProcList_Lookup(name, &monitor) ;
+		last = ProcList_GetGeneration() ;
+
+		//a table is published before the generation is bumped
+		for (g = first; g <= last + 1; g++)
+		{
+			ULONG64 s = g_History[min(g - g_Generation0, UPDATES)] ;
+
+			if (LISTED(s, i) == found && (!found || MONITORED(s, i) == monitor))
+				break ;
+		}
+
+		CHECK(g <= last + 1) ;
+
+		if (n % 64 == 0)
+			sched_yield() ;
+	}
+}
+
+static void
+Updater(void)
+{
+	CHAR name[PROCLIST_NAME_LENGTH] ;
+	ULONG64 state = g_History[0] ;
+	BOOLEAN listed, monitored ;
+	ULONG n, i ;
+
+	for (n = 1; n <= UPDATES; n++)
+	{
+		i = n * 5 % NAMES ;
+		Name(i, n % 2, name) ;
+		listed = (BOOLEAN)LISTED(state, i) ;
+		monitored = (BOOLEAN)MONITORED(state, i) ;
+
+		//not listed: add; listed: every third time delete, else toggle
+		state &= ~STATE(i, 1, 1) ;
+		if (!listed)
+			state |= STATE(i, 1, n % 4 < 2) ;
+		else if (n % 3 != 0)
+			state |= STATE(i, 1, !monitored) ;
+		g_History[n] = state ;
+
+		if (!listed)
+			CHECK(Add(name, n % 4 < 2) == MGAPI_RESULT_SUCCESS) ;
+		else if (n % 3 == 0)
+			CHECK(ProcList_Delete(name) == MGDPI_RESULT_SUCCESS) ;
+		else
+			CHECK(SetMonitor(name, !monitored) == STATUS_SUCCESS) ;
+
+		CHECK(ProcList_GetGeneration() == g_Generation0 + n) ;
+		sched_yield() ;
+	}
+}
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	(void)Context ;
+
+	if (Index < READERS)
+		Reader(Index) ;
+	else
+		Updater() ;
+}
+
+int
+main(void)
+{
+	CHAR name[PROCLIST_NAME_LENGTH] ;
+	ULONG i ;
+
+	setenv("WDK_CPUS", "8", 0) ;
+
+	CHECK(NT_SUCCESS(ProcList_Init())) ;
+
+	Scripted() ;
+
+	//every other name listed, monitored or not
+	for (i = 0; i < NAMES; i += 2)
+	{
+		Name(i, FALSE, name) ;
+		CHECK(Add(name, i % 4 == 0) == MGAPI_RESULT_SUCCESS) ;
+		g_History[0] |= STATE(i, 1, i % 4 == 0) ;
+	}
+
+	g_Generation0 = ProcList_GetGeneration() ;
+
+	Wdk_RunThreads(READERS + 1, Stress, NULL) ;
+
+	ProcList_Uninit() ;
+	CHECK(Wdk_PoolBytes(PROCLIST_TAG) == 0) ;
+
+	return Report("proclist_test") ;
+}
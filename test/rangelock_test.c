@@ -0,0 +1,341 @@
+/*++
+
+Module Name:
+
+    rangelock_test.c
+
+Abstract:
+
+    Byte range locks under threads.
+
+    Builds rangelock.c against the threaded kernel stand-ins of wdk/.
+    Scripted runs queue waiters in a known order and check who is
+    granted when: overlapping exclusive ranges in arrival order, a shared
+    range held back by an earlier waiting exclusive one it overlaps while
+    a disjoint shared one goes through, and ranges to the end of the
+    file.  A stress run then has 32 threads take random shared and
+    exclusive ranges over a small file and checks every held byte
+    against the others holding it.
+
+--*/
+#include <sched.h>
+#include <stdlib.h>
+
+#include "rangelock.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define WAITERS         8
+
+#define THREADS         32
+#define ITERATIONS      3000
+#define SLOTS           64
+
+//
+//  Scripted runs: thread 0 drives, threads 1..WAITERS queue in turn
+//
+
+typedef struct _WAITER {
+
+	LONGLONG Start ;
+	LONGLONG End ;
+	BOOLEAN Exclusive ;
+
+	//granted as the how manieth, 0 while waiting
+	volatile LONG Order ;
+
+	//set by the driver to let the waiter release
+	volatile LONG Release ;
+
+} WAITER ;
+
+//a broken lock may never get there, fail instead of hanging
+#define WAIT_UNTIL(c) do { double _deadline = Now() + 10 ; while (!(c) && Now() < _deadline) sched_yield() ; CHECK(c) ; } while (0)
+
+static RANGE_LOCK g_Lock ;
+static WAITER g_Waiters[WAITERS + 1] ;
+static ULONG g_WaiterCount ;
+static volatile LONG g_Turn ;
+static volatile LONG g_Granted ;
+static void (*g_Script)(void) ;
+
+static ULONG
+QueuedCount(void)
+{
+	PLIST_ENTRY link ;
+	KIRQL oldIrql ;
+	ULONG count = 0 ;
+
+	KeAcquireSpinLock(&g_Lock.Lock, &oldIrql) ;
+	for (link = g_Lock.Waiting.Flink; link != &g_Lock.Waiting; link = link->Flink)
+		count++ ;
+	KeReleaseSpinLock(&g_Lock.Lock, oldIrql) ;
+
+	return count ;
+}
+
+//lets waiter Index acquire and returns once it is granted or queued
+static void
+Queue(ULONG Index, ULONG Queued)
+{
+	InterlockedExchange(&g_Turn, Index) ;
+
+	WAIT_UNTIL(g_Waiters[Index].Order != 0 || QueuedCount() >= Queued) ;
+}
+
+//lets waiter Index release and waits for what that grants to settle
+static void
+Let(ULONG Index)
+{
+	InterlockedExchange(&g_Waiters[Index].Release, TRUE) ;
+	WAIT_UNTIL(!g_Waiters[Index].Release) ;
+}
+
+static void
+Settle(void)
+{
+	int i ;
+
+	for (i = 0; i < 1000; i++)
+		sched_yield() ;
+}
+
+static void
+Scripted(PVOID Context, ULONG Index)
+{
+	WAITER *waiter = &g_Waiters[Index] ;
+	RANGE_LOCK_ENTRY entry ;
+
+	(void)Context ;
+
+	if (Index == 0)
+	{
+		g_Script() ;
+
+		//whatever a failed script left waiting
+		InterlockedExchange(&g_Turn, WAITERS + 1) ;
+		for (Index = 1; Index <= WAITERS; Index++)
+			InterlockedExchange(&g_Waiters[Index].Release, TRUE) ;
+		return ;
+	}
+
+	if (Index > g_WaiterCount)
+		return ;
+
+	while (g_Turn < (LONG)Index)
+		sched_yield() ;
+
+	RangeLock_Acquire(&g_Lock, &entry, waiter->Start, waiter->End, waiter->Exclusive) ;
+	InterlockedExchange(&waiter->Order, InterlockedIncrement(&g_Granted)) ;
+
+	while (!waiter->Release)
+		sched_yield() ;
+
+	RangeLock_Release(&g_Lock, &entry) ;
+	InterlockedExchange(&waiter->Release, FALSE) ;
+}
+
+static void
+Run(void (*Script)(void), ULONG Count)
+{
+	RangeLock_Init(&g_Lock) ;
+	memset(g_Waiters, 0, sizeof(g_Waiters)) ;
+	g_WaiterCount = Count ;
+	g_Turn = 0 ;
+	g_Granted = 0 ;
+	g_Script = Script ;
+
+	Wdk_RunThreads(WAITERS + 1, Scripted, NULL) ;
+
+	CHECK(IsListEmpty(&g_Lock.Granted) && IsListEmpty(&g_Lock.Waiting)) ;
+}
+
+static void
+SetWaiter(ULONG Index, LONGLONG Start, LONGLONG End, BOOLEAN Exclusive)
+{
+	g_Waiters[Index].Start = Start ;
+	g_Waiters[Index].End = End ;
+	g_Waiters[Index].Exclusive = Exclusive ;
+}
+
+//overlapping waiters are granted in arrival order, a run of shared ones
+//together
+static void
+Fifo(void)
+{
+	RANGE_LOCK_ENTRY held ;
+	ULONG i, last, j ;
+
+	RangeLock_Acquire(&g_Lock, &held, 0, 4096, TRUE) ;
+
+	for (i = 1; i <= WAITERS; i++)
+	{
+		//exclusive, shared, shared, exclusive, ... all overlapping
+		SetWaiter(i, i * 100, 4096 + i * 100, i % 3 == 1) ;
+		Queue(i, i) ;
+	}
+
+	RangeLock_Release(&g_Lock, &held) ;
+
+	for (i = 1; i <= WAITERS; i = last + 1)
+	{
+		last = i ;
+		while (!g_Waiters[i].Exclusive && last < WAITERS && !g_Waiters[last + 1].Exclusive)
+			last++ ;
+
+		for (j = i; j <= last; j++)
+			WAIT_UNTIL(g_Waiters[j].Order != 0) ;
+
+		Settle() ;
+		CHECK(g_Granted == (LONG)last) ;
+
+		for (j = i; j <= last; j++)
+			Let(j) ;
+	}
+}
+
+//a shared range waits behind an earlier exclusive waiter it overlaps,
+//even though nothing granted conflicts with it
+static void
+NoStarvation(void)
+{
+	RANGE_LOCK_ENTRY reader ;
+	RANGE_LOCK_ENTRY disjoint ;
+
+	RangeLock_Acquire(&g_Lock, &reader, 0, 100, FALSE) ;
+
+	SetWaiter(1, 50, 150, TRUE) ;
+	Queue(1, 1) ;
+	CHECK(g_Waiters[1].Order == 0) ;
+
+	SetWaiter(2, 60, 70, FALSE) ;
+	Queue(2, 2) ;
+
+	//overlaps the reader only: shared with it, and the waiter is not in the way
+	RangeLock_Acquire(&g_Lock, &disjoint, 0, 10, FALSE) ;
+	RangeLock_Release(&g_Lock, &disjoint) ;
+
+	Settle() ;
+	CHECK(g_Waiters[1].Order == 0 && g_Waiters[2].Order == 0) ;
+
+	RangeLock_Release(&g_Lock, &reader) ;
+
+	WAIT_UNTIL(g_Waiters[1].Order != 0) ;
+	Settle() ;
+	CHECK(g_Waiters[2].Order == 0) ;
+
+	Let(1) ;
+	WAIT_UNTIL(g_Waiters[2].Order != 0) ;
+	CHECK(g_Waiters[2].Order == 2) ;
+	Let(2) ;
+}
+
+//a size change to the end of the file holds back every I/O past the old
+//end, not the ones before it
+static void
+EndOfFile(void)
+{
+	RANGE_LOCK_ENTRY extend ;
+	RANGE_LOCK_ENTRY before ;
+
+	RangeLock_Acquire(&g_Lock, &extend, 8192, RANGE_LOCK_TO_END_OF_FILE, TRUE) ;
+
+	RangeLock_Acquire(&g_Lock, &before, 0, 8192, TRUE) ;
+	RangeLock_Release(&g_Lock, &before) ;
+
+	SetWaiter(1, 1 << 30, (1 << 30) + 512, FALSE) ;
+	Queue(1, 1) ;
+	SetWaiter(2, 4096, 12288, TRUE) ;
+	Queue(2, 2) ;
+
+	Settle() ;
+	CHECK(g_Waiters[1].Order == 0 && g_Waiters[2].Order == 0) ;
+
+	RangeLock_Release(&g_Lock, &extend) ;
+
+	WAIT_UNTIL(g_Waiters[1].Order != 0 && g_Waiters[2].Order != 0) ;
+
+	Let(1) ;
+	Let(2) ;
+}
+
+//
+//  Stress: every byte held is held by one exclusive range or by shared
+//  ones only
+//
+
+static volatile LONG g_Shared[SLOTS] ;
+static volatile LONG g_Exclusive[SLOTS] ;
+static RANGE_LOCK g_StressLock ;
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	unsigned long long state = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+	RANGE_LOCK_ENTRY entry ;
+	ULONG first, last, i ;
+	BOOLEAN exclusive ;
+	LONGLONG end ;
+	int n ;
+
+	(void)Context ;
+
+	for (n = 0; n < ITERATIONS; n++)
+	{
+		state ^= state << 13 ;
+		state ^= state >> 7 ;
+		state ^= state << 17 ;
+
+		first = (ULONG)(state % SLOTS) ;
+		last = min(first + (ULONG)(state >> 8) % 8, SLOTS - 1) ;
+		exclusive = (state >> 16) % 4 == 0 ;
+
+		//a slot is 512 bytes; now and then a range to the end of the file
+		end = (state >> 24) % 16 == 0 ? RANGE_LOCK_TO_END_OF_FILE : (LONGLONG)(last + 1) * 512 ;
+		if (end == RANGE_LOCK_TO_END_OF_FILE)
+			last = SLOTS - 1 ;
+
+		RangeLock_Acquire(&g_StressLock, &entry, (LONGLONG)first * 512 + (state >> 32) % 512, end, exclusive) ;
+
+		for (i = first; i <= last; i++)
+		{
+			if (exclusive)
+			{
+				CHECK(InterlockedIncrement(&g_Exclusive[i]) == 1) ;
+				CHECK(g_Shared[i] == 0) ;
+			}
+			else
+			{
+				InterlockedIncrement(&g_Shared[i]) ;
+				CHECK(g_Exclusive[i] == 0) ;
+			}
+		}
+
+		if (n % 4 == 0)
+			sched_yield() ;
+
+		for (i = first; i <= last; i++)
+		{
+			if (exclusive)
+				InterlockedDecrement(&g_Exclusive[i]) ;
+			else
+				InterlockedDecrement(&g_Shared[i]) ;
+		}
+
+		RangeLock_Release(&g_StressLock, &entry) ;
+	}
+}
+
+int
+main(void)
+{
+	Run(Fifo, WAITERS) ;
+	Run(NoStarvation, 2) ;
+	Run(EndOfFile, 2) ;
+
+	RangeLock_Init(&g_StressLock) ;
+	Wdk_RunThreads(THREADS, Stress, NULL) ;
+	CHECK(IsListEmpty(&g_StressLock.Granted) && IsListEmpty(&g_StressLock.Waiting)) ;
+
+	return Report("rangelock_test") ;
+}
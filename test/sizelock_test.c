@@ -0,0 +1,165 @@
+/*++
+
+Module Name:
+
+    sizelock_test.c
+
+Abstract:
+
+    The size sequence lock of a stream context under threads.
+
+    Builds ctx.c against the threaded kernel stand-ins of wdk/.  Writers
+    take SC_SIZE_LOCK as the driver does and store FileValidLength and
+    FileSize of one generation, yielding between the two stores.  Loads
+    of the sizes yield now and then, so that readers are caught between
+    them, and so does a writer between reading the sequence and taking
+    it.
+
+    12 readers take snapshots with SC_READ_SIZES while 4 writers, at
+    PASSIVE_LEVEL and at DISPATCH_LEVEL, each move the sizes on by one
+    generation at a time.  Every snapshot must be of one generation, and
+    not older than the one a reader saw before.  The generation at the
+    end counts every writer's increments: none is lost to a concurrent
+    writer.
+
+--*/
+#include <sched.h>
+#include <stdlib.h>
+
+#include "ctx.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define READERS         12
+#define WRITERS         4
+#define SNAPSHOTS       20000
+#define GENERATIONS     5000
+
+static STREAM_CONTEXT g_StreamCtx ;
+static volatile LONG g_Writing ;
+
+//as in wdk/, but a reader between the two sizes now and then yields:
+//SC_READ_SIZES loads them in pairs
+LONG64
+ReadAcquire64(const volatile LONG64 *p)
+{
+	static __thread ULONG calls ;
+	LONG64 value = __atomic_load_n(p, __ATOMIC_ACQUIRE) ;
+
+	//long enough for a writer to get through its section
+	if (++calls % 8 == 1)
+	{
+		sched_yield() ;
+		sched_yield() ;
+		sched_yield() ;
+	}
+
+	return value ;
+}
+
+//and a writer between reading the sequence and taking it, the only
+//reads at DISPATCH_LEVEL here
+LONG
+ReadNoFence(const volatile LONG *p)
+{
+	LONG value = __atomic_load_n(p, __ATOMIC_RELAXED) ;
+
+	if (KeGetCurrentIrql() == DISPATCH_LEVEL)
+		sched_yield() ;
+
+	return value ;
+}
+
+//the size of a file whose valid length is generation G, with the layout
+//of nothing in particular
+#define SIZE_OF(_g)     ((_g) * 3 + 4096)
+
+static void
+Reader(ULONG Index)
+{
+	LARGE_INTEGER validLength, fileSize ;
+	LONG64 last = 0 ;
+	ULONG n ;
+
+	(void)Index ;
+
+	for (n = 0; n < SNAPSHOTS || g_Writing != 0; n++)
+	{
+		SC_READ_SIZES(&g_StreamCtx, &validLength, &fileSize) ;
+
+		CHECK(fileSize.QuadPart == SIZE_OF(validLength.QuadPart)) ;
+		CHECK(validLength.QuadPart >= last) ;
+		last = validLength.QuadPart ;
+
+		//either one alone
+		SC_READ_SIZES(&g_StreamCtx, NULL, &fileSize) ;
+		CHECK(fileSize.QuadPart >= SIZE_OF(last)) ;
+		SC_READ_SIZES(&g_StreamCtx, &validLength, NULL) ;
+		CHECK(validLength.QuadPart >= last) ;
+		last = validLength.QuadPart ;
+
+		if (n % 64 == 0)
+			sched_yield() ;
+	}
+}
+
+static void
+Writer(ULONG Index)
+{
+	KIRQL oldIrql, sizeIrql ;
+	LONG64 g ;
+	ULONG n ;
+
+	for (n = 0; n < GENERATIONS; n++)
+	{
+		//half of them write from DISPATCH_LEVEL, as completions do
+		if (Index % 2)
+			KeRaiseIrql(DISPATCH_LEVEL, &oldIrql) ;
+
+		SC_SIZE_LOCK(&g_StreamCtx, &sizeIrql) ;
+		g = g_StreamCtx.FileValidLength.QuadPart + 1 ;
+		g_StreamCtx.FileValidLength.QuadPart = g ;
+		sched_yield() ;
+		g_StreamCtx.FileSize.QuadPart = SIZE_OF(g) ;
+		SC_SIZE_UNLOCK(&g_StreamCtx, sizeIrql) ;
+
+		if (Index % 2)
+			KeLowerIrql(oldIrql) ;
+
+		CHECK(KeGetCurrentIrql() == PASSIVE_LEVEL) ;
+		sched_yield() ;
+	}
+
+	InterlockedDecrement(&g_Writing) ;
+}
+
+static void
+Stress(PVOID Context, ULONG Index)
+{
+	(void)Context ;
+
+	if (Index < READERS)
+		Reader(Index) ;
+	else
+		Writer(Index - READERS) ;
+}
+
+int
+main(void)
+{
+	LARGE_INTEGER validLength, fileSize ;
+
+	setenv("WDK_CPUS", "8", 0) ;
+
+	g_StreamCtx.FileSize.QuadPart = SIZE_OF(0) ;
+	g_Writing = WRITERS ;
+
+	Wdk_RunThreads(READERS + WRITERS, Stress, NULL) ;
+
+	SC_READ_SIZES(&g_StreamCtx, &validLength, &fileSize) ;
+	CHECK(validLength.QuadPart == (LONG64)WRITERS * GENERATIONS) ;
+	CHECK(fileSize.QuadPart == SIZE_OF(validLength.QuadPart)) ;
+	CHECK(g_StreamCtx.SizeSequence == 2 * WRITERS * GENERATIONS) ;
+
+	return Report("sizelock_test") ;
+}
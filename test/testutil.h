@@ -0,0 +1,70 @@
+#ifndef _TESTUTIL_H_
+#define _TESTUTIL_H_
+
+//
+//  Helpers shared by the user mode tests and benchmarks.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int g_Failures ;
+
+//callable from the threads of the stress tests
+#define CHECK(c) do { if (!(c)) { if (__atomic_fetch_add(&g_Failures, 1, __ATOMIC_RELAXED) < 20) printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c) ; } } while (0)
+
+static unsigned long long g_RandState = 0x9E3779B97F4A7C15ULL ;
+
+//xorshift64, fixed seed so failures reproduce
+static inline unsigned long long
+Rand(void)
+{
+	g_RandState ^= g_RandState << 13 ;
+	g_RandState ^= g_RandState >> 7 ;
+	g_RandState ^= g_RandState << 17 ;
+	return g_RandState ;
+}
+
+static inline void
+RandFill(void *Buffer, size_t Length)
+{
+	size_t i ;
+
+	for (i = 0; i < Length; i++)
+		((unsigned char *)Buffer)[i] = (unsigned char)Rand() ;
+}
+
+//parses a hex string into Out, returns the number of bytes
+static inline size_t
+Hex(const char *String, unsigned char *Out)
+{
+	size_t n = 0 ;
+	unsigned int byte ;
+
+	for (; String[0] && String[1]; String += 2)
+	{
+		sscanf(String, "%2x", &byte) ;
+		Out[n++] = (unsigned char)byte ;
+	}
+
+	return n ;
+}
+
+static inline double
+Now(void)
+{
+	struct timespec t ;
+
+	clock_gettime(CLOCK_MONOTONIC, &t) ;
+	return t.tv_sec + t.tv_nsec * 1e-9 ;
+}
+
+static inline int
+Report(const char *Name)
+{
+	printf("%s: %d failures\n", Name, g_Failures) ;
+	return g_Failures != 0 ;
+}
+
+#endif//_TESTUTIL_H_
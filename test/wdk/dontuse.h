@@ -0,0 +1,5 @@
+#pragma once
+
+//
+//  Empty: the driver uses nothing from dontuse.h that the tests reach.
+//
@@ -0,0 +1,378 @@
+#pragma once
+
+//
+//  Just enough of the WDK for the driver sources to compile with GCC or
+//  Clang on Linux, for the tests that build them.  Types and structures
+//  carry the fields the driver uses, not the real layouts; the kernel
+//  routines are declared only.  A test defines those on the paths it
+//  drives, or links the threaded stand-ins of wdk.c.
+//
+//  try/finally become a do/while(0) block and leave a break, so finally
+//  blocks run on leave and on falling through; nothing raises.
+//
+#include <stddef.h>
+#include <stdint.h>
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#define __out_opt
+#define __deref_out
+#define __deref_out_opt
+#define __in_bcount(x)
+#define __in_bcount_opt(x)
+#define __out_bcount(x)
+#define __out_bcount_part_opt(a,b)
+#define __in_ecount(x)
+#define __out_ecount(x)
+#define __inout_ecount(x)
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Out_
+#define _Out_opt_
+#define _Flt_CompletionContext_Outptr_
+#define UNALIGNED
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(64)
+#define CONST const
+#define FORCEINLINE static inline
+#define C_ASSERT(e) _Static_assert(e, #e)
+#define TYPE_ALIGNMENT(t) _Alignof(t)
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define FLT_ASSERT(e) ((void)0)
+#define ASSERT(e) ((void)0)
+#define NT_ASSERT(e) ((void)0)
+#define PAGED_CODE() ((void)0)
+#define try do
+#define finally while(0); if(1)
+#define except(x) while(0); if(0)
+#define leave break
+#define GetExceptionCode() 0
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define TRUE 1
+#define FALSE 0
+#include <stddef.h>
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define FlagOn(f,b) ((f)&(b))
+#define SetFlag(f,b) ((f)|=(b))
+#define ClearFlag(f,b) ((f)&=~(b))
+#define BooleanFlagOn(f,b) ((BOOLEAN)(((f)&(b))!=0))
+#define FIELD_OFFSET(t,f) offsetof(t,f)
+#define CONTAINING_RECORD(a,t,f) ((t*)((char*)(a)-offsetof(t,f)))
+#define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
+#define ROUND_TO_SIZE(l,a) ((((ULONG_PTR)(l))+(a)-1)&~((ULONG_PTR)(a)-1))
+#define ROUND_TO_PAGES(s) ROUND_TO_SIZE(s,PAGE_SIZE)
+#define ALIGN_UP_BY(l,a) ROUND_TO_SIZE(l,a)
+#define ALIGN_DOWN_BY(l,a) (((ULONG_PTR)(l))&~((ULONG_PTR)(a)-1))
+#define BYTES_TO_PAGES(s) (((s)+PAGE_SIZE-1)/PAGE_SIZE)
+typedef void VOID, *PVOID; typedef char CHAR, *PCHAR; typedef unsigned char UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, BYTE;
+typedef short SHORT; typedef unsigned short USHORT, *PUSHORT, WCHAR, *PWCHAR, *PWSTR; typedef const WCHAR *PCWSTR;
+typedef int INT; typedef unsigned int UINT; typedef int32_t LONG, *PLONG; typedef uint32_t ULONG, *PULONG, DWORD;
+typedef int64_t LONGLONG, LONG64, *PLONG64, *PLONGLONG; typedef uint64_t ULONGLONG, ULONG64, *PULONGLONG, *PULONG64;
+typedef uintptr_t ULONG_PTR, SIZE_T, *PSIZE_T, *PULONG_PTR; typedef intptr_t LONG_PTR;
+typedef LONG NTSTATUS; typedef UCHAR KIRQL, *PKIRQL; typedef ULONG ACCESS_MASK; typedef char TCHAR; typedef ULONG DEVICE_TYPE;
+typedef union _LARGE_INTEGER { struct { ULONG LowPart; LONG HighPart; }; LONGLONG QuadPart; } LARGE_INTEGER, *PLARGE_INTEGER;
+typedef unsigned short *PWCH;
+typedef struct _UNICODE_STRING { USHORT Length, MaximumLength; PWCH Buffer; } UNICODE_STRING, *PUNICODE_STRING; 
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+typedef struct _LIST_ENTRY { struct _LIST_ENTRY *Flink, *Blink; } LIST_ENTRY, *PLIST_ENTRY;
+typedef struct _SLIST_ENTRY { struct _SLIST_ENTRY *Next; } SLIST_ENTRY, *PSLIST_ENTRY;
+typedef union DECLSPEC_ALIGN(16) _SLIST_HEADER { ULONGLONG A[2]; } SLIST_HEADER, *PSLIST_HEADER;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef struct _KLOCK_QUEUE_HANDLE { ULONG_PTR x[3]; } KLOCK_QUEUE_HANDLE, *PKLOCK_QUEUE_HANDLE;
+typedef struct _ERESOURCE { ULONG_PTR x[13]; } ERESOURCE, *PERESOURCE;
+typedef struct _FAST_MUTEX { ULONG_PTR x[7]; } FAST_MUTEX, *PFAST_MUTEX;
+typedef struct _KEVENT { ULONG_PTR x[3]; } KEVENT, *PKEVENT;
+typedef struct _KDPC { ULONG_PTR x[8]; } KDPC, *PKDPC;
+typedef struct _EX_PUSH_LOCK { ULONG_PTR x; } EX_PUSH_LOCK, *PEX_PUSH_LOCK;
+typedef struct _EX_RUNDOWN_REF { ULONG_PTR x; } EX_RUNDOWN_REF, *PEX_RUNDOWN_REF;
+typedef struct _EX_RUNDOWN_REF_CACHE_AWARE *PEX_RUNDOWN_REF_CACHE_AWARE;
+typedef struct _RTL_GENERIC_TABLE { ULONG_PTR x[9]; } RTL_GENERIC_TABLE;
+typedef struct _NPAGED_LOOKASIDE_LIST { ULONG_PTR x[32]; } NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+typedef struct _PAGED_LOOKASIDE_LIST { ULONG_PTR x[32]; } PAGED_LOOKASIDE_LIST, *PPAGED_LOOKASIDE_LIST;
+typedef struct _XSTATE_SAVE { ULONG_PTR x[8]; } XSTATE_SAVE;
+typedef struct _MDL { struct _MDL *Next; ULONG ByteCount; PVOID StartVa; } MDL, *PMDL;
+typedef struct _KTHREAD *PKTHREAD; typedef struct _EPROCESS *PEPROCESS; typedef PVOID HANDLE, *PHANDLE;
+typedef struct _DRIVER_OBJECT *PDRIVER_OBJECT; typedef struct _DEVICE_OBJECT *PDEVICE_OBJECT;
+typedef struct _SECURITY_DESCRIPTOR *PSECURITY_DESCRIPTOR;
+typedef struct _OBJECT_ATTRIBUTES { ULONG x; } OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+typedef struct _IO_STATUS_BLOCK { NTSTATUS Status; ULONG_PTR Information; } IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+typedef struct _FILE_OBJECT { ULONG Flags; struct _FILE_OBJECT *RelatedFileObject; UNICODE_STRING FileName; BOOLEAN ReadAccess, WriteAccess, DeleteAccess; PVOID FsContext; LARGE_INTEGER CurrentByteOffset; } FILE_OBJECT, *PFILE_OBJECT;
+typedef struct _FILE_STANDARD_INFORMATION { LARGE_INTEGER AllocationSize, EndOfFile; ULONG NumberOfLinks; BOOLEAN DeletePending, Directory; } FILE_STANDARD_INFORMATION, *PFILE_STANDARD_INFORMATION;
+typedef struct _FILE_INTERNAL_INFORMATION { LARGE_INTEGER IndexNumber; } FILE_INTERNAL_INFORMATION;
+typedef struct _FILE_BASIC_INFORMATION { LARGE_INTEGER CreationTime, LastAccessTime, LastWriteTime, ChangeTime; ULONG FileAttributes; } FILE_BASIC_INFORMATION;
+typedef struct _FILE_END_OF_FILE_INFORMATION { LARGE_INTEGER EndOfFile; } FILE_END_OF_FILE_INFORMATION, *PFILE_END_OF_FILE_INFORMATION;
+typedef struct _FILE_ALLOCATION_INFORMATION { LARGE_INTEGER AllocationSize; } FILE_ALLOCATION_INFORMATION, *PFILE_ALLOCATION_INFORMATION;
+typedef struct _FILE_ALL_INFORMATION { FILE_BASIC_INFORMATION BasicInformation; FILE_STANDARD_INFORMATION StandardInformation; FILE_INTERNAL_INFORMATION InternalInformation; } FILE_ALL_INFORMATION, *PFILE_ALL_INFORMATION;
+typedef struct _FILE_ID_128 { UCHAR Identifier[16]; } FILE_ID_128;
+typedef struct _FILE_ID_INFORMATION { ULONGLONG VolumeSerialNumber; FILE_ID_128 FileId; } FILE_ID_INFORMATION;
+typedef enum { FileBasicInformation=4, FileStandardInformation=5, FileInternalInformation=6, FileAllInformation=18, FileAllocationInformation=19, FileEndOfFileInformation=20, FileNetworkOpenInformation=34, FileIdInformation=59 } FILE_INFORMATION_CLASS;
+typedef enum { NormalPagePriority=16, HighPagePriority=32 } MM_PAGE_PRIORITY;
+typedef enum { NonPagedPool, PagedPool, NonPagedPoolNx=512 } POOL_TYPE;
+typedef enum { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum { Executive } KWAIT_REASON;
+typedef enum { DelayedWorkQueue, CriticalWorkQueue } WORK_QUEUE_TYPE;
+typedef struct _PROCESSOR_NUMBER { USHORT Group; UCHAR Number, Reserved; } PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+typedef struct _PS_CREATE_NOTIFY_INFO *PPS_CREATE_NOTIFY_INFO;
+typedef VOID (*PCREATE_PROCESS_NOTIFY_ROUTINE)(HANDLE, HANDLE, BOOLEAN);
+typedef VOID KDEFERRED_ROUTINE(PKDPC, PVOID, PVOID, PVOID); typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+typedef VOID KSTART_ROUTINE(PVOID); typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT, PUNICODE_STRING);
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define STATUS_PENDING ((NTSTATUS)0x103)
+#define STATUS_REPARSE ((NTSTATUS)0x104)
+#define STATUS_TIMEOUT ((NTSTATUS)0x102)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001)
+#define STATUS_NOT_IMPLEMENTED ((NTSTATUS)0xC0000002)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000D)
+#define STATUS_END_OF_FILE ((NTSTATUS)0xC0000011)
+#define STATUS_ACCESS_DENIED ((NTSTATUS)0xC0000022)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009A)
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BB)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010)
+#define STATUS_DISK_FULL ((NTSTATUS)0xC000007F)
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225)
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034)
+#define STATUS_OBJECT_PATH_NOT_FOUND ((NTSTATUS)0xC000003A)
+#define STATUS_DATA_ERROR ((NTSTATUS)0xC000003E)
+#define STATUS_FILE_CORRUPT_ERROR ((NTSTATUS)0xC0000102)
+#define STATUS_FLT_DO_NOT_ATTACH ((NTSTATUS)0xC01C000F)
+#define STATUS_FLT_CONTEXT_ALREADY_DEFINED ((NTSTATUS)0xC01C0002)
+#define NT_SUCCESS(s) (((NTSTATUS)(s))>=0)
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+#define MAXIMUM_PROCESSORS 64
+#define ALL_PROCESSOR_GROUPS 0xffff
+#define FO_VOLUME_OPEN 0x00400000
+#define FO_STREAM_FILE 0x00000100
+#define IRP_NOCACHE 0x1
+#define IRP_PAGING_IO 0x2
+#define IRP_SYNCHRONOUS_PAGING_IO 0x40
+#define IRP_MJ_CREATE 0
+#define IRP_MJ_CREATE_NAMED_PIPE 1
+#define IRP_MJ_CLOSE 2
+#define IRP_MJ_READ 3
+#define IRP_MJ_WRITE 4
+#define IRP_MJ_QUERY_INFORMATION 5
+#define IRP_MJ_SET_INFORMATION 6
+#define IRP_MJ_CLEANUP 0x12
+#define IRP_MJ_ACQUIRE_FOR_SECTION_SYNCHRONIZATION ((UCHAR)-1)
+#define IRP_MJ_DIRECTORY_CONTROL 0xc
+#define IRP_MJ_FILE_SYSTEM_CONTROL 0xd
+#define IRP_MN_NOTIFY_CHANGE_DIRECTORY 2
+#define FSCTL_REQUEST_FILTER_OPLOCK 1
+#define FSCTL_REQUEST_BATCH_OPLOCK 2
+#define FSCTL_REQUEST_OPLOCK_LEVEL_1 3
+#define FSCTL_REQUEST_OPLOCK_LEVEL_2 4
+#define OBJ_KERNEL_HANDLE 0x200
+#define OBJ_CASE_INSENSITIVE 0x40
+#define FILE_READ_DATA 1
+#define FILE_WRITE_DATA 2
+#define FILE_APPEND_DATA 4
+#define FILE_READ_ATTRIBUTES 0x80
+#define SYNCHRONIZE 0x100000
+#define FILE_SHARE_READ 1
+#define FILE_SHARE_WRITE 2
+#define FILE_SHARE_DELETE 4
+#define FILE_SUPERSEDE 0
+#define FILE_OPEN 1
+#define FILE_CREATE 2
+#define FILE_OPEN_IF 3
+#define FILE_OVERWRITE 4
+#define FILE_OVERWRITE_IF 5
+#define FILE_DIRECTORY_FILE 1
+#define FILE_NON_DIRECTORY_FILE 0x40
+#define FILE_SYNCHRONOUS_IO_NONALERT 0x20
+#define FILE_COMPLETE_IF_OPLOCKED 0x100
+#define IO_IGNORE_SHARE_ACCESS_CHECK 0x800
+#define FILE_OPEN_BY_FILE_ID 0x2000
+#define FILE_SUPERSEDED 0
+#define FILE_OPENED 1
+#define FILE_CREATED 2
+#define FILE_OVERWRITTEN 3
+#define KernelMode 0
+#define UserMode 1
+#define LOW_REALTIME_PRIORITY 16
+#define THREAD_ALL_ACCESS 0x1fffff
+#define XSTATE_MASK_LEGACY 3
+#define PAGE_SIZE 4096
+
+#define RTL_CONSTANT_STRING(s) { sizeof(s)-sizeof((s)[0]), sizeof(s), (PWCH)(s) }
+#define InitializeObjectAttributes(p,n,a,r,s) ((void)(p),(void)(n),(void)(r),(void)(s))
+/* interlocked */
+LONG InterlockedIncrement(volatile LONG*); LONG InterlockedDecrement(volatile LONG*);
+LONG InterlockedExchange(volatile LONG*, LONG); LONG InterlockedExchangeAdd(volatile LONG*, LONG);
+LONG InterlockedCompareExchange(volatile LONG*, LONG, LONG); LONG InterlockedOr(volatile LONG*, LONG); LONG InterlockedAnd(volatile LONG*, LONG);
+LONG64 InterlockedIncrement64(volatile LONG64*); LONG64 InterlockedDecrement64(volatile LONG64*);
+LONG64 InterlockedExchange64(volatile LONG64*, LONG64); LONG64 InterlockedExchangeAdd64(volatile LONG64*, LONG64);
+LONG64 InterlockedCompareExchange64(volatile LONG64*, LONG64, LONG64); LONG64 InterlockedOr64(volatile LONG64*, LONG64);
+PVOID InterlockedExchangePointer(PVOID volatile*, PVOID); PVOID InterlockedCompareExchangePointer(PVOID volatile*, PVOID, PVOID);
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER, PSLIST_ENTRY); PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER);
+PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER); VOID InitializeSListHead(PSLIST_HEADER); USHORT QueryDepthSList(PSLIST_HEADER);
+VOID KeMemoryBarrier(void); VOID YieldProcessor(void); VOID _ReadWriteBarrier(void); VOID KeStallExecutionProcessor(ULONG);
+ULONG ReadULongAcquire(const volatile ULONG*); LONG ReadAcquire(const volatile LONG*); LONG ReadNoFence(const volatile LONG*);
+LONG64 ReadAcquire64(const volatile LONG64*); LONG64 ReadNoFence64(const volatile LONG64*); VOID WriteRelease(volatile LONG*, LONG); VOID WriteRelease64(volatile LONG64*, LONG64); VOID WriteNoFence(volatile LONG*, LONG);
+/* memory */
+PVOID ExAllocatePoolWithTag(POOL_TYPE, SIZE_T, ULONG); VOID ExFreePoolWithTag(PVOID, ULONG); VOID ExFreePool(PVOID);
+VOID ExInitializeNPagedLookasideList(PNPAGED_LOOKASIDE_LIST, PVOID, PVOID, ULONG, SIZE_T, ULONG, USHORT);
+VOID ExDeleteNPagedLookasideList(PNPAGED_LOOKASIDE_LIST); PVOID ExAllocateFromNPagedLookasideList(PNPAGED_LOOKASIDE_LIST); VOID ExFreeToNPagedLookasideList(PNPAGED_LOOKASIDE_LIST, PVOID);
+VOID ExInitializePagedLookasideList(PPAGED_LOOKASIDE_LIST, PVOID, PVOID, ULONG, SIZE_T, ULONG, USHORT);
+VOID ExDeletePagedLookasideList(PPAGED_LOOKASIDE_LIST); PVOID ExAllocateFromPagedLookasideList(PPAGED_LOOKASIDE_LIST); VOID ExFreeToPagedLookasideList(PPAGED_LOOKASIDE_LIST, PVOID);
+VOID RtlZeroMemory(PVOID, SIZE_T); VOID RtlSecureZeroMemory(PVOID, SIZE_T); VOID RtlCopyMemory(PVOID, const void*, SIZE_T); VOID RtlMoveMemory(PVOID, const void*, SIZE_T); VOID RtlFillMemory(PVOID, SIZE_T, UCHAR);
+BOOLEAN RtlEqualMemory(const void*, const void*, SIZE_T); SIZE_T RtlCompareMemory(const void*, const void*, SIZE_T);
+PMDL IoAllocateMdl(PVOID, ULONG, BOOLEAN, BOOLEAN, PVOID); VOID IoFreeMdl(PMDL); VOID MmBuildMdlForNonPagedPool(PMDL);
+PVOID MmGetSystemAddressForMdlSafe(PMDL, ULONG); PVOID MmGetMdlVirtualAddress(PMDL); ULONG MmGetMdlByteCount(PMDL);
+VOID ProbeForRead(const void*, SIZE_T, ULONG); VOID ProbeForWrite(PVOID, SIZE_T, ULONG);
+/* sync */
+VOID KeInitializeSpinLock(PKSPIN_LOCK); VOID KeAcquireSpinLock(PKSPIN_LOCK, PKIRQL); VOID KeReleaseSpinLock(PKSPIN_LOCK, KIRQL);
+VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK); VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK);
+VOID KeAcquireInStackQueuedSpinLock(PKSPIN_LOCK, PKLOCK_QUEUE_HANDLE); VOID KeReleaseInStackQueuedSpinLock(PKLOCK_QUEUE_HANDLE);
+KIRQL KeGetCurrentIrql(void); VOID KeRaiseIrql(KIRQL, PKIRQL); VOID KeLowerIrql(KIRQL); KIRQL KeRaiseIrqlToDpcLevel(void);
+VOID KeEnterCriticalRegion(void); VOID KeLeaveCriticalRegion(void);
+NTSTATUS ExInitializeResourceLite(PERESOURCE); NTSTATUS ExDeleteResourceLite(PERESOURCE); BOOLEAN ExAcquireResourceExclusiveLite(PERESOURCE, BOOLEAN);
+BOOLEAN ExAcquireResourceSharedLite(PERESOURCE, BOOLEAN); VOID ExReleaseResourceLite(PERESOURCE); BOOLEAN ExIsResourceAcquiredExclusiveLite(PERESOURCE); ULONG ExIsResourceAcquiredSharedLite(PERESOURCE);
+VOID ExInitializeFastMutex(PFAST_MUTEX); VOID ExAcquireFastMutex(PFAST_MUTEX); VOID ExReleaseFastMutex(PFAST_MUTEX);
+VOID ExInitializePushLock(PEX_PUSH_LOCK); VOID ExAcquirePushLockExclusive(PEX_PUSH_LOCK); VOID ExReleasePushLockExclusive(PEX_PUSH_LOCK);
+VOID ExAcquirePushLockShared(PEX_PUSH_LOCK); VOID ExReleasePushLockShared(PEX_PUSH_LOCK);
+VOID FltInitializePushLock(PEX_PUSH_LOCK); VOID FltDeletePushLock(PEX_PUSH_LOCK); VOID FltAcquirePushLockExclusive(PEX_PUSH_LOCK); VOID FltReleasePushLock(PEX_PUSH_LOCK); VOID FltAcquirePushLockShared(PEX_PUSH_LOCK);
+VOID KeInitializeEvent(PKEVENT, EVENT_TYPE, BOOLEAN); LONG KeSetEvent(PKEVENT, LONG, BOOLEAN); VOID KeClearEvent(PKEVENT); LONG KeResetEvent(PKEVENT);
+NTSTATUS KeWaitForSingleObject(PVOID, KWAIT_REASON, ULONG, BOOLEAN, PLARGE_INTEGER);
+VOID ExInitializeRundownProtection(PEX_RUNDOWN_REF); BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF); VOID ExReleaseRundownProtection(PEX_RUNDOWN_REF);
+VOID ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF); VOID ExReInitializeRundownProtection(PEX_RUNDOWN_REF);
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE, ULONG); VOID ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE);
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE); VOID ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE);
+VOID ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE); VOID ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE);
+/* ke */
+ULONG KeQueryMaximumProcessorCountEx(USHORT); ULONG KeQueryActiveProcessorCountEx(USHORT); ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER); ULONG KeGetCurrentProcessorNumber(void);
+NTSTATUS KeSaveExtendedProcessorState(ULONG64, XSTATE_SAVE*); VOID KeRestoreExtendedProcessorState(XSTATE_SAVE*);
+ULONGLONG KeQueryInterruptTime(void); LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER); VOID KeQuerySystemTime(PLARGE_INTEGER);
+VOID KeInitializeDpc(PKDPC, PKDEFERRED_ROUTINE, PVOID); BOOLEAN KeInsertQueueDpc(PKDPC, PVOID, PVOID);
+NTSTATUS PsCreateSystemThread(PHANDLE, ULONG, POBJECT_ATTRIBUTES, HANDLE, PVOID, PKSTART_ROUTINE, PVOID); NTSTATUS PsTerminateSystemThread(NTSTATUS);
+NTSTATUS ObReferenceObjectByHandle(HANDLE, ACCESS_MASK, PVOID, int, PVOID*, PVOID); VOID ObDereferenceObject(PVOID); VOID ObReferenceObject(PVOID);
+NTSTATUS ZwClose(HANDLE); HANDLE PsGetCurrentProcessId(void); PEPROCESS PsGetCurrentProcess(void); HANDLE PsGetProcessId(PEPROCESS);
+NTSTATUS ZwWaitForSingleObject(HANDLE, BOOLEAN, PLARGE_INTEGER);
+
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE, BOOLEAN);
+ULONG DbgPrint(const char*, ...); NTSTATUS RtlVolumeDeviceToDosName(PVOID, PUNICODE_STRING);
+VOID RtlCopyUnicodeString(PUNICODE_STRING, PCUNICODE_STRING); NTSTATUS RtlAppendUnicodeToString(PUNICODE_STRING, PCWSTR); VOID RtlInitUnicodeString(PUNICODE_STRING, PCWSTR);
+WCHAR RtlUpcaseUnicodeChar(WCHAR); WCHAR RtlDowncaseUnicodeChar(WCHAR); BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING, PCUNICODE_STRING, BOOLEAN);
+BOOLEAN RtlPrefixUnicodeString(PCUNICODE_STRING, PCUNICODE_STRING, BOOLEAN); NTSTATUS RtlUpcaseUnicodeString(PUNICODE_STRING, PCUNICODE_STRING, BOOLEAN);
+NTSTATUS BCryptGenRandom(PVOID, PUCHAR, ULONG, ULONG);
+#define BCRYPT_USE_SYSTEM_PREFERRED_RNG 2
+typedef PVOID BCRYPT_ALG_HANDLE, BCRYPT_HASH_HANDLE;
+#define BCRYPT_SHA256_ALGORITHM L"SHA256"
+#define BCRYPT_ALG_HANDLE_HMAC_FLAG 0x8
+#define BCRYPT_PROV_DISPATCH 0x1
+#define BCRYPT_OBJECT_LENGTH L"ObjectLength"
+#define BCRYPT_HASH_LENGTH L"HashDigestLength"
+NTSTATUS BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE*, PCWSTR, PCWSTR, ULONG); NTSTATUS BCryptCloseAlgorithmProvider(BCRYPT_ALG_HANDLE, ULONG);
+NTSTATUS BCryptCreateHash(BCRYPT_ALG_HANDLE, BCRYPT_HASH_HANDLE*, PUCHAR, ULONG, PUCHAR, ULONG, ULONG); NTSTATUS BCryptHashData(BCRYPT_HASH_HANDLE, PUCHAR, ULONG, ULONG);
+NTSTATUS BCryptFinishHash(BCRYPT_HASH_HANDLE, PUCHAR, ULONG, ULONG); NTSTATUS BCryptDestroyHash(BCRYPT_HASH_HANDLE);
+NTSTATUS BCryptGetProperty(PVOID, PCWSTR, PUCHAR, ULONG, ULONG*, ULONG);
+/* FltMgr */
+typedef struct _FLT_FILTER *PFLT_FILTER; typedef struct _FLT_INSTANCE *PFLT_INSTANCE; typedef struct _FLT_VOLUME *PFLT_VOLUME; typedef struct _FLT_PORT *PFLT_PORT;
+typedef PVOID PFLT_CONTEXT; typedef USHORT FLT_CONTEXT_TYPE; typedef ULONG FLT_INSTANCE_SETUP_FLAGS, FLT_INSTANCE_TEARDOWN_FLAGS, FLT_INSTANCE_QUERY_TEARDOWN_FLAGS, FLT_FILTER_UNLOAD_FLAGS, FLT_POST_OPERATION_FLAGS, FLT_FILE_NAME_OPTIONS;
+typedef ULONG FLT_FILESYSTEM_TYPE;
+typedef struct _FLT_DEFERRED_IO_WORKITEM *PFLT_DEFERRED_IO_WORKITEM; typedef struct _FLT_GENERIC_WORKITEM *PFLT_GENERIC_WORKITEM;
+#define FLT_VOLUME_CONTEXT 1
+#define FLT_INSTANCE_CONTEXT 2
+#define FLT_FILE_CONTEXT 4
+#define FLT_STREAM_CONTEXT 8
+#define FLT_STREAMHANDLE_CONTEXT 0x10
+#define FLT_CONTEXT_END 0xffff
+#define FLT_SET_CONTEXT_KEEP_IF_EXISTS 1
+#define FLT_SET_CONTEXT_REPLACE_IF_EXISTS 0
+#define FLT_PORT_ALL_ACCESS 0x1f0001
+#define FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO 1
+#define FLTFL_OPERATION_REGISTRATION_SKIP_CACHED_IO 2
+#define FLTFL_CALLBACK_DATA_IRP_OPERATION 1
+#define FLTFL_CALLBACK_DATA_FAST_IO_OPERATION 2
+#define FLTFL_CALLBACK_DATA_FS_FILTER_OPERATION 4
+#define FLTFL_CALLBACK_DATA_SYSTEM_BUFFER 8
+#define FLTFL_CALLBACK_DATA_GENERATED_IO 0x10000
+#define FLTFL_CALLBACK_DATA_POST_OPERATION 0x80000000
+#define FLTFL_POST_OPERATION_DRAINING 1
+#define FLTFL_IO_OPERATION_NON_CACHED 1
+#define FLTFL_IO_OPERATION_PAGING 2
+#define FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET 4
+#define FLT_FILE_NAME_NORMALIZED 1
+#define FLT_FILE_NAME_OPENED 2
+#define FLT_FILE_NAME_QUERY_DEFAULT 0x100
+#define FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP 0x300
+#define FLT_IS_FASTIO_OPERATION(d) FlagOn((d)->Flags, FLTFL_CALLBACK_DATA_FAST_IO_OPERATION)
+#define FLT_IS_IRP_OPERATION(d) FlagOn((d)->Flags, FLTFL_CALLBACK_DATA_IRP_OPERATION)
+#define FLT_REGISTRATION_VERSION 0x203
+typedef enum { FLT_PREOP_SUCCESS_WITH_CALLBACK, FLT_PREOP_SUCCESS_NO_CALLBACK, FLT_PREOP_PENDING, FLT_PREOP_DISALLOW_FASTIO, FLT_PREOP_COMPLETE, FLT_PREOP_SYNCHRONIZE } FLT_PREOP_CALLBACK_STATUS;
+typedef enum { FLT_POSTOP_FINISHED_PROCESSING, FLT_POSTOP_MORE_PROCESSING_REQUIRED } FLT_POSTOP_CALLBACK_STATUS;
+typedef union _FLT_PARAMETERS {
+	struct { PVOID SecurityContext; ULONG Options; USHORT FileAttributes; USHORT ShareAccess; ULONG EaLength; PVOID EaBuffer; LARGE_INTEGER AllocationSize; } Create;
+	struct { ULONG Length; ULONG Key; LARGE_INTEGER ByteOffset; PVOID ReadBuffer; PMDL MdlAddress; } Read;
+	struct { ULONG Length; ULONG Key; LARGE_INTEGER ByteOffset; PVOID WriteBuffer; PMDL MdlAddress; } Write;
+	struct { ULONG Length; FILE_INFORMATION_CLASS FileInformationClass; PVOID ParentOfTarget; union { struct { BOOLEAN ReplaceIfExists; BOOLEAN AdvanceOnly; }; ULONG ClusterCount; HANDLE DeleteHandle; }; PVOID InfoBuffer; } SetFileInformation;
+	struct { ULONG Length; FILE_INFORMATION_CLASS FileInformationClass; PVOID InfoBuffer; } QueryFileInformation;
+	union { struct { ULONG OutputBufferLength; ULONG InputBufferLength; ULONG FsControlCode; } Common; } FileSystemControl;
+} FLT_PARAMETERS;
+typedef struct _FLT_IO_PARAMETER_BLOCK { ULONG IrpFlags; UCHAR MajorFunction, MinorFunction, OperationFlags, Reserved; PFILE_OBJECT TargetFileObject; PFLT_INSTANCE TargetInstance; FLT_PARAMETERS Parameters; } FLT_IO_PARAMETER_BLOCK, *PFLT_IO_PARAMETER_BLOCK;
+typedef struct _FLT_CALLBACK_DATA { ULONG Flags; PKTHREAD Thread; PFLT_IO_PARAMETER_BLOCK Iopb; IO_STATUS_BLOCK IoStatus; UCHAR RequestorMode; } FLT_CALLBACK_DATA, *PFLT_CALLBACK_DATA;
+typedef struct _FLT_RELATED_OBJECTS { USHORT Size, TransactionContext; PFLT_FILTER Filter; PFLT_VOLUME Volume; PFLT_INSTANCE Instance; PFILE_OBJECT FileObject; } FLT_RELATED_OBJECTS, *PFLT_RELATED_OBJECTS;
+typedef const FLT_RELATED_OBJECTS *PCFLT_RELATED_OBJECTS;
+typedef struct _FLT_FILE_NAME_INFORMATION { USHORT Size; ULONG NamesParsed; ULONG Format; UNICODE_STRING Name, Volume, Share, Extension, Stream, FinalComponent, ParentDir; } FLT_FILE_NAME_INFORMATION, *PFLT_FILE_NAME_INFORMATION;
+typedef struct _FLT_VOLUME_PROPERTIES { DEVICE_TYPE DeviceType; ULONG DeviceCharacteristics, DeviceObjectFlags; ULONG AlignmentRequirement; USHORT SectorSize; USHORT Flags; UNICODE_STRING FileSystemDriverName, FileSystemDeviceName, RealDeviceName; } FLT_VOLUME_PROPERTIES, *PFLT_VOLUME_PROPERTIES;
+typedef FLT_PREOP_CALLBACK_STATUS (*PFLT_PRE_OPERATION_CALLBACK)(PFLT_CALLBACK_DATA, PCFLT_RELATED_OBJECTS, PVOID*);
+typedef FLT_POSTOP_CALLBACK_STATUS (*PFLT_POST_OPERATION_CALLBACK)(PFLT_CALLBACK_DATA, PCFLT_RELATED_OBJECTS, PVOID, FLT_POST_OPERATION_FLAGS);
+typedef VOID (*PFLT_CONTEXT_CLEANUP_CALLBACK)(PFLT_CONTEXT, FLT_CONTEXT_TYPE);
+typedef VOID (*PFLT_COMPLETE_LOCK_CALLBACK_DATA_ROUTINE)(PVOID, PFLT_CALLBACK_DATA);
+typedef VOID FLT_DEFERRED_IO_WORKITEM_ROUTINE(PFLT_DEFERRED_IO_WORKITEM, PFLT_CALLBACK_DATA, PVOID); typedef FLT_DEFERRED_IO_WORKITEM_ROUTINE *PFLT_DEFERRED_IO_WORKITEM_ROUTINE;
+typedef VOID FLT_GENERIC_WORKITEM_ROUTINE(PFLT_GENERIC_WORKITEM, PVOID, PVOID); typedef FLT_GENERIC_WORKITEM_ROUTINE *PFLT_GENERIC_WORKITEM_ROUTINE;
+typedef struct _FLT_OPERATION_REGISTRATION { UCHAR MajorFunction; ULONG Flags; PFLT_PRE_OPERATION_CALLBACK PreOperation; PFLT_POST_OPERATION_CALLBACK PostOperation; PVOID Reserved1; } FLT_OPERATION_REGISTRATION;
+typedef struct _FLT_CONTEXT_REGISTRATION { FLT_CONTEXT_TYPE ContextType; USHORT Flags; PFLT_CONTEXT_CLEANUP_CALLBACK ContextCleanupCallback; SIZE_T Size; ULONG PoolTag; PVOID a, b, c; } FLT_CONTEXT_REGISTRATION;
+typedef struct _FLT_REGISTRATION { USHORT Size, Version; ULONG Flags; const FLT_CONTEXT_REGISTRATION *ContextRegistration; const FLT_OPERATION_REGISTRATION *OperationRegistration; PVOID FilterUnloadCallback, InstanceSetupCallback, InstanceQueryTeardownCallback, InstanceTeardownStartCallback, InstanceTeardownCompleteCallback, a, b, c, d, e; } FLT_REGISTRATION;
+typedef NTSTATUS (*PFLT_CONNECT_NOTIFY)(PFLT_PORT, PVOID, PVOID, ULONG, PVOID*); typedef VOID (*PFLT_DISCONNECT_NOTIFY)(PVOID);
+typedef NTSTATUS (*PFLT_MESSAGE_NOTIFY)(PVOID, PVOID, ULONG, PVOID, ULONG, PULONG);
+typedef VOID (*PFLT_CALLBACK_DATA_QUEUE_COMPLETE)(PVOID);
+NTSTATUS FltRegisterFilter(PDRIVER_OBJECT, const FLT_REGISTRATION*, PFLT_FILTER*); VOID FltUnregisterFilter(PFLT_FILTER); NTSTATUS FltStartFiltering(PFLT_FILTER);
+NTSTATUS FltAllocateContext(PFLT_FILTER, FLT_CONTEXT_TYPE, SIZE_T, POOL_TYPE, PFLT_CONTEXT*); VOID FltReleaseContext(PFLT_CONTEXT); VOID FltDeleteContext(PFLT_CONTEXT); VOID FltReferenceContext(PFLT_CONTEXT);
+NTSTATUS FltGetStreamContext(PFLT_INSTANCE, PFILE_OBJECT, PVOID); NTSTATUS FltSetStreamContext(PFLT_INSTANCE, PFILE_OBJECT, ULONG, PFLT_CONTEXT, PVOID);
+NTSTATUS FltGetVolumeContext(PFLT_FILTER, PFLT_VOLUME, PVOID); NTSTATUS FltSetVolumeContext(PFLT_VOLUME, ULONG, PFLT_CONTEXT, PVOID);
+NTSTATUS FltGetStreamHandleContext(PFLT_INSTANCE, PFILE_OBJECT, PVOID); NTSTATUS FltSetStreamHandleContext(PFLT_INSTANCE, PFILE_OBJECT, ULONG, PFLT_CONTEXT, PVOID);
+NTSTATUS FltGetVolumeProperties(PFLT_VOLUME, PFLT_VOLUME_PROPERTIES, ULONG, PULONG); NTSTATUS FltGetDiskDeviceObject(PFLT_VOLUME, PDEVICE_OBJECT*);
+NTSTATUS FltEnumerateVolumes(PFLT_FILTER, PFLT_VOLUME*, ULONG, PULONG); VOID FltObjectDereference(PVOID);
+NTSTATUS FltIsDirectory(PFILE_OBJECT, PFLT_INSTANCE, PBOOLEAN);
+NTSTATUS FltGetFileNameInformation(PFLT_CALLBACK_DATA, FLT_FILE_NAME_OPTIONS, PFLT_FILE_NAME_INFORMATION*); VOID FltReleaseFileNameInformation(PFLT_FILE_NAME_INFORMATION); NTSTATUS FltParseFileNameInformation(PFLT_FILE_NAME_INFORMATION);
+NTSTATUS FltQueryInformationFile(PFLT_INSTANCE, PFILE_OBJECT, PVOID, ULONG, FILE_INFORMATION_CLASS, PULONG); NTSTATUS FltSetInformationFile(PFLT_INSTANCE, PFILE_OBJECT, PVOID, ULONG, FILE_INFORMATION_CLASS);
+NTSTATUS FltReadFile(PFLT_INSTANCE, PFILE_OBJECT, PLARGE_INTEGER, ULONG, PVOID, ULONG, PULONG, PVOID, PVOID);
+NTSTATUS FltWriteFile(PFLT_INSTANCE, PFILE_OBJECT, PLARGE_INTEGER, ULONG, PVOID, ULONG, PULONG, PVOID, PVOID);
+NTSTATUS FltCreateFileEx(PFLT_FILTER, PFLT_INSTANCE, PHANDLE, PFILE_OBJECT*, ACCESS_MASK, POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, PLARGE_INTEGER, ULONG, ULONG, ULONG, ULONG, PVOID, ULONG, ULONG); NTSTATUS FltClose(HANDLE);
+VOID FltSetCallbackDataDirty(PFLT_CALLBACK_DATA); NTSTATUS FltLockUserBuffer(PFLT_CALLBACK_DATA);
+BOOLEAN FltDoCompletionProcessingWhenSafe(PFLT_CALLBACK_DATA, PCFLT_RELATED_OBJECTS, PVOID, FLT_POST_OPERATION_FLAGS, PFLT_POST_OPERATION_CALLBACK, FLT_POSTOP_CALLBACK_STATUS*);
+PFLT_DEFERRED_IO_WORKITEM FltAllocateDeferredIoWorkItem(void); VOID FltFreeDeferredIoWorkItem(PFLT_DEFERRED_IO_WORKITEM);
+NTSTATUS FltQueueDeferredIoWorkItem(PFLT_DEFERRED_IO_WORKITEM, PFLT_CALLBACK_DATA, PFLT_DEFERRED_IO_WORKITEM_ROUTINE, WORK_QUEUE_TYPE, PVOID);
+PFLT_GENERIC_WORKITEM FltAllocateGenericWorkItem(void); VOID FltFreeGenericWorkItem(PFLT_GENERIC_WORKITEM);
+NTSTATUS FltQueueGenericWorkItem(PFLT_GENERIC_WORKITEM, PVOID, PFLT_GENERIC_WORKITEM_ROUTINE, WORK_QUEUE_TYPE, PVOID);
+VOID FltCompletePendedPostOperation(PFLT_CALLBACK_DATA); VOID FltCompletePendedPreOperation(PFLT_CALLBACK_DATA, FLT_PREOP_CALLBACK_STATUS, PVOID);
+NTSTATUS FltRequestOperationStatusCallback(PFLT_CALLBACK_DATA, PVOID, PVOID); const char *FltGetIrpName(UCHAR);
+NTSTATUS FltBuildDefaultSecurityDescriptor(PSECURITY_DESCRIPTOR*, ACCESS_MASK); VOID FltFreeSecurityDescriptor(PSECURITY_DESCRIPTOR);
+NTSTATUS FltCreateCommunicationPort(PFLT_FILTER, PFLT_PORT*, POBJECT_ATTRIBUTES, PVOID, PFLT_CONNECT_NOTIFY, PFLT_DISCONNECT_NOTIFY, PFLT_MESSAGE_NOTIFY, LONG);
+VOID FltCloseCommunicationPort(PFLT_PORT); VOID FltCloseClientPort(PFLT_FILTER, PFLT_PORT*);
+PEPROCESS FltGetRequestorProcess(PFLT_CALLBACK_DATA); ULONG FltGetRequestorProcessId(PFLT_CALLBACK_DATA); HANDLE FltGetRequestorProcessIdEx(PFLT_CALLBACK_DATA);
+NTSTATUS FltGetFileContext(PFLT_INSTANCE, PFILE_OBJECT, PVOID);
+#define IRP_MJ_OPERATION_END 0x80
+#define FILE_WRITE_TO_END_OF_FILE 0xffffffff
+#define FO_SYNCHRONOUS_IO 2
+#define IO_NO_INCREMENT 0
+#define RTL_FIELD_SIZE(t,f) (sizeof(((t*)0)->f))
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005)
+#define NTKERNELAPI
+NTSTATUS PsLookupProcessByProcessId(HANDLE, PEPROCESS*); HANDLE PsGetCurrentThreadId(void); PKTHREAD KeGetCurrentThread(void);
+#define SL_OPEN_PAGING_FILE 0x02
+VOID FltReferenceContext(PVOID);
+#define MAXLONGLONG (0x7fffffffffffffffLL)
+VOID InitializeListHead(PLIST_ENTRY); VOID InsertTailList(PLIST_ENTRY, PLIST_ENTRY); BOOLEAN RemoveEntryList(PLIST_ENTRY); BOOLEAN IsListEmpty(PLIST_ENTRY);
+typedef struct _FILE_NETWORK_OPEN_INFORMATION { LARGE_INTEGER CreationTime, LastAccessTime, LastWriteTime, ChangeTime, AllocationSize, EndOfFile; ULONG FileAttributes; } FILE_NETWORK_OPEN_INFORMATION, *PFILE_NETWORK_OPEN_INFORMATION;
+#define FileNetworkOpenInformation ((FILE_INFORMATION_CLASS)34)
+LONG InterlockedExchange(volatile LONG*, LONG);
+#define FILE_USE_FILE_POINTER_POSITION 0xfffffffe
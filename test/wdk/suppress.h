@@ -0,0 +1,5 @@
+#pragma once
+
+//
+//  Empty: the driver uses nothing from suppress.h that the tests reach.
+//
@@ -0,0 +1,1013 @@
+/*++
+
+Module Name:
+
+    wdk.c
+
+Abstract:
+
+    Threaded user mode stand-ins for the kernel routines of fltKernel.h,
+    for the tests that run driver modules on many threads.  Every routine
+    is weak, so a test overrides what it mocks; filter manager routines
+    are left to the tests.
+
+    IRQL is per thread.  Raising to DISPATCH_LEVEL takes one of
+    Wdk_CpuCount virtual processors, the thread's own if free, so code
+    at DISPATCH_LEVEL owns its processor number as in the kernel: what a
+    driver keeps per processor is never touched by two threads at once.
+
+    Pool blocks below a page are 16 byte aligned and never 64, larger
+    ones page aligned, and both come filled with 0xCD, so code relying
+    on more than the pool guarantees fails here too.  The bytes live per
+    pool tag are counted, for leak checks.
+
+--*/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wctype.h>
+#include <sys/random.h>
+
+#include "wdk.h"
+
+#define WEAK __attribute__((weak))
+
+//
+//  Virtual processors
+//
+
+static pthread_mutex_t g_WdkCpu[MAXIMUM_PROCESSORS] ;
+static ULONG g_WdkCpuCount ;
+static pthread_once_t g_WdkOnce = PTHREAD_ONCE_INIT ;
+static volatile ULONG g_WdkNextCpu ;
+
+static __thread KIRQL t_Irql ;
+static __thread LONG t_HeldCpu = -1 ;
+static __thread LONG t_HomeCpu = -1 ;
+
+static void
+WdkInit(void)
+{
+	const char *env = getenv("WDK_CPUS") ;
+	long n = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN) ;
+	ULONG i ;
+
+	g_WdkCpuCount = (ULONG)(n < 1 ? 1 : n > MAXIMUM_PROCESSORS ? MAXIMUM_PROCESSORS : n) ;
+
+	for (i = 0; i < MAXIMUM_PROCESSORS; i++)
+		pthread_mutex_init(&g_WdkCpu[i], NULL) ;
+}
+
+ULONG
+Wdk_CpuCount(void)
+{
+	pthread_once(&g_WdkOnce, WdkInit) ;
+	return g_WdkCpuCount ;
+}
+
+static LONG
+WdkHomeCpu(void)
+{
+	if (t_HomeCpu < 0)
+		t_HomeCpu = (LONG)(__atomic_fetch_add(&g_WdkNextCpu, 1, __ATOMIC_RELAXED) % Wdk_CpuCount()) ;
+
+	return t_HomeCpu ;
+}
+
+//the home processor if free, any free one, else waits for the home one
+static void
+WdkTakeCpu(void)
+{
+	LONG home = WdkHomeCpu() ;
+	ULONG i ;
+
+	for (i = 0; i < g_WdkCpuCount; i++)
+	{
+		LONG cpu = (LONG)((home + i) % g_WdkCpuCount) ;
+
+		if (pthread_mutex_trylock(&g_WdkCpu[cpu]) == 0)
+		{
+			t_HeldCpu = cpu ;
+			return ;
+		}
+	}
+
+	pthread_mutex_lock(&g_WdkCpu[home]) ;
+	t_HeldCpu = home ;
+}
+
+WEAK KIRQL KeGetCurrentIrql(void) { return t_Irql ; }
+
+WEAK VOID
+KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql)
+{
+	*OldIrql = t_Irql ;
+
+	if (NewIrql >= DISPATCH_LEVEL && t_Irql < DISPATCH_LEVEL)
+		WdkTakeCpu() ;
+
+	if (NewIrql > t_Irql)
+		t_Irql = NewIrql ;
+}
+
+WEAK KIRQL
+KeRaiseIrqlToDpcLevel(void)
+{
+	KIRQL old ;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &old) ;
+	return old ;
+}
+
+WEAK VOID
+KeLowerIrql(KIRQL NewIrql)
+{
+	if (NewIrql < DISPATCH_LEVEL && t_Irql >= DISPATCH_LEVEL)
+	{
+		pthread_mutex_unlock(&g_WdkCpu[t_HeldCpu]) ;
+		t_HeldCpu = -1 ;
+	}
+
+	t_Irql = NewIrql ;
+}
+
+WEAK ULONG
+KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER Number)
+{
+	ULONG cpu = (ULONG)(t_HeldCpu >= 0 ? t_HeldCpu : WdkHomeCpu()) ;
+
+	if (Number != NULL)
+	{
+		Number->Group = 0 ;
+		Number->Number = (UCHAR)cpu ;
+		Number->Reserved = 0 ;
+	}
+
+	return cpu ;
+}
+
+WEAK ULONG KeGetCurrentProcessorNumber(void) { return KeGetCurrentProcessorNumberEx(NULL) ; }
+WEAK ULONG KeQueryMaximumProcessorCountEx(USHORT Group) { (void)Group ; return Wdk_CpuCount() ; }
+WEAK ULONG KeQueryActiveProcessorCountEx(USHORT Group) { (void)Group ; return Wdk_CpuCount() ; }
+
+WEAK VOID KeEnterCriticalRegion(void) { }
+WEAK VOID KeLeaveCriticalRegion(void) { }
+WEAK NTSTATUS KeSaveExtendedProcessorState(ULONG64 Mask, XSTATE_SAVE *Save) { (void)Mask ; (void)Save ; return STATUS_SUCCESS ; }
+WEAK VOID KeRestoreExtendedProcessorState(XSTATE_SAVE *Save) { (void)Save ; }
+
+//
+//  Interlocked and barriers
+//
+
+WEAK LONG InterlockedIncrement(volatile LONG *p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+WEAK LONG InterlockedDecrement(volatile LONG *p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+WEAK LONG InterlockedExchange(volatile LONG *p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG InterlockedExchangeAdd(volatile LONG *p, LONG v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG InterlockedOr(volatile LONG *p, LONG v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG InterlockedAnd(volatile LONG *p, LONG v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG InterlockedCompareExchange(volatile LONG *p, LONG x, LONG c) { __atomic_compare_exchange_n(p, &c, x, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ; return c ; }
+WEAK LONG64 InterlockedIncrement64(volatile LONG64 *p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+WEAK LONG64 InterlockedDecrement64(volatile LONG64 *p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST) ; }
+WEAK LONG64 InterlockedExchange64(volatile LONG64 *p, LONG64 v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG64 InterlockedExchangeAdd64(volatile LONG64 *p, LONG64 v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG64 InterlockedOr64(volatile LONG64 *p, LONG64 v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK LONG64 InterlockedCompareExchange64(volatile LONG64 *p, LONG64 x, LONG64 c) { __atomic_compare_exchange_n(p, &c, x, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ; return c ; }
+WEAK PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST) ; }
+WEAK PVOID InterlockedCompareExchangePointer(PVOID volatile *p, PVOID x, PVOID c) { __atomic_compare_exchange_n(p, &c, x, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ; return c ; }
+
+WEAK LONG ReadNoFence(const volatile LONG *p) { return __atomic_load_n(p, __ATOMIC_RELAXED) ; }
+WEAK LONG ReadAcquire(const volatile LONG *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE) ; }
+WEAK ULONG ReadULongAcquire(const volatile ULONG *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE) ; }
+WEAK LONG64 ReadNoFence64(const volatile LONG64 *p) { return __atomic_load_n(p, __ATOMIC_RELAXED) ; }
+WEAK LONG64 ReadAcquire64(const volatile LONG64 *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE) ; }
+WEAK VOID WriteNoFence(volatile LONG *p, LONG v) { __atomic_store_n(p, v, __ATOMIC_RELAXED) ; }
+WEAK VOID WriteRelease(volatile LONG *p, LONG v) { __atomic_store_n(p, v, __ATOMIC_RELEASE) ; }
+WEAK VOID WriteRelease64(volatile LONG64 *p, LONG64 v) { __atomic_store_n(p, v, __ATOMIC_RELEASE) ; }
+
+WEAK VOID KeMemoryBarrier(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST) ; }
+WEAK VOID _ReadWriteBarrier(void) { __asm__ __volatile__("" ::: "memory") ; }
+
+//threads outnumber processors in the stress tests, spinning would starve
+//the holder
+WEAK VOID YieldProcessor(void) { sched_yield() ; }
+
+WEAK VOID
+KeStallExecutionProcessor(ULONG MicroSeconds)
+{
+	struct timespec t = { MicroSeconds / 1000000, (MicroSeconds % 1000000) * 1000L } ;
+
+	nanosleep(&t, NULL) ;
+}
+
+//
+//  SLIST: A[0] is the first entry, A[1] the depth and a lock bit
+//
+
+#define WDK_SLIST_LOCK (1ULL << 63)
+
+static void
+WdkSListLock(PSLIST_HEADER Head)
+{
+	while (__atomic_fetch_or(&Head->A[1], WDK_SLIST_LOCK, __ATOMIC_ACQUIRE) & WDK_SLIST_LOCK)
+		sched_yield() ;
+}
+
+static void
+WdkSListUnlock(PSLIST_HEADER Head)
+{
+	__atomic_fetch_and(&Head->A[1], ~WDK_SLIST_LOCK, __ATOMIC_RELEASE) ;
+}
+
+WEAK VOID InitializeSListHead(PSLIST_HEADER Head) { Head->A[0] = Head->A[1] = 0 ; }
+WEAK USHORT QueryDepthSList(PSLIST_HEADER Head) { return (USHORT)(__atomic_load_n(&Head->A[1], __ATOMIC_RELAXED) & 0xFFFF) ; }
+
+WEAK PSLIST_ENTRY
+InterlockedPushEntrySList(PSLIST_HEADER Head, PSLIST_ENTRY Entry)
+{
+	PSLIST_ENTRY first ;
+
+	WdkSListLock(Head) ;
+	first = (PSLIST_ENTRY)Head->A[0] ;
+	Entry->Next = first ;
+	Head->A[0] = (ULONGLONG)Entry ;
+	Head->A[1]++ ;
+	WdkSListUnlock(Head) ;
+
+	return first ;
+}
+
+WEAK PSLIST_ENTRY
+InterlockedPopEntrySList(PSLIST_HEADER Head)
+{
+	PSLIST_ENTRY first ;
+
+	WdkSListLock(Head) ;
+	first = (PSLIST_ENTRY)Head->A[0] ;
+	if (first != NULL)
+	{
+		Head->A[0] = (ULONGLONG)first->Next ;
+		Head->A[1]-- ;
+	}
+	WdkSListUnlock(Head) ;
+
+	return first ;
+}
+
+WEAK PSLIST_ENTRY
+InterlockedFlushSList(PSLIST_HEADER Head)
+{
+	PSLIST_ENTRY first ;
+
+	WdkSListLock(Head) ;
+	first = (PSLIST_ENTRY)Head->A[0] ;
+	Head->A[0] = 0 ;
+	Head->A[1] &= WDK_SLIST_LOCK ;
+	WdkSListUnlock(Head) ;
+
+	return first ;
+}
+
+//
+//  Spin locks
+//
+
+WEAK VOID KeInitializeSpinLock(PKSPIN_LOCK Lock) { *Lock = 0 ; }
+
+WEAK VOID
+KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK Lock)
+{
+	while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0)
+		sched_yield() ;
+}
+
+WEAK VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK Lock) { __atomic_store_n(Lock, 0, __ATOMIC_RELEASE) ; }
+
+WEAK VOID
+KeAcquireSpinLock(PKSPIN_LOCK Lock, PKIRQL OldIrql)
+{
+	KeRaiseIrql(DISPATCH_LEVEL, OldIrql) ;
+	KeAcquireSpinLockAtDpcLevel(Lock) ;
+}
+
+WEAK VOID
+KeReleaseSpinLock(PKSPIN_LOCK Lock, KIRQL OldIrql)
+{
+	KeReleaseSpinLockFromDpcLevel(Lock) ;
+	KeLowerIrql(OldIrql) ;
+}
+
+//x[0] the lock, x[1] the IRQL to return to
+WEAK VOID
+KeAcquireInStackQueuedSpinLock(PKSPIN_LOCK Lock, PKLOCK_QUEUE_HANDLE Handle)
+{
+	KIRQL old ;
+
+	KeAcquireSpinLock(Lock, &old) ;
+	Handle->x[0] = (ULONG_PTR)Lock ;
+	Handle->x[1] = old ;
+}
+
+WEAK VOID
+KeReleaseInStackQueuedSpinLock(PKLOCK_QUEUE_HANDLE Handle)
+{
+	KeReleaseSpinLock((PKSPIN_LOCK)Handle->x[0], (KIRQL)Handle->x[1]) ;
+}
+
+//
+//  Resources and fast mutexes: a zeroed pthread lock is an initialized one
+//
+
+C_ASSERT(sizeof(pthread_rwlock_t) <= sizeof(ERESOURCE)) ;
+C_ASSERT(sizeof(pthread_mutex_t) + sizeof(ULONG_PTR) <= sizeof(FAST_MUTEX)) ;
+
+WEAK NTSTATUS ExInitializeResourceLite(PERESOURCE Resource) { pthread_rwlock_init((pthread_rwlock_t *)Resource, NULL) ; return STATUS_SUCCESS ; }
+WEAK NTSTATUS ExDeleteResourceLite(PERESOURCE Resource) { pthread_rwlock_destroy((pthread_rwlock_t *)Resource) ; return STATUS_SUCCESS ; }
+
+WEAK BOOLEAN
+ExAcquireResourceExclusiveLite(PERESOURCE Resource, BOOLEAN Wait)
+{
+	if (!Wait)
+		return pthread_rwlock_trywrlock((pthread_rwlock_t *)Resource) == 0 ;
+
+	pthread_rwlock_wrlock((pthread_rwlock_t *)Resource) ;
+	return TRUE ;
+}
+
+WEAK BOOLEAN
+ExAcquireResourceSharedLite(PERESOURCE Resource, BOOLEAN Wait)
+{
+	if (!Wait)
+		return pthread_rwlock_tryrdlock((pthread_rwlock_t *)Resource) == 0 ;
+
+	pthread_rwlock_rdlock((pthread_rwlock_t *)Resource) ;
+	return TRUE ;
+}
+
+WEAK VOID ExReleaseResourceLite(PERESOURCE Resource) { pthread_rwlock_unlock((pthread_rwlock_t *)Resource) ; }
+WEAK BOOLEAN ExIsResourceAcquiredExclusiveLite(PERESOURCE Resource) { (void)Resource ; return TRUE ; }
+WEAK ULONG ExIsResourceAcquiredSharedLite(PERESOURCE Resource) { (void)Resource ; return 1 ; }
+
+//the mutex, then the IRQL to return to
+WEAK VOID ExInitializeFastMutex(PFAST_MUTEX Mutex) { memset(Mutex, 0, sizeof(*Mutex)) ; pthread_mutex_init((pthread_mutex_t *)Mutex, NULL) ; }
+
+WEAK VOID
+ExAcquireFastMutex(PFAST_MUTEX Mutex)
+{
+	KIRQL old = t_Irql ;
+
+	pthread_mutex_lock((pthread_mutex_t *)Mutex) ;
+	t_Irql = APC_LEVEL ;
+	Mutex->x[ARRAYSIZE(Mutex->x) - 1] = old ;
+}
+
+WEAK VOID
+ExReleaseFastMutex(PFAST_MUTEX Mutex)
+{
+	t_Irql = (KIRQL)Mutex->x[ARRAYSIZE(Mutex->x) - 1] ;
+	pthread_mutex_unlock((pthread_mutex_t *)Mutex) ;
+}
+
+//
+//  Events, and the objects waited on: threads start with their exit event
+//
+
+static pthread_mutex_t g_WdkEventLock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t g_WdkEventCond = PTHREAD_COND_INITIALIZER ;
+
+//x[0] signaled, x[1] EVENT_TYPE
+WEAK VOID
+KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+	Event->x[0] = State ;
+	Event->x[1] = Type ;
+}
+
+WEAK LONG
+KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait)
+{
+	LONG old ;
+
+	(void)Increment ; (void)Wait ;
+
+	pthread_mutex_lock(&g_WdkEventLock) ;
+	old = (LONG)Event->x[0] ;
+	Event->x[0] = 1 ;
+	pthread_cond_broadcast(&g_WdkEventCond) ;
+	pthread_mutex_unlock(&g_WdkEventLock) ;
+
+	return old ;
+}
+
+WEAK LONG
+KeResetEvent(PKEVENT Event)
+{
+	LONG old ;
+
+	pthread_mutex_lock(&g_WdkEventLock) ;
+	old = (LONG)Event->x[0] ;
+	Event->x[0] = 0 ;
+	pthread_mutex_unlock(&g_WdkEventLock) ;
+
+	return old ;
+}
+
+WEAK VOID KeClearEvent(PKEVENT Event) { KeResetEvent(Event) ; }
+
+//Timeout in 100 ns units, relative if negative; absolute ones are taken as
+//relative to now, the tests only pass relative ones
+WEAK NTSTATUS
+KeWaitForSingleObject(PVOID Object, KWAIT_REASON Reason, ULONG Mode, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	PKEVENT event = Object ;
+	struct timespec deadline ;
+	NTSTATUS status = STATUS_SUCCESS ;
+
+	(void)Reason ; (void)Mode ; (void)Alertable ;
+
+	if (Timeout != NULL)
+	{
+		LONGLONG ns = (Timeout->QuadPart < 0 ? -Timeout->QuadPart : Timeout->QuadPart) * 100 ;
+
+		clock_gettime(CLOCK_REALTIME, &deadline) ;
+		deadline.tv_sec += ns / 1000000000 + (deadline.tv_nsec + ns % 1000000000) / 1000000000 ;
+		deadline.tv_nsec = (deadline.tv_nsec + ns % 1000000000) % 1000000000 ;
+	}
+
+	pthread_mutex_lock(&g_WdkEventLock) ;
+
+	while (event->x[0] == 0)
+	{
+		if (Timeout == NULL)
+		{
+			pthread_cond_wait(&g_WdkEventCond, &g_WdkEventLock) ;
+		}
+		else if (pthread_cond_timedwait(&g_WdkEventCond, &g_WdkEventLock, &deadline) != 0 && event->x[0] == 0)
+		{
+			status = STATUS_TIMEOUT ;
+			break ;
+		}
+	}
+
+	if (status == STATUS_SUCCESS && event->x[1] == SynchronizationEvent)
+		event->x[0] = 0 ;
+
+	pthread_mutex_unlock(&g_WdkEventLock) ;
+
+	return status ;
+}
+
+//
+//  System threads.  The handle and the object are the same; the thread
+//  holds a reference until it exits
+//
+
+#define WDK_THREAD_MAGIC 0x44524854
+
+typedef struct _WDK_THREAD {
+
+	KEVENT Exited ;
+	ULONG Magic ;
+	volatile LONG References ;
+	PKSTART_ROUTINE Routine ;
+	PVOID Context ;
+
+} WDK_THREAD, *PWDK_THREAD ;
+
+static __thread PWDK_THREAD t_Thread ;
+
+static void
+WdkDereferenceThread(PWDK_THREAD Thread)
+{
+	if (__atomic_sub_fetch(&Thread->References, 1, __ATOMIC_ACQ_REL) == 0)
+		free(Thread) ;
+}
+
+static void
+WdkExitThread(void)
+{
+	PWDK_THREAD thread = t_Thread ;
+
+	KeSetEvent(&thread->Exited, 0, FALSE) ;
+	WdkDereferenceThread(thread) ;
+}
+
+static void *
+WdkThreadStart(void *Parameter)
+{
+	t_Thread = Parameter ;
+	t_Thread->Routine(t_Thread->Context) ;
+	WdkExitThread() ;
+
+	return NULL ;
+}
+
+WEAK NTSTATUS
+PsCreateSystemThread(PHANDLE Handle, ULONG Access, POBJECT_ATTRIBUTES Attributes, HANDLE Process, PVOID ClientId, PKSTART_ROUTINE Routine, PVOID Context)
+{
+	PWDK_THREAD thread = calloc(1, sizeof(WDK_THREAD)) ;
+	pthread_attr_t attr ;
+	pthread_t id ;
+	int error ;
+
+	(void)Access ; (void)Attributes ; (void)Process ; (void)ClientId ;
+
+	if (thread == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES ;
+
+	KeInitializeEvent(&thread->Exited, NotificationEvent, FALSE) ;
+	thread->Magic = WDK_THREAD_MAGIC ;
+	thread->References = 2 ;
+	thread->Routine = Routine ;
+	thread->Context = Context ;
+
+	pthread_attr_init(&attr) ;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) ;
+	error = pthread_create(&id, &attr, WdkThreadStart, thread) ;
+	pthread_attr_destroy(&attr) ;
+
+	if (error != 0)
+	{
+		free(thread) ;
+		return STATUS_INSUFFICIENT_RESOURCES ;
+	}
+
+	*Handle = thread ;
+	return STATUS_SUCCESS ;
+}
+
+WEAK NTSTATUS
+PsTerminateSystemThread(NTSTATUS ExitStatus)
+{
+	(void)ExitStatus ;
+
+	WdkExitThread() ;
+	pthread_exit(NULL) ;
+}
+
+WEAK NTSTATUS
+ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK Access, PVOID Type, int Mode, PVOID *Object, PVOID Info)
+{
+	(void)Access ; (void)Type ; (void)Mode ; (void)Info ;
+
+	ObReferenceObject(Handle) ;
+	*Object = Handle ;
+	return STATUS_SUCCESS ;
+}
+
+//only threads are counted, other objects are the tests' own
+WEAK VOID
+ObReferenceObject(PVOID Object)
+{
+	PWDK_THREAD thread = Object ;
+
+	if (thread->Magic == WDK_THREAD_MAGIC)
+		__atomic_add_fetch(&thread->References, 1, __ATOMIC_RELAXED) ;
+}
+
+WEAK VOID
+ObDereferenceObject(PVOID Object)
+{
+	PWDK_THREAD thread = Object ;
+
+	if (thread->Magic == WDK_THREAD_MAGIC)
+		WdkDereferenceThread(thread) ;
+}
+
+WEAK NTSTATUS ZwClose(HANDLE Handle) { ObDereferenceObject(Handle) ; return STATUS_SUCCESS ; }
+
+WEAK NTSTATUS
+ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	return KeWaitForSingleObject(Handle, Executive, KernelMode, Alertable, Timeout) ;
+}
+
+WEAK HANDLE PsGetCurrentProcessId(void) { return (HANDLE)(ULONG_PTR)getpid() ; }
+WEAK HANDLE PsGetCurrentThreadId(void) { return (HANDLE)pthread_self() ; }
+WEAK PKTHREAD KeGetCurrentThread(void) { return (PKTHREAD)pthread_self() ; }
+
+typedef struct _WDK_RUN {
+
+	VOID (*Routine)(PVOID, ULONG) ;
+	PVOID Context ;
+	ULONG Index ;
+	pthread_barrier_t *Start ;
+
+} WDK_RUN, *PWDK_RUN ;
+
+static void *
+WdkRunStart(void *Parameter)
+{
+	PWDK_RUN run = Parameter ;
+
+	pthread_barrier_wait(run->Start) ;
+	run->Routine(run->Context, run->Index) ;
+
+	return NULL ;
+}
+
+//all threads are started before any runs, to contend from the first call
+VOID
+Wdk_RunThreads(ULONG Count, VOID (*Routine)(PVOID, ULONG), PVOID Context)
+{
+	pthread_barrier_t start ;
+	pthread_t *ids = calloc(Count, sizeof(pthread_t)) ;
+	PWDK_RUN runs = calloc(Count, sizeof(WDK_RUN)) ;
+	ULONG i ;
+
+	if (ids == NULL || runs == NULL)
+		abort() ;
+
+	pthread_barrier_init(&start, NULL, Count) ;
+
+	for (i = 0; i < Count; i++)
+	{
+		runs[i].Routine = Routine ;
+		runs[i].Context = Context ;
+		runs[i].Index = i ;
+		runs[i].Start = &start ;
+		if (pthread_create(&ids[i], NULL, WdkRunStart, &runs[i]) != 0)
+			abort() ;
+	}
+
+	for (i = 0; i < Count; i++)
+		pthread_join(ids[i], NULL) ;
+
+	pthread_barrier_destroy(&start) ;
+	free(runs) ;
+	free(ids) ;
+}
+
+//
+//  Pool and lookaside lists.  A header in front of each block records
+//  what was allocated, and the bytes live per tag are counted
+//
+
+typedef struct _WDK_POOL_HEADER {
+
+	PVOID Base ;
+	SIZE_T Length ;
+	ULONG Tag ;
+
+} WDK_POOL_HEADER, *PWDK_POOL_HEADER ;
+
+static struct {
+
+	volatile ULONG Tag ;
+	volatile LONG64 Bytes ;
+
+} g_WdkPoolTags[64] ;
+
+static volatile LONG64 *
+WdkPoolTagBytes(ULONG Tag)
+{
+	ULONG i ;
+
+	for (i = 0; i < ARRAYSIZE(g_WdkPoolTags); i++)
+	{
+		ULONG cur = __atomic_load_n(&g_WdkPoolTags[i].Tag, __ATOMIC_ACQUIRE) ;
+
+		if (cur == 0)
+		{
+			__atomic_compare_exchange_n(&g_WdkPoolTags[i].Tag, &cur, Tag, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ;
+			if (cur == 0)
+				cur = Tag ;
+		}
+
+		if (cur == Tag)
+			return &g_WdkPoolTags[i].Bytes ;
+	}
+
+	abort() ;
+}
+
+LONG64
+Wdk_PoolBytes(ULONG Tag)
+{
+	return __atomic_load_n(WdkPoolTagBytes(Tag), __ATOMIC_ACQUIRE) ;
+}
+
+WEAK PVOID
+ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Length, ULONG Tag)
+{
+	SIZE_T front = Length >= PAGE_SIZE ? PAGE_SIZE : 64 + 16 ;
+	PUCHAR base ;
+	PUCHAR p ;
+	PWDK_POOL_HEADER header ;
+
+	(void)Type ;
+
+	if (posix_memalign((void **)&base, Length >= PAGE_SIZE ? PAGE_SIZE : 64, front + Length) != 0)
+		return NULL ;
+
+	p = base + front ;
+	header = (PWDK_POOL_HEADER)p - 1 ;
+	header->Base = base ;
+	header->Length = Length ;
+	header->Tag = Tag ;
+	__atomic_add_fetch(WdkPoolTagBytes(Tag), (LONG64)Length, __ATOMIC_RELAXED) ;
+
+	memset(p, 0xCD, Length) ;
+
+	return p ;
+}
+
+WEAK VOID
+ExFreePoolWithTag(PVOID p, ULONG Tag)
+{
+	PWDK_POOL_HEADER header = (PWDK_POOL_HEADER)p - 1 ;
+
+	(void)Tag ;
+
+	if (p == NULL)
+		return ;
+
+	__atomic_sub_fetch(WdkPoolTagBytes(header->Tag), (LONG64)header->Length, __ATOMIC_RELAXED) ;
+
+	//a read of freed pool sees garbage, not what was there
+	memset(p, 0xDD, header->Length) ;
+	free(header->Base) ;
+}
+
+WEAK VOID ExFreePool(PVOID p) { ExFreePoolWithTag(p, 0) ; }
+
+//x[0] the entry size
+WEAK VOID ExInitializeNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID Allocate, PVOID Free, ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth) { (void)Allocate ; (void)Free ; (void)Flags ; (void)Tag ; (void)Depth ; List->x[0] = Size ; }
+WEAK VOID ExDeleteNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List) { (void)List ; }
+WEAK PVOID ExAllocateFromNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List) { return ExAllocatePoolWithTag(NonPagedPool, List->x[0], 0) ; }
+WEAK VOID ExFreeToNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID p) { (void)List ; ExFreePool(p) ; }
+WEAK VOID ExInitializePagedLookasideList(PPAGED_LOOKASIDE_LIST List, PVOID Allocate, PVOID Free, ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth) { (void)Allocate ; (void)Free ; (void)Flags ; (void)Tag ; (void)Depth ; List->x[0] = Size ; }
+WEAK VOID ExDeletePagedLookasideList(PPAGED_LOOKASIDE_LIST List) { (void)List ; }
+WEAK PVOID ExAllocateFromPagedLookasideList(PPAGED_LOOKASIDE_LIST List) { return ExAllocatePoolWithTag(PagedPool, List->x[0], 0) ; }
+WEAK VOID ExFreeToPagedLookasideList(PPAGED_LOOKASIDE_LIST List, PVOID p) { (void)List ; ExFreePool(p) ; }
+
+//
+//  Cache aware rundown protection: twice the references, and bit 0 set
+//  once rundown started
+//
+
+WEAK PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE Type, ULONG Tag) { (void)Type ; (void)Tag ; return calloc(1, sizeof(LONG64)) ; }
+WEAK VOID ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { free(Ref) ; }
+
+WEAK BOOLEAN
+ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref)
+{
+	volatile LONG64 *count = (volatile LONG64 *)Ref ;
+	LONG64 cur = __atomic_load_n(count, __ATOMIC_RELAXED) ;
+
+	do {
+		if (cur & 1)
+			return FALSE ;
+	} while (!__atomic_compare_exchange_n(count, &cur, cur + 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) ;
+
+	return TRUE ;
+}
+
+WEAK VOID ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { __atomic_sub_fetch((volatile LONG64 *)Ref, 2, __ATOMIC_RELEASE) ; }
+
+WEAK VOID
+ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref)
+{
+	volatile LONG64 *count = (volatile LONG64 *)Ref ;
+
+	__atomic_fetch_or(count, 1, __ATOMIC_ACQ_REL) ;
+
+	while (__atomic_load_n(count, __ATOMIC_ACQUIRE) != 1)
+		sched_yield() ;
+}
+
+WEAK VOID ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE Ref) { __atomic_store_n((volatile LONG64 *)Ref, 0, __ATOMIC_RELEASE) ; }
+
+//
+//  Memory, lists and MDLs
+//
+
+WEAK VOID RtlZeroMemory(PVOID Destination, SIZE_T Length) { memset(Destination, 0, Length) ; }
+WEAK VOID RtlSecureZeroMemory(PVOID Destination, SIZE_T Length) { memset(Destination, 0, Length) ; __asm__ __volatile__("" ::: "memory") ; }
+WEAK VOID RtlCopyMemory(PVOID Destination, const VOID *Source, SIZE_T Length) { memcpy(Destination, Source, Length) ; }
+WEAK VOID RtlMoveMemory(PVOID Destination, const VOID *Source, SIZE_T Length) { memmove(Destination, Source, Length) ; }
+WEAK VOID RtlFillMemory(PVOID Destination, SIZE_T Length, UCHAR Fill) { memset(Destination, Fill, Length) ; }
+WEAK BOOLEAN RtlEqualMemory(const VOID *a, const VOID *b, SIZE_T Length) { return memcmp(a, b, Length) == 0 ; }
+
+WEAK SIZE_T
+RtlCompareMemory(const VOID *a, const VOID *b, SIZE_T Length)
+{
+	SIZE_T i ;
+
+	for (i = 0; i < Length && ((const UCHAR *)a)[i] == ((const UCHAR *)b)[i]; i++)
+		;
+
+	return i ;
+}
+
+WEAK VOID InitializeListHead(PLIST_ENTRY Head) { Head->Flink = Head->Blink = Head ; }
+WEAK BOOLEAN IsListEmpty(PLIST_ENTRY Head) { return Head->Flink == Head ; }
+WEAK VOID InsertTailList(PLIST_ENTRY Head, PLIST_ENTRY Entry) { Entry->Flink = Head ; Entry->Blink = Head->Blink ; Head->Blink->Flink = Entry ; Head->Blink = Entry ; }
+WEAK BOOLEAN RemoveEntryList(PLIST_ENTRY Entry) { Entry->Blink->Flink = Entry->Flink ; Entry->Flink->Blink = Entry->Blink ; return Entry->Flink == Entry->Blink ; }
+
+WEAK PMDL
+IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN Secondary, BOOLEAN ChargeQuota, PVOID Irp)
+{
+	PMDL mdl = calloc(1, sizeof(MDL)) ;
+
+	(void)Secondary ; (void)ChargeQuota ; (void)Irp ;
+
+	if (mdl != NULL)
+	{
+		mdl->ByteCount = Length ;
+		mdl->StartVa = VirtualAddress ;
+	}
+
+	return mdl ;
+}
+
+WEAK VOID IoFreeMdl(PMDL Mdl) { free(Mdl) ; }
+WEAK VOID MmBuildMdlForNonPagedPool(PMDL Mdl) { (void)Mdl ; }
+WEAK PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority) { (void)Priority ; return Mdl->StartVa ; }
+WEAK PVOID MmGetMdlVirtualAddress(PMDL Mdl) { return Mdl->StartVa ; }
+WEAK ULONG MmGetMdlByteCount(PMDL Mdl) { return Mdl->ByteCount ; }
+WEAK VOID ProbeForRead(const VOID *Address, SIZE_T Length, ULONG Alignment) { (void)Address ; (void)Length ; (void)Alignment ; }
+WEAK VOID ProbeForWrite(PVOID Address, SIZE_T Length, ULONG Alignment) { (void)Address ; (void)Length ; (void)Alignment ; }
+
+//
+//  Time, in 100 ns units
+//
+
+static LONGLONG
+WdkNow(clockid_t Clock)
+{
+	struct timespec t ;
+
+	clock_gettime(Clock, &t) ;
+	return (LONGLONG)t.tv_sec * 10000000 + t.tv_nsec / 100 ;
+}
+
+WEAK ULONGLONG KeQueryInterruptTime(void) { return (ULONGLONG)WdkNow(CLOCK_MONOTONIC) ; }
+
+WEAK LARGE_INTEGER
+KeQueryPerformanceCounter(PLARGE_INTEGER Frequency)
+{
+	LARGE_INTEGER now ;
+
+	if (Frequency != NULL)
+		Frequency->QuadPart = 10000000 ;
+
+	now.QuadPart = WdkNow(CLOCK_MONOTONIC) ;
+	return now ;
+}
+
+//from 1601, as the system time is
+WEAK VOID KeQuerySystemTime(PLARGE_INTEGER Time) { Time->QuadPart = WdkNow(CLOCK_REALTIME) + 116444736000000000LL ; }
+
+//
+//  Processes, strings, random numbers and the debugger
+//
+
+static PCREATE_PROCESS_NOTIFY_ROUTINE g_WdkNotify ;
+
+WEAK NTSTATUS
+PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE Routine, BOOLEAN Remove)
+{
+	g_WdkNotify = Remove ? NULL : Routine ;
+	return STATUS_SUCCESS ;
+}
+
+VOID
+Wdk_NotifyProcess(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create)
+{
+	if (g_WdkNotify != NULL)
+		g_WdkNotify(ParentId, ProcessId, Create) ;
+}
+
+WEAK VOID
+RtlInitUnicodeString(PUNICODE_STRING String, PCWSTR Source)
+{
+	USHORT length = 0 ;
+
+	if (Source != NULL)
+	{
+		while (Source[length])
+			length++ ;
+	}
+
+	String->Buffer = (PWCH)Source ;
+	String->Length = (USHORT)(length * sizeof(WCHAR)) ;
+	String->MaximumLength = Source != NULL ? (USHORT)(String->Length + sizeof(WCHAR)) : 0 ;
+}
+
+WEAK VOID
+RtlCopyUnicodeString(PUNICODE_STRING Destination, PCUNICODE_STRING Source)
+{
+	USHORT length = 0 ;
+
+	if (Source != NULL)
+	{
+		length = min(Source->Length, Destination->MaximumLength) ;
+		memmove(Destination->Buffer, Source->Buffer, length) ;
+	}
+
+	Destination->Length = length ;
+}
+
+WEAK NTSTATUS
+RtlAppendUnicodeToString(PUNICODE_STRING Destination, PCWSTR Source)
+{
+	UNICODE_STRING source ;
+
+	RtlInitUnicodeString(&source, Source) ;
+	if ((ULONG)Destination->Length + source.Length > Destination->MaximumLength)
+		return STATUS_BUFFER_TOO_SMALL ;
+
+	memmove((PUCHAR)Destination->Buffer + Destination->Length, source.Buffer, source.Length) ;
+	Destination->Length += source.Length ;
+
+	return STATUS_SUCCESS ;
+}
+
+WEAK WCHAR RtlUpcaseUnicodeChar(WCHAR c) { return (WCHAR)towupper(c) ; }
+WEAK WCHAR RtlDowncaseUnicodeChar(WCHAR c) { return (WCHAR)towlower(c) ; }
+
+WEAK BOOLEAN
+RtlPrefixUnicodeString(PCUNICODE_STRING Prefix, PCUNICODE_STRING String, BOOLEAN CaseInsensitive)
+{
+	USHORT i ;
+
+	if (Prefix->Length > String->Length)
+		return FALSE ;
+
+	for (i = 0; i < Prefix->Length / sizeof(WCHAR); i++)
+	{
+		WCHAR a = Prefix->Buffer[i] ;
+		WCHAR b = String->Buffer[i] ;
+
+		if (CaseInsensitive)
+		{
+			a = RtlUpcaseUnicodeChar(a) ;
+			b = RtlUpcaseUnicodeChar(b) ;
+		}
+
+		if (a != b)
+			return FALSE ;
+	}
+
+	return TRUE ;
+}
+
+WEAK BOOLEAN
+RtlEqualUnicodeString(PCUNICODE_STRING a, PCUNICODE_STRING b, BOOLEAN CaseInsensitive)
+{
+	return a->Length == b->Length && RtlPrefixUnicodeString(a, b, CaseInsensitive) ;
+}
+
+WEAK NTSTATUS
+RtlUpcaseUnicodeString(PUNICODE_STRING Destination, PCUNICODE_STRING Source, BOOLEAN Allocate)
+{
+	USHORT i ;
+
+	if (Allocate)
+	{
+		Destination->Buffer = ExAllocatePoolWithTag(PagedPool, Source->Length + sizeof(WCHAR), 0) ;
+		if (Destination->Buffer == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES ;
+		Destination->MaximumLength = (USHORT)(Source->Length + sizeof(WCHAR)) ;
+	}
+	else if (Destination->MaximumLength < Source->Length)
+	{
+		return STATUS_BUFFER_OVERFLOW ;
+	}
+
+	for (i = 0; i < Source->Length / sizeof(WCHAR); i++)
+		Destination->Buffer[i] = RtlUpcaseUnicodeChar(Source->Buffer[i]) ;
+
+	Destination->Length = Source->Length ;
+	return STATUS_SUCCESS ;
+}
+
+WEAK NTSTATUS
+BCryptGenRandom(PVOID Algorithm, PUCHAR Buffer, ULONG Length, ULONG Flags)
+{
+	(void)Algorithm ; (void)Flags ;
+
+	return getrandom(Buffer, Length, 0) == (ssize_t)Length ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL ;
+}
+
+//quiet unless WDK_DEBUG is set
+WEAK ULONG
+DbgPrint(const char *Format, ...)
+{
+	va_list args ;
+
+	if (getenv("WDK_DEBUG") != NULL)
+	{
+		va_start(args, Format) ;
+		vprintf(Format, args) ;
+		va_end(args) ;
+	}
+
+	return 0 ;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+//
+//  Hooks of the threaded kernel stand-ins in wdk.c for the tests built
+//  on them.  The routines of fltKernel.h are defined there weakly: a test
+//  overrides any of them by defining its own.
+//
+#include "fltKernel.h"
+
+//processors KeGetCurrentProcessorNumberEx reports, WDK_CPUS or the online
+//processors, at most MAXIMUM_PROCESSORS
+ULONG Wdk_CpuCount(void);
+
+//calls the routine PsSetCreateProcessNotifyRoutine registered
+VOID Wdk_NotifyProcess(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+
+//pool bytes allocated with Tag and not freed yet
+LONG64 Wdk_PoolBytes(ULONG Tag);
+
+//starts Count threads running Routine(Context, index) and joins them
+VOID Wdk_RunThreads(ULONG Count, VOID (*Routine)(PVOID, ULONG), PVOID Context);
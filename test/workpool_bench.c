@@ -0,0 +1,192 @@
+/*++
+
+Module Name:
+
+    workpool_bench.c
+
+Abstract:
+
+    Where splitting a transform over the worker pool starts to pay:
+
+        workpool_bench [repetitions per point]
+
+    Counter mode over buffers of 128 KiB to 16 MiB, inline on one thread
+    and split over the workers in chunks of 64 KiB to 1 MiB the way
+    Crypt_TransformParallel does, on the virtual processors of wdk/
+    (WDK_CPUS, by default the online ones).  Prints the speedup of each
+    split, then the cost of a WorkPool_Run call and of a chunk measured
+    with empty chunks, and from those and the single thread throughput
+    the length from which a split gains a quarter of the time, for 2 to
+    16 threads.  On a machine with fewer processors than workers the
+    measured speedups stay at or below 1, but the costs the model is
+    built from are still measured.
+
+--*/
+#include <stdlib.h>
+
+#include "workpool.c"
+#include "wdk.h"
+#include "testutil.h"
+
+typedef struct _JOB {
+
+	const AES_KEY *Key ;
+	const unsigned char *Nonce ;
+	unsigned char *Buffer ;
+	ULONG Length ;
+	ULONG Chunk ;
+
+} JOB ;
+
+static int g_Repetitions = 20 ;
+
+static VOID
+Transform(PVOID Context, ULONG Index)
+{
+	JOB *job = Context ;
+	ULONG start = Index * job->Chunk ;
+
+	Aes_CtrXorAt(job->Key, job->Nonce, start, job->Buffer + start, job->Buffer + start, min(job->Length - start, job->Chunk)) ;
+}
+
+static VOID
+Nothing(PVOID Context, ULONG Index)
+{
+	(void)Context ; (void)Index ;
+}
+
+//seconds per transform, best of the repetitions
+static double
+Measure(JOB *Job)
+{
+	double best = 1e9, start ;
+	int i ;
+
+	for (i = 0; i < g_Repetitions; i++)
+	{
+		start = Now() ;
+
+		if (Job->Chunk == 0)
+			Aes_CtrXorAt(Job->Key, Job->Nonce, 0, Job->Buffer, Job->Buffer, Job->Length) ;
+		else
+			WorkPool_Run(Transform, Job, (Job->Length + Job->Chunk - 1) / Job->Chunk) ;
+
+		best = min(best, Now() - start) ;
+	}
+
+	return best ;
+}
+
+//seconds per WorkPool_Run call of Count empty chunks, best of the repetitions
+static double
+Overhead(ULONG Count)
+{
+	double best = 1e9, start ;
+	int i ;
+
+	for (i = 0; i < g_Repetitions * 10; i++)
+	{
+		start = Now() ;
+		WorkPool_Run(Nothing, NULL, Count) ;
+		best = min(best, Now() - start) ;
+	}
+
+	return best ;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const ULONG chunks[] = { 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024 } ;
+	unsigned char key[AES_KEY_SIZE], nonce[16] ;
+	double perByte, perCall, perChunk, inline_ ;
+	ULONG length, threads ;
+	AES_KEY schedule ;
+	JOB job ;
+	int i ;
+
+	if (argc > 1)
+		g_Repetitions = max(atoi(argv[1]), 1) ;
+
+	Aes_Init(AesImplNi) ;
+	RandFill(key, sizeof(key)) ;
+	RandFill(nonce, sizeof(nonce)) ;
+	Aes_SetKey(&schedule, key) ;
+
+	if (!NT_SUCCESS(WorkPool_Init(0)))
+		return 1 ;
+
+	job.Key = &schedule ;
+	job.Nonce = nonce ;
+	job.Buffer = malloc(16 * 1024 * 1024) ;
+	RandFill(job.Buffer, 16 * 1024 * 1024) ;
+
+	//the caller runs chunks too
+	threads = WorkPool_GetWorkerCount() + 1 ;
+
+	printf("%u workers, %u virtual processors; speedup over one thread by chunk size\n", threads - 1, Wdk_CpuCount()) ;
+	printf("%10s %10s", "bytes", "GB/s") ;
+	for (i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); i++)
+		printf(" %8uK", chunks[i] / 1024) ;
+	printf("\n") ;
+
+	for (length = 128 * 1024; length <= 16 * 1024 * 1024; length *= 2)
+	{
+		job.Length = length ;
+		job.Chunk = 0 ;
+		inline_ = Measure(&job) ;
+
+		printf("%10u %10.2f", length, length / inline_ / 1e9) ;
+
+		for (i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); i++)
+		{
+			job.Chunk = chunks[i] ;
+			if (chunks[i] >= length)
+				printf(" %9s", "-") ;
+			else
+				printf(" %9.2f", inline_ / Measure(&job)) ;
+		}
+
+		printf("\n") ;
+	}
+
+	//time(L, n chunks) = perCall + n * perChunk + L * perByte / min(n, threads)
+	job.Length = 4 * 1024 * 1024 ;
+	job.Chunk = 0 ;
+	perByte = Measure(&job) / job.Length ;
+	perCall = Overhead(1) ;
+	perChunk = (Overhead(64) - perCall) / 63 ;
+
+	printf("\nrun %.1f us, chunk %.2f us, %.2f GB/s on one thread\n", perCall * 1e6, perChunk * 1e6, 1e-9 / perByte) ;
+
+	printf("length from which a split is 25%% faster, in KiB, by threads\n%10s", "chunk") ;
+	for (threads = 2; threads <= WORKPOOL_MAX_WORKERS; threads *= 2)
+		printf(" %8u", threads) ;
+	printf("\n") ;
+
+	for (i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); i++)
+	{
+		printf("%9uK", chunks[i] / 1024) ;
+
+		for (threads = 2; threads <= WORKPOOL_MAX_WORKERS; threads *= 2)
+		{
+			for (length = chunks[i] * 2; length <= 64 * 1024 * 1024; length += chunks[i])
+			{
+				ULONG n = length / chunks[i] ;
+				double split = perCall + n * perChunk + length * perByte / min(n, threads) ;
+
+				if (split < 0.75 * length * perByte)
+					break ;
+			}
+
+			printf(" %8u", length / 1024) ;
+		}
+
+		printf("\n") ;
+	}
+
+	WorkPool_Uninit() ;
+	free(job.Buffer) ;
+
+	return 0 ;
+}
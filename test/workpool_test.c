@@ -0,0 +1,131 @@
+/*++
+
+Module Name:
+
+    workpool_test.c
+
+Abstract:
+
+    Concurrent WorkPool_Run callers.
+
+    Builds workpool.c against the threaded kernel stand-ins of wdk/ with 8
+    workers and has 16 threads call WorkPool_Run at once, each with its
+    own jobs of up to more chunks than all rings hold, so chunks are run
+    by their worker, stolen by other workers and callers, and run inline.
+    Every chunk must run exactly once and before its WorkPool_Run
+    returns; the counters must add up to the chunks run.
+
+    Uninit must join the workers and free their block; WorkPool_Run then
+    runs every chunk on the caller.
+
+--*/
+#include <sched.h>
+#include <stdlib.h>
+
+#include "workpool.c"
+#include "wdk.h"
+#include "testutil.h"
+
+#define CALLERS         16
+#define ROUNDS          150
+#define MAX_CHUNKS      (WORKPOOL_QUEUE_DEPTH * 8 + 200)
+
+typedef struct _CALLER {
+
+	volatile LONG Hits[MAX_CHUNKS] ;
+
+	//between the call and the return of WorkPool_Run
+	volatile LONG Running ;
+
+	ULONG Count ;
+
+	unsigned long long State ;
+
+} CALLER ;
+
+static CALLER g_Callers[CALLERS] ;
+static volatile LONG64 g_Chunks ;
+
+static VOID
+Chunk(PVOID Context, ULONG Index)
+{
+	CALLER *caller = Context ;
+
+	CHECK(caller->Running) ;
+	CHECK(Index < caller->Count) ;
+
+	InterlockedIncrement(&caller->Hits[Index]) ;
+
+	//some chunks take long enough to be stolen around
+	if (Index % 7 == 0)
+		sched_yield() ;
+}
+
+static void
+Call(PVOID Context, ULONG Index)
+{
+	CALLER *caller = &g_Callers[Index] ;
+	ULONG i ;
+	int round ;
+
+	(void)Context ;
+
+	caller->State = 0x9E3779B97F4A7C15ULL * (Index + 1) ;
+
+	for (round = 0; round < ROUNDS; round++)
+	{
+		caller->State ^= caller->State << 13 ;
+		caller->State ^= caller->State >> 7 ;
+		caller->State ^= caller->State << 17 ;
+
+		//mostly a few chunks, a large write's worth now and then
+		caller->Count = round % 10 == 0 ? MAX_CHUNKS - (ULONG)(caller->State % 100) : 1 + (ULONG)(caller->State % 40) ;
+
+		InterlockedExchange(&caller->Running, TRUE) ;
+		WorkPool_Run(Chunk, caller, caller->Count) ;
+		InterlockedExchange(&caller->Running, FALSE) ;
+
+		for (i = 0; i < MAX_CHUNKS; i++)
+		{
+			CHECK(caller->Hits[i] == (i < caller->Count ? 1 : 0)) ;
+			caller->Hits[i] = 0 ;
+		}
+
+		InterlockedExchangeAdd64(&g_Chunks, caller->Count) ;
+	}
+}
+
+int
+main(void)
+{
+	WORKPOOL_STATS stats ;
+	CALLER *caller = &g_Callers[0] ;
+	ULONG i ;
+
+	setenv("WDK_CPUS", "8", 0) ;
+
+	CHECK(NT_SUCCESS(WorkPool_Init(0))) ;
+	CHECK(WorkPool_GetWorkerCount() == min(Wdk_CpuCount(), WORKPOOL_MAX_WORKERS)) ;
+	CHECK(((ULONG_PTR)g_WorkPoolWorkers & (WORKPOOL_WORKER_ALIGNMENT - 1)) == 0) ;
+
+	Wdk_RunThreads(CALLERS, Call, NULL) ;
+
+	WorkPool_QueryStats(&stats) ;
+	CHECK(stats.Executed + stats.Stolen + stats.Inline == g_Chunks) ;
+	CHECK(stats.Executed > 0 && stats.Stolen > 0 && stats.Inline > 0) ;
+	printf("%lld chunks: %lld run by their worker, %lld stolen, %lld inline\n",
+		(long long)g_Chunks, (long long)stats.Executed, (long long)stats.Stolen, (long long)stats.Inline) ;
+
+	WorkPool_Uninit() ;
+	CHECK(WorkPool_GetWorkerCount() == 0) ;
+	CHECK(Wdk_PoolBytes(WORKPOOL_TAG) == 0) ;
+
+	//without workers the caller runs everything
+	caller->Count = 100 ;
+	caller->Running = TRUE ;
+	WorkPool_Run(Chunk, caller, caller->Count) ;
+	for (i = 0; i < caller->Count; i++)
+		CHECK(caller->Hits[i] == 1) ;
+
+	return Report("workpool_test") ;
+}